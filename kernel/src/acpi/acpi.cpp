@@ -0,0 +1,118 @@
+#include "acpi.h"
+#include <limine.h>
+#include "../memory/pmm.h"
+#include "../memory/vmm.h"
+#include "../cppstd/stdio.h"
+
+__attribute__((used, section(".limine_requests")))
+static volatile struct limine_rsdp_request rsdp_request = {
+    .id = LIMINE_RSDP_REQUEST_ID,
+    .revision = 0,
+    .response = nullptr
+};
+
+struct AcpiRsdp {
+    char signature[8];
+    uint8_t checksum;
+    char oem_id[6];
+    uint8_t revision;
+    uint32_t rsdt_address;
+    // ACPI 2.0+
+    uint32_t length;
+    uint64_t xsdt_address;
+    uint8_t extended_checksum;
+    uint8_t reserved[3];
+} __attribute__((packed));
+
+static AcpiSdtHeader* root_table = nullptr;
+static bool root_is_xsdt = false;
+
+// Makes sure [phys, phys + size) is readable through the HHDM. Limine
+// does not map every ACPI region there on all base revisions.
+static void* acpi_map(uint64_t phys, uint64_t size) {
+    uint64_t virt = phys + g_hhdm_offset;
+    for (uint64_t page = virt & ~0xFFFULL; page < virt + size; page += 0x1000) {
+        if (vmm_virt_to_phys(page) == 0) {
+            vmm_map_page(page, page - g_hhdm_offset, PTE_PRESENT | PTE_NX);
+        }
+    }
+    return (void*)virt;
+}
+
+static bool checksum_ok(const void* data, uint32_t length) {
+    const uint8_t* bytes = (const uint8_t*)data;
+    uint8_t sum = 0;
+    for (uint32_t i = 0; i < length; i++) sum += bytes[i];
+    return sum == 0;
+}
+
+static AcpiSdtHeader* map_table(uint64_t phys) {
+    if (phys == 0) return nullptr;
+    AcpiSdtHeader* header = (AcpiSdtHeader*)acpi_map(phys, sizeof(AcpiSdtHeader));
+    acpi_map(phys, header->length);
+    return header;
+}
+
+bool acpi_init() {
+    struct limine_rsdp_response* response = rsdp_request.response;
+    if (response == nullptr || response->address == nullptr) {
+        printf("ACPI: No RSDP from the bootloader\n");
+        return false;
+    }
+
+    // Base revision 2 hands out an HHDM pointer, later ones a physical address
+    uint64_t rsdp_addr = (uint64_t)response->address;
+    if (rsdp_addr >= g_hhdm_offset) rsdp_addr -= g_hhdm_offset;
+    AcpiRsdp* rsdp = (AcpiRsdp*)acpi_map(rsdp_addr, sizeof(AcpiRsdp));
+
+    if (!checksum_ok(rsdp, 20)) {
+        printf("ACPI: Bad RSDP checksum\n");
+        return false;
+    }
+
+    if (rsdp->revision >= 2 && rsdp->xsdt_address) {
+        root_table = map_table(rsdp->xsdt_address);
+        root_is_xsdt = true;
+    } else {
+        root_table = map_table(rsdp->rsdt_address);
+        root_is_xsdt = false;
+    }
+
+    if (!root_table || !checksum_ok(root_table, root_table->length)) {
+        printf("ACPI: Bad root table\n");
+        root_table = nullptr;
+        return false;
+    }
+
+    printf("ACPI: Revision %d, %s at %x\n", (int)rsdp->revision,
+        root_is_xsdt ? "XSDT" : "RSDT", (uint64_t)root_table - g_hhdm_offset);
+    return true;
+}
+
+AcpiSdtHeader* acpi_find_table(const char* signature) {
+    if (!root_table) return nullptr;
+
+    uint32_t entry_size = root_is_xsdt ? 8 : 4;
+    uint32_t count = (root_table->length - sizeof(AcpiSdtHeader)) / entry_size;
+    uint8_t* entries = (uint8_t*)root_table + sizeof(AcpiSdtHeader);
+
+    for (uint32_t i = 0; i < count; i++) {
+        uint64_t phys;
+        if (root_is_xsdt) {
+            // XSDT entries are only 4 byte aligned
+            uint32_t lo = *(uint32_t*)(entries + i * 8);
+            uint32_t hi = *(uint32_t*)(entries + i * 8 + 4);
+            phys = ((uint64_t)hi << 32) | lo;
+        } else {
+            phys = *(uint32_t*)(entries + i * 4);
+        }
+
+        AcpiSdtHeader* table = map_table(phys);
+        if (!table) continue;
+        if (table->signature[0] != signature[0] || table->signature[1] != signature[1] ||
+            table->signature[2] != signature[2] || table->signature[3] != signature[3]) continue;
+        if (!checksum_ok(table, table->length)) continue;
+        return table;
+    }
+    return nullptr;
+}
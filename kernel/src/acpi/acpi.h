@@ -0,0 +1,28 @@
+#ifndef ACPI_H
+#define ACPI_H
+
+#include <cstdint>
+
+// Static ACPI tables only (no AML). Limine hands us the RSDP; the tables
+// are read in place through the HHDM.
+
+struct AcpiSdtHeader {
+    char signature[4];
+    uint32_t length;
+    uint8_t revision;
+    uint8_t checksum;
+    char oem_id[6];
+    char oem_table_id[8];
+    uint32_t oem_revision;
+    uint32_t creator_id;
+    uint32_t creator_revision;
+} __attribute__((packed));
+
+// Locates the RSDP and the root table (XSDT, or RSDT on ACPI 1.0)
+bool acpi_init();
+
+// First table with the given 4 character signature ("APIC", "HPET", ...)
+// with a valid checksum, or nullptr
+AcpiSdtHeader* acpi_find_table(const char* signature);
+
+#endif
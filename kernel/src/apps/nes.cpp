@@ -8,10 +8,12 @@
 #include "../timer.h"
 #include "../globals.h"
 #include "../game_data.h"
+#include "../sys/sched.h"
 
 // --- Configuration ---
 #define NES_WIDTH  256
 #define NES_HEIGHT 240
+#define NES_FRAME_NS 16639267 // NTSC: 60.0988 frames per second
 #define PRG_ROM_PAGE_SIZE 16384
 #define CHR_ROM_PAGE_SIZE 8192
 
@@ -62,11 +64,20 @@ NESApp::NESApp(const char* filename) {
     controller_strobe = false;
     
     cart.loaded = false; 
-    next_frame_ticks = 0;
-    ticks_per_frame = 0;
+    next_frame_ns = 0;
+
+    emu_thread = nullptr;
+    emu_stop = false;
 }
 
 NESApp::~NESApp() {
+    // Stop the emulator before its buffers go away
+    if (emu_thread) {
+        emu_stop = true;
+        thread_join(emu_thread);
+        emu_thread = nullptr;
+    }
+
     // Robust cleanup
     if (cart.prg_rom) { free(cart.prg_rom); cart.prg_rom = nullptr; }
     if (cart.chr_rom) { free(cart.chr_rom); cart.chr_rom = nullptr; }
@@ -88,10 +99,19 @@ void NESApp::on_init(Window* win) {
     
     win->renderer->clear(0x000000);
 
-    uint64_t freq = get_cpu_frequency();
-    if (freq == 0) freq = 2000000000; 
-    ticks_per_frame = freq / 60;
-    next_frame_ticks = rdtsc_serialized();
+    next_frame_ns = clock_ns();
+
+    // Falls back to emulating from on_draw if no thread could be made
+    if (cart.loaded && ppu.frame_buffer) {
+        emu_thread = thread_create("nes", emu_thread_entry, this);
+    }
+}
+
+void NESApp::emu_thread_entry(void* arg) {
+    NESApp* app = (NESApp*)arg;
+    while (!app->emu_stop) {
+        if (!app->step_frame()) sleep_until_ns(app->next_frame_ns);
+    }
 }
 
 void NESApp::on_input(char c) { (void)c; }
@@ -628,13 +648,38 @@ void NESApp::on_draw() {
          return;
     }
 
-    uint64_t now = rdtsc_serialized();
-    if (now < next_frame_ticks) return; 
+    if (!emu_thread && !step_frame()) return;
+
+    uint32_t* win_buf = my_window->backing_buffer;
+    uint32_t* nes_buf = ppu.frame_buffer;
+    int win_w = my_window->width; 
+    
+    if (win_w != 512) return; 
+
+    for (int y = 0; y < 240; y++) {
+        for (int x = 0; x < 256; x++) {
+            uint32_t col = nes_buf[y * 256 + x];
+            int wy = y * 2;
+            int wx = x * 2;
+            int row1 = wy * win_w + wx;
+            int row2 = (wy + 1) * win_w + wx;
+            win_buf[row1] = col;
+            win_buf[row1 + 1] = col;
+            win_buf[row2] = col;
+            win_buf[row2 + 1] = col;
+        }
+    }
+}
+
+// Emulates one frame if it is due. Returns false if it is too early.
+bool NESApp::step_frame() {
+    uint64_t now = clock_ns();
+    if (now < next_frame_ns) return false; 
 
-    if (now > next_frame_ticks + ticks_per_frame) {
-        next_frame_ticks = now; 
+    if (now > next_frame_ns + NES_FRAME_NS) {
+        next_frame_ns = now; 
     }
-    next_frame_ticks += ticks_per_frame;
+    next_frame_ns += NES_FRAME_NS;
 
     uint8_t joy = 0;
     bool left = g_key_state[0x4B];
@@ -809,24 +854,5 @@ void NESApp::on_draw() {
             }
         }
     }
-    
-    uint32_t* win_buf = my_window->backing_buffer;
-    uint32_t* nes_buf = ppu.frame_buffer;
-    int win_w = my_window->width; 
-    
-    if (win_w != 512) return; 
-
-    for (int y = 0; y < 240; y++) {
-        for (int x = 0; x < 256; x++) {
-            uint32_t col = nes_buf[y * 256 + x];
-            int wy = y * 2;
-            int wx = x * 2;
-            int row1 = wy * win_w + wx;
-            int row2 = (wy + 1) * win_w + wx;
-            win_buf[row1] = col;
-            win_buf[row1 + 1] = col;
-            win_buf[row2] = col;
-            win_buf[row2 + 1] = col;
-        }
-    }
+    return true;
 }
\ No newline at end of file
@@ -2,6 +2,7 @@
 #define NES_H
 
 #include "../gui/window.h"
+#include "../sys/sched.h"
 #include <cstdint>
 
 // --- Internal Struct Definitions ---
@@ -65,9 +66,8 @@ private:
     char rom_file[64];
     Window* my_window;
     
-    // Timing State
-    uint64_t next_frame_ticks;
-    uint64_t ticks_per_frame;
+    // Timing State (clock_ns)
+    uint64_t next_frame_ns;
     
     // Emulation State (Now Members!)
     CPU6502 cpu;
@@ -79,8 +79,14 @@ private:
     uint8_t controller_latch;
     bool controller_strobe;
 
+    // Emulation runs on its own kernel thread; on_draw only blits
+    Thread* emu_thread;
+    volatile bool emu_stop;
+    static void emu_thread_entry(void* arg);
+
     // Helpers
     void init_emulation();
+    bool step_frame();
     
     // Internal Emulation Methods
     uint8_t cpu_read(uint16_t addr);
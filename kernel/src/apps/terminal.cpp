@@ -22,17 +22,45 @@
 #include "../memory/swp.h"
 #include "../memory/pmm.h"
 #include "../fs/fat32.h"
+#include "../fs/bcache.h"
 #include "../io.h"
 #include "../loader/raw_loader.h"
 #include "../loader/high_loader.h"
 #include "../drv/usb/xhci.h"
 #include "../drv/storage/ahci.h"
 #include "../drv/net/e1000.h"
+#include "../sys/sched.h"
+#include "../sys/parallel.h"
+#include "../sys/timer_wheel.h"
+#include "../sys/spinlock.h"
+#include "../interrupts/irq.h"
+#include "../smp/smp_call.h"
 #include "../net/network.h" 
 #include "../sys/chuckles_daemon.h"
 
 extern int g_sata_port;
 
+// Decimal, or hex with a 0x prefix. -1 on garbage.
+static int parse_number(const char* s) {
+    int base = 10;
+    if (s[0] == '0' && (s[1] == 'x' || s[1] == 'X')) {
+        base = 16;
+        s += 2;
+    }
+    if (!*s) return -1;
+
+    int val = 0;
+    for (; *s; s++) {
+        int digit;
+        if (*s >= '0' && *s <= '9') digit = *s - '0';
+        else if (base == 16 && *s >= 'a' && *s <= 'f') digit = *s - 'a' + 10;
+        else if (base == 16 && *s >= 'A' && *s <= 'F') digit = *s - 'A' + 10;
+        else return -1;
+        val = val * base + digit;
+    }
+    return val;
+}
+
 void TerminalApp::on_init(Window* win) {
     my_window = win;
     input_index = 0;
@@ -112,7 +140,7 @@ void TerminalApp::execute_command() {
         BrowserApp* app = new BrowserApp();
         Window* win = new Window(150, 150, 800, 600, "ChucklesBrowse", app);
         WindowManager::getInstance().add_window(win);
-        if (argc > 1) app->navigate(argv[1]);
+        if (argc > 1) app->navigate_async(argv[1]);
     }
     else if (strcmp(argv[0], "term") == 0) {
         TerminalApp* app = new TerminalApp();
@@ -167,18 +195,81 @@ void TerminalApp::execute_command() {
     // --- SYSTEM UTILS ---
     else if (strcmp(argv[0], "help") == 0) {
         printf("GUI Apps: dvd, 3drnd, nes, browse, term, edit, disp\n");
-        printf("System:   reboot, clear, sysinfo, lspci\n");
+        printf("System:   reboot, clear, sysinfo, lspci, ps, dmesg, timers, locks, ipis, parbench, irqs\n");
+        printf("Disk:     ahcibench, ahcistat, cachestat, readbench\n");
+        printf("Memory:   pmmbench, heapbench, heaptrim, swap, swapstat\n");
         printf("Dev:      cpl, ccc, run\n");
     }
-    else if (strcmp(argv[0], "reboot") == 0) outb(0x64, 0xFE);
+    else if (strcmp(argv[0], "reboot") == 0) {
+        BlockCache::getInstance().sync();
+        outb(0x64, 0xFE);
+    }
     else if (strcmp(argv[0], "clear") == 0) my_window->renderer->clear(0);
     else if (strcmp(argv[0], "sysinfo") == 0) {
         printf("ChucklesOS v3.0 Beta 2\n");
         printf("RAM: %d MB Used / %d MB Total\n", 
             (int)(pmm_get_used_memory()/1024/1024), 
             (int)(pmm_get_total_memory()/1024/1024));
+        printf("Heap: %d KB Used / %d KB Mapped (%d KB returned to PMM)\n",
+            (int)(heap_get_used()/1024),
+            (int)(heap_get_total()/1024),
+            (int)(heap_get_reclaimed()/1024));
     }
     else if (strcmp(argv[0], "lspci") == 0) lspci_run_detailed();
+    else if (strcmp(argv[0], "ps") == 0) sched_print_stats();
+    else if (strcmp(argv[0], "dmesg") == 0) klog_dump();
+    else if (strcmp(argv[0], "timers") == 0) timer_wheel_print_stats();
+    else if (strcmp(argv[0], "locks") == 0) {
+        if (argc > 1 && strcmp(argv[1], "reset") == 0) lock_stats_reset();
+        else lock_stats_print();
+    }
+    else if (strcmp(argv[0], "ipis") == 0) smp_call_print_stats();
+    else if (strcmp(argv[0], "parbench") == 0) parallel_benchmark();
+    else if (strcmp(argv[0], "ahcibench") == 0) AhciDriver::getInstance().benchmark();
+    else if (strcmp(argv[0], "ahcistat") == 0) AhciDriver::getInstance().printStats();
+    else if (strcmp(argv[0], "readbench") == 0) {
+        if (argc > 1) Fat32::getInstance().benchmark_read(argv[1]);
+        else printf("Usage: readbench <file>\n");
+    }
+    else if (strcmp(argv[0], "cachestat") == 0) {
+        BlockCache& cache = BlockCache::getInstance();
+        if (argc > 1 && strcmp(argv[1], "reset") == 0) cache.resetStats();
+        else if (argc > 1 && strcmp(argv[1], "sync") == 0) {
+            if (!cache.sync()) printf("BCACHE: Some blocks could not be written\n");
+        }
+        else if (argc > 2 && strcmp(argv[1], "size") == 0) {
+            int blocks = parse_number(argv[2]);
+            if (blocks <= 0 || !cache.resize((uint32_t)blocks)) printf("BCACHE: Resize failed\n");
+            else cache.printStats();
+        }
+        else if (argc > 1) printf("Usage: cachestat [reset | sync | size <blocks>]\n");
+        else cache.printStats();
+    }
+    else if (strcmp(argv[0], "irqs") == 0) {
+        if (argc > 2) {
+            int vector = parse_number(argv[1]);
+            int cpu = parse_number(argv[2]);
+            if (vector < 0 || vector > 0xFF || cpu < 0 || !irq_set_affinity((uint8_t)vector, cpu)) {
+                printf("IRQ: Can't move vector %s to CPU %s\n", argv[1], argv[2]);
+            }
+        }
+        else if (argc > 1) printf("Usage: irqs [<vector> <cpu>]\n");
+        else irq_print_routes();
+    }
+    else if (strcmp(argv[0], "pmmbench") == 0) pmm_benchmark();
+    else if (strcmp(argv[0], "heapbench") == 0) heap_benchmark();
+    else if (strcmp(argv[0], "heaptrim") == 0) {
+        size_t released = heap_trim();
+        printf("HEAP: Returned %d KB to the PMM (%d KB total since boot)\n",
+            (int)(released/1024), (int)(heap_get_reclaimed()/1024));
+    }
+    else if (strcmp(argv[0], "swap") == 0) {
+        if (argc > 1 && strcmp(argv[1], "off") == 0) SwapManager::getInstance().free_swap();
+        else if (argc > 1 && strcmp(argv[1], "test") == 0) SwapManager::getInstance().test_swap();
+        else if (argc > 1) SwapManager::getInstance().allocate_swap(argv[1]);
+        else printf("Usage: swap <size (512M, 1G)> | off | test\n");
+    }
+    else if (strcmp(argv[0], "swapstat") == 0) SwapManager::getInstance().print_stats();
     else if (strcmp(argv[0], "netinit") == 0) E1000Driver::getInstance().init();
     else if (strcmp(argv[0], "usbinit") == 0) XhciDriver::getInstance().init(0x8086, 0x31A8);
     else {
@@ -9,11 +9,15 @@
 #include "../fs/fat32.h"
 #include "js/engine.h"
 
-BrowserApp::BrowserApp() : page_content(nullptr), content_len(0), scroll_y(0), scripts_executed(false) {
+BrowserApp::BrowserApp() : page_content(nullptr), content_len(0), scroll_y(0), scripts_executed(false),
+                           loader_thread(nullptr), loading(false) {
     page_content = (char*)malloc(262144); // 256 KB
+    pending_url[0] = 0;
 }
 
 BrowserApp::~BrowserApp() {
+    // The loader writes into page_content, let it finish first
+    if (loader_thread) thread_join(loader_thread);
     if (page_content) free(page_content);
 }
 
@@ -28,6 +32,7 @@ void BrowserApp::on_init(Window* win) {
 }
 
 void BrowserApp::on_input(char c) {
+    if (loading) return;
     if (c == (char)KEY_UP) {
         scroll_y -= 20;
         if (scroll_y < 0) scroll_y = 0;
@@ -41,6 +46,12 @@ void BrowserApp::on_input(char c) {
 void BrowserApp::on_draw() {
     if (!my_window) return;
     my_window->renderer->clear(0xFFFFFF); // White background
+
+    // page_content is being rewritten by the loader thread
+    if (loading) {
+        my_window->renderer->drawString(10, 10, "Loading...", 0x000000, 2);
+        return;
+    }
     parse_and_render_html();
 }
 
@@ -95,6 +106,40 @@ bool BrowserApp::find_header_value(const char* headers, const char* key, char* o
     return true;
 }
 
+void BrowserApp::navigate_async(const char* url) {
+    if (loading) {
+        printf("BROWSE: Still loading, try again in a moment.\n");
+        return;
+    }
+    if (loader_thread) {
+        thread_join(loader_thread);
+        loader_thread = nullptr;
+    }
+
+    int i = 0;
+    while (url[i] && i < 255) { pending_url[i] = url[i]; i++; }
+    pending_url[i] = 0;
+
+    loading = true;
+    loader_thread = thread_create("browse", loader_thread_entry, this);
+    if (!loader_thread) {
+        loading = false;
+        navigate(pending_url);
+    }
+}
+
+void BrowserApp::loader_thread_entry(void* arg) {
+    BrowserApp* app = (BrowserApp*)arg;
+    app->navigate(app->pending_url);
+    app->loading = false;
+}
+
+// The window manager belongs to kmain, and it redraws every window each
+// frame anyway, so the loader thread just leaves the drawing to it
+void BrowserApp::request_redraw() {
+    if (thread_is_kmain()) on_draw();
+}
+
 void BrowserApp::navigate(const char* url, int redirect_count) {
     if (!page_content) return;
     
@@ -102,7 +147,7 @@ void BrowserApp::navigate(const char* url, int redirect_count) {
         strcpy(page_content, "<h1>Error</h1><p>Too many redirects.</p>");
         content_len = strlen(page_content);
         scripts_executed = true; // No scripts on error page
-        on_draw();
+        request_redraw();
         return;
     }
 
@@ -116,7 +161,7 @@ void BrowserApp::navigate(const char* url, int redirect_count) {
         sprintf(my_window->title, "Local: %s", url);
         scroll_y = 0;
         scripts_executed = false; // RESET FLAG: Allow scripts to run once for this new page
-        on_draw();
+        request_redraw();
         return; 
     }
     // ------------------------
@@ -125,7 +170,7 @@ void BrowserApp::navigate(const char* url, int redirect_count) {
     content_len = 0;
     scroll_y = 0;
     scripts_executed = false; // RESET FLAG: Allow scripts for network page
-    on_draw();
+    request_redraw();
     
     char host[128];
     char path[256];
@@ -165,7 +210,7 @@ void BrowserApp::navigate(const char* url, int redirect_count) {
     
     if (strlen(page_content) > 0) content_len = strlen(page_content);
     strcpy(my_window->title, host);
-    on_draw();
+    request_redraw();
 }
 
 int BrowserApp::strcicmp(const char* s1, const char* s2) {
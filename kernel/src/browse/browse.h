@@ -2,6 +2,7 @@
 #define BROWSE_H
 
 #include "../gui/window.h"
+#include "../sys/sched.h"
 #include "../net/tcp.h"
 
 class BrowserApp : public WindowApp {
@@ -16,6 +17,9 @@ public:
     // Main function to load a URL, now with redirect tracking
     void navigate(const char* url, int redirect_count = 0);
 
+    // Loads the URL on a kernel thread so DNS/TCP waits don't stall the UI
+    void navigate_async(const char* url);
+
     // Public for JS Access
     Window* my_window;
 
@@ -29,6 +33,13 @@ private:
     // NEW: Prevents infinite alert loops
     bool scripts_executed;
 
+    // Background page load (navigate_async)
+    Thread* loader_thread;
+    volatile bool loading;
+    char pending_url[256];
+    static void loader_thread_entry(void* arg);
+    void request_redraw();
+
     // Helper functions
     void parse_and_render_html();
     void parse_url(const char* url, char* host, int max_host, char* path, int max_path);
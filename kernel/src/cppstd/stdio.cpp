@@ -1,10 +1,13 @@
 #include "stdio.h"
 #include "../globals.h"
 #include "../sys/spinlock.h"
+#include "../sys/ring.h"
+#include "../sys/percpu.h"
 #include <stdarg.h>
 #include <cstddef>
 
-static Spinlock stdio_lock;
+// Interrupt handlers print too
+static TicketLock stdio_lock("stdio");
 
 static int itoa(unsigned long long value, char* str, int base) {
     if (base < 2 || base > 36) {
@@ -52,22 +55,56 @@ void putchar(char c) {
     }
 }
 
-void puts(const char* str) {
-    ScopedLock lock(stdio_lock);
-    if (g_console && str) {
-        g_console->print(str);
-        g_console->putChar('\n');
-    }
+// Kernel log: printf and puts also leave their text here for dmesg. Any
+// core prints, so it's an MPSC ring; lines are pushed after stdio_lock
+// is dropped. When it's full new lines are counted and dropped, which
+// keeps the boot messages.
+#define KLOG_LINES    128
+#define KLOG_LINE_LEN 120
+
+struct LogLine {
+    int cpu;
+    int len;
+    char text[KLOG_LINE_LEN];
+};
+
+static MpscRing<LogLine, KLOG_LINES> klog;
+static volatile uint64_t klog_dropped = 0;
+
+static void log_char(LogLine* line, char c) {
+    if (line->len < KLOG_LINE_LEN - 1) line->text[line->len++] = c;
 }
 
-void printf(const char* format, ...) {
-    ScopedLock lock(stdio_lock);
+static void emit_char(LogLine* line, char c) {
+    if (g_console) g_console->putChar(c);
+    log_char(line, c);
+}
 
-    if (!g_console || !format) return;
+static void emit(LogLine* line, const char* s) {
+    if (g_console) g_console->print(s);
+    while (*s) log_char(line, *s++);
+}
 
-    va_list args;
-    va_start(args, format);
+static void log_push(LogLine* line) {
+    if (line->len == 0) return;
+    line->text[line->len] = 0;
+    line->cpu = this_cpu_id();
+    if (!klog.push(*line)) __atomic_fetch_add(&klog_dropped, 1, __ATOMIC_RELAXED);
+}
+
+void puts(const char* str) {
+    if (!str) return;
+    LogLine line;
+    line.len = 0;
+    {
+        ScopedIrqLock lock(stdio_lock);
+        emit(&line, str);
+        emit_char(&line, '\n');
+    }
+    log_push(&line);
+}
 
+static void vprint(LogLine* line, const char* format, va_list args) {
     while (*format) {
         if (*format == '%') {
             format++;
@@ -84,51 +121,86 @@ void printf(const char* format, ...) {
             switch (*format) {
                 case 'c': {
                     char c = (char)va_arg(args, int);
-                    putchar(c);
+                    emit_char(line, c);
                     break;
                 }
                 case 's': {
                     const char* s = va_arg(args, const char*);
-                    g_console->print(s ? s : "(null)");
+                    emit(line, s ? s : "(null)");
                     break;
                 }
                 case 'd':
                 case 'i': {
                     long long val = va_arg(args, long long);
                     if (val < 0) {
-                        putchar('-');
+                        emit_char(line, '-');
                         val = -val;
                     }
                     char buffer[32];
                     itoa((unsigned long long)val, buffer, 10);
-                    g_console->print(buffer);
+                    emit(line, buffer);
                     break;
                 }
                 case 'u': {
                     unsigned long long val = va_arg(args, unsigned long long);
                     char buffer[32];
                     itoa(val, buffer, 10);
-                    g_console->print(buffer);
+                    emit(line, buffer);
                     break;
                 }
                 case 'x': 
                 case 'p': {
                     unsigned long long val = va_arg(args, unsigned long long);
-                    g_console->print("0x");
+                    emit(line, "0x");
                     char buffer[32];
                     itoa(val, buffer, 16);
-                    g_console->print(buffer);
+                    emit(line, buffer);
                     break;
                 }
-                case '%': putchar('%'); break;
-                default: putchar(*format); break;
+                case '%': emit_char(line, '%'); break;
+                default: emit_char(line, *format); break;
             }
         } else {
-            putchar(*format);
+            emit_char(line, *format);
         }
         format++;
     }
+}
+
+void printf(const char* format, ...) {
+    if (!format) return;
+    LogLine line;
+    line.len = 0;
+
+    va_list args;
+    va_start(args, format);
+    {
+        ScopedIrqLock lock(stdio_lock);
+        vprint(&line, format, args);
+    }
     va_end(args);
+
+    log_push(&line);
+}
+
+void klog_dump() {
+    LogLine line;
+    int count = 0;
+    char header[64];
+
+    ScopedIrqLock lock(stdio_lock);
+    if (!g_console) return;
+
+    // Straight to the console: going through printf would log the log
+    while (klog.pop(&line)) {
+        sprintf(header, "[cpu %d] ", line.cpu);
+        g_console->print(header);
+        g_console->print(line.text);
+        if (line.len > 0 && line.text[line.len - 1] != '\n') g_console->putChar('\n');
+        count++;
+    }
+    sprintf(header, "DMESG: %d lines, %d dropped\n", count, (int)klog_dropped);
+    g_console->print(header);
 }
 
 int sprintf(char* str, const char* format, ...) {
@@ -17,6 +17,9 @@ void putchar(char c);
 // Helper to put a string
 void puts(const char* str);
 
+// Print (and consume) the lines logged by printf/puts since the last call
+void klog_dump();
+
 #ifdef __cplusplus
 }
 #endif
@@ -5,17 +5,21 @@
 #include "../../cppstd/stdio.h"
 #include "../../cppstd/string.h"
 #include "../../timer.h"
-#include "../../interrupts/pic.h"
+#include "../../interrupts/irq.h"
 #include "../../net/network.h" 
 #include "../../sys/system_stats.h" // Include Stats
 
 #define E1000_MMIO_VIRT 0xFFFFA00030000000
 
-E1000Driver::E1000Driver() : mmio_base_virt(0), initialized(false), rx_cur(0), tx_cur(0) {
+E1000Driver::E1000Driver() : mmio_base_virt(0), initialized(false), rx_cur(0), tx_cur(0), tx_lock("e1000 tx") {
     memset(mac_addr, 0, 6);
     pci_dev.irq_line = 0xFF; 
 }
 
+static void e1000_irq(void* ctx) {
+    ((E1000Driver*)ctx)->handle_interrupt();
+}
+
 E1000Driver& E1000Driver::getInstance() {
     static E1000Driver instance;
     return instance;
@@ -127,27 +131,25 @@ bool E1000Driver::init() {
     write_reg(E1000_IMC, 0xFFFFFFFF);
     write_reg(E1000_CTRL, E1000_CTRL_SLU); 
 
-    // Setup RX
-    void* rx_ring_phys = pmm_alloc(1);
-    void* rx_ring_virt = (void*)((uint64_t)rx_ring_phys + 0xFFFF800000000000); 
-    vmm_map_page((uint64_t)rx_ring_virt, (uint64_t)rx_ring_phys, 3);
-    
-    rx_descs = (e1000_rx_desc*)rx_ring_virt;
-    memset(rx_descs, 0, 4096);
+    // Setup RX (descriptor rings need 128 byte alignment)
+    if (!dma_alloc(4096, 128, 0, &rx_ring) ||
+        !rx_pool.init("e1000-rx", E1000_BUFFER_SIZE, 16, E1000_NUM_RX_DESC)) {
+        printf("E1000: OOM allocating RX ring.\n");
+        return false;
+    }
+    rx_descs = (e1000_rx_desc*)rx_ring.virt;
 
     for(int i=0; i<E1000_NUM_RX_DESC; i++) {
-        void* buf_phys = pmm_alloc(1);
-        uint64_t buf_virt_addr = (uint64_t)buf_phys + 0xFFFF800000000000;
-        vmm_map_page(buf_virt_addr, (uint64_t)buf_phys, 3);
-        
-        rx_buffers[i] = (uint8_t*)buf_virt_addr;
+        DmaBuffer buf;
+        rx_pool.alloc(&buf);
+        rx_buffers[i] = (uint8_t*)buf.virt;
         
-        rx_descs[i].addr = (uint64_t)buf_phys;
+        rx_descs[i].addr = buf.phys;
         rx_descs[i].status = 0;
     }
 
-    write_reg(E1000_RDBAL, (uint32_t)((uint64_t)rx_ring_phys & 0xFFFFFFFF));
-    write_reg(E1000_RDBAH, (uint32_t)((uint64_t)rx_ring_phys >> 32));
+    write_reg(E1000_RDBAL, (uint32_t)(rx_ring.phys & 0xFFFFFFFF));
+    write_reg(E1000_RDBAH, (uint32_t)(rx_ring.phys >> 32));
     write_reg(E1000_RDLEN, E1000_NUM_RX_DESC * 16);
     write_reg(E1000_RDH, 0);
     write_reg(E1000_RDT, E1000_NUM_RX_DESC - 1);
@@ -156,21 +158,26 @@ bool E1000Driver::init() {
     write_reg(E1000_RCTL, rctl);
 
     // Setup TX
-    void* tx_ring_phys = pmm_alloc(1);
-    void* tx_ring_virt = (void*)((uint64_t)tx_ring_phys + 0xFFFF800000000000);
-    vmm_map_page((uint64_t)tx_ring_virt, (uint64_t)tx_ring_phys, 3);
-    
-    tx_descs = (e1000_tx_desc*)tx_ring_virt;
-    memset(tx_descs, 0, 4096);
+    if (!dma_alloc(4096, 128, 0, &tx_ring) ||
+        !tx_pool.init("e1000-tx", E1000_BUFFER_SIZE, 16, E1000_NUM_TX_DESC)) {
+        printf("E1000: OOM allocating TX ring.\n");
+        return false;
+    }
+    tx_descs = (e1000_tx_desc*)tx_ring.virt;
 
     for(int i=0; i<E1000_NUM_TX_DESC; i++) {
+        DmaBuffer buf;
+        tx_pool.alloc(&buf);
+        tx_buffers[i] = (uint8_t*)buf.virt;
+        tx_buffers_phys[i] = buf.phys;
+
         tx_descs[i].addr = 0;
         tx_descs[i].cmd = 0;
         tx_descs[i].status = 1; 
     }
 
-    write_reg(E1000_TDBAL, (uint32_t)((uint64_t)tx_ring_phys & 0xFFFFFFFF));
-    write_reg(E1000_TDBAH, (uint32_t)((uint64_t)tx_ring_phys >> 32));
+    write_reg(E1000_TDBAL, (uint32_t)(tx_ring.phys & 0xFFFFFFFF));
+    write_reg(E1000_TDBAH, (uint32_t)(tx_ring.phys >> 32));
     write_reg(E1000_TDLEN, E1000_NUM_TX_DESC * 16);
     write_reg(E1000_TDH, 0);
     write_reg(E1000_TDT, 0);
@@ -180,9 +187,9 @@ bool E1000Driver::init() {
     // Enable Interrupts
     write_reg(E1000_IMS, E1000_ICR_LSC | E1000_ICR_RXT0);
     
-    if (pci_dev.irq_line > 0 && pci_dev.irq_line < 16) {
-        printf("E1000: Unmasking IRQ %d\n", pci_dev.irq_line);
-        pic_unmask(pci_dev.irq_line);
+    // RX processing runs off the UI core when the NIC can do MSI
+    if (!irq_install_pci(&pci_dev, "e1000", e1000_irq, this, IRQ_CPU_AUTO)) {
+        printf("E1000: No usable IRQ (line %d)\n", pci_dev.irq_line);
     }
 
     NetworkStack::getInstance().init();
@@ -198,15 +205,15 @@ bool E1000Driver::init() {
 
 void E1000Driver::send_packet(const uint8_t* data, uint16_t len) {
     if (!initialized) return;
+    ScopedIrqLock guard(tx_lock);
     tx_cur = read_reg(E1000_TDT);
+    if (len > E1000_BUFFER_SIZE) len = E1000_BUFFER_SIZE;
     
-    void* page = pmm_alloc(1);
-    void* virt = (void*)((uint64_t)page + 0xFFFF800000000000);
-    vmm_map_page((uint64_t)virt, (uint64_t)page, 3);
-    
-    memcpy(virt, data, len);
+    // Each descriptor owns a pre-carved buffer; the wait below makes sure
+    // the NIC is done with it before the slot comes around again
+    memcpy(tx_buffers[tx_cur], data, len);
     
-    tx_descs[tx_cur].addr = (uint64_t)page;
+    tx_descs[tx_cur].addr = tx_buffers_phys[tx_cur];
     tx_descs[tx_cur].length = len;
     tx_descs[tx_cur].cmd = E1000_CMD_EOP | E1000_CMD_IFCS | E1000_CMD_RS; 
     tx_descs[tx_cur].status = 0;
@@ -219,8 +226,6 @@ void E1000Driver::send_packet(const uint8_t* data, uint16_t len) {
     while (!(tx_descs[old_cur].status & 0xff) && timeout-- > 0) {
         asm("pause");
     }
-    
-    pmm_free(page, 1);
 }
 
 void E1000Driver::handle_interrupt() {
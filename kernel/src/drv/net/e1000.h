@@ -3,11 +3,16 @@
 
 #include "e1000_defs.h"
 #include "../../pci/pci.h"
+#include "../../memory/dma.h"
+#include "../../sys/spinlock.h"
 #include <cstdint>
 
 #define E1000_NUM_RX_DESC 32
 #define E1000_NUM_TX_DESC 8
 
+// RCTL.BSIZE = 00: the NIC writes at most 2048 bytes per RX descriptor
+#define E1000_BUFFER_SIZE 2048
+
 class E1000Driver {
 public:
     static E1000Driver& getInstance();
@@ -43,13 +48,21 @@ private:
     bool has_eeprom;
 
     // Rings
+    DmaBuffer rx_ring;
+    DmaBuffer tx_ring;
     e1000_rx_desc* rx_descs; // Virtual
     e1000_tx_desc* tx_descs; // Virtual
+
+    // Packet buffers, carved once at init and bound to their descriptors
+    DmaPool rx_pool;
+    DmaPool tx_pool;
     uint8_t* rx_buffers[E1000_NUM_RX_DESC]; // Virtual ptrs to buffers
     uint8_t* tx_buffers[E1000_NUM_TX_DESC];
+    uint64_t tx_buffers_phys[E1000_NUM_TX_DESC];
 
     uint16_t rx_cur;
     uint16_t tx_cur;
+    Spinlock tx_lock;        // TX ring and tx_cur; the RX path sends replies from the IRQ
 
     // Helpers
     void write_reg(uint32_t offset, uint32_t val);
@@ -1,9 +1,13 @@
 #include "ps2_kbd.h"
 #include "../../io.h"
 #include "../../input.h"
-#include "../../interrupts/pic.h"
+#include "../../interrupts/irq.h"
 #include "../../cppstd/stdio.h"
 
+static void ps2_kbd_irq(void*) {
+    ps2_irq_callback();
+}
+
 void ps2_init() {
     printf("PS/2: Initializing Interrupts...\n");
     
@@ -12,8 +16,8 @@ void ps2_init() {
         inb(0x60);
     }
     
-    // 2. Unmask IRQ 1 on the Master PIC
-    pic_unmask(1);
+    // 2. Route IRQ 1 (IOAPIC, or the master PIC) to the BSP, which owns input
+    irq_install_isa(1, "ps2-kbd", ps2_kbd_irq, nullptr, IRQ_CPU_BSP);
 }
 
 void ps2_irq_callback() {
@@ -1,7 +1,7 @@
 #ifndef PS2_KBD_H
 #define PS2_KBD_H
 
-// Initialize the PS/2 controller and unmask IRQ 1
+// Initialize the PS/2 controller and install the IRQ 1 handler
 void ps2_init();
 
 // The function called by the ISR to process the scancode
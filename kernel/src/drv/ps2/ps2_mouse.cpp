@@ -1,7 +1,7 @@
 #include "ps2_mouse.h"
 #include "../../io.h"
 #include "../../input.h"
-#include "../../interrupts/pic.h"
+#include "../../interrupts/irq.h"
 #include "../../cppstd/stdio.h"
 #include "../../globals.h"
 
@@ -10,6 +10,10 @@
 #define MOUSE_PORT_CMD     0x64
 
 static uint8_t mouse_cycle = 0;
+
+static void ps2_mouse_irq(void*) {
+    ps2_mouse_irq_callback();
+}
 static uint8_t mouse_packet[4]; 
 
 static void mouse_wait(uint8_t type) {
@@ -64,11 +68,9 @@ void ps2_mouse_init() {
     mouse_write(0xF4);
     mouse_read(); // ACK
 
-    // 5. Unmask IRQ 12 (Mouse) AND IRQ 2 (Cascade)
-    // IMPORTANT: IRQ 12 is on the Slave PIC. We must enable the cascade (IRQ 2)
-    // on the Master PIC, or we will never hear from the mouse.
-    pic_unmask(2);
-    pic_unmask(12);
+    // 5. Route IRQ 12 to the BSP. Without an IOAPIC it sits on the slave
+    // PIC, and irq_install_isa() opens the cascade (IRQ 2) for us.
+    irq_install_isa(12, "ps2-mouse", ps2_mouse_irq, nullptr, IRQ_CPU_BSP);
     
     if (g_renderer) {
         g_mouse_x = g_renderer->getWidth() / 2;
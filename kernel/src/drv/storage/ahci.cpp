@@ -4,26 +4,55 @@
 #include "../../cppstd/stdio.h"
 #include "../../cppstd/string.h"
 #include "../../timer.h"
+#include "../../sys/timer_wheel.h"
+#include "../../sys/idle.h"
+#include "../../sys/percpu.h"
+#include "../../sys/sched.h"
+#include "../../interrupts/irq.h"
+
+#define AHCI_SPIN_NS     50000   // Busy-poll a command this long before sleeping
+#define AHCI_TIMEOUT_MS  2000
 
 static void* phys_to_virt(uint64_t phys) {
     return (void*)(phys + g_hhdm_offset);
 }
 
+// Only the HHDM itself translates by subtraction. The heap, the DMA
+// window and the other kernel mappings sit above g_hhdm_offset too but
+// have their own page tables.
+static bool in_hhdm(uint64_t addr) {
+    return addr >= g_hhdm_offset && addr - g_hhdm_offset < pmm_get_highest_address();
+}
+
 static uint64_t virt_to_phys_addr(void* vaddr) {
     uint64_t addr = (uint64_t)vaddr;
-    if (addr >= g_hhdm_offset) {
+    if (in_hhdm(addr)) {
         return addr - g_hhdm_offset;
     }
     return vmm_virt_to_phys(addr);
 }
 
+static void command_expired(void* arg) {
+    *(volatile bool*)arg = true;
+}
+
+static void ahci_irq(void* ctx) {
+    ((AhciDriver*)ctx)->handle_interrupt();
+}
+
+static bool irqs_enabled() {
+    uint64_t flags;
+    asm volatile("pushfq; pop %0" : "=r"(flags));
+    return flags & 0x200;
+}
+
 AhciDriver& AhciDriver::getInstance() {
     static AhciDriver instance;
     return instance;
 }
 
-AhciDriver::AhciDriver() : hba_mem(nullptr) {
-    memset(ports, 0, sizeof(ports));
+AhciDriver::AhciDriver() : hba_mem(nullptr), irq_ready(false), max_slots(1) {
+    memset((void*)ports, 0, sizeof(ports));
 }
 
 bool AhciDriver::init() {
@@ -57,9 +86,23 @@ bool AhciDriver::init() {
     printf("AHCI: Hardware Version %d.%d\n", 
         (hba_mem->vs >> 16) & 0xFFFF, hba_mem->vs & 0xFFFF);
 
-    hba_mem->ghc |= (1 << 31);
-    
+    hba_mem->ghc |= HBA_GHC_AE;
+
+    max_slots = ((hba_mem->cap >> 8) & 0x1F) + 1;
+    printf("AHCI: %d command slots%s\n", max_slots,
+           (hba_mem->cap & HBA_CAP_SNCQ) ? ", NCQ" : "");
+
     probe_ports();
+
+    // Completions come from the port interrupt from here on; until the
+    // vector is live (and without one) waiters poll
+    hba_mem->is = (uint32_t)-1;
+    if (irq_install_pci(&pci_dev, "ahci", ahci_irq, this, IRQ_CPU_AUTO)) {
+        hba_mem->ghc |= HBA_GHC_IE;
+        irq_ready = true;
+    } else {
+        printf("AHCI: No usable IRQ (line %d), polling for completions\n", pci_dev.irq_line);
+    }
     return true;
 }
 
@@ -70,11 +113,11 @@ void AhciDriver::probe_ports() {
             int dt = check_type(&hba_mem->ports[i]);
             if (dt == AHCI_DEV_SATA) {
                 printf("AHCI: Port %d: SATA Device Found\n", i);
-                ports[i].implemented = true;
                 ports[i].type = dt;
                 ports[i].port_reg = &hba_mem->ports[i];
                 ports[i].id = i;
                 rebase_port(&ports[i]);
+                ports[i].implemented = identify(&ports[i]);
             } else if (dt == AHCI_DEV_SATAPI) {
                 printf("AHCI: Port %d: SATAPI (CD-ROM)\n", i);
             }
@@ -142,151 +185,536 @@ void AhciDriver::rebase_port(AhciPort* p) {
     p->port_reg->fb = (uint32_t)(p->fis_base_phys & 0xFFFFFFFF);
     p->port_reg->fbu = (uint32_t)(p->fis_base_phys >> 32);
 
-    void* cmd_table_phys_addr = pmm_alloc(1);
-    p->cmd_table_phys = (uint64_t)cmd_table_phys_addr;
-    p->cmd_table = (HBA_CMD_TABLE*)phys_to_virt(p->cmd_table_phys);
-    memset(p->cmd_table, 0, 4096);
+    // A table per slot, so commands in flight never share one. Tables
+    // must be 128-byte aligned, which AHCI_CMD_TABLE_SIZE keeps.
+    dma_alloc(max_slots * AHCI_CMD_TABLE_SIZE, 4096, 0, &p->cmd_tables);
+    for (int i = 0; i < max_slots; i++) {
+        uint64_t table_phys = p->cmd_tables.phys + i * AHCI_CMD_TABLE_SIZE;
+        HBA_CMD_HEADER* hdr = &p->cmd_list[i];
+        hdr->ctba = (uint32_t)(table_phys & 0xFFFFFFFF);
+        hdr->ctbau = (uint32_t)(table_phys >> 32);
+        hdr->prdtl = 1;
+    }
 
-    HBA_CMD_HEADER* hdr = &p->cmd_list[0];
-    hdr->ctba = (uint32_t)(p->cmd_table_phys & 0xFFFFFFFF);
-    hdr->ctbau = (uint32_t)(p->cmd_table_phys >> 32);
-    hdr->prdtl = 1; 
+    // Everything that ends a command, and every error
+    p->port_reg->serr = (uint32_t)-1;
+    p->port_reg->is = (uint32_t)-1;
+    p->port_reg->ie = HBA_PxIS_DHRS | HBA_PxIS_PSS | HBA_PxIS_DSS | HBA_PxIS_SDBS | HBA_PxIS_ERRORS;
 
     start_cmd(p->port_reg);
 }
 
-int AhciDriver::find_cmd_slot(HBA_PORT* port) {
-    uint32_t slots = (port->sact | port->ci);
-    for (int i=0; i<32; i++) {
-        if ((slots & 1) == 0) return i;
-        slots >>= 1;
+// Runs before the port takes requests, so it has slot 0 to itself and
+// simply polls for completion
+bool AhciDriver::identify(AhciPort* p) {
+    HBA_PORT* reg = p->port_reg;
+
+    if (!p->cmd_tables.virt) return false;
+
+    DmaBuffer id_buf;
+    if (!dma_alloc(512, 512, 0, &id_buf)) return false;
+    uint16_t* id = (uint16_t*)id_buf.virt;
+
+    int spin = 0;
+    while ((reg->tfd & (0x80 | 0x08)) && spin < 1000000) { spin++; }
+    if (spin == 1000000) { printf("AHCI: BUSY Timeout\n"); dma_free(&id_buf); return false; }
+
+    build_command(p, 0, ATA_CMD_IDENTIFY, 0, 0, id_buf.virt, 512, false);
+
+    reg->is = (uint32_t)-1;
+    reg->ci = 1;
+
+    bool ok = true;
+    uint64_t deadline = clock_ns() + AHCI_TIMEOUT_MS * 1000000ULL;
+    while (reg->ci & 1) {
+        if (reg->is & HBA_PxIS_TFES) { printf("AHCI: Disk Error\n"); ok = false; break; }
+        if (clock_ns() > deadline) {
+            printf("AHCI: Timeout waiting for IDENTIFY completion.\n");
+            ok = false;
+            break;
+        }
+        asm volatile("pause");
     }
-    return -1;
+    reg->is = (uint32_t)-1;
+
+    if (ok) {
+        // Word 83 bit 10: LBA48 supported, count in words 100-103.
+        // Otherwise the 28-bit count in words 60-61.
+        if (id[83] & (1 << 10)) {
+            p->sector_count = (uint64_t)id[100] | ((uint64_t)id[101] << 16) |
+                              ((uint64_t)id[102] << 32) | ((uint64_t)id[103] << 48);
+        } else {
+            p->sector_count = (uint64_t)id[60] | ((uint64_t)id[61] << 16);
+        }
+
+        // Word 76 bit 8: NCQ supported, queue depth - 1 in word 75 bits 4:0
+        int depth = max_slots;
+        p->ncq = (hba_mem->cap & HBA_CAP_SNCQ) && (id[76] & (1 << 8));
+        if (p->ncq && (id[75] & 0x1F) + 1 < depth) depth = (id[75] & 0x1F) + 1;
+        p->slot_mask = depth >= 32 ? 0xFFFFFFFF : (1u << depth) - 1;
+
+        printf("AHCI: Port %d: %d MB, %s, queue depth %d\n", p->id,
+               (int)(p->sector_count / 2048), p->ncq ? "NCQ" : "no NCQ", depth);
+    }
+
+    dma_free(&id_buf);
+    return ok;
 }
 
-// --- IO OPS WITH TIMEOUTS ---
+// Describes a virtual buffer to the HBA one page at a time, merging
+// pages that happen to be physically adjacent. Returns the number of
+// entries, 0 if part of the buffer isn't mapped or it doesn't fit.
+static int build_prdt(HBA_PRDT_ENTRY* prdt, void* buffer, uint32_t bytes) {
+    uint64_t addr = (uint64_t)buffer;
+    uint64_t next_phys = 0;
+    int n = 0;
+
+    while (bytes > 0) {
+        uint32_t chunk = 4096 - (addr & 0xFFF);
+        if (chunk > bytes) chunk = bytes;
+
+        uint64_t phys = virt_to_phys_addr((void*)addr);
+        if (!phys) return 0;
+
+        if (n > 0 && phys == next_phys && prdt[n - 1].dbc + 1 + chunk <= AHCI_PRD_MAX_BYTES) {
+            prdt[n - 1].dbc = prdt[n - 1].dbc + chunk;
+        } else {
+            if (n == AHCI_PRDT_ENTRIES) return 0;
+            prdt[n].dba = (uint32_t)(phys & 0xFFFFFFFF);
+            prdt[n].dbau = (uint32_t)(phys >> 32);
+            prdt[n].rsv0 = 0;
+            prdt[n].dbc = chunk - 1;
+            prdt[n].rsv1 = 0;
+            prdt[n].i = 0;
+            n++;
+        }
 
-bool AhciDriver::read(int port_index, uint64_t lba, uint32_t count, void* buffer) {
-    if (port_index < 0 || port_index >= 32) return false;
-    if (!ports[port_index].implemented) return false;
+        next_phys = phys + chunk;
+        addr += chunk;
+        bytes -= chunk;
+    }
 
-    AhciPort* p = &ports[port_index];
-    HBA_PORT* reg = p->port_reg;
+    prdt[n - 1].i = 1;
+    return n;
+}
 
-    reg->is = (uint32_t)-1;
-    int spin = 0;
-    int slot = find_cmd_slot(reg);
-    if (slot == -1) return false;
+// Reading into a page that isn't there yet (lazy heap or user memory, a
+// copy-on-write share) has to fault it in before the HBA writes behind
+// the MMU's back; writing from one only needs it present. The HHDM is
+// always mapped.
+static void prefault(void* buffer, uint32_t bytes, bool device_writes) {
+    uint64_t addr = (uint64_t)buffer;
+    if (in_hhdm(addr)) return;
+
+    uint64_t end = addr + bytes;
+    for (uint64_t page = addr & ~0xFFFULL; page < end; page += 4096) {
+        volatile uint8_t* byte = (volatile uint8_t*)(page < addr ? addr : page);
+        uint8_t value = *byte;
+        if (device_writes) *byte = value;
+    }
+}
 
-    HBA_CMD_HEADER* cmdheader = (HBA_CMD_HEADER*)p->cmd_list;
-    cmdheader += slot;
-    cmdheader->cfl = sizeof(FIS_REG_H2D)/sizeof(uint32_t); 
-    cmdheader->w = 0; 
-    cmdheader->prdtl = 1;
+bool AhciDriver::build_command(AhciPort* p, int slot, uint8_t command, uint64_t lba, uint32_t count,
+                               void* buffer, uint32_t bytes, bool write) {
+    HBA_CMD_TABLE* cmdtable = (HBA_CMD_TABLE*)((uint8_t*)p->cmd_tables.virt + slot * AHCI_CMD_TABLE_SIZE);
+    memset(cmdtable, 0, 0x80);
 
-    HBA_CMD_TABLE* cmdtable = (HBA_CMD_TABLE*)p->cmd_table;
-    memset(cmdtable, 0, sizeof(HBA_CMD_TABLE) + (cmdheader->prdtl-1)*sizeof(HBA_PRDT_ENTRY));
+    int entries = build_prdt(cmdtable->prdt_entry, buffer, bytes);
+    if (entries == 0) return false;
 
-    uint64_t buf_phys = virt_to_phys_addr(buffer);
-    
-    cmdtable->prdt_entry[0].dba = (uint32_t)(buf_phys & 0xFFFFFFFF);
-    cmdtable->prdt_entry[0].dbau = (uint32_t)(buf_phys >> 32);
-    cmdtable->prdt_entry[0].dbc = (count * 512) - 1;
-    cmdtable->prdt_entry[0].i = 1;
+    HBA_CMD_HEADER* cmdheader = &p->cmd_list[slot];
+    cmdheader->cfl = sizeof(FIS_REG_H2D)/sizeof(uint32_t); 
+    cmdheader->w = write ? 1 : 0;
+    cmdheader->prdtl = (uint16_t)entries;
+    cmdheader->prdbc = 0;
 
     FIS_REG_H2D* cmdfis = (FIS_REG_H2D*)(&cmdtable->cfis);
     cmdfis->fis_type = 0x27;
     cmdfis->c = 1;
-    cmdfis->command = ATA_CMD_READ_DMA_EX;
+    cmdfis->command = command;
+
+    if (command == ATA_CMD_IDENTIFY) return true;
 
     cmdfis->lba0 = (uint8_t)lba;
     cmdfis->lba1 = (uint8_t)(lba >> 8);
     cmdfis->lba2 = (uint8_t)(lba >> 16);
-    cmdfis->device = 1 << 6; 
+    cmdfis->device = 1 << 6;
     cmdfis->lba3 = (uint8_t)(lba >> 24);
     cmdfis->lba4 = (uint8_t)(lba >> 32);
     cmdfis->lba5 = (uint8_t)(lba >> 40);
-    cmdfis->countl = count & 0xFF;
-    cmdfis->counth = (count >> 8) & 0xFF;
 
-    while ((reg->tfd & (0x80 | 0x08)) && spin < 1000000) { spin++; }
-    if (spin == 1000000) { printf("AHCI: BUSY Timeout\n"); return false; }
-
-    reg->ci |= (1 << slot);
-
-    // Timeout loop ~2 seconds
-    uint64_t timeout = 2000; 
-    while (true) {
-        if ((reg->ci & (1 << slot)) == 0) break;
-        if (reg->is & (1 << 30)) { printf("AHCI: Disk Error\n"); return false; }
-        
-        sleep_ms(1);
-        if (timeout-- == 0) {
-            printf("AHCI: Timeout waiting for Read completion.\n");
-            return false;
-        }
+    if (command == ATA_CMD_READ_FPDMA_QUEUED || command == ATA_CMD_WRITE_FPDMA_QUEUED) {
+        // FPDMA: the sector count moves to the feature register and the
+        // count register carries the tag, which is the slot
+        cmdfis->featurel = count & 0xFF;
+        cmdfis->featureh = (count >> 8) & 0xFF;
+        cmdfis->countl = (uint8_t)(slot << 3);
+    } else {
+        cmdfis->countl = count & 0xFF;
+        cmdfis->counth = (count >> 8) & 0xFF;
     }
     return true;
 }
 
-bool AhciDriver::write(int port_index, uint64_t lba, uint32_t count, const void* buffer) {
+bool AhciDriver::submit(int port_index, AhciRequest* req) {
     if (port_index < 0 || port_index >= 32) return false;
     if (!ports[port_index].implemented) return false;
+    if (req->count == 0 || req->count > AHCI_MAX_SECTORS) return false;
+    if ((uint64_t)req->buffer & 1) return false; // PRD addresses are word aligned
 
     AhciPort* p = &ports[port_index];
     HBA_PORT* reg = p->port_reg;
+    uint32_t bytes = req->count * 512;
+    prefault(req->buffer, bytes, !req->write);
+    uint8_t command = p->ncq ? (req->write ? ATA_CMD_WRITE_FPDMA_QUEUED : ATA_CMD_READ_FPDMA_QUEUED)
+                             : (req->write ? ATA_CMD_WRITE_DMA_EX : ATA_CMD_READ_DMA_EX);
+    req->status = AHCI_REQ_PENDING;
+
+    while (true) {
+        {
+            ScopedIrqLock<Spinlock> guard(p->lock);
+            uint32_t free = p->slot_mask & ~p->outstanding;
+            if (free) {
+                int slot = __builtin_ctz(free);
+                if (!build_command(p, slot, command, req->lba, req->count, req->buffer, bytes, req->write)) {
+                    printf("AHCI: Can't map buffer %p for DMA\n", req->buffer);
+                    return false;
+                }
+                p->requests[slot] = req;
+                p->outstanding |= 1u << slot;
+
+                int depth = __builtin_popcount(p->outstanding);
+                if (depth > p->max_depth) p->max_depth = depth;
+
+                // Both registers only take the bits written as 1. SACT
+                // has to be set before the command goes out.
+                if (p->ncq) reg->sact = 1u << slot;
+                reg->ci = 1u << slot;
+                return true;
+            }
+        }
+
+        // Every slot in flight: one completes soon
+        if (needsPolling()) poll(port_index);
+        asm volatile("pause");
+    }
+}
+
+// Collects finished requests into done. Lock held. With error set, every
+// outstanding command counts as failed: the port is restarted after an
+// error, which throws away whatever was still queued.
+void AhciDriver::reap(AhciPort* p, bool error, AhciRequest** done, int* done_count) {
+    HBA_PORT* reg = p->port_reg;
+    uint32_t active = error ? 0 : (reg->ci | reg->sact);
+    uint32_t finished = p->outstanding & ~active;
+
+    while (finished) {
+        int slot = __builtin_ctz(finished);
+        finished &= finished - 1;
+
+        AhciRequest* req = p->requests[slot];
+        p->requests[slot] = nullptr;
+        p->outstanding &= ~(1u << slot);
+        if (req) done[(*done_count)++] = req;
+    }
+}
+
+// Outside the lock: callbacks may submit again
+void AhciDriver::complete(AhciPort* p, AhciRequest** done, int done_count, bool ok) {
+    if (done_count == 0) return;
+    __atomic_fetch_add(ok ? &p->completed : &p->errors, (uint64_t)done_count, __ATOMIC_RELAXED);
+
+    for (int i = 0; i < done_count; i++) {
+        AhciRequest* req = done[i];
+        req->status = ok ? AHCI_REQ_OK : AHCI_REQ_ERROR;
+        if (req->callback) req->callback(req);
+    }
+}
+
+// Error recovery (AHCI 1.3 section 6.2.2): stop the command engine, which
+// clears CI and SACT, clear the error state and start it again
+void AhciDriver::recover(AhciPort* p) {
+    HBA_PORT* reg = p->port_reg;
+    printf("AHCI: Port %d error (IS %x, TFD %x, SERR %x), restarting\n",
+           p->id, reg->is, reg->tfd, reg->serr);
+
+    reg->cmd &= ~HBA_PxCMD_ST;
+    uint64_t deadline = clock_ns() + 500000000ULL;
+    while ((reg->cmd & HBA_PxCMD_CR) && clock_ns() < deadline) asm volatile("pause");
 
+    reg->serr = (uint32_t)-1;
     reg->is = (uint32_t)-1;
-    int spin = 0;
-    int slot = find_cmd_slot(reg);
-    if (slot == -1) return false;
+    reg->cmd |= HBA_PxCMD_ST;
+}
 
-    HBA_CMD_HEADER* cmdheader = (HBA_CMD_HEADER*)p->cmd_list;
-    cmdheader += slot;
-    cmdheader->cfl = sizeof(FIS_REG_H2D)/sizeof(uint32_t); 
-    cmdheader->w = 1; 
-    cmdheader->prdtl = 1;
+void AhciDriver::service_port(AhciPort* p) {
+    AhciRequest* done[AHCI_MAX_SLOTS];
+    int done_count = 0;
+    bool error;
+    {
+        ScopedIrqLock<Spinlock> guard(p->lock);
+        uint32_t is = p->port_reg->is;
+        error = is & HBA_PxIS_ERRORS;
+        if (error) recover(p);
+        else p->port_reg->is = is;
+        reap(p, error, done, &done_count);
+    }
+    complete(p, done, done_count, !error);
+}
 
-    HBA_CMD_TABLE* cmdtable = (HBA_CMD_TABLE*)p->cmd_table;
-    memset(cmdtable, 0, sizeof(HBA_CMD_TABLE) + (cmdheader->prdtl-1)*sizeof(HBA_PRDT_ENTRY));
+void AhciDriver::handle_interrupt() {
+    uint32_t pending = hba_mem->is;
+    for (int i = 0; i < 32; i++) {
+        if ((pending & (1u << i)) && ports[i].implemented) service_port(&ports[i]);
+    }
+    // Port status first, then the HBA bit it feeds
+    hba_mem->is = pending;
+}
 
-    uint64_t buf_phys = virt_to_phys_addr((void*)buffer);
-    
-    cmdtable->prdt_entry[0].dba = (uint32_t)(buf_phys & 0xFFFFFFFF);
-    cmdtable->prdt_entry[0].dbau = (uint32_t)(buf_phys >> 32);
-    cmdtable->prdt_entry[0].dbc = (count * 512) - 1;
-    cmdtable->prdt_entry[0].i = 1;
+void AhciDriver::poll(int port_index) {
+    if (port_index < 0 || port_index >= 32) return;
+    if (!ports[port_index].implemented || !ports[port_index].outstanding) return;
+    service_port(&ports[port_index]);
+}
 
-    FIS_REG_H2D* cmdfis = (FIS_REG_H2D*)(&cmdtable->cfis);
-    cmdfis->fis_type = 0x27;
-    cmdfis->c = 1;
-    cmdfis->command = ATA_CMD_WRITE_DMA_EX;
+bool AhciDriver::needsPolling() const {
+    return !irq_ready || !irqs_enabled();
+}
 
-    cmdfis->lba0 = (uint8_t)lba;
-    cmdfis->lba1 = (uint8_t)(lba >> 8);
-    cmdfis->lba2 = (uint8_t)(lba >> 16);
-    cmdfis->device = 1 << 6;
-    cmdfis->lba3 = (uint8_t)(lba >> 24);
-    cmdfis->lba4 = (uint8_t)(lba >> 32);
-    cmdfis->lba5 = (uint8_t)(lba >> 40);
-    cmdfis->countl = count & 0xFF;
-    cmdfis->counth = (count >> 8) & 0xFF;
+struct SyncWait {
+    volatile bool done;
+    int cpu;
+};
+
+static void sync_done(AhciRequest* req) {
+    SyncWait* wait = (SyncWait*)req->ctx;
+    int cpu = wait->cpu;
+    // The waiter may return (and its stack go) as soon as it sees this
+    __atomic_store_n(&wait->done, true, __ATOMIC_RELEASE);
+    idle_wake(cpu);
+}
 
-    while ((reg->tfd & (0x80 | 0x08)) && spin < 1000000) { spin++; }
-    if (spin == 1000000) return false;
+// Submits and waits. Most commands finish within the spin window. After
+// that a kernel thread yields between checks and anything else idles
+// until the completion interrupt wakes it; with interrupts off (swap-in
+// from the page fault handler) or no IRQ the loop reaps by itself.
+bool AhciDriver::transfer(int port_index, uint64_t lba, uint32_t count, void* buffer, bool write) {
+    SyncWait wait;
+    wait.done = false;
+    wait.cpu = this_cpu_id();
+
+    AhciRequest req;
+    req.lba = lba;
+    req.count = count;
+    req.buffer = buffer;
+    req.write = write;
+    req.callback = sync_done;
+    req.ctx = &wait;
+    if (!submit(port_index, &req)) return false;
+
+    uint64_t spin_until = clock_ns() + AHCI_SPIN_NS;
+    volatile bool expired = false;
+    bool armed = false;
+    Timer timeout;
+
+    while (!__atomic_load_n(&wait.done, __ATOMIC_ACQUIRE)) {
+        if (expired) {
+            printf("AHCI: Timeout waiting for %s completion.\n", write ? "Write" : "Read");
+            // Fails everything in flight, ours included
+            AhciPort* p = &ports[port_index];
+            AhciRequest* done[AHCI_MAX_SLOTS];
+            int done_count = 0;
+            {
+                ScopedIrqLock<Spinlock> guard(p->lock);
+                recover(p);
+                reap(p, true, done, &done_count);
+            }
+            complete(p, done, done_count, false);
+            expired = false;
+            continue;
+        }
 
-    reg->ci |= (1 << slot);
+        if (needsPolling()) {
+            // Nothing will interrupt us with the completion (nor fire
+            // the timer wheel if interrupts are off)
+            poll(port_index);
+            if (clock_ns() > spin_until + AHCI_TIMEOUT_MS * 1000000ULL) expired = true;
+            asm volatile("pause");
+            continue;
+        }
 
-    uint64_t timeout = 2000;
-    while (true) {
-        if ((reg->ci & (1 << slot)) == 0) break;
-        if (reg->is & (1 << 30)) { printf("AHCI: Disk Error\n"); return false; }
-        
-        sleep_ms(1);
-        if (timeout-- == 0) {
-            printf("AHCI: Timeout waiting for Write completion.\n");
-            return false;
+        if (clock_ns() < spin_until) {
+            asm volatile("pause");
+            continue;
+        }
+        if (!armed) {
+            armed = true;
+            timer_init(&timeout);
+            timer_add(&timeout, clock_ns() + AHCI_TIMEOUT_MS * 1000000ULL, command_expired, (void*)&expired);
+        }
+
+        if (sched_may_sleep()) {
+            thread_yield();
+        } else {
+            uint64_t seq = idle_wake_seq();
+            if (!__atomic_load_n(&wait.done, __ATOMIC_ACQUIRE)) idle_wait(seq);
         }
     }
+
+    if (armed) timer_cancel(&timeout);
+    return req.status == AHCI_REQ_OK;
+}
+
+// Anything past the per-command limit goes out as several commands
+bool AhciDriver::read(int port_index, uint64_t lba, uint32_t count, void* buffer) {
+    uint8_t* dst = (uint8_t*)buffer;
+    while (count > 0) {
+        uint32_t n = count > AHCI_MAX_SECTORS ? AHCI_MAX_SECTORS : count;
+        if (!transfer(port_index, lba, n, dst, false)) return false;
+        lba += n;
+        count -= n;
+        dst += n * 512;
+    }
+    return true;
+}
+
+bool AhciDriver::write(int port_index, uint64_t lba, uint32_t count, const void* buffer) {
+    const uint8_t* src = (const uint8_t*)buffer;
+    while (count > 0) {
+        uint32_t n = count > AHCI_MAX_SECTORS ? AHCI_MAX_SECTORS : count;
+        if (!transfer(port_index, lba, n, (void*)src, true)) return false;
+        lba += n;
+        count -= n;
+        src += n * 512;
+    }
     return true;
-}
\ No newline at end of file
+}
+
+uint64_t AhciDriver::getSectorCount(int port_index) {
+    if (port_index < 0 || port_index >= 32) return 0;
+    if (!ports[port_index].implemented) return 0;
+    return ports[port_index].sector_count;
+}
+
+void AhciDriver::printStats() {
+    for (int i = 0; i < 32; i++) {
+        AhciPort* p = &ports[i];
+        if (!p->implemented) continue;
+        printf("AHCI: Port %d: %s, %d slots, %d in flight (max %d), %d done, %d failed\n",
+               i, p->ncq ? "NCQ" : "no NCQ", __builtin_popcount(p->slot_mask),
+               __builtin_popcount(p->outstanding), p->max_depth, (int)p->completed, (int)p->errors);
+    }
+    printf("AHCI: Completions by %s\n", irq_ready ? "interrupt" : "polling");
+}
+
+// --- QUEUE DEPTH BENCHMARK ---
+
+#define AHCI_BENCH_REQUESTS 2048
+#define AHCI_BENCH_SECTORS  8       // 4 KB per read
+
+struct AhciBench {
+    int port;
+    uint64_t span;            // LBAs we pick from, in AHCI_BENCH_SECTORS units
+    uint64_t seed;
+    volatile int issued;
+    volatile int finished;
+    volatile int failed;
+};
+
+static uint64_t bench_next_lba(AhciBench* b) {
+    // xorshift64; races between cores only make it more random
+    uint64_t x = b->seed;
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+    b->seed = x;
+    return (x % b->span) * AHCI_BENCH_SECTORS;
+}
+
+// Keeps the queue full: every completion puts its request back in
+static void bench_done(AhciRequest* req) {
+    AhciBench* b = (AhciBench*)req->ctx;
+    if (req->status != AHCI_REQ_OK) __atomic_fetch_add(&b->failed, 1, __ATOMIC_RELAXED);
+
+    if (__atomic_fetch_add(&b->issued, 1, __ATOMIC_RELAXED) < AHCI_BENCH_REQUESTS) {
+        req->lba = bench_next_lba(b);
+        if (AhciDriver::getInstance().submit(b->port, req)) return;
+    }
+    __atomic_fetch_add(&b->finished, 1, __ATOMIC_RELEASE);
+}
+
+void AhciDriver::benchmark() {
+    int port = findFirstSataPort();
+    if (port < 0) { printf("AHCI: No SATA drive\n"); return; }
+    AhciPort* p = &ports[port];
+
+    DmaBuffer buffers;
+    if (!dma_alloc(AHCI_MAX_SLOTS * AHCI_BENCH_SECTORS * 512, 4096, 0, &buffers)) {
+        printf("AHCI: Out of memory\n");
+        return;
+    }
+    AhciRequest* reqs = new AhciRequest[AHCI_MAX_SLOTS];
+
+    // Reads only, from the first GB (or the whole drive if smaller)
+    uint64_t span = p->sector_count < 2097152 ? p->sector_count : 2097152;
+    span /= AHCI_BENCH_SECTORS;
+    if (span == 0) span = 1;
+
+    int max_depth = __builtin_popcount(p->slot_mask);
+    printf("AHCI: Port %d, %d random 4 KB reads per depth (%s)\n", port, AHCI_BENCH_REQUESTS,
+           p->ncq ? "NCQ" : "no NCQ");
+
+    for (int depth = 1; ; depth *= 2) {
+        if (depth > max_depth) depth = max_depth;
+        AhciBench bench;
+        bench.port = port;
+        bench.span = span;
+        bench.seed = rdtsc() | 1;
+        bench.issued = depth;
+        bench.finished = 0;
+        bench.failed = 0;
+
+        uint64_t start = clock_ns();
+        for (int i = 0; i < depth; i++) {
+            reqs[i].lba = bench_next_lba(&bench);
+            reqs[i].count = AHCI_BENCH_SECTORS;
+            reqs[i].buffer = (uint8_t*)buffers.virt + i * AHCI_BENCH_SECTORS * 512;
+            reqs[i].write = false;
+            reqs[i].callback = bench_done;
+            reqs[i].ctx = &bench;
+            if (!submit(port, &reqs[i])) __atomic_fetch_add(&bench.finished, 1, __ATOMIC_RELEASE);
+        }
+
+        uint64_t deadline = start + 10000000000ULL;
+        while (__atomic_load_n(&bench.finished, __ATOMIC_ACQUIRE) < depth) {
+            if (needsPolling()) poll(port);
+            if (clock_ns() > deadline) break;
+            asm volatile("pause");
+        }
+        uint64_t elapsed = clock_ns() - start;
+
+        if (bench.finished < depth) {
+            // Requests still queued point at our stack; wait them out
+            printf("AHCI: QD %d timed out\n", depth);
+            while (__atomic_load_n(&bench.finished, __ATOMIC_ACQUIRE) < depth) {
+                if (needsPolling()) poll(port);
+                asm volatile("pause");
+            }
+            break;
+        }
+        if (elapsed == 0) elapsed = 1;
+
+        uint64_t iops = (uint64_t)AHCI_BENCH_REQUESTS * 1000000000ULL / elapsed;
+        uint64_t kbps = iops * AHCI_BENCH_SECTORS / 2;
+        // Little's law: each read spent depth / IOPS in the queue
+        printf("QD %d: %d IOPS, %d.%d MB/s, %d us latency%s\n", depth, (int)iops,
+               (int)(kbps / 1024), (int)((kbps % 1024) * 10 / 1024),
+               (int)(elapsed * depth / 1000 / AHCI_BENCH_REQUESTS),
+               bench.failed ? " (errors)" : "");
+
+        if (depth == max_depth) break;
+    }
+
+    delete[] reqs;
+    dma_free(&buffers);
+}
@@ -5,18 +5,68 @@
 #include <cstddef>
 #include "ahci_defs.h"
 #include "../../pci/pci.h"
+#include "../../memory/dma.h"
+#include "../../sys/spinlock.h"
+
+#define AHCI_MAX_SLOTS      32
+#define AHCI_MAX_SECTORS    8192          // 4 MB per command
+#define AHCI_PRD_MAX_BYTES  (4u << 20)    // Per PRDT entry (22-bit count)
+
+// Enough for a 4 MB buffer that is scattered page by page and doesn't
+// start on a page boundary (1025), rounded up so every slot's table
+// stays 128-byte aligned
+#define AHCI_PRDT_ENTRIES   1032
+#define AHCI_CMD_TABLE_SIZE (0x80 + AHCI_PRDT_ENTRIES * 16)
+
+#define AHCI_REQ_PENDING    0
+#define AHCI_REQ_OK         1
+#define AHCI_REQ_ERROR      2
+
+struct AhciRequest;
+
+// Runs once the request has finished (req->status says how), in
+// interrupt context when the port has an IRQ, otherwise from whoever
+// polls. May submit again; must not sleep.
+typedef void (*AhciCallback)(AhciRequest* req);
+
+// Filled in by the caller, owned by the driver from submit() until the
+// callback runs. The buffer can be any mapped kernel or user memory
+// (word aligned, up to AHCI_MAX_SECTORS); the driver walks the page
+// tables and hands the HBA a scatter-gather list.
+struct AhciRequest {
+    uint64_t lba;
+    uint32_t count;          // Sectors
+    void* buffer;
+    bool write;
+    AhciCallback callback;   // May be null: just watch status
+    void* ctx;
+    volatile int status;     // AHCI_REQ_*
+};
 
 struct AhciPort {
     int id;
     HBA_PORT* port_reg;
     HBA_CMD_HEADER* cmd_list; // Virtual Address
     uint64_t cmd_list_phys;
-    HBA_CMD_TABLE* cmd_table; // Virtual Address
-    uint64_t cmd_table_phys;
+    DmaBuffer cmd_tables;     // One AHCI_CMD_TABLE_SIZE table per slot
     void* fis_base;           // Virtual Address
     uint64_t fis_base_phys;
     bool implemented;
     int type; // SATA, SATAPI, etc.
+    uint64_t sector_count; // From IDENTIFY at init
+
+    // Queueing. Slots in slot_mask are usable; with NCQ that is the
+    // smaller of the HBA's and the drive's queue depth, without it the
+    // HBA still runs issued commands one after another.
+    bool ncq;
+    uint32_t slot_mask;
+    uint32_t outstanding;     // Slots issued and not yet completed
+    AhciRequest* requests[AHCI_MAX_SLOTS];
+    Spinlock lock;            // Slots, outstanding, requests
+
+    uint64_t completed;
+    uint64_t errors;
+    int max_depth;            // Most commands seen in flight at once
 };
 
 class AhciDriver {
@@ -29,12 +79,43 @@ public:
     // Returns the index of the first connected SATA drive, or -1 if none.
     int findFirstSataPort();
 
-    // Read sectors (512 bytes each)
+    // Read sectors (512 bytes each) into any mapped buffer, waiting for
+    // the transfer. No size limit: large ones are split into commands.
     bool read(int port_index, uint64_t lba, uint32_t count, void* buffer);
 
     // Write sectors
     bool write(int port_index, uint64_t lba, uint32_t count, const void* buffer);
 
+    // Capacity in 512 byte sectors (ATA IDENTIFY at init). 0 on error.
+    uint64_t getSectorCount(int port_index);
+
+    // Queues a request and returns without waiting. Waits for a free slot
+    // if all are in flight. False if the port or request is unusable.
+    bool submit(int port_index, AhciRequest* req);
+
+    // Reaps finished commands without waiting for the interrupt. Needed
+    // by callers that wait with interrupts off or when the port has no
+    // IRQ; harmless otherwise.
+    void poll(int port_index);
+
+    // True if waiters have to poll() instead of relying on the IRQ
+    bool needsPolling() const;
+
+    // Commands in flight per port and totals
+    void printStats();
+
+    // Commands completed on a port so far, failed ones included
+    uint64_t getCommandCount(int port_index) const {
+        if (port_index < 0 || port_index >= 32) return 0;
+        return ports[port_index].completed + ports[port_index].errors;
+    }
+
+    // Random 4 KB reads at increasing queue depths, IOPS and MB/s
+    void benchmark();
+
+    // IRQ handler
+    void handle_interrupt();
+
 private:
     AhciDriver();
     
@@ -44,14 +125,23 @@ private:
     HBA_MEM* hba_mem;
 
     AhciPort ports[32];
+    bool irq_ready;
+    int max_slots;   // Command slots per port (CAP.NCS)
 
     void probe_ports();
     int  check_type(HBA_PORT* port);
     void start_cmd(HBA_PORT* port);
     void stop_cmd(HBA_PORT* port);
     void rebase_port(AhciPort* port);
-    
-    int find_cmd_slot(HBA_PORT* port);
+    bool identify(AhciPort* port);
+
+    bool build_command(AhciPort* p, int slot, uint8_t command, uint64_t lba, uint32_t count,
+                       void* buffer, uint32_t bytes, bool write);
+    void reap(AhciPort* p, bool error, AhciRequest** done, int* done_count);
+    void complete(AhciPort* p, AhciRequest** done, int done_count, bool ok);
+    void recover(AhciPort* p);
+    void service_port(AhciPort* p);
+    bool transfer(int port_index, uint64_t lba, uint32_t count, void* buffer, bool write);
 };
 
 #endif
\ No newline at end of file
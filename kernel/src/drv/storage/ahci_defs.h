@@ -5,6 +5,8 @@
 
 #define ATA_CMD_READ_DMA_EX     0x25
 #define ATA_CMD_WRITE_DMA_EX    0x35
+#define ATA_CMD_READ_FPDMA_QUEUED  0x60
+#define ATA_CMD_WRITE_FPDMA_QUEUED 0x61
 #define ATA_CMD_IDENTIFY        0xEC
 
 #define HBA_PORT_IPM_ACTIVE     1
@@ -21,7 +23,19 @@
 #define HBA_PxCMD_FR            0x4000
 #define HBA_PxCMD_CR            0x8000
 
-#define HBA_PxIS_TFES           (1 << 30)
+#define HBA_CAP_SNCQ            (1u << 30) // Supports Native Command Queuing
+#define HBA_GHC_AE              (1u << 31) // AHCI Enable
+#define HBA_GHC_IE              (1 << 1)   // Interrupt Enable
+
+#define HBA_PxIS_DHRS           (1 << 0)   // D2H Register FIS (non-queued done)
+#define HBA_PxIS_PSS            (1 << 1)   // PIO Setup FIS
+#define HBA_PxIS_DSS            (1 << 2)   // DMA Setup FIS
+#define HBA_PxIS_SDBS           (1 << 3)   // Set Device Bits FIS (NCQ done)
+#define HBA_PxIS_IFS            (1 << 27)  // Interface Fatal Error
+#define HBA_PxIS_HBDS           (1 << 28)  // Host Bus Data Error
+#define HBA_PxIS_HBFS           (1 << 29)  // Host Bus Fatal Error
+#define HBA_PxIS_TFES           (1 << 30)  // Task File Error
+#define HBA_PxIS_ERRORS         (HBA_PxIS_IFS | HBA_PxIS_HBDS | HBA_PxIS_HBFS | HBA_PxIS_TFES)
 
 // Port Registers
 struct HBA_PORT {
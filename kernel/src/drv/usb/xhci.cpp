@@ -4,10 +4,11 @@
 #include "../../cppstd/string.h"
 #include "../../memory/vmm.h"
 #include "../../memory/pmm.h"
+#include "../../memory/dma.h"
 #include "../../timer.h"
 #include "../../io.h"
 #include "../../input.h" 
-#include "../../interrupts/pic.h"
+#include "../../interrupts/irq.h"
 #include "../../globals.h"
 #include "../../sys/system_stats.h" // Stats
 
@@ -21,16 +22,16 @@ XhciDriver& XhciDriver::getInstance() {
     return instance;
 }
 
+// Controller structures live for the lifetime of the driver, so only the
+// virtual pointer is kept; dma_alloc honours the alignment the spec asks for
 static void* alloc_aligned(size_t size, size_t alignment) {
-    (void)alignment; 
-    size_t pages = (size + 4095) / 4096;
-    void* phys = pmm_alloc(pages);
-    if (!phys) return nullptr;
-    return (void*)((uint64_t)phys + g_hhdm_offset);
+    DmaBuffer buf;
+    if (!dma_alloc(size, alignment, 0, &buf)) return nullptr;
+    return buf.virt;
 }
 
 static uint64_t get_phys(void* virt) {
-    return (uint64_t)virt - g_hhdm_offset;
+    return dma_virt_to_phys(virt);
 }
 
 void XhciDriver::write_op_reg(uint32_t offset, uint32_t val) {
@@ -182,8 +183,9 @@ void XhciDriver::enumerate_device(int port_id) {
     queue_trb(dev->ep0_ring, dev->ep0_enqueue_ptr, dev->ep0_cycle, 0x0012010000000680UL, 8, 
               (TRB_SETUP_STAGE << 10) | (2 << 16) | (3 << 6)); 
               
-    void* buffer = alloc_aligned(64, 64);
-    queue_trb(dev->ep0_ring, dev->ep0_enqueue_ptr, dev->ep0_cycle, get_phys(buffer), 18,
+    DmaBuffer desc_buf;
+    if (!dma_alloc(64, 64, 0, &desc_buf)) return;
+    queue_trb(dev->ep0_ring, dev->ep0_enqueue_ptr, dev->ep0_cycle, desc_buf.phys, 18,
               (TRB_DATA_STAGE << 10) | (1 << 16)); 
               
     queue_trb(dev->ep0_ring, dev->ep0_enqueue_ptr, dev->ep0_cycle, 0, 0,
@@ -193,12 +195,14 @@ void XhciDriver::enumerate_device(int port_id) {
     
     sleep_ms(100); 
     
-    UsbDeviceDescriptor* desc = (UsbDeviceDescriptor*)buffer;
+    UsbDeviceDescriptor* desc = (UsbDeviceDescriptor*)desc_buf.virt;
     printf("XHCI: DEVICE IDENTIFIED:\n");
     printf("  VID: %04x  PID: %04x\n", desc->idVendor, desc->idProduct);
     if (desc->bDeviceClass == 0) printf("  Type: Interface Specific (Keyboard/Mouse?)\n");
     else if (desc->bDeviceClass == 9) printf("  Type: Hub\n");
     else printf("  Type: Class %d\n", desc->bDeviceClass);
+
+    dma_free(&desc_buf);
 }
 
 void XhciDriver::reset_port(int port) {
@@ -295,6 +299,10 @@ void XhciDriver::poll_ports() {
     }
 }
 
+static void xhci_irq(void* ctx) {
+    ((XhciDriver*)ctx)->poll_events();
+}
+
 bool XhciDriver::init(uint16_t vendor_id, uint16_t device_id) {
     printf("XHCI: Initializing for Gemini Lake J4125\n");
     
@@ -323,9 +331,8 @@ dev_found:
 
     pci_enable_bus_mastering(&pci_dev);
     
-    if (pci_dev.irq_line > 0 && pci_dev.irq_line < 16) {
-        pic_unmask(pci_dev.irq_line);
-    }
+    // Port changes end up in the UI, keep the handler on the BSP
+    irq_install_pci(&pci_dev, "xhci", xhci_irq, this, IRQ_CPU_BSP);
 
     mmio_base_phys = pci_dev.bar0;
     mmio_base_virt = XHCI_VIRT_BASE;
@@ -0,0 +1,473 @@
+#include "bcache.h"
+#include "../drv/storage/ahci.h"
+#include "../memory/dma.h"
+#include "../cppstd/stdio.h"
+#include "../cppstd/string.h"
+#include "../sys/sched.h"
+
+static void flusher_entry(void*) {
+    BlockCache& cache = BlockCache::getInstance();
+    while (true) {
+        thread_sleep_ms(BCACHE_FLUSH_MS);
+        cache.sync();
+    }
+}
+
+BlockCache& BlockCache::getInstance() {
+    static BlockCache instance;
+    return instance;
+}
+
+BlockCache::BlockCache()
+    : blocks(nullptr), block_count(0), hash(nullptr), hash_mask(0),
+      lru_head(nullptr), lru_tail(nullptr), dirty_count(0), next_tag(0), inflight(nullptr), lock("bcache"),
+      hits(0), misses(0), writebacks(0), evictions(0), bypassed(0), write_errors(0) {}
+
+bool BlockCache::init(uint32_t count) {
+    {
+        ScopedLock guard(lock);
+        if (!allocate(count)) return false;
+    }
+    thread_create("bcache", flusher_entry, nullptr);
+    printf("BCACHE: %d blocks (%d KB)\n", (int)block_count, (int)(block_count * BCACHE_BLOCK_SIZE / 1024));
+    return true;
+}
+
+bool BlockCache::resize(uint32_t count) {
+    if (count == 0) return false;
+    lock.lock();
+
+    // Write-backs drop the lock, so keep going until one pass under the
+    // lock finds nothing dirty and nobody holding a block
+    while (true) {
+        bool settled = true;
+        for (uint32_t i = 0; i < block_count; i++) {
+            Block* b = &blocks[i];
+            if (b->busy) { settled = false; continue; }
+            if (!b->dirty) continue;
+            settled = false;
+            if (!write_back(b)) { lock.unlock(); return false; }
+        }
+        if (settled) break;
+        relax();
+    }
+
+    release();
+    bool ok = allocate(count);
+    lock.unlock();
+    return ok;
+}
+
+// Lock held
+bool BlockCache::allocate(uint32_t count) {
+    blocks = new Block[count];
+    if (!blocks) return false;
+
+    uint32_t buckets = 1;
+    while (buckets < count) buckets <<= 1;
+    hash = new Block*[buckets];
+    if (!hash) {
+        delete[] blocks;
+        blocks = nullptr;
+        return false;
+    }
+    memset(hash, 0, buckets * sizeof(Block*));
+    hash_mask = buckets - 1;
+
+    // Whatever buffers we get make up the cache, linked up as the LRU
+    // list in array order
+    block_count = 0;
+    lru_head = lru_tail = nullptr;
+    for (uint32_t i = 0; i < count; i++) {
+        DmaBuffer buf;
+        if (!dma_alloc(BCACHE_BLOCK_SIZE, BCACHE_BLOCK_SIZE, 0, &buf)) break;
+
+        Block* b = &blocks[block_count++];
+        b->port = -1;
+        b->number = 0;
+        b->sectors = 0;
+        b->dirty = false;
+        b->busy = false;
+        b->owner = 0;
+        b->data = (uint8_t*)buf.virt;
+        b->hash_next = nullptr;
+        b->lru_prev = lru_tail;
+        b->lru_next = nullptr;
+        if (lru_tail) lru_tail->lru_next = b;
+        else lru_head = b;
+        lru_tail = b;
+    }
+    dirty_count = 0;
+
+    if (block_count < count) printf("BCACHE: Only got %d of %d blocks\n", (int)block_count, (int)count);
+    return block_count > 0;
+}
+
+// Lock held, nothing dirty
+void BlockCache::release() {
+    for (uint32_t i = 0; i < block_count; i++) {
+        DmaBuffer buf = { blocks[i].data, dma_virt_to_phys(blocks[i].data), BCACHE_BLOCK_SIZE };
+        dma_free(&buf);
+    }
+    delete[] blocks;
+    delete[] hash;
+    blocks = nullptr;
+    hash = nullptr;
+    block_count = 0;
+    lru_head = lru_tail = nullptr;
+}
+
+uint32_t BlockCache::hash_of(int port, uint64_t number) const {
+    // Fibonacci hashing: consecutive blocks land in different buckets
+    return (uint32_t)(((number + ((uint64_t)port << 40)) * 0x9E3779B97F4A7C15ULL) >> 32) & hash_mask;
+}
+
+BlockCache::Block* BlockCache::lookup(int port, uint64_t number) {
+    for (Block* b = hash[hash_of(port, number)]; b; b = b->hash_next) {
+        if (b->port == port && b->number == number) return b;
+    }
+    return nullptr;
+}
+
+void BlockCache::hash_remove(Block* b) {
+    Block** link = &hash[hash_of(b->port, b->number)];
+    while (*link && *link != b) link = &(*link)->hash_next;
+    if (*link) *link = b->hash_next;
+    b->hash_next = nullptr;
+}
+
+void BlockCache::lru_touch(Block* b) {
+    if (b == lru_head) return;
+
+    // Unlink
+    b->lru_prev->lru_next = b->lru_next;
+    if (b->lru_next) b->lru_next->lru_prev = b->lru_prev;
+    else lru_tail = b->lru_prev;
+
+    // Push front
+    b->lru_prev = nullptr;
+    b->lru_next = lru_head;
+    lru_head->lru_prev = b;
+    lru_head = b;
+}
+
+// The whole transfer lies on the disk. Checked before touching the cache
+// so no block is ever set up for sectors past the end.
+bool BlockCache::in_range(int port, uint64_t lba, uint32_t count) {
+    uint64_t disk_sectors = AhciDriver::getInstance().getSectorCount(port);
+    return lba < disk_sectors && count <= disk_sectors - lba;
+}
+
+// Lock held. True if a bypass write covering the block is still on its
+// way to the disk: loading the block now could pick up the old data.
+bool BlockCache::write_in_flight(int port, uint64_t number) {
+    for (Inflight* w = inflight; w; w = w->next) {
+        if (w->port == port && number >= w->first && number < w->end) return true;
+    }
+    return false;
+}
+
+// Lock held. Lets go of it for a moment so whoever holds what we're
+// waiting for can finish.
+void BlockCache::relax() {
+    lock.unlock();
+    if (sched_may_sleep()) thread_yield();
+    else for (int i = 0; i < 64; i++) lock_relax();
+    lock.lock();
+}
+
+// Lock held, b dirty and not busy. The write runs without the lock; b
+// stays busy meanwhile so nobody changes or evicts it.
+bool BlockCache::write_back(Block* b) {
+    b->busy = true;
+    lock.unlock();
+    bool ok = AhciDriver::getInstance().write(b->port, b->number * BCACHE_BLOCK_SECTORS, b->sectors, b->data);
+    lock.lock();
+    b->busy = false;
+
+    if (!ok) {
+        write_errors++;
+        return false;
+    }
+    b->dirty = false;
+    dirty_count--;
+    writebacks++;
+    return true;
+}
+
+// Lock held (dropped while waiting or reading). Returns the block marked
+// busy for the caller, who clears busy once done with it. With fill
+// false the caller is about to overwrite all of it, so a miss skips the
+// disk read. nullptr past the end of the disk or on an I/O error.
+BlockCache::Block* BlockCache::get(int port, uint64_t number, bool fill) {
+    uint64_t disk_sectors = AhciDriver::getInstance().getSectorCount(port);
+    uint64_t first = number * BCACHE_BLOCK_SECTORS;
+    if (first >= disk_sectors) return nullptr;
+
+    while (true) {
+        Block* b = lookup(port, number);
+        if (b) {
+            if (b->busy) { relax(); continue; }
+            hits++;
+            lru_touch(b);
+            b->busy = true;
+            return b;
+        }
+
+        // Not cached: wait for a bypass write to the block to land first
+        if (write_in_flight(port, number)) { relax(); continue; }
+
+        // Victim: least recently used block nobody holds
+        Block* victim = lru_tail;
+        while (victim && victim->busy) victim = victim->lru_prev;
+        if (!victim) { relax(); continue; }
+
+        // Written back without the lock, so everything may have moved
+        // by the time we're back: look again from the top
+        if (victim->dirty) {
+            if (!write_back(victim)) return nullptr;
+            continue;
+        }
+
+        misses++;
+        if (victim->port != -1) {
+            hash_remove(victim);
+            evictions++;
+        }
+
+        uint32_t sectors = BCACHE_BLOCK_SECTORS;
+        if (disk_sectors - first < sectors) sectors = (uint32_t)(disk_sectors - first);
+
+        // In the hash (and busy) before the read, so others wait for the
+        // fill instead of loading the block a second time
+        victim->port = port;
+        victim->number = number;
+        victim->sectors = sectors;
+        victim->busy = true;
+        uint32_t bucket = hash_of(port, number);
+        victim->hash_next = hash[bucket];
+        hash[bucket] = victim;
+        lru_touch(victim);
+
+        if (fill) {
+            lock.unlock();
+            bool ok = AhciDriver::getInstance().read(port, first, sectors, victim->data);
+            lock.lock();
+            if (!ok) {
+                hash_remove(victim);
+                victim->port = -1;
+                victim->busy = false;
+                return nullptr;
+            }
+        }
+        return victim;
+    }
+}
+
+// Lock held (dropped while waiting). Marks every cached block in the
+// range busy under tag, lowest first, so two bypass transfers can't
+// deadlock. Blocks loaded after this aren't claimed. A bypass read
+// doesn't need them, they come from the disk as it is now; a bypass
+// write registers itself in inflight first, which holds off loading
+// them until it's done.
+void BlockCache::claim_range(int port, uint64_t lba, uint32_t count, uint64_t tag) {
+    uint64_t end = lba + count;
+    for (uint64_t number = lba / BCACHE_BLOCK_SECTORS; number * BCACHE_BLOCK_SECTORS < end; number++) {
+        while (true) {
+            Block* b = lookup(port, number);
+            if (!b) break;
+            if (b->busy) { relax(); continue; }
+            b->busy = true;
+            b->owner = tag;
+            break;
+        }
+    }
+}
+
+bool BlockCache::read(int port, uint64_t lba, uint32_t count, void* buffer) {
+    if (!blocks) return AhciDriver::getInstance().read(port, lba, count, buffer);
+    if (!in_range(port, lba, count)) return false;
+    if (count > BCACHE_BYPASS_SECTORS) return bypass_read(port, lba, count, buffer);
+
+    uint8_t* dst = (uint8_t*)buffer;
+    bool ok = true;
+    lock.lock();
+    while (count > 0) {
+        uint64_t number = lba / BCACHE_BLOCK_SECTORS;
+        uint32_t offset = (uint32_t)(lba % BCACHE_BLOCK_SECTORS);
+        uint32_t n = BCACHE_BLOCK_SECTORS - offset;
+        if (n > count) n = count;
+
+        Block* b = get(port, number, true);
+        if (!b) {
+            ok = false;
+            break;
+        }
+
+        // The caller's buffer may fault; copy without the lock
+        lock.unlock();
+        memcpy(dst, b->data + offset * 512, n * 512);
+        lock.lock();
+        b->busy = false;
+
+        dst += n * 512;
+        lba += n;
+        count -= n;
+    }
+    lock.unlock();
+    return ok;
+}
+
+bool BlockCache::write(int port, uint64_t lba, uint32_t count, const void* buffer) {
+    if (!blocks) return AhciDriver::getInstance().write(port, lba, count, buffer);
+    if (!in_range(port, lba, count)) return false;
+    if (count > BCACHE_BYPASS_SECTORS) return bypass_write(port, lba, count, buffer);
+
+    const uint8_t* src = (const uint8_t*)buffer;
+    bool ok = true;
+    lock.lock();
+    while (count > 0) {
+        uint64_t number = lba / BCACHE_BLOCK_SECTORS;
+        uint32_t offset = (uint32_t)(lba % BCACHE_BLOCK_SECTORS);
+        uint32_t n = BCACHE_BLOCK_SECTORS - offset;
+        if (n > count) n = count;
+
+        // Overwriting a whole block doesn't need the old contents. The
+        // range is checked up front, so n never runs past a short last
+        // block and the unfilled block is always completely written.
+        Block* b = get(port, number, offset != 0 || n != BCACHE_BLOCK_SECTORS);
+        if (!b) {
+            ok = false;
+            break;
+        }
+
+        lock.unlock();
+        memcpy(b->data + offset * 512, src, n * 512);
+        lock.lock();
+        if (!b->dirty) {
+            b->dirty = true;
+            dirty_count++;
+        }
+        b->busy = false;
+
+        src += n * 512;
+        lba += n;
+        count -= n;
+    }
+    lock.unlock();
+    return ok;
+}
+
+// The cached blocks in the range stay claimed across the transfer, so
+// none of them can be written back or evicted underneath it. Dirty ones
+// are newer than the disk and win.
+bool BlockCache::bypass_read(int port, uint64_t lba, uint32_t count, void* buffer) {
+    lock.lock();
+    uint64_t tag = ++next_tag;
+    bypassed++;
+    claim_range(port, lba, count, tag);
+    lock.unlock();
+
+    bool ok = AhciDriver::getInstance().read(port, lba, count, buffer);
+
+    lock.lock();
+    uint64_t end = lba + count;
+    for (uint64_t number = lba / BCACHE_BLOCK_SECTORS; number * BCACHE_BLOCK_SECTORS < end; number++) {
+        Block* b = lookup(port, number);
+        if (!b || !b->busy || b->owner != tag) continue;
+
+        uint64_t first = number * BCACHE_BLOCK_SECTORS;
+        uint64_t from = first > lba ? first : lba;
+        uint64_t to = first + b->sectors < end ? first + b->sectors : end;
+        if (ok && b->dirty && from < to) {
+            // Just written by the HBA, so the pages are present
+            memcpy((uint8_t*)buffer + (from - lba) * 512, b->data + (from - first) * 512, (to - from) * 512);
+        }
+        b->busy = false;
+    }
+    lock.unlock();
+    return ok;
+}
+
+// Claimed the same way: no write-back of older data can land on top of
+// ours. Cached copies take the new data; ones covered completely now
+// match the disk. Until then the range is in flight, so get() can't load
+// a block of it from the disk in between.
+bool BlockCache::bypass_write(int port, uint64_t lba, uint32_t count, const void* buffer) {
+    uint64_t end = lba + count;
+    Inflight range;
+    range.port = port;
+    range.first = lba / BCACHE_BLOCK_SECTORS;
+    range.end = (end + BCACHE_BLOCK_SECTORS - 1) / BCACHE_BLOCK_SECTORS;
+
+    lock.lock();
+    uint64_t tag = ++next_tag;
+    bypassed++;
+    range.next = inflight;
+    inflight = &range;
+    claim_range(port, lba, count, tag);
+    lock.unlock();
+
+    bool ok = AhciDriver::getInstance().write(port, lba, count, buffer);
+
+    lock.lock();
+    for (uint64_t number = lba / BCACHE_BLOCK_SECTORS; number * BCACHE_BLOCK_SECTORS < end; number++) {
+        Block* b = lookup(port, number);
+        if (!b || !b->busy || b->owner != tag) continue;
+
+        uint64_t first = number * BCACHE_BLOCK_SECTORS;
+        uint64_t from = first > lba ? first : lba;
+        uint64_t to = first + b->sectors < end ? first + b->sectors : end;
+        if (ok && from < to) {
+            memcpy(b->data + (from - first) * 512, (const uint8_t*)buffer + (from - lba) * 512, (to - from) * 512);
+            if (b->dirty && from == first && to == first + b->sectors) {
+                b->dirty = false;
+                dirty_count--;
+            }
+        }
+        b->busy = false;
+    }
+
+    Inflight** link = &inflight;
+    while (*link != &range) link = &(*link)->next;
+    *link = range.next;
+    lock.unlock();
+    return ok;
+}
+
+// Walks the blocks by index, since write_back() lets go of the lock and
+// the array is only stable while we hold it
+bool BlockCache::sync() {
+    if (!dirty_count) return true; // Unlocked peek, the flusher calls this a lot
+    lock.lock();
+
+    bool ok = true;
+    for (uint32_t i = 0; i < block_count; i++) {
+        Block* b = &blocks[i];
+        if (b->dirty && !b->busy && !write_back(b)) ok = false;
+    }
+    lock.unlock();
+    return ok;
+}
+
+void BlockCache::printStats() {
+    ScopedLock guard(lock);
+
+    uint32_t used = 0;
+    for (uint32_t i = 0; i < block_count; i++) {
+        if (blocks[i].port != -1) used++;
+    }
+    uint64_t lookups = hits + misses;
+
+    printf("Cache: %d blocks (%d KB), %d in use, %d dirty\n", (int)block_count,
+           (int)(block_count * BCACHE_BLOCK_SIZE / 1024), (int)used, (int)dirty_count);
+    printf("Hits: %d, misses: %d (%d%% hit)\n", (int)hits, (int)misses,
+           lookups ? (int)(hits * 100 / lookups) : 0);
+    printf("Evictions: %d, write-backs: %d, write errors: %d, bypassed: %d\n",
+           (int)evictions, (int)writebacks, (int)write_errors, (int)bypassed);
+}
+
+void BlockCache::resetStats() {
+    ScopedLock guard(lock);
+    hits = misses = writebacks = evictions = bypassed = write_errors = 0;
+}
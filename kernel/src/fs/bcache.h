@@ -0,0 +1,112 @@
+#ifndef BCACHE_H
+#define BCACHE_H
+
+#include <cstdint>
+#include <cstddef>
+#include "../sys/spinlock.h"
+
+// Block buffer cache between the file system (and the raw disk syscalls)
+// and the AHCI driver. The disk is cached in 4 KB blocks (8 sectors)
+// found through a hash on (port, block) and replaced least recently used
+// first. Writes only dirty the cached block; dirty blocks go back to disk
+// when they are evicted, on sync(), and every BCACHE_FLUSH_MS from the
+// flusher thread.
+//
+// Transfers larger than BCACHE_BYPASS_SECTORS go straight between the
+// disk and the caller's buffer (they would only flush the cache), patched
+// against cached blocks so both views stay consistent.
+//
+// The lock only covers the bookkeeping. A block being filled, written
+// back or copied is marked busy and the lock is dropped for the I/O;
+// anyone else who needs that block waits for it to come free.
+
+#define BCACHE_BLOCK_SIZE      4096
+#define BCACHE_BLOCK_SECTORS   (BCACHE_BLOCK_SIZE / 512)
+#define BCACHE_DEFAULT_BLOCKS  1024   // 4 MB
+#define BCACHE_BYPASS_SECTORS  128    // 64 KB
+#define BCACHE_FLUSH_MS        2000
+
+class BlockCache {
+public:
+    static BlockCache& getInstance();
+
+    // Allocates `blocks` buffers and starts the flusher thread
+    bool init(uint32_t blocks = BCACHE_DEFAULT_BLOCKS);
+
+    // Writes everything back and starts over with a different size
+    bool resize(uint32_t blocks);
+
+    // Same contract as AhciDriver::read/write
+    bool read(int port, uint64_t lba, uint32_t count, void* buffer);
+    bool write(int port, uint64_t lba, uint32_t count, const void* buffer);
+
+    // Writes every dirty block back. False if any write failed (those
+    // blocks stay dirty).
+    bool sync();
+
+    // Size, dirty blocks, hit ratio and write-back counts (cachestat)
+    void printStats();
+    void resetStats();
+
+private:
+    BlockCache();
+
+    struct Block {
+        int port;             // -1 while unused
+        uint64_t number;      // lba / BCACHE_BLOCK_SECTORS
+        uint32_t sectors;     // Valid sectors, short only at the end of the disk
+        bool dirty;
+        bool busy;            // Owned by one operation, which may be doing I/O
+        uint64_t owner;       // Tag of the bypass transfer that claimed it
+        uint8_t* data;
+        Block* hash_next;
+        Block* lru_prev;      // Towards most recently used
+        Block* lru_next;
+    };
+
+    Block* blocks;
+    uint32_t block_count;
+    Block** hash;
+    uint32_t hash_mask;
+    Block* lru_head;          // Most recently used
+    Block* lru_tail;          // Next victim
+    uint32_t dirty_count;
+    uint64_t next_tag;
+
+    // Bypass writes still on their way to the disk (on their callers'
+    // stacks), blocks [first, end)
+    struct Inflight {
+        int port;
+        uint64_t first;
+        uint64_t end;
+        Inflight* next;
+    };
+    Inflight* inflight;
+    Spinlock lock;            // Everything above, never held across I/O
+
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t writebacks;
+    uint64_t evictions;
+    uint64_t bypassed;
+    uint64_t write_errors;
+
+    bool allocate(uint32_t count);
+    void release();
+
+    uint32_t hash_of(int port, uint64_t number) const;
+    Block* lookup(int port, uint64_t number);
+    void hash_remove(Block* b);
+    void lru_touch(Block* b);
+    bool in_range(int port, uint64_t lba, uint32_t count);
+    bool write_in_flight(int port, uint64_t number);
+    void relax();
+    bool write_back(Block* b);
+    Block* get(int port, uint64_t number, bool fill);
+    void claim_range(int port, uint64_t lba, uint32_t count, uint64_t tag);
+
+    bool bypass_read(int port, uint64_t lba, uint32_t count, void* buffer);
+    bool bypass_write(int port, uint64_t lba, uint32_t count, const void* buffer);
+};
+
+#endif
@@ -1,23 +1,41 @@
 #include "fat32.h"
+#include "bcache.h"
 #include "../cppstd/string.h"
 #include "../cppstd/stdio.h"
 #include "../memory/pmm.h"
 #include "../memory/heap.h"
+#include "../memory/dma.h"
+#include "../timer.h"
 
 // --- DMA Allocator Helpers ---
-static void* dma_alloc(size_t pages) {
-    void* phys = pmm_alloc(pages);
-    if (!phys) return nullptr;
-    // Assume HHDM is set in pmm.cpp global
-    extern uint64_t g_hhdm_offset;
-    return (void*)((uint64_t)phys + g_hhdm_offset);
+// Sector buffers come from a pool carved on first use; nested helpers
+// hold at most a few at once. Falls back to the PMM if it runs dry.
+#define FAT32_POOL_BUFFERS 8
+
+// The FAT itself sits in heap memory and moves to and from the disk
+// through a bounce buffer this many sectors at a time (128 KB)
+#define FAT32_FAT_CHUNK 256
+
+static DmaPool io_pool;
+
+static void* io_buf_alloc(size_t pages) {
+    DmaBuffer buf;
+    if (pages == 1) {
+        if (!io_pool.isReady()) io_pool.init("fat32", 4096, 4096, FAT32_POOL_BUFFERS);
+        if (io_pool.alloc(&buf)) return buf.virt;
+    }
+    if (!dma_alloc(pages * 4096, 4096, 0, &buf)) return nullptr;
+    return buf.virt;
 }
 
-static void dma_free(void* virt, size_t pages) {
+static void io_buf_free(void* virt, size_t pages) {
     if (!virt) return;
-    extern uint64_t g_hhdm_offset;
-    uint64_t phys = (uint64_t)virt - g_hhdm_offset;
-    pmm_free((void*)phys, pages);
+    if (io_pool.owns(virt)) {
+        io_pool.free(virt);
+        return;
+    }
+    DmaBuffer buf = { virt, dma_virt_to_phys(virt), pages * 4096 };
+    dma_free(&buf);
 }
 
 Fat32& Fat32::getInstance() {
@@ -25,7 +43,8 @@ Fat32& Fat32::getInstance() {
     return instance;
 }
 
-Fat32::Fat32() : mounted(false) {
+Fat32::Fat32() : mounted(false), fat(nullptr), fat_dirty(nullptr), fat_has_dirty(false),
+                 free_map(nullptr), cluster_count(0), free_count(0), next_free(2) {
     memset(&bpb, 0, sizeof(Fat32BootSector));
 }
 
@@ -35,75 +54,209 @@ uint32_t Fat32::cluster_to_lba(uint32_t cluster) {
 }
 
 uint32_t Fat32::get_next_cluster(uint32_t cluster) {
-    uint32_t fat_offset = cluster * 4;
-    uint32_t fat_sector = fat_start_lba + (fat_offset / 512);
-    uint32_t ent_offset = fat_offset % 512;
+    if (!fat || cluster >= cluster_count + 2) return 0;
+    return fat[cluster] & 0x0FFFFFFF;
+}
 
-    uint8_t* buf = (uint8_t*)dma_alloc(1);
-    if (!buf) return 0;
+void Fat32::set_next_cluster(uint32_t cluster, uint32_t next) {
+    if (!fat || cluster < 2 || cluster >= cluster_count + 2) return;
+
+    // The top four bits are reserved and keep whatever they had
+    fat[cluster] = (fat[cluster] & 0xF0000000) | (next & 0x0FFFFFFF);
 
-    if (!AhciDriver::getInstance().read(port_index, fat_sector, 1, buf)) {
-        dma_free(buf, 1);
-        return 0;
+    uint32_t sector = cluster / 128;
+    fat_dirty[sector / 8] |= 1 << (sector % 8);
+    fat_has_dirty = true;
+
+    uint64_t bit = 1ULL << (cluster % 64);
+    bool used = free_map[cluster / 64] & bit;
+    if ((next & 0x0FFFFFFF) == FAT32_ENTRY_FREE) {
+        if (used) { free_map[cluster / 64] &= ~bit; free_count++; }
+    } else {
+        if (!used) { free_map[cluster / 64] |= bit; free_count--; }
+    }
+}
+
+uint32_t Fat32::allocate_cluster(uint32_t prev, bool zero) {
+    if (!fat || free_count == 0) return 0;
+    uint32_t end = cluster_count + 2;
+    uint32_t cluster = 0;
+
+    if (prev >= 2 && prev + 1 < end && !(free_map[(prev + 1) / 64] & (1ULL << ((prev + 1) % 64)))) {
+        cluster = prev + 1;
+    } else {
+        // A word at a time from the hint, wrapping once. Clusters 0 and 1
+        // and the tail past the last cluster are marked used at mount.
+        uint32_t words = (end + 63) / 64;
+        uint32_t start = (next_free < end ? next_free : 2) / 64;
+        for (uint32_t n = 0; n < words && !cluster; n++) {
+            uint32_t w = (start + n) % words;
+            if (free_map[w] != ~0ULL) cluster = w * 64 + __builtin_ctzll(~free_map[w]);
+        }
+        if (!cluster) return 0;
     }
-    uint32_t val = *(uint32_t*)&buf[ent_offset];
-    dma_free(buf, 1);
 
-    return val & 0x0FFFFFFF; 
+    set_next_cluster(cluster, FAT32_ENTRY_EOC);
+    next_free = cluster + 1 < end ? cluster + 1 : 2;
+
+    if (zero) {
+        uint32_t bytes = bpb.sectors_per_cluster * 512;
+        size_t pages = (bytes + 4095) / 4096;
+        uint8_t* buf = (uint8_t*)io_buf_alloc(pages);
+        if (buf) {
+            memset(buf, 0, bytes);
+            BlockCache::getInstance().write(port_index, cluster_to_lba(cluster), bpb.sectors_per_cluster, buf);
+            io_buf_free(buf, pages);
+        }
+    }
+    return cluster;
 }
 
-void Fat32::set_next_cluster(uint32_t cluster, uint32_t next) {
-    uint32_t fat_offset = cluster * 4;
-    uint32_t fat_sector = fat_start_lba + (fat_offset / 512);
-    uint32_t ent_offset = fat_offset % 512;
+// Counts the clusters from `cluster` on that follow each other on disk,
+// up to max. next gets the chain's entry after the last one.
+uint32_t Fat32::contiguous_run(uint32_t cluster, uint32_t max, uint32_t* next) {
+    uint32_t run = 1;
+    uint32_t n = get_next_cluster(cluster);
+    while (run < max && n == cluster + run) {
+        run++;
+        n = get_next_cluster(n);
+    }
+    *next = n;
+    return run;
+}
 
-    uint8_t* buf = (uint8_t*)dma_alloc(1);
-    if (!buf) return;
+// Copies FAT sectors [first, first + count) of copy `copy` between the
+// in-memory table and the disk, a bounce buffer at a time
+bool Fat32::fat_io(uint8_t* bounce, int copy, uint32_t first, uint32_t count, bool write) {
+    BlockCache& cache = BlockCache::getInstance();
+    uint64_t lba = fat_start_lba + (uint64_t)copy * sectors_per_fat;
+    uint8_t* table = (uint8_t*)fat;
+
+    while (count > 0) {
+        uint32_t n = count < FAT32_FAT_CHUNK ? count : FAT32_FAT_CHUNK;
+        if (write) {
+            memcpy(bounce, table + first * 512, n * 512);
+            if (!cache.write(port_index, lba + first, n, bounce)) return false;
+        } else {
+            if (!cache.read(port_index, lba + first, n, bounce)) return false;
+            memcpy(table + first * 512, bounce, n * 512);
+        }
+        first += n;
+        count -= n;
+    }
+    return true;
+}
 
-    AhciDriver::getInstance().read(port_index, fat_sector, 1, buf);
-    *(uint32_t*)&buf[ent_offset] = (next & 0x0FFFFFFF);
-    
-    // Write to all FAT copies
-    for (int i = 0; i < bpb.fat_count; i++) {
-        AhciDriver::getInstance().write(port_index, fat_sector + (i * sectors_per_fat), 1, buf);
+// Reads the first FAT and builds the free map from it
+bool Fat32::load_fat() {
+    unload_fat();
+
+    uint32_t data_sectors = bpb.total_sectors_32 - data_start_lba;
+    cluster_count = data_sectors / bpb.sectors_per_cluster;
+    if (cluster_count + 2 > sectors_per_fat * 128) cluster_count = sectors_per_fat * 128 - 2;
+
+    fat = new uint32_t[sectors_per_fat * 128];
+    fat_dirty = new uint8_t[(sectors_per_fat + 7) / 8];
+    uint32_t words = (cluster_count + 2 + 63) / 64;
+    free_map = new uint64_t[words];
+    if (!fat || !fat_dirty || !free_map) {
+        printf("FAT32: OOM loading the FAT\n");
+        unload_fat();
+        return false;
+    }
+
+    uint8_t* bounce = (uint8_t*)io_buf_alloc(FAT32_FAT_CHUNK / 8);
+    bool read_ok = bounce && fat_io(bounce, 0, 0, sectors_per_fat, false);
+    io_buf_free(bounce, FAT32_FAT_CHUNK / 8);
+    if (!read_ok) {
+        printf("FAT32: Can't read the FAT\n");
+        unload_fat();
+        return false;
+    }
+    memset(fat_dirty, 0, (sectors_per_fat + 7) / 8);
+    fat_has_dirty = false;
+
+    // Entry 0 carries the media byte, entry 1 an end-of-chain marker.
+    // Anything else means we didn't read a FAT, and allocating from it
+    // (then flushing it back) would wreck the volume. Bits 27 and 26 of
+    // entry 1 are the clean-shutdown and no-error flags, cleared on a
+    // volume that wasn't unmounted cleanly, so they don't count.
+    if ((fat[0] & 0x0FFFFFFF) != (0x0FFFFF00u | bpb.media_type) ||
+        ((fat[1] | 0x0C000000) & 0x0FFFFFFF) < FAT32_ENTRY_EOC) {
+        printf("FAT32: FAT looks corrupt (%x %x), not mounting\n", fat[0], fat[1]);
+        unload_fat();
+        return false;
+    }
+
+    // Everything that isn't a free data cluster counts as used, so the
+    // search never has to check bounds
+    memset(free_map, 0xFF, words * sizeof(uint64_t));
+    free_count = 0;
+    for (uint32_t c = 2; c < cluster_count + 2; c++) {
+        if ((fat[c] & 0x0FFFFFFF) == FAT32_ENTRY_FREE) {
+            free_map[c / 64] &= ~(1ULL << (c % 64));
+            free_count++;
+        }
+    }
+
+    // Pick up where the last session left off, if FSInfo has a hint
+    next_free = 2;
+    uint8_t* buf = (uint8_t*)io_buf_alloc(1);
+    if (buf) {
+        FSInfo* info = (FSInfo*)buf;
+        if (BlockCache::getInstance().read(port_index, bpb.fs_info_sector, 1, buf) &&
+            info->lead_sig == 0x41615252 && info->next_free >= 2 && info->next_free < cluster_count + 2) {
+            next_free = info->next_free;
+        }
+        io_buf_free(buf, 1);
     }
-    dma_free(buf, 1);
+    return true;
 }
 
-uint32_t Fat32::allocate_cluster() {
-    uint8_t* buf = (uint8_t*)dma_alloc(1);
-    if (!buf) return 0;
+void Fat32::unload_fat() {
+    delete[] fat;
+    delete[] fat_dirty;
+    delete[] free_map;
+    fat = nullptr;
+    fat_dirty = nullptr;
+    free_map = nullptr;
+    fat_has_dirty = false;
+}
 
-    for (uint32_t i = 0; i < sectors_per_fat; i++) {
-        AhciDriver::getInstance().read(port_index, fat_start_lba + i, 1, buf);
-        uint32_t* table = (uint32_t*)buf;
-        
-        for (int j = 0; j < 128; j++) {
-             if (i == 0 && j < 2) continue; 
-
-             if ((table[j] & 0x0FFFFFFF) == FAT32_ENTRY_FREE) {
-                 uint32_t cluster = (i * 128) + j;
-                 
-                 table[j] = FAT32_ENTRY_EOC;
-                 
-                 for (int f = 0; f < bpb.fat_count; f++) {
-                     AhciDriver::getInstance().write(port_index, fat_start_lba + i + (f * sectors_per_fat), 1, buf);
-                 }
-                 
-                 uint8_t* zero = (uint8_t*)dma_alloc(1); 
-                 if (zero) {
-                     memset(zero, 0, 4096);
-                     AhciDriver::getInstance().write(port_index, cluster_to_lba(cluster), bpb.sectors_per_cluster, zero);
-                     dma_free(zero, 1);
-                 }
-                 
-                 dma_free(buf, 1);
-                 return cluster;
-             }
+// Writes every dirty FAT sector to each copy, runs of them as one
+// transfer, then brings FSInfo up to date
+bool Fat32::flush_fat() {
+    if (!fat || !fat_has_dirty) return true;
+    BlockCache& cache = BlockCache::getInstance();
+    uint8_t* bounce = (uint8_t*)io_buf_alloc(FAT32_FAT_CHUNK / 8);
+    if (!bounce) return false; // Still dirty, the next flush tries again
+    bool ok = true;
+
+    uint32_t s = 0;
+    while (s < sectors_per_fat) {
+        if (!(fat_dirty[s / 8] & (1 << (s % 8)))) { s++; continue; }
+        uint32_t run = 1;
+        while (s + run < sectors_per_fat && (fat_dirty[(s + run) / 8] & (1 << ((s + run) % 8)))) run++;
+
+        for (int f = 0; f < bpb.fat_count; f++) {
+            if (!fat_io(bounce, f, s, run, true)) ok = false;
         }
+        s += run;
     }
-    dma_free(buf, 1);
-    return 0;
+    io_buf_free(bounce, FAT32_FAT_CHUNK / 8);
+    memset(fat_dirty, 0, (sectors_per_fat + 7) / 8);
+    fat_has_dirty = false;
+
+    uint8_t* buf = (uint8_t*)io_buf_alloc(1);
+    if (!buf) return false;
+    FSInfo* info = (FSInfo*)buf;
+    if (cache.read(port_index, bpb.fs_info_sector, 1, buf) && info->lead_sig == 0x41615252) {
+        info->free_count = free_count;
+        info->next_free = next_free;
+        if (!cache.write(port_index, bpb.fs_info_sector, 1, buf)) ok = false;
+    }
+    io_buf_free(buf, 1);
+    return ok;
 }
 
 void Fat32::to_dos_filename(const char* input, char* dest_name, char* dest_ext) {
@@ -130,17 +283,18 @@ void Fat32::to_dos_filename(const char* input, char* dest_name, char* dest_ext)
 
 bool Fat32::init(int port) {
     port_index = port;
-    uint8_t* buf = (uint8_t*)dma_alloc(1);
+    mounted = false;
+    uint8_t* buf = (uint8_t*)io_buf_alloc(1);
     if (!buf) { printf("FAT32: OOM\n"); return false; }
     
-    if (!AhciDriver::getInstance().read(port, 0, 1, buf)) {
+    if (!BlockCache::getInstance().read(port, 0, 1, buf)) {
         printf("FAT32: Read Error on Port %d\n", port);
-        dma_free(buf, 1); 
+        io_buf_free(buf, 1); 
         return false;
     }
 
     memcpy(&bpb, buf, sizeof(Fat32BootSector));
-    dma_free(buf, 1);
+    io_buf_free(buf, 1);
 
     if (bpb.boot_signature != 0x29 || bpb.bytes_per_sector != 512) {
         printf("FAT32: Invalid Sig (%x) or Sector Size (%d)\n", bpb.boot_signature, bpb.bytes_per_sector);
@@ -152,7 +306,10 @@ bool Fat32::init(int port) {
     data_start_lba = fat_start_lba + (bpb.fat_count * sectors_per_fat);
     root_cluster = bpb.root_cluster;
 
-    printf("FAT32: Mounted Port %d (Root @ %d)\n", port, root_cluster);
+    if (!load_fat()) return false;
+
+    printf("FAT32: Mounted Port %d (Root @ %d, %d MB free)\n", port, root_cluster,
+           (int)((uint64_t)free_count * bpb.sectors_per_cluster / 2048));
     mounted = true;
     return true;
 }
@@ -160,7 +317,7 @@ bool Fat32::init(int port) {
 bool Fat32::format(int port, uint32_t size_sectors) {
     printf("FAT32: Formatting Port %d (%d sectors)...\n", port, size_sectors);
     
-    uint8_t* buf = (uint8_t*)dma_alloc(1);
+    uint8_t* buf = (uint8_t*)io_buf_alloc(1);
     if (!buf) return false;
     memset(buf, 0, 4096);
 
@@ -190,9 +347,9 @@ bool Fat32::format(int port, uint32_t size_sectors) {
     uint32_t saved_fat_count = new_bpb->fat_count;
 
     // 1. Write BPB
-    if (!AhciDriver::getInstance().write(port, 0, 1, buf)) {
+    if (!BlockCache::getInstance().write(port, 0, 1, buf)) {
         printf("FAT32: Write BPB Failed.\n");
-        dma_free(buf, 1); return false;
+        io_buf_free(buf, 1); return false;
     }
 
     // 2. Write FSInfo
@@ -201,11 +358,12 @@ bool Fat32::format(int port, uint32_t size_sectors) {
     info->lead_sig = 0x41615252;
     info->struct_sig = 0x61417272;
     info->trail_sig = 0xAA550000;
-    info->free_count = 0xFFFFFFFF;
-    info->next_free = 0xFFFFFFFF;
-    AhciDriver::getInstance().write(port, 1, 1, buf);
+    // Every data cluster but the root directory's is free
+    info->free_count = (size_sectors - (saved_reserved + saved_fat_count * saved_sectors_fat)) / 8 - 1;
+    info->next_free = 3;
+    BlockCache::getInstance().write(port, 1, 1, buf);
 
-    dma_free(buf, 1);
+    io_buf_free(buf, 1);
 
     // 3. ZERO OUT FAT TABLES
     uint32_t fat_total_sectors = saved_sectors_fat * saved_fat_count;
@@ -215,7 +373,7 @@ bool Fat32::format(int port, uint32_t size_sectors) {
     
     // Allocate 64KB chunks (128 sectors)
     uint32_t chunk_size = 128;
-    uint8_t* big_buf = (uint8_t*)dma_alloc(16); // 16 pages
+    uint8_t* big_buf = (uint8_t*)io_buf_alloc(16); // 16 pages
     if (!big_buf) return false;
     memset(big_buf, 0, 4096 * 16);
 
@@ -223,32 +381,32 @@ bool Fat32::format(int port, uint32_t size_sectors) {
         uint32_t count = chunk_size;
         if (i + count > fat_total_sectors) count = fat_total_sectors - i;
         
-        if (!AhciDriver::getInstance().write(port, fat_start + i, count, big_buf)) {
+        if (!BlockCache::getInstance().write(port, fat_start + i, count, big_buf)) {
             printf("\nFAT32: Wipe failed at LBA %d\n", fat_start + i);
-            dma_free(big_buf, 16);
+            io_buf_free(big_buf, 16);
             return false;
         }
     }
     printf(" Done.\n");
-    dma_free(big_buf, 16);
+    io_buf_free(big_buf, 16);
 
     // 4. Init FAT Headers
-    buf = (uint8_t*)dma_alloc(1);
+    buf = (uint8_t*)io_buf_alloc(1);
     memset(buf, 0, 512);
     uint32_t* fat_table = (uint32_t*)buf;
     fat_table[0] = 0x0FFFFFF8;
     fat_table[1] = 0xFFFFFFFF;
     fat_table[2] = 0x0FFFFFFF; // Root Dir EOF
     
-    AhciDriver::getInstance().write(port, saved_reserved, 1, buf);
-    AhciDriver::getInstance().write(port, saved_reserved + saved_sectors_fat, 1, buf);
+    BlockCache::getInstance().write(port, saved_reserved, 1, buf);
+    BlockCache::getInstance().write(port, saved_reserved + saved_sectors_fat, 1, buf);
 
     // 5. Zero Root Directory
     uint32_t data_start = saved_reserved + (saved_fat_count * saved_sectors_fat);
     memset(buf, 0, 4096); 
-    AhciDriver::getInstance().write(port, data_start, 8, buf); 
+    BlockCache::getInstance().write(port, data_start, 8, buf); 
 
-    dma_free(buf, 1);
+    io_buf_free(buf, 1);
     printf("FAT32: Format complete.\n");
     return init(port);
 }
@@ -260,14 +418,14 @@ void Fat32::ls() {
     }
     
     uint32_t cluster = root_cluster;
-    uint8_t* buf = (uint8_t*)dma_alloc(1); 
+    uint8_t* buf = (uint8_t*)io_buf_alloc(1); 
     if (!buf) return;
     
     printf("Directory Listing:\n");
     
     while (cluster < 0x0FFFFFF8 && cluster != 0) {
         uint32_t lba = cluster_to_lba(cluster);
-        AhciDriver::getInstance().read(port_index, lba, bpb.sectors_per_cluster, buf);
+        BlockCache::getInstance().read(port_index, lba, bpb.sectors_per_cluster, buf);
         
         FatDirectoryEntry* entry = (FatDirectoryEntry*)buf;
         for (int i=0; i < (512 * bpb.sectors_per_cluster) / 32; i++) {
@@ -296,7 +454,7 @@ void Fat32::ls() {
         }
         cluster = get_next_cluster(cluster);
     }
-    dma_free(buf, 1);
+    io_buf_free(buf, 1);
 }
 
 uint32_t Fat32::find_entry(const char* filename, FatDirectoryEntry* out_entry, uint32_t* out_dir_clus, uint32_t* out_offset) {
@@ -307,12 +465,12 @@ uint32_t Fat32::find_entry(const char* filename, FatDirectoryEntry* out_entry, u
     to_dos_filename(filename, dos_name, dos_ext);
 
     uint32_t cluster = root_cluster;
-    uint8_t* buf = (uint8_t*)dma_alloc(1);
+    uint8_t* buf = (uint8_t*)io_buf_alloc(1);
     if (!buf) return 0;
     
     while (cluster < 0x0FFFFFF8 && cluster != 0) {
         uint32_t lba = cluster_to_lba(cluster);
-        AhciDriver::getInstance().read(port_index, lba, bpb.sectors_per_cluster, buf);
+        BlockCache::getInstance().read(port_index, lba, bpb.sectors_per_cluster, buf);
         
         FatDirectoryEntry* entry = (FatDirectoryEntry*)buf;
         int max_entries = (512 * bpb.sectors_per_cluster) / 32;
@@ -328,13 +486,13 @@ uint32_t Fat32::find_entry(const char* filename, FatDirectoryEntry* out_entry, u
                 if(out_entry) *out_entry = entry[i];
                 if(out_dir_clus) *out_dir_clus = cluster;
                 if(out_offset) *out_offset = i; 
-                dma_free(buf, 1);
+                io_buf_free(buf, 1);
                 return (entry[i].cluster_high << 16) | entry[i].cluster_low;
             }
         }
         cluster = get_next_cluster(cluster);
     }
-    dma_free(buf, 1);
+    io_buf_free(buf, 1);
     return 0;
 }
 
@@ -350,23 +508,34 @@ bool Fat32::read_file(const char* filename, void* buffer, uint32_t buffer_len) {
         return false;
     }
 
+    // One transfer per run of contiguous clusters, straight into the
+    // caller's buffer. Only a partial last sector is bounced.
+    uint32_t cluster_bytes = bpb.sectors_per_cluster * 512;
     uint8_t* out_ptr = (uint8_t*)buffer;
-    uint8_t* temp = (uint8_t*)dma_alloc(1);
-    if (!temp) return false;
-    
     uint32_t remaining = entry.file_size;
-    while (remaining > 0 && cluster < 0x0FFFFFF8) {
+
+    while (remaining > 0 && cluster >= 2 && cluster < 0x0FFFFFF8) {
+        uint32_t next;
+        uint32_t run = contiguous_run(cluster, (remaining + cluster_bytes - 1) / cluster_bytes, &next);
         uint32_t lba = cluster_to_lba(cluster);
-        AhciDriver::getInstance().read(port_index, lba, bpb.sectors_per_cluster, temp);
-        
-        uint32_t chunk = (remaining > 4096) ? 4096 : remaining;
-        memcpy(out_ptr, temp, chunk);
-        out_ptr += chunk;
-        remaining -= chunk;
-        cluster = get_next_cluster(cluster);
+        uint32_t run_bytes = run * cluster_bytes;
+
+        uint32_t direct = run_bytes < remaining ? run_bytes : (remaining & ~511u);
+        if (direct && !BlockCache::getInstance().read(port_index, lba, direct / 512, out_ptr)) return false;
+        out_ptr += direct;
+        remaining -= direct;
+
+        if (remaining > 0 && remaining < 512 && run_bytes > direct) {
+            uint8_t* temp = (uint8_t*)io_buf_alloc(1);
+            if (!temp) return false;
+            bool ok = BlockCache::getInstance().read(port_index, lba + direct / 512, 1, temp);
+            if (ok) memcpy(out_ptr, temp, remaining);
+            io_buf_free(temp, 1);
+            return ok;
+        }
+        cluster = next;
     }
-    dma_free(temp, 1);
-    return true;
+    return remaining == 0;
 }
 
 bool Fat32::create_file(const char* filename) {
@@ -386,26 +555,29 @@ bool Fat32::create_file(const char* filename) {
     new_ent.file_size = 0;
 
     uint32_t cluster = root_cluster;
-    uint8_t* buf = (uint8_t*)dma_alloc(1);
+    uint8_t* buf = (uint8_t*)io_buf_alloc(1);
     if (!buf) return false;
+    bool added = false;
     
-    while (cluster < 0x0FFFFFF8 && cluster != 0) {
-        AhciDriver::getInstance().read(port_index, cluster_to_lba(cluster), bpb.sectors_per_cluster, buf);
+    while (!added && cluster < 0x0FFFFFF8 && cluster != 0) {
+        BlockCache::getInstance().read(port_index, cluster_to_lba(cluster), bpb.sectors_per_cluster, buf);
         FatDirectoryEntry* entry = (FatDirectoryEntry*)buf;
         int max_entries = (512 * bpb.sectors_per_cluster) / 32;
 
         for (int i=0; i < max_entries; i++) {
             if (entry[i].name[0] == 0x00 || entry[i].name[0] == 0xE5) {
                 entry[i] = new_ent;
-                AhciDriver::getInstance().write(port_index, cluster_to_lba(cluster), bpb.sectors_per_cluster, buf);
-                dma_free(buf, 1);
-                return true;
+                BlockCache::getInstance().write(port_index, cluster_to_lba(cluster), bpb.sectors_per_cluster, buf);
+                added = true;
+                break;
             }
         }
+        if (added) break;
         
         uint32_t next = get_next_cluster(cluster);
         if (next >= 0x0FFFFFF8) {
-            uint32_t dir_next = allocate_cluster();
+            // Directory clusters must start out zeroed (end marker)
+            uint32_t dir_next = allocate_cluster(cluster, true);
             if (dir_next == 0) break;
             set_next_cluster(cluster, dir_next);
             cluster = dir_next;
@@ -414,8 +586,9 @@ bool Fat32::create_file(const char* filename) {
         }
     }
 
-    dma_free(buf, 1);
-    return false;
+    io_buf_free(buf, 1);
+    flush_fat();
+    return added;
 }
 
 bool Fat32::write_file(const char* filename, void* data, uint32_t len) {
@@ -430,39 +603,90 @@ bool Fat32::write_file(const char* filename, void* data, uint32_t len) {
         cluster = find_entry(filename, &entry, &dir_clus, &dir_offset);
     }
 
-    uint8_t* src = (uint8_t*)data;
-    uint8_t* temp = (uint8_t*)dma_alloc(1);
+    uint32_t cluster_bytes = bpb.sectors_per_cluster * 512;
+    uint8_t* temp = (uint8_t*)io_buf_alloc(1);
     if (!temp) return false;
 
-    uint32_t bytes_left = len;
+    // Grow the chain to size first. New clusters follow their
+    // predecessor where possible, so the runs below stay long.
+    uint32_t needed = len ? (len + cluster_bytes - 1) / cluster_bytes : 1;
     uint32_t curr_clus = cluster;
-    
+    for (uint32_t i = 1; i < needed; i++) {
+        uint32_t next = get_next_cluster(curr_clus);
+        if (next < 2 || next >= 0x0FFFFFF8) {
+            next = allocate_cluster(curr_clus);
+            if (next == 0) { io_buf_free(temp, 1); flush_fat(); return false; }
+            set_next_cluster(curr_clus, next);
+        }
+        curr_clus = next;
+    }
+
+    // Then one transfer per run, straight from the caller's data. A
+    // partial last sector goes out zero padded.
+    const uint8_t* src = (const uint8_t*)data;
+    uint32_t bytes_left = len;
+    curr_clus = cluster;
     while (bytes_left > 0) {
-        uint32_t chunk = (bytes_left > 4096) ? 4096 : bytes_left;
-        memset(temp, 0, 4096);
-        memcpy(temp, src, chunk);
-        
-        AhciDriver::getInstance().write(port_index, cluster_to_lba(curr_clus), bpb.sectors_per_cluster, temp);
-        
-        src += chunk;
-        bytes_left -= chunk;
-        
-        if (bytes_left > 0) {
-            uint32_t next = get_next_cluster(curr_clus);
-            if (next >= 0x0FFFFFF8) {
-                next = allocate_cluster();
-                if (next == 0) { dma_free(temp, 1); return false; }
-                set_next_cluster(curr_clus, next);
-            }
-            curr_clus = next;
+        uint32_t next;
+        uint32_t run = contiguous_run(curr_clus, (bytes_left + cluster_bytes - 1) / cluster_bytes, &next);
+        uint32_t lba = cluster_to_lba(curr_clus);
+        uint32_t run_bytes = run * cluster_bytes;
+
+        uint32_t direct = run_bytes < bytes_left ? run_bytes : (bytes_left & ~511u);
+        if (direct && !BlockCache::getInstance().write(port_index, lba, direct / 512, src)) {
+            io_buf_free(temp, 1);
+            flush_fat();
+            return false;
         }
+        src += direct;
+        bytes_left -= direct;
+
+        if (bytes_left > 0 && bytes_left < 512 && run_bytes > direct) {
+            memset(temp, 0, 512);
+            memcpy(temp, src, bytes_left);
+            BlockCache::getInstance().write(port_index, lba + direct / 512, 1, temp);
+            bytes_left = 0;
+        }
+        curr_clus = next;
     }
     
-    AhciDriver::getInstance().read(port_index, cluster_to_lba(dir_clus), bpb.sectors_per_cluster, temp);
+    BlockCache::getInstance().read(port_index, cluster_to_lba(dir_clus), bpb.sectors_per_cluster, temp);
     FatDirectoryEntry* entries = (FatDirectoryEntry*)temp;
     entries[dir_offset].file_size = len;
-    AhciDriver::getInstance().write(port_index, cluster_to_lba(dir_clus), bpb.sectors_per_cluster, temp);
+    BlockCache::getInstance().write(port_index, cluster_to_lba(dir_clus), bpb.sectors_per_cluster, temp);
 
-    dma_free(temp, 1);
+    io_buf_free(temp, 1);
+    return flush_fat();
+}
+bool Fat32::get_file_size(const char* filename, uint32_t* size) {
+    FatDirectoryEntry entry;
+    if (find_entry(filename, &entry, nullptr, nullptr) == 0) return false;
+    *size = entry.file_size;
     return true;
-}
\ No newline at end of file
+}
+
+void Fat32::benchmark_read(const char* filename) {
+    uint32_t size;
+    if (!get_file_size(filename, &size) || size == 0) {
+        printf("FAT32: %s not found or empty\n", filename);
+        return;
+    }
+    uint8_t* buffer = new uint8_t[size];
+    if (!buffer) { printf("FAT32: OOM\n"); return; }
+
+    // Pass one may still find parts in the block cache; big runs bypass it
+    for (int pass = 1; pass <= 3; pass++) {
+        uint64_t commands = AhciDriver::getInstance().getCommandCount(port_index);
+        uint64_t start = clock_ns();
+        bool ok = read_file(filename, buffer, size);
+        uint64_t elapsed = clock_ns() - start;
+        commands = AhciDriver::getInstance().getCommandCount(port_index) - commands;
+        if (!ok) { printf("FAT32: Read failed\n"); break; }
+        if (elapsed == 0) elapsed = 1;
+
+        uint64_t kbps = (uint64_t)size * 1000000000ULL / elapsed / 1024;
+        printf("Pass %d: %d KB in %d us, %d.%d MB/s, %d disk commands\n", pass, (int)(size / 1024),
+               (int)(elapsed / 1000), (int)(kbps / 1024), (int)((kbps % 1024) * 10 / 1024), (int)commands);
+    }
+    delete[] buffer;
+}
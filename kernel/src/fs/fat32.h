@@ -21,6 +21,16 @@ public:
     bool read_file(const char* filename, void* buffer, uint32_t buffer_len);
     bool create_file(const char* filename); // Creates empty file
     bool write_file(const char* filename, void* data, uint32_t len);
+    bool get_file_size(const char* filename, uint32_t* size);
+
+    // Reads a file a few times and prints throughput and disk commands
+    void benchmark_read(const char* filename);
+
+    // Sectors covered by the mounted volume (it starts at LBA 0), 0 if unmounted
+    uint32_t getVolumeSectors() const { return mounted ? bpb.total_sectors_32 : 0; }
+
+    // Free space in bytes, 0 if unmounted
+    uint64_t getFreeBytes() const { return mounted ? (uint64_t)free_count * bpb.sectors_per_cluster * 512 : 0; }
 
 private:
     Fat32();
@@ -35,11 +45,32 @@ private:
     uint32_t sectors_per_fat;
     uint32_t root_cluster;
 
+    // The first FAT lives in memory from mount on. Changes mark their
+    // sector dirty and flush_fat() writes those to every copy at the end
+    // of each operation. free_map has a bit per cluster (set = in use)
+    // so allocation doesn't scan the FAT itself.
+    uint32_t* fat;
+    uint8_t*  fat_dirty;      // One bit per FAT sector
+    bool      fat_has_dirty;
+    uint64_t* free_map;
+    uint32_t  cluster_count;  // Data clusters, numbered from 2
+    uint32_t  free_count;
+    uint32_t  next_free;      // Where the next search starts (FSInfo hint)
+
     // Helpers
     uint32_t cluster_to_lba(uint32_t cluster);
     uint32_t get_next_cluster(uint32_t cluster);
     void     set_next_cluster(uint32_t cluster, uint32_t next);
-    uint32_t allocate_cluster();
+    uint32_t contiguous_run(uint32_t cluster, uint32_t max, uint32_t* next);
+
+    // Prefers prev + 1, so files grow contiguously. zero clears the new
+    // cluster on disk (directories). 0 when the volume is full.
+    uint32_t allocate_cluster(uint32_t prev = 0, bool zero = false);
+
+    bool fat_io(uint8_t* bounce, int copy, uint32_t first, uint32_t count, bool write);
+    bool load_fat();
+    void unload_fat();
+    bool flush_fat();
 
     // String Helpers
     void to_dos_filename(const char* input, char* dest_name, char* dest_ext);
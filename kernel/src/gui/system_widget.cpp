@@ -2,6 +2,8 @@
 #include "../render.h"           
 #include "window.h"              
 #include "../sys/system_stats.h" 
+#include "../sys/percpu.h"
+#include "../sys/idle.h"
 #include "../memory/pmm.h"
 #include "../cppstd/stdio.h"
 #include "../timer.h"
@@ -54,11 +56,26 @@ void SystemWidget::render(Renderer* r, int screen_w) {
     r->drawString(cursor_x, cursor_y, "--- CORES ---", 0xAAAAAA);
     cursor_y += line_h;
     
+    // Utilisation over the last half second; a per-frame window is too
+    // short to read
+    static IdleSample samples[8];
+    static int busy[8];
+    static uint64_t last_sample = 0;
+    uint64_t now = clock_ms();
+    bool resample = now - last_sample >= 500;
+    if (resample) last_sample = now;
+
     for(int i=0; i<stats.cpu_count && i < 8; i++) {
-        const char* spinner = "|/-\\";
-        uint64_t ticks = stats.cpu_ticks[i];
-        char spin_char = spinner[(ticks / 1000) % 4]; 
-        sprintf(buf, "CPU %d: %c Online", i, spin_char);
+        PerCpu* cpu = percpu_of(i);
+        if (!cpu) continue;
+        if (resample) busy[i] = idle_busy_percent(i, &samples[i]);
+        uint64_t hits = cpu->pcp_hits;
+        uint64_t lookups = hits + cpu->pcp_misses;
+        if (lookups > 0) {
+            sprintf(buf, "CPU %d: %d%% busy PCP %d%%", i, busy[i], (int)(hits * 100 / lookups));
+        } else {
+            sprintf(buf, "CPU %d: %d%% busy", i, busy[i]);
+        }
         r->drawString(cursor_x, cursor_y, buf, TEXT_NORMAL);
         cursor_y += line_h;
     }
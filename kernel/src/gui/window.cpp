@@ -5,6 +5,10 @@
 #include "../input.h"
 #include "../globals.h"
 #include "system_widget.h" 
+#include "../sys/parallel.h"
+
+// Rows per parallel_for chunk for the final colour conversion pass
+#define WM_CONVERT_GRAIN_ROWS 64
 
 // --- Default Theme Initialization (Dark Mode) ---
 Theme g_theme = { 
@@ -38,10 +42,11 @@ Window::Window(int x, int y, int w, int h, const char* t, WindowApp* a)
 }
 
 Window::~Window() {
+    // App first: it may own a thread that still draws into the window
+    if (app) delete app;
     if (console) delete console;
     if (renderer) delete renderer;
     if (backing_buffer) free(backing_buffer);
-    if (app) delete app;
 }
 
 void Window::render_frame(Renderer* r) {
@@ -289,6 +294,34 @@ uint32_t WindowManager::process_pixel(uint32_t c) {
     }
 }
 
+void WindowManager::convert_rows(int64_t begin, int64_t end, void* arg) {
+    WindowManager* wm = (WindowManager*)arg;
+    int physical_width = wm->physical_width;
+    int logical_width = wm->logical_width;
+    int logical_height = wm->logical_height;
+    uint32_t* src = wm->logical_buffer;
+    uint32_t* dst = wm->physical_backbuffer;
+
+    if (logical_width == physical_width && logical_height == wm->physical_height) {
+        for (int64_t i = begin * physical_width; i < end * physical_width; i++) {
+            dst[i] = process_pixel(src[i]);
+        }
+        return;
+    }
+
+    float scale_x = (float)physical_width / (float)logical_width;
+    float scale_y = (float)wm->physical_height / (float)logical_height;
+    for (int y = (int)begin; y < (int)end; y++) {
+        int src_y = (int)(y / scale_y);
+        if (src_y >= logical_height) src_y = logical_height - 1;
+        for (int x = 0; x < physical_width; x++) {
+            int src_x = (int)(x / scale_x);
+            if (src_x >= logical_width) src_x = logical_width - 1;
+            dst[y * physical_width + x] = process_pixel(src[src_y * logical_width + src_x]);
+        }
+    }
+}
+
 void WindowManager::render(Renderer* global_renderer) {
     if (!logical_buffer || !physical_backbuffer) return;
 
@@ -322,24 +355,8 @@ void WindowManager::render(Renderer* global_renderer) {
         }
     }
 
-    float scale_x = (float)physical_width / (float)logical_width;
-    float scale_y = (float)physical_height / (float)logical_height;
-    
-    if (logical_width == physical_width && logical_height == physical_height) {
-        for (int i=0; i<physical_width*physical_height; i++) {
-            physical_backbuffer[i] = process_pixel(logical_buffer[i]);
-        }
-    } else {
-        for (int y = 0; y < physical_height; y++) {
-            int src_y = (int)(y / scale_y);
-            if (src_y >= logical_height) src_y = logical_height - 1;
-            for (int x = 0; x < physical_width; x++) {
-                int src_x = (int)(x / scale_x);
-                if (src_x >= logical_width) src_x = logical_width - 1;
-                physical_backbuffer[y * physical_width + x] = process_pixel(logical_buffer[src_y * logical_width + src_x]);
-            }
-        }
-    }
+    // Colour conversion / scaling is per row, so spread it over the cores
+    parallel_for(0, physical_height, WM_CONVERT_GRAIN_ROWS, convert_rows, this);
 
     global_renderer->renderBitmap32(0, 0, physical_width, physical_height, physical_backbuffer);
 }
\ No newline at end of file
@@ -92,7 +92,8 @@ private:
     // Helper to resize logical buffer
     void reallocate_buffers();
     // Helper to process colors
-    uint32_t process_pixel(uint32_t c);
+    static uint32_t process_pixel(uint32_t c);
+    static void convert_rows(int64_t begin, int64_t end, void* arg);
 };
 
 #endif
\ No newline at end of file
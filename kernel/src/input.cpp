@@ -1,10 +1,11 @@
 #include "input.h"
 #include "io.h"
+#include "sys/ring.h"
 
+// Filled by the PS/2 IRQ, USB HID and touchpad pollers, which may run
+// on any core; drained by whoever has keyboard focus.
 #define K_INPUT_BUF_SIZE 256
-static volatile char g_key_buffer[K_INPUT_BUF_SIZE];
-static volatile int g_head = 0;
-static volatile int g_tail = 0;
+static MpscRing<char, K_INPUT_BUF_SIZE> g_key_buffer;
 
 static void (*g_external_poller)() = nullptr;
 
@@ -81,33 +82,28 @@ static char scancode_to_ascii(std::uint8_t code) {
 
 void input_buffer_push(char c) {
     if (c == 0) return;
-    int next = (g_head + 1) % K_INPUT_BUF_SIZE;
-    if (next != g_tail) {
-        g_key_buffer[g_head] = c;
-        g_head = next;
-    }
+    // Dropped when full
+    g_key_buffer.push(c);
 }
 
 char input_check_char() {
-    if (g_head == g_tail) return 0;
-    char c = g_key_buffer[g_tail];
-    g_tail = (g_tail + 1) % K_INPUT_BUF_SIZE;
+    char c;
+    if (!g_key_buffer.pop(&c)) return 0;
     return c;
 }
 
 char input_get_char() {
     while (true) {
         check_input_hooks();
-        if (g_using_interrupts) cli();
-        
-        if (g_head != g_tail) {
-            char c = g_key_buffer[g_tail];
-            g_tail = (g_tail + 1) % K_INPUT_BUF_SIZE;
-            if (g_using_interrupts) sti();
-            return c;
-        }
+
+        char c;
+        if (g_key_buffer.pop(&c)) return c;
         
         if (g_using_interrupts) {
+            // Recheck with interrupts off: "sti; hlt" only takes an IRQ
+            // after the hlt, so a key arriving in between still wakes us
+            cli();
+            if (!g_key_buffer.empty()) { sti(); continue; }
             asm volatile("sti; hlt");
         } else {
             asm volatile("pause");
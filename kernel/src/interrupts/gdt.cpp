@@ -4,6 +4,7 @@
 #include "../cppstd/string.h"
 #include "../cppstd/stdio.h"
 #include "../sys/spinlock.h"
+#include "../sys/percpu.h"
 
 // MAX CORES SUPPORTED
 #define MAX_CORES 32
@@ -90,18 +91,12 @@ void gdt_init() {
     printf("GDT: BSP Initialized. TSS @ 0x28\n");
 }
 
-// Called by APs. 
-// Uses the processor ID (LAPIC ID / Index) to select a unique TSS.
-// We must derive the index locally or assume a sequential ID.
-// For simplicity, we implement a counter here, but ideally we'd pass the CPU ID.
-// Since smp_ap_entry doesn't pass args to this func easily, we use a simple atomic counter.
-static volatile int g_ap_count = 0;
-
+// Called by APs, after percpu_init_ap() gave the core its index.
+// That index selects the TSS.
 void gdt_init_ap() {
     ScopedLock lock(gdt_lock);
     
-    // Increment core count (BSP is 0, first AP is 1)
-    int core_id = ++g_ap_count;
+    int core_id = this_cpu_id();
     
     if (core_id >= MAX_CORES) {
         // Too many cores, just halt or reuse 0 (dangerous)
@@ -129,4 +124,4 @@ void gdt_init_ap() {
     // 3. Load GDT
     // We reuse the global GDTR since the table is shared, just the TSS selector differs.
     load_gdt(&gdtr, 0x08, 0x10, tss_selector);
-}
\ No newline at end of file
+}
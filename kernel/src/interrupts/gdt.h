@@ -29,7 +29,8 @@ struct GDTDescriptor {
 // Initialize GDT + TSS for the BSP (Bootstrap Processor)
 void gdt_init();
 
-// Initialize GDT + TSS for an AP (Allocates new structures)
+// Initialize GDT + TSS for an AP (Allocates new structures).
+// Call after percpu_init_ap(): the core index picks the TSS.
 void gdt_init_ap();
 
 #endif
\ No newline at end of file
@@ -1,15 +1,18 @@
 #include "idt.h"
 #include "gdt.h"
 #include "pic.h"
+#include "lapic.h"
+#include "irq.h"
 #include "../render.h"
 #include "../globals.h"
 #include "../cppstd/stdio.h"
 #include "../cppstd/string.h"
-#include "../drv/usb/xhci.h" 
-#include "../drv/ps2/ps2_mouse.h"
-#include "../drv/net/e1000.h"
-#include "../drv/ps2/ps2_kbd.h"
+#include "../smp/smp_call.h"
+#include "../memory/swp.h"
+#include "../memory/vmm.h"
 #include "../sys/raw_panic.h" // Critical: Raw Panic for Double Faults
+#include "../sys/sched.h"
+#include "../sys/timer_wheel.h"
 
 struct IDTEntry {
     uint16_t offset_1; 
@@ -48,6 +51,12 @@ extern "C" void isr41(); extern "C" void isr42(); extern "C" void isr43();
 extern "C" void isr44(); extern "C" void isr45(); extern "C" void isr46();
 extern "C" void isr47();
 
+// isr48 - isr79, see interrupts.asm
+extern "C" void* isr_device_table[IRQ_DEVICE_VECTORS];
+
+extern "C" void isr239(); extern "C" void isr240(); extern "C" void isr241();
+extern "C" void isr255();
+
 extern "C" void isr128();
 
 static void idt_set_gate(uint8_t num, void* base, uint16_t sel, uint8_t flags, uint8_t ist = 0) {
@@ -137,6 +146,17 @@ void idt_init() {
         idt_set_gate(32+i, handler, kernel_cs, 0x8E, 0);
     }
 
+    // Device vectors (IOAPIC / MSI)
+    for (int i = 0; i < IRQ_DEVICE_VECTORS; i++) {
+        idt_set_gate(IRQ_DEVICE_VECTOR_BASE + i, isr_device_table[i], kernel_cs, 0x8E, 0);
+    }
+
+    // Local APIC
+    idt_set_gate(LAPIC_TIMER_VECTOR, (void*)isr239, kernel_cs, 0x8E, 0);
+    idt_set_gate(IPI_CALL_VECTOR, (void*)isr240, kernel_cs, 0x8E, 0);
+    idt_set_gate(IPI_RESCHEDULE_VECTOR, (void*)isr241, kernel_cs, 0x8E, 0);
+    idt_set_gate(LAPIC_SPURIOUS_VECTOR, (void*)isr255, kernel_cs, 0x8E, 0);
+
     // SYSCALL
     idt_set_gate(0x80, (void*)isr128, kernel_cs, 0xEE, 0);
 
@@ -156,7 +176,22 @@ static const char* exception_messages[] = {
 };
 
 extern "C" void exception_handler(InterruptFrame* frame) {
+    // Demand paging: copy-on-write breaks and faults inside the swap
+    // window are resolved and the access retried
+    if (frame->int_number == 14) {
+        uint64_t cr2;
+        asm volatile("mov %%cr2, %0" : "=r"(cr2));
+        if (vmm_handle_fault(cr2, frame->error_code)) return;
+        if (SwapManager::getInstance().handle_page_fault(cr2, frame->error_code)) return;
+    }
+
+    // A panicking core parks the others with an NMI
+    if (frame->int_number == 2) smp_stop_nmi();
+
     asm volatile("cli");
+
+    // Nothing else runs (or draws) behind the panic screen
+    smp_stop_others();
     
     // --- SPECIAL DOUBLE FAULT HANDLER ---
     if (frame->int_number == 8) {
@@ -242,18 +277,44 @@ extern "C" void exception_handler(InterruptFrame* frame) {
 }
 
 extern "C" void irq_handler(InterruptFrame* frame) {
-    uint8_t irq = frame->int_number - 32;
+    uint64_t vector = frame->int_number;
+
+    // IOAPIC pins and MSI: delivered by the Local APIC to whichever
+    // core the route points at
+    if (vector >= IRQ_DEVICE_VECTOR_BASE && vector < IRQ_DEVICE_VECTOR_BASE + IRQ_DEVICE_VECTORS) {
+        irq_dispatch((uint8_t)vector);
+        lapic_eoi();
+        return;
+    }
 
-    if (g_sniffer_mode) sniffer_log_irq(irq, frame->rip);
-    
-    if (irq == 1) ps2_irq_callback();
-    else if (irq == 12) ps2_mouse_irq_callback();
-    
-    if (irq == E1000Driver::getInstance().get_irq()) {
-        E1000Driver::getInstance().handle_interrupt();
+    // Vectors past the device range come from the Local APIC itself
+    if (vector >= IRQ_DEVICE_VECTOR_BASE + IRQ_DEVICE_VECTORS) {
+        // Ring 3 code runs on the TSS stack, so only switch away from ring 0
+        bool from_kernel = (frame->cs & 3) == 0;
+
+        if (vector == IPI_CALL_VECTOR) {
+            smp_call_handler();
+            lapic_eoi();
+        }
+        else if (vector == LAPIC_TIMER_VECTOR) {
+            lapic_eoi();
+            timer_wheel_tick();
+            sched_tick(from_kernel);
+        }
+        else if (vector == IPI_RESCHEDULE_VECTOR) {
+            lapic_eoi();
+            sched_reschedule_ipi(from_kernel);
+        }
+        // Spurious interrupts must not be acknowledged
+        return;
     }
-    
-    if (irq >= 10 && irq <= 15) XhciDriver::getInstance().poll_events();
+
+    // 8259 lines (virtual wire, BSP only)
+    uint8_t irq = vector - IRQ_PIC_VECTOR_BASE;
+
+    if (g_sniffer_mode) sniffer_log_irq(irq, frame->rip);
+
+    irq_dispatch((uint8_t)vector);
 
     pic_eoi(irq);
-}
\ No newline at end of file
+}
@@ -68,8 +68,90 @@ ISR_NOERRCODE 45
 ISR_NOERRCODE 46
 ISR_NOERRCODE 47
 
+; Device vectors (0x30-0x4F), handed out by irq.cpp to IOAPIC pins and MSI
+ISR_NOERRCODE 48
+ISR_NOERRCODE 49
+ISR_NOERRCODE 50
+ISR_NOERRCODE 51
+ISR_NOERRCODE 52
+ISR_NOERRCODE 53
+ISR_NOERRCODE 54
+ISR_NOERRCODE 55
+ISR_NOERRCODE 56
+ISR_NOERRCODE 57
+ISR_NOERRCODE 58
+ISR_NOERRCODE 59
+ISR_NOERRCODE 60
+ISR_NOERRCODE 61
+ISR_NOERRCODE 62
+ISR_NOERRCODE 63
+ISR_NOERRCODE 64
+ISR_NOERRCODE 65
+ISR_NOERRCODE 66
+ISR_NOERRCODE 67
+ISR_NOERRCODE 68
+ISR_NOERRCODE 69
+ISR_NOERRCODE 70
+ISR_NOERRCODE 71
+ISR_NOERRCODE 72
+ISR_NOERRCODE 73
+ISR_NOERRCODE 74
+ISR_NOERRCODE 75
+ISR_NOERRCODE 76
+ISR_NOERRCODE 77
+ISR_NOERRCODE 78
+ISR_NOERRCODE 79
+
+; Stub addresses for idt.cpp, indexed by vector - 48
+global isr_device_table
+section .rodata
+isr_device_table:
+    dq isr48
+    dq isr49
+    dq isr50
+    dq isr51
+    dq isr52
+    dq isr53
+    dq isr54
+    dq isr55
+    dq isr56
+    dq isr57
+    dq isr58
+    dq isr59
+    dq isr60
+    dq isr61
+    dq isr62
+    dq isr63
+    dq isr64
+    dq isr65
+    dq isr66
+    dq isr67
+    dq isr68
+    dq isr69
+    dq isr70
+    dq isr71
+    dq isr72
+    dq isr73
+    dq isr74
+    dq isr75
+    dq isr76
+    dq isr77
+    dq isr78
+    dq isr79
+section .text
+
+; Local APIC vectors (timer, IPIs, spurious)
+ISR_NOERRCODE 239
+ISR_NOERRCODE 240
+ISR_NOERRCODE 241
+ISR_NOERRCODE 255
+
 global isr128
 isr128:
+    test qword [rsp + 8], 3     ; CS of the caller
+    jz .from_kernel
+    swapgs
+.from_kernel:
     push rbp
     push rbx
     push r12
@@ -93,6 +175,10 @@ isr128:
     pop r12
     pop rbx
     pop rbp
+    test qword [rsp + 8], 3
+    jz .to_kernel
+    swapgs
+.to_kernel:
     iretq
 
 global jump_to_user_program
@@ -151,6 +237,9 @@ jump_to_user_program:
     mov r14, rdx    ; argv
     mov r15, rcx    ; stack_top
     
+    ; Park the per-CPU pointer in KERNEL_GS_BASE, the selector load
+    ; below then gives ring 3 a zero GS base
+    swapgs
     mov ax, 0x23
     mov ds, ax
     mov es, ax
@@ -193,12 +282,13 @@ restore_kernel_stack:
     ; Returns to .safe_exit
     ret
 
+; GS is left alone: reloading the selector would zero the GS base,
+; which holds the per-CPU pointer
 load_gdt:
     lgdt [rdi]
     mov es, dx
     mov ds, dx
     mov fs, dx
-    mov gs, dx
     mov ss, dx
     push rsi
     lea rax, [rel .reload]
@@ -208,7 +298,34 @@ load_gdt:
     ltr cx
     ret
 
+; void sched_switch(uint64_t* old_rsp, uint64_t new_rsp)
+; Pushes the callee-saved registers, stores RSP in *old_rsp, then
+; pops the same frame off the new stack and returns into that thread.
+global sched_switch
+sched_switch:
+    push rbp
+    push rbx
+    push r12
+    push r13
+    push r14
+    push r15
+    mov [rdi], rsp
+    mov rsp, rsi
+    pop r15
+    pop r14
+    pop r13
+    pop r12
+    pop rbx
+    pop rbp
+    ret
+
 isr_common_stub:
+    ; From ring 3: swap the kernel's GS base back in (CS is above the
+    ; vector, error code and RIP)
+    test qword [rsp + 24], 3
+    jz .from_kernel
+    swapgs
+.from_kernel:
     push r15
     push r14
     push r13
@@ -253,4 +370,8 @@ isr_common_stub:
     pop r14
     pop r15
     add rsp, 16
+    test qword [rsp + 8], 3
+    jz .to_kernel
+    swapgs
+.to_kernel:
     iretq
\ No newline at end of file
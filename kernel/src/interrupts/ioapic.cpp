@@ -0,0 +1,252 @@
+#include "ioapic.h"
+#include "../acpi/acpi.h"
+#include "../memory/vmm.h"
+#include "../sys/spinlock.h"
+#include "../cppstd/stdio.h"
+
+// Right after the LAPIC window (lapic.cpp)
+#define IOAPIC_VIRT_BASE 0xFFFFA00040001000ULL
+
+#define IOAPIC_REGSEL 0x00
+#define IOAPIC_WIN    0x10
+
+#define IOAPIC_REG_ID    0x00
+#define IOAPIC_REG_VER   0x01
+#define IOAPIC_REG_REDIR 0x10 // Two registers per pin
+
+#define IOAPIC_ACTIVE_LOW (1 << 13)
+#define IOAPIC_LEVEL      (1 << 15)
+#define IOAPIC_MASKED     (1 << 16)
+
+// MADT entry types
+#define MADT_LAPIC        0
+#define MADT_IOAPIC       1
+#define MADT_OVERRIDE     2
+#define MADT_LAPIC_NMI    4
+#define MADT_X2APIC       9
+
+// MPS INTI flags (interrupt source overrides)
+#define MPS_POLARITY_MASK 0x3
+#define MPS_POLARITY_LOW  0x3
+#define MPS_TRIGGER_MASK  0xC
+#define MPS_TRIGGER_LEVEL 0xC
+
+struct MadtHeader {
+    AcpiSdtHeader header;
+    uint32_t lapic_address;
+    uint32_t flags;       // Bit 0: dual 8259 present
+} __attribute__((packed));
+
+struct MadtEntry {
+    uint8_t type;
+    uint8_t length;
+} __attribute__((packed));
+
+struct MadtIoApic {
+    MadtEntry entry;
+    uint8_t id;
+    uint8_t reserved;
+    uint32_t address;
+    uint32_t gsi_base;
+} __attribute__((packed));
+
+struct MadtOverride {
+    MadtEntry entry;
+    uint8_t bus;
+    uint8_t source;       // ISA IRQ
+    uint32_t gsi;
+    uint16_t flags;
+} __attribute__((packed));
+
+struct MadtLapic {
+    MadtEntry entry;
+    uint8_t processor_id;
+    uint8_t apic_id;
+    uint32_t flags;       // Bit 0: enabled, bit 1: online capable
+} __attribute__((packed));
+
+struct MadtX2Apic {
+    MadtEntry entry;
+    uint16_t reserved;
+    uint32_t x2apic_id;
+    uint32_t flags;
+    uint32_t processor_uid;
+} __attribute__((packed));
+
+struct IoApic {
+    volatile uint32_t* mmio;
+    uint8_t id;
+    uint32_t gsi_base;
+    uint32_t pins;
+};
+
+struct IsaOverride {
+    uint8_t irq;
+    uint32_t gsi;
+    uint16_t flags;
+};
+
+static IoApic ioapics[IOAPIC_MAX_CONTROLLERS];
+static int ioapic_count = 0;
+static IsaOverride overrides[IOAPIC_MAX_OVERRIDES];
+static int override_count = 0;
+static int madt_cpus = 0;
+static bool madt_has_8259 = false;
+
+// IOREGSEL/IOWIN is a register pair shared by every core
+static Spinlock ioapic_lock;
+
+static uint32_t ioapic_read(IoApic* io, uint8_t reg) {
+    io->mmio[IOAPIC_REGSEL / 4] = reg;
+    return io->mmio[IOAPIC_WIN / 4];
+}
+
+static void ioapic_write(IoApic* io, uint8_t reg, uint32_t val) {
+    io->mmio[IOAPIC_REGSEL / 4] = reg;
+    io->mmio[IOAPIC_WIN / 4] = val;
+}
+
+static IoApic* ioapic_for_gsi(uint32_t gsi, uint32_t* pin) {
+    for (int i = 0; i < ioapic_count; i++) {
+        IoApic* io = &ioapics[i];
+        if (gsi >= io->gsi_base && gsi < io->gsi_base + io->pins) {
+            *pin = gsi - io->gsi_base;
+            return io;
+        }
+    }
+    return nullptr;
+}
+
+static void add_ioapic(MadtIoApic* entry) {
+    if (ioapic_count >= IOAPIC_MAX_CONTROLLERS) return;
+
+    IoApic* io = &ioapics[ioapic_count];
+    uint64_t virt = IOAPIC_VIRT_BASE + (uint64_t)ioapic_count * 0x1000;
+    vmm_map_page(virt, entry->address & ~0xFFFULL, PTE_PRESENT | PTE_RW | PTE_PCD | PTE_NX);
+
+    io->mmio = (volatile uint32_t*)(virt + (entry->address & 0xFFF));
+    io->id = entry->id;
+    io->gsi_base = entry->gsi_base;
+    io->pins = ((ioapic_read(io, IOAPIC_REG_VER) >> 16) & 0xFF) + 1;
+
+    // Start with every pin masked; drivers route what they use
+    for (uint32_t pin = 0; pin < io->pins; pin++) {
+        ioapic_write(io, IOAPIC_REG_REDIR + pin * 2, IOAPIC_MASKED);
+        ioapic_write(io, IOAPIC_REG_REDIR + pin * 2 + 1, 0);
+    }
+
+    ioapic_count++;
+}
+
+bool ioapic_init() {
+    MadtHeader* madt = (MadtHeader*)acpi_find_table("APIC");
+    if (!madt) {
+        printf("IOAPIC: No MADT, staying on the 8259\n");
+        return false;
+    }
+
+    madt_has_8259 = madt->flags & 1;
+
+    uint8_t* ptr = (uint8_t*)madt + sizeof(MadtHeader);
+    uint8_t* end = (uint8_t*)madt + madt->header.length;
+    while (ptr + sizeof(MadtEntry) <= end) {
+        MadtEntry* entry = (MadtEntry*)ptr;
+        if (entry->length < sizeof(MadtEntry) || ptr + entry->length > end) break;
+
+        switch (entry->type) {
+            case MADT_LAPIC:
+                if (((MadtLapic*)entry)->flags & 3) madt_cpus++;
+                break;
+            case MADT_X2APIC:
+                if (((MadtX2Apic*)entry)->flags & 3) madt_cpus++;
+                break;
+            case MADT_IOAPIC:
+                add_ioapic((MadtIoApic*)entry);
+                break;
+            case MADT_OVERRIDE: {
+                MadtOverride* iso = (MadtOverride*)entry;
+                if (iso->bus == 0 && override_count < IOAPIC_MAX_OVERRIDES) {
+                    overrides[override_count++] = { iso->source, iso->gsi, iso->flags };
+                }
+                break;
+            }
+            default:
+                // LAPIC NMI wiring (type 4) is already covered by LINT1 = NMI
+                break;
+        }
+        ptr += entry->length;
+    }
+
+    if (ioapic_count == 0) {
+        printf("IOAPIC: MADT lists no IOAPIC, staying on the 8259\n");
+        return false;
+    }
+
+    printf("IOAPIC: %d controller(s), %d CPUs, %d ISA overrides\n",
+        ioapic_count, madt_cpus, override_count);
+    return true;
+}
+
+bool ioapic_available() {
+    return ioapic_count > 0;
+}
+
+uint32_t ioapic_isa_to_gsi(uint8_t irq, bool* level, bool* active_low) {
+    *level = false;
+    *active_low = false;
+
+    for (int i = 0; i < override_count; i++) {
+        if (overrides[i].irq != irq) continue;
+
+        uint16_t flags = overrides[i].flags;
+        *active_low = (flags & MPS_POLARITY_MASK) == MPS_POLARITY_LOW;
+        *level = (flags & MPS_TRIGGER_MASK) == MPS_TRIGGER_LEVEL;
+        return overrides[i].gsi;
+    }
+    return irq;
+}
+
+bool ioapic_route(uint32_t gsi, uint8_t vector, uint32_t apic_id, bool level, bool active_low) {
+    uint32_t pin;
+    IoApic* io = ioapic_for_gsi(gsi, &pin);
+    if (!io || apic_id > 0xFF) return false;
+
+    uint32_t lo = vector;
+    if (level) lo |= IOAPIC_LEVEL;
+    if (active_low) lo |= IOAPIC_ACTIVE_LOW;
+
+    // Mask while the destination changes so the pin never fires half set up
+    ScopedLock lock(ioapic_lock);
+    ioapic_write(io, IOAPIC_REG_REDIR + pin * 2, lo | IOAPIC_MASKED);
+    ioapic_write(io, IOAPIC_REG_REDIR + pin * 2 + 1, apic_id << 24);
+    ioapic_write(io, IOAPIC_REG_REDIR + pin * 2, lo);
+    return true;
+}
+
+void ioapic_mask(uint32_t gsi) {
+    uint32_t pin;
+    IoApic* io = ioapic_for_gsi(gsi, &pin);
+    if (!io) return;
+
+    ScopedLock lock(ioapic_lock);
+    uint32_t lo = ioapic_read(io, IOAPIC_REG_REDIR + pin * 2);
+    ioapic_write(io, IOAPIC_REG_REDIR + pin * 2, lo | IOAPIC_MASKED);
+}
+
+void ioapic_print_info() {
+    if (ioapic_count == 0) {
+        printf("IOAPIC: Not present (8259 mode)\n");
+        return;
+    }
+
+    printf("MADT: %d CPUs, 8259 %s\n", madt_cpus, madt_has_8259 ? "present" : "absent");
+    for (int i = 0; i < ioapic_count; i++) {
+        printf("  IOAPIC %d: GSI %d-%d\n", (int)ioapics[i].id,
+            (int)ioapics[i].gsi_base, (int)(ioapics[i].gsi_base + ioapics[i].pins - 1));
+    }
+    for (int i = 0; i < override_count; i++) {
+        printf("  ISA IRQ %d -> GSI %d (%s, %s)\n", (int)overrides[i].irq, (int)overrides[i].gsi,
+            (overrides[i].flags & MPS_TRIGGER_MASK) == MPS_TRIGGER_LEVEL ? "level" : "edge",
+            (overrides[i].flags & MPS_POLARITY_MASK) == MPS_POLARITY_LOW ? "low" : "high");
+    }
+}
@@ -0,0 +1,29 @@
+#ifndef IOAPIC_H
+#define IOAPIC_H
+
+#include <cstdint>
+
+#define IOAPIC_MAX_CONTROLLERS 8
+#define IOAPIC_MAX_OVERRIDES   16
+
+// Reads the MADT, maps every IOAPIC and masks all of their pins.
+// Needs acpi_init(). Returns false if there is no MADT or no IOAPIC,
+// in which case everything stays on the 8259.
+bool ioapic_init();
+
+bool ioapic_available();
+
+// GSI an ISA IRQ is wired to, with its trigger mode and polarity
+// (MADT interrupt source overrides; identity, edge, active high otherwise)
+uint32_t ioapic_isa_to_gsi(uint8_t irq, bool* level, bool* active_low);
+
+// Programs the redirection entry for gsi: fixed delivery of vector to one
+// LAPIC (physical destination), unmasked. False if no IOAPIC owns gsi.
+bool ioapic_route(uint32_t gsi, uint8_t vector, uint32_t apic_id, bool level, bool active_low);
+
+void ioapic_mask(uint32_t gsi);
+
+// MADT summary (controllers, pins, overrides)
+void ioapic_print_info();
+
+#endif
@@ -0,0 +1,232 @@
+#include "irq.h"
+#include "pic.h"
+#include "ioapic.h"
+#include "lapic.h"
+#include "../sys/spinlock.h"
+#include "../cppstd/stdio.h"
+
+#define IRQ_MAX_CPUS 32
+#define IRQ_SLOTS (IRQ_DEVICE_VECTOR_BASE + IRQ_DEVICE_VECTORS - IRQ_PIC_VECTOR_BASE)
+
+enum IrqSource {
+    IRQ_SRC_NONE,
+    IRQ_SRC_PIC,    // line = ISA IRQ, always the BSP
+    IRQ_SRC_IOAPIC, // line = GSI
+    IRQ_SRC_MSI
+};
+
+struct IrqAction {
+    IrqHandler handler;
+    void* ctx;
+    const char* name;
+};
+
+// One slot per vector from 0x20 up. Actions are only ever appended, and
+// nr_actions is published last, so irq_dispatch() reads them lock free.
+struct IrqVector {
+    IrqSource source;
+    uint32_t line;
+    bool level;
+    bool active_low;
+    PCIDevice pci;          // IRQ_SRC_MSI: the device to reprogram
+    int cpu;
+    volatile int nr_actions;
+    IrqAction actions[IRQ_MAX_SHARED];
+    volatile uint64_t count;
+};
+
+static IrqVector vectors[IRQ_SLOTS];
+static Spinlock irq_lock("irq");
+
+static IrqVector* slot(uint8_t vector) {
+    if (vector < IRQ_PIC_VECTOR_BASE || vector >= IRQ_PIC_VECTOR_BASE + IRQ_SLOTS) return nullptr;
+    return &vectors[vector - IRQ_PIC_VECTOR_BASE];
+}
+
+// Picks the core and its APIC ID. IRQ_CPU_AUTO spreads device vectors
+// over the APs; cores that aren't up fall back to the BSP.
+static int resolve_cpu(int cpu, uint32_t* apic_id) {
+    if (cpu == IRQ_CPU_AUTO) {
+        int best = -1;
+        int best_load = 0;
+        for (int i = 1; i < IRQ_MAX_CPUS; i++) {
+            uint32_t id;
+            if (!lapic_core_apic_id(i, &id)) continue;
+
+            int load = 0;
+            for (int v = 0; v < IRQ_SLOTS; v++) {
+                if (vectors[v].source != IRQ_SRC_NONE && vectors[v].source != IRQ_SRC_PIC && vectors[v].cpu == i) load++;
+            }
+            if (best < 0 || load < best_load) {
+                best = i;
+                best_load = load;
+            }
+        }
+        cpu = best < 0 ? IRQ_CPU_BSP : best;
+    }
+
+    if (!lapic_core_apic_id(cpu, apic_id)) {
+        cpu = IRQ_CPU_BSP;
+        lapic_core_apic_id(cpu, apic_id);
+    }
+    return cpu;
+}
+
+static int alloc_device_vector() {
+    for (int i = 0; i < IRQ_DEVICE_VECTORS; i++) {
+        uint8_t vector = IRQ_DEVICE_VECTOR_BASE + i;
+        if (slot(vector)->source == IRQ_SRC_NONE) return vector;
+    }
+    return -1;
+}
+
+static bool add_action(IrqVector* v, const char* name, IrqHandler handler, void* ctx) {
+    int n = v->nr_actions;
+    for (int i = 0; i < n; i++) {
+        if (v->actions[i].handler == handler && v->actions[i].ctx == ctx) return true;
+    }
+    if (n >= IRQ_MAX_SHARED) return false;
+
+    v->actions[n] = { handler, ctx, name };
+    __atomic_store_n(&v->nr_actions, n + 1, __ATOMIC_RELEASE);
+    return true;
+}
+
+static bool find_installed(IrqHandler handler, void* ctx) {
+    for (int v = 0; v < IRQ_SLOTS; v++) {
+        for (int i = 0; i < vectors[v].nr_actions; i++) {
+            if (vectors[v].actions[i].handler == handler && vectors[v].actions[i].ctx == ctx) return true;
+        }
+    }
+    return false;
+}
+
+static bool install_pic(uint8_t irq, const char* name, IrqHandler handler, void* ctx) {
+    if (irq == 0 || irq >= 16) return false;
+
+    IrqVector* v = slot(IRQ_PIC_VECTOR_BASE + irq);
+    v->source = IRQ_SRC_PIC;
+    v->line = irq;
+    v->cpu = IRQ_CPU_BSP;
+    if (!add_action(v, name, handler, ctx)) return false;
+
+    // Slave lines need the cascade on the master
+    if (irq >= 8) pic_unmask(2);
+    pic_unmask(irq);
+    return true;
+}
+
+bool irq_install_isa(uint8_t irq, const char* name, IrqHandler handler, void* ctx, int cpu) {
+    ScopedLock lock(irq_lock);
+
+    if (!ioapic_available()) return install_pic(irq, name, handler, ctx);
+
+    bool level, active_low;
+    uint32_t gsi = ioapic_isa_to_gsi(irq, &level, &active_low);
+
+    // Share the vector if the GSI is already routed
+    for (int i = 0; i < IRQ_DEVICE_VECTORS; i++) {
+        IrqVector* v = slot(IRQ_DEVICE_VECTOR_BASE + i);
+        if (v->source == IRQ_SRC_IOAPIC && v->line == gsi) return add_action(v, name, handler, ctx);
+    }
+
+    int vector = alloc_device_vector();
+    if (vector < 0) return false;
+
+    uint32_t apic_id;
+    IrqVector* v = slot(vector);
+    v->cpu = resolve_cpu(cpu, &apic_id);
+    v->source = IRQ_SRC_IOAPIC;
+    v->line = gsi;
+    v->level = level;
+    v->active_low = active_low;
+    add_action(v, name, handler, ctx);
+
+    if (!ioapic_route(gsi, vector, apic_id, level, active_low)) {
+        printf("IRQ: GSI %d has no IOAPIC pin\n", (int)gsi);
+        v->nr_actions = 0;
+        v->source = IRQ_SRC_NONE;
+        return false;
+    }
+    return true;
+}
+
+bool irq_install_pci(PCIDevice* dev, const char* name, IrqHandler handler, void* ctx, int cpu) {
+    ScopedLock lock(irq_lock);
+
+    if (find_installed(handler, ctx)) return true;
+
+    if (pci_find_capability(dev, PCI_CAP_MSI)) {
+        int vector = alloc_device_vector();
+        if (vector >= 0) {
+            uint32_t apic_id;
+            IrqVector* v = slot(vector);
+            v->cpu = resolve_cpu(cpu, &apic_id);
+            v->source = IRQ_SRC_MSI;
+            v->line = 0;
+            v->pci = *dev;
+            add_action(v, name, handler, ctx);
+
+            if (pci_enable_msi(dev, apic_id, vector)) return true;
+
+            v->nr_actions = 0;
+            v->source = IRQ_SRC_NONE;
+        }
+    }
+
+    return install_pic(dev->irq_line, name, handler, ctx);
+}
+
+bool irq_set_affinity(uint8_t vector, int cpu) {
+    ScopedLock lock(irq_lock);
+
+    IrqVector* v = slot(vector);
+    if (!v || (v->source != IRQ_SRC_IOAPIC && v->source != IRQ_SRC_MSI)) return false;
+    if (cpu < 0 || cpu >= IRQ_MAX_CPUS) return false;
+
+    uint32_t apic_id;
+    if (!lapic_core_apic_id(cpu, &apic_id)) return false;
+
+    bool ok;
+    if (v->source == IRQ_SRC_IOAPIC) ok = ioapic_route(v->line, vector, apic_id, v->level, v->active_low);
+    else ok = pci_enable_msi(&v->pci, apic_id, vector);
+
+    if (ok) v->cpu = cpu;
+    return ok;
+}
+
+void irq_dispatch(uint8_t vector) {
+    IrqVector* v = slot(vector);
+    if (!v) return;
+
+    __atomic_fetch_add(&v->count, 1, __ATOMIC_RELAXED);
+
+    int n = __atomic_load_n(&v->nr_actions, __ATOMIC_ACQUIRE);
+    for (int i = 0; i < n; i++) {
+        v->actions[i].handler(v->actions[i].ctx);
+    }
+}
+
+void irq_print_routes() {
+    ioapic_print_info();
+    printf("IRQ: Vector  Source  CPU  Count  Handlers\n");
+
+    for (int i = 0; i < IRQ_SLOTS; i++) {
+        IrqVector* v = &vectors[i];
+        if (v->source == IRQ_SRC_NONE) continue;
+
+        const char* source = "PIC IRQ";
+        if (v->source == IRQ_SRC_IOAPIC) source = "GSI";
+        else if (v->source == IRQ_SRC_MSI) source = "MSI";
+
+        printf("  %x  %s", IRQ_PIC_VECTOR_BASE + i, source);
+        if (v->source == IRQ_SRC_MSI) printf(" %x:%x", (int)v->pci.bus, (int)v->pci.slot);
+        else printf(" %d", (int)v->line);
+        printf("  CPU %d  %d  ", v->cpu, (int)v->count);
+
+        for (int a = 0; a < v->nr_actions; a++) {
+            printf("%s%s", a ? ", " : "", v->actions[a].name);
+        }
+        printf("\n");
+    }
+}
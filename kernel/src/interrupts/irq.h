@@ -0,0 +1,43 @@
+#ifndef IRQ_H
+#define IRQ_H
+
+#include <cstdint>
+#include "../pci/pci.h"
+
+// Device interrupt registration. Handlers are attached to a vector; the
+// vector is fed by the IOAPIC (ISA lines), by MSI (PCI devices that have
+// it) or, without an IOAPIC / for plain PCI INTx, by the 8259 through the
+// BSP's LINT0.
+
+#define IRQ_PIC_VECTOR_BASE    0x20 // 8259 lines 0-15
+#define IRQ_DEVICE_VECTOR_BASE 0x30 // Allocated to IOAPIC / MSI sources
+#define IRQ_DEVICE_VECTORS     32
+#define IRQ_MAX_SHARED         4    // Handlers per vector
+
+#define IRQ_CPU_BSP   0
+#define IRQ_CPU_AUTO  -1            // Least loaded AP, the BSP keeps the UI
+
+// Runs in interrupt context on the target core, interrupts off.
+// Must not sleep or take locks that are held with interrupts on.
+typedef void (*IrqHandler)(void* ctx);
+
+// Legacy ISA IRQ (PS/2, ...). Goes through the IOAPIC (honouring the
+// MADT overrides) when there is one, the 8259 otherwise.
+bool irq_install_isa(uint8_t irq, const char* name, IrqHandler handler, void* ctx, int cpu = IRQ_CPU_BSP);
+
+// PCI function: MSI when the device supports it, otherwise its INTx line
+// via the 8259 on the BSP (INTx -> GSI routing lives in AML _PRT, which
+// we don't interpret). Installing the same handler/ctx twice is a no-op.
+bool irq_install_pci(PCIDevice* dev, const char* name, IrqHandler handler, void* ctx, int cpu = IRQ_CPU_AUTO);
+
+// Moves a device vector to another core. False for 8259 lines, which
+// can only reach the BSP.
+bool irq_set_affinity(uint8_t vector, int cpu);
+
+// Called by irq_handler (idt.cpp) before it sends EOI
+void irq_dispatch(uint8_t vector);
+
+// Vector / source / core / count table for the terminal
+void irq_print_routes();
+
+#endif
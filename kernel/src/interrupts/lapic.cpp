@@ -0,0 +1,246 @@
+#include "lapic.h"
+#include "../io.h"
+#include "../memory/vmm.h"
+#include "../cppstd/stdio.h"
+#include "../timer.h"
+#include "gdt.h"
+#include "../sys/percpu.h"
+
+#define IA32_APIC_BASE_MSR   0x1B
+#define APIC_BASE_ENABLE     (1ULL << 11)
+#define APIC_BASE_X2APIC     (1ULL << 10)
+#define APIC_BASE_ADDR_MASK  0x000FFFFFFFFFF000ULL
+
+// xAPIC register offsets (x2APIC MSR = 0x800 + offset / 16)
+#define LAPIC_REG_ID     0x020
+#define LAPIC_REG_EOI    0x0B0
+#define LAPIC_REG_SVR    0x0F0
+#define LAPIC_REG_ICR_LO 0x300
+#define LAPIC_REG_ICR_HI 0x310
+#define LAPIC_REG_LINT0  0x350
+#define LAPIC_REG_LINT1  0x360
+#define LAPIC_REG_TIMER  0x320
+#define LAPIC_REG_TIMER_INIT  0x380
+#define LAPIC_REG_TIMER_CUR   0x390
+#define LAPIC_REG_TIMER_DIV   0x3E0
+
+#define LAPIC_SVR_ENABLE    (1 << 8)
+#define LAPIC_LVT_MASKED    (1 << 16)
+#define LAPIC_LVT_EXTINT    (7 << 8)
+#define LAPIC_LVT_NMI       (4 << 8)
+#define LAPIC_ICR_PENDING   (1 << 12)
+#define LAPIC_ICR_ASSERT    (1 << 14)
+#define LAPIC_ICR_NMI       (4 << 8)
+#define LAPIC_ICR_ALL_BUT_SELF (3 << 18)
+#define LAPIC_TIMER_ONESHOT  (0 << 17)
+#define LAPIC_TIMER_PERIODIC (1 << 17)
+#define LAPIC_TIMER_DIV_16   0x3
+#define LAPIC_CALIBRATE_MS   10
+#define LAPIC_ONESHOT_MAX_NS 10000000000ULL
+
+#define LAPIC_VIRT_BASE 0xFFFFA00040000000ULL
+#define LAPIC_NO_CORE   0xFFFFFFFF
+#define LAPIC_MAX_CORES 32
+
+static volatile uint32_t* lapic_mmio = nullptr;
+static bool use_x2apic = false;
+static bool lapic_ready = false;
+static uint64_t timer_counts_per_sec = 0; // At divide by 16
+
+// Periodic rate per core, 0 while stopped or in one-shot mode
+static uint32_t core_tick_hz[LAPIC_MAX_CORES];
+
+// APIC ID of every core that has enabled its LAPIC, by gdt core id.
+// Interrupt steering (IOAPIC redirection, MSI) targets these.
+static uint32_t core_apic_ids[LAPIC_MAX_CORES];
+
+static bool cpu_has_x2apic() {
+    uint32_t eax, ebx, ecx, edx;
+    asm volatile("cpuid" : "=a"(eax), "=b"(ebx), "=c"(ecx), "=d"(edx) : "a"(1), "c"(0));
+    return ecx & (1 << 21);
+}
+
+static uint32_t lapic_read(uint32_t reg) {
+    if (use_x2apic) return (uint32_t)rdmsr(0x800 + (reg >> 4));
+    return lapic_mmio[reg / 4];
+}
+
+static void lapic_write(uint32_t reg, uint32_t val) {
+    if (use_x2apic) {
+        wrmsr(0x800 + (reg >> 4), val);
+        return;
+    }
+    lapic_mmio[reg / 4] = val;
+}
+
+// Writes the ICR and waits for the previous IPI to leave the xAPIC.
+// x2APIC takes the destination and command in one 64-bit MSR write.
+// Interrupts are masked so the xAPIC HI/LO pair can't be split by a
+// preemption (another thread, or another core, finishing the write).
+static void lapic_write_icr(uint32_t dest, uint32_t cmd) {
+    uint64_t flags;
+    asm volatile("pushfq; pop %0; cli" : "=r"(flags) :: "memory");
+
+    if (use_x2apic) {
+        wrmsr(0x800 + (LAPIC_REG_ICR_LO >> 4), ((uint64_t)dest << 32) | cmd);
+    } else {
+        while (lapic_read(LAPIC_REG_ICR_LO) & LAPIC_ICR_PENDING) asm volatile("pause");
+        lapic_write(LAPIC_REG_ICR_HI, dest << 24);
+        lapic_write(LAPIC_REG_ICR_LO, cmd);
+    }
+
+    if (flags & 0x200) asm volatile("sti" ::: "memory");
+}
+
+// Globally enables the APIC of the calling core and sets the spurious
+// vector. Shared by BSP and APs (all cores see the same MMIO window).
+// Every core has to run in the mode the BSP picked, since use_x2apic is
+// shared. xAPIC -> x2APIC is a legal transition while enabled.
+static void lapic_enable() {
+    uint64_t base = rdmsr(IA32_APIC_BASE_MSR);
+
+    if (!(base & APIC_BASE_ENABLE)) {
+        base |= APIC_BASE_ENABLE;
+        wrmsr(IA32_APIC_BASE_MSR, base);
+    }
+    if (use_x2apic && !(base & APIC_BASE_X2APIC)) {
+        wrmsr(IA32_APIC_BASE_MSR, base | APIC_BASE_X2APIC);
+    }
+
+    lapic_write(LAPIC_REG_SVR, LAPIC_SVR_ENABLE | LAPIC_SPURIOUS_VECTOR);
+    __atomic_store_n(&core_apic_ids[this_cpu_id()], lapic_get_id(), __ATOMIC_RELEASE);
+}
+
+void lapic_init() {
+    uint64_t base = rdmsr(IA32_APIC_BASE_MSR);
+
+    for (int i = 0; i < LAPIC_MAX_CORES; i++) core_apic_ids[i] = LAPIC_NO_CORE;
+
+    // x2APIC whenever the CPU has it: MSR access instead of MMIO, and a
+    // single ICR write per IPI
+    use_x2apic = (base & APIC_BASE_X2APIC) || cpu_has_x2apic();
+
+    if (!use_x2apic) {
+        // Uncached MMIO window (4KB)
+        vmm_map_page(LAPIC_VIRT_BASE, base & APIC_BASE_ADDR_MASK, PTE_PRESENT | PTE_RW | PTE_PCD | PTE_NX);
+        lapic_mmio = (volatile uint32_t*)LAPIC_VIRT_BASE;
+    }
+
+    lapic_enable();
+
+    // Virtual wire: PIC interrupts arrive through LINT0, NMI on LINT1
+    lapic_write(LAPIC_REG_LINT0, LAPIC_LVT_EXTINT);
+    lapic_write(LAPIC_REG_LINT1, LAPIC_LVT_NMI);
+
+    lapic_ready = true;
+    printf("LAPIC: BSP ID %d (%s)\n", (int)lapic_get_id(), use_x2apic ? "x2APIC" : "xAPIC");
+}
+
+void lapic_init_ap() {
+    if (!lapic_ready) return;
+
+    lapic_enable();
+    lapic_write(LAPIC_REG_LINT0, LAPIC_LVT_MASKED);
+    lapic_write(LAPIC_REG_LINT1, LAPIC_LVT_MASKED);
+}
+
+bool lapic_is_ready() {
+    return lapic_ready;
+}
+
+bool lapic_is_x2apic() {
+    return use_x2apic;
+}
+
+bool lapic_core_apic_id(int core, uint32_t* apic_id) {
+    if (!lapic_ready || core < 0 || core >= LAPIC_MAX_CORES) return false;
+    uint32_t id = __atomic_load_n(&core_apic_ids[core], __ATOMIC_ACQUIRE);
+    if (id == LAPIC_NO_CORE) return false;
+    *apic_id = id;
+    return true;
+}
+
+uint32_t lapic_get_id() {
+    if (use_x2apic) return lapic_read(LAPIC_REG_ID);
+    return lapic_read(LAPIC_REG_ID) >> 24;
+}
+
+void lapic_eoi() {
+    lapic_write(LAPIC_REG_EOI, 0);
+}
+
+void lapic_send_ipi(uint32_t apic_id, uint8_t vector) {
+    if (!lapic_ready) return;
+    lapic_write_icr(apic_id, LAPIC_ICR_ASSERT | vector);
+}
+
+void lapic_broadcast_ipi(uint8_t vector) {
+    if (!lapic_ready) return;
+    lapic_write_icr(0, LAPIC_ICR_ALL_BUT_SELF | LAPIC_ICR_ASSERT | vector);
+}
+
+void lapic_broadcast_nmi() {
+    if (!lapic_ready) return;
+    lapic_write_icr(0, LAPIC_ICR_ALL_BUT_SELF | LAPIC_ICR_ASSERT | LAPIC_ICR_NMI);
+}
+
+void lapic_timer_calibrate() {
+    if (!lapic_ready) return;
+
+    // Let the counter run down (masked) over a TSC-timed window. The TSC
+    // has been calibrated against the HPET/PIT by timer_init().
+    lapic_write(LAPIC_REG_TIMER_DIV, LAPIC_TIMER_DIV_16);
+    lapic_write(LAPIC_REG_TIMER, LAPIC_LVT_MASKED | LAPIC_TIMER_VECTOR);
+    lapic_write(LAPIC_REG_TIMER_INIT, 0xFFFFFFFF);
+
+    uint64_t window = ns_to_tsc(LAPIC_CALIBRATE_MS * 1000000ULL);
+    uint64_t start = rdtsc_serialized();
+    while (rdtsc() - start < window) {
+        asm volatile("pause");
+    }
+
+    uint32_t elapsed = 0xFFFFFFFF - lapic_read(LAPIC_REG_TIMER_CUR);
+    lapic_write(LAPIC_REG_TIMER_INIT, 0);
+
+    timer_counts_per_sec = ((uint64_t)elapsed * 1000) / LAPIC_CALIBRATE_MS;
+    printf("LAPIC: Timer runs at %d kHz\n", (int)(timer_counts_per_sec / 1000));
+}
+
+void lapic_timer_start(uint32_t hz) {
+    if (!lapic_ready || timer_counts_per_sec == 0 || hz == 0) return;
+
+    uint64_t count = timer_counts_per_sec / hz;
+    if (count == 0) count = 1;
+    if (count > 0xFFFFFFFF) count = 0xFFFFFFFF;
+
+    lapic_write(LAPIC_REG_TIMER_DIV, LAPIC_TIMER_DIV_16);
+    lapic_write(LAPIC_REG_TIMER, LAPIC_TIMER_PERIODIC | LAPIC_TIMER_VECTOR);
+    lapic_write(LAPIC_REG_TIMER_INIT, (uint32_t)count);
+    core_tick_hz[this_cpu_id()] = hz;
+}
+
+void lapic_timer_oneshot(uint64_t ns) {
+    if (!lapic_ready || timer_counts_per_sec == 0) return;
+
+    // Longer than the 32-bit counter can hold anyway; keeps the product in range
+    if (ns > LAPIC_ONESHOT_MAX_NS) ns = LAPIC_ONESHOT_MAX_NS;
+    uint64_t count = (ns * timer_counts_per_sec) / 1000000000ULL;
+    if (count == 0) count = 1;
+    if (count > 0xFFFFFFFF) count = 0xFFFFFFFF;
+
+    lapic_write(LAPIC_REG_TIMER_DIV, LAPIC_TIMER_DIV_16);
+    lapic_write(LAPIC_REG_TIMER, LAPIC_TIMER_ONESHOT | LAPIC_TIMER_VECTOR);
+    lapic_write(LAPIC_REG_TIMER_INIT, (uint32_t)count);
+    core_tick_hz[this_cpu_id()] = 0;
+}
+
+void lapic_timer_stop() {
+    if (!lapic_ready) return;
+    lapic_write(LAPIC_REG_TIMER, LAPIC_LVT_MASKED | LAPIC_TIMER_VECTOR);
+    lapic_write(LAPIC_REG_TIMER_INIT, 0);
+    core_tick_hz[this_cpu_id()] = 0;
+}
+
+uint32_t lapic_timer_hz() {
+    return core_tick_hz[this_cpu_id()];
+}
@@ -0,0 +1,62 @@
+#ifndef LAPIC_H
+#define LAPIC_H
+
+#include <cstdint>
+
+// Vectors above the remapped PIC range (0x20-0x2F) and the device
+// range handed out by irq.cpp (0x30-0x4F)
+#define LAPIC_TIMER_VECTOR       0xEF
+#define IPI_CALL_VECTOR          0xF0   // smp_call_function() mailbox
+#define IPI_RESCHEDULE_VECTOR    0xF1
+#define LAPIC_SPURIOUS_VECTOR    0xFF
+
+// Enable the BSP's Local APIC, in x2APIC mode if the CPU supports it.
+// Keeps LINT0 in ExtINT mode so the legacy PIC keeps delivering IRQs
+// (virtual wire mode) for lines the IOAPIC does not take over.
+void lapic_init();
+
+// Enable the Local APIC of the calling AP. LINT0/LINT1 stay masked.
+void lapic_init_ap();
+
+// True once the BSP's Local APIC is enabled and IPIs can be sent
+bool lapic_is_ready();
+
+uint32_t lapic_get_id();
+
+bool lapic_is_x2apic();
+
+// APIC ID of a core (gdt core id). False until that core has run
+// lapic_init()/lapic_init_ap().
+bool lapic_core_apic_id(int core, uint32_t* apic_id);
+
+// Signal end of interrupt for a LAPIC delivered vector (IPIs, IOAPIC
+// and MSI device interrupts)
+void lapic_eoi();
+
+// Send a fixed IPI to one core
+void lapic_send_ipi(uint32_t apic_id, uint8_t vector);
+
+// Send a fixed IPI to every core except the caller
+void lapic_broadcast_ipi(uint8_t vector);
+
+// Send an NMI to every core except the caller (panic stop)
+void lapic_broadcast_nmi();
+
+// Measures the LAPIC timer rate against the TSC. BSP only, once, after
+// timer_init().
+void lapic_timer_calibrate();
+
+// Periodic interrupt on LAPIC_TIMER_VECTOR at the given rate on the
+// calling core. Needs lapic_timer_calibrate() first.
+void lapic_timer_start(uint32_t hz);
+
+// Single LAPIC_TIMER_VECTOR interrupt ns from now on the calling core.
+// Replaces the periodic tick until lapic_timer_start() is called again.
+void lapic_timer_oneshot(uint64_t ns);
+
+void lapic_timer_stop();
+
+// Periodic rate of the calling core's timer, 0 if it isn't ticking
+uint32_t lapic_timer_hz();
+
+#endif
@@ -36,4 +36,15 @@ static inline void cli() { asm volatile("cli"); }
 static inline void sti() { asm volatile("sti"); }
 static inline void hlt() { asm volatile("hlt"); }
 
+// Model Specific Registers
+static inline std::uint64_t rdmsr(std::uint32_t msr) {
+    std::uint32_t lo, hi;
+    asm volatile ( "rdmsr" : "=a"(lo), "=d"(hi) : "c"(msr) );
+    return ((std::uint64_t)hi << 32) | lo;
+}
+
+static inline void wrmsr(std::uint32_t msr, std::uint64_t val) {
+    asm volatile ( "wrmsr" : : "c"(msr), "a"((std::uint32_t)val), "d"((std::uint32_t)(val >> 32)) );
+}
+
 #endif
\ No newline at end of file
@@ -52,15 +52,10 @@ void ElfLoader::load_and_run(const char* filename, int argc, char** argv) {
     uint32_t text_pages = (hdr->text_len + 4095) / 4096;
     if (text_pages == 0) text_pages = 1;
     
-    for(uint32_t i=0; i<text_pages; i++) {
-        void* phys = pmm_alloc(1);
-        if (!phys) { printf("LOADER: OOM Physical.\n"); free(file_buffer); return; }
-        
-        // CRITICAL FIX: PTE_RW is required to copy the code into place.
-        // For simplicity, we leave it writable.
-        vmm_map_page(text_vaddr + i*4096, (uint64_t)phys, PTE_PRESENT | PTE_RW | PTE_USER);
-        memset((void*)(text_vaddr + i*4096), 0, 4096);
-    }
+    // CRITICAL FIX: PTE_RW is required to copy the code into place.
+    // For simplicity, we leave it writable.
+    // Reserved pages read as zero; the copy below faults in real frames.
+    vmm_reserve_range(text_vaddr, text_pages * 4096, PTE_PRESENT | PTE_RW | PTE_USER);
     
     // Copy Text from file buffer
     // Offset in file = sizeof(CXEHeader)
@@ -73,11 +68,7 @@ void ElfLoader::load_and_run(const char* filename, int argc, char** argv) {
     uint32_t data_pages = (hdr->data_len + 4095) / 4096;
     if (data_pages == 0) data_pages = 1;
     
-    for(uint32_t i=0; i<data_pages; i++) {
-        void* phys = pmm_alloc(1);
-        vmm_map_page(data_vaddr + i*4096, (uint64_t)phys, PTE_PRESENT | PTE_RW | PTE_USER);
-        memset((void*)(data_vaddr + i*4096), 0, 4096);
-    }
+    vmm_reserve_range(data_vaddr, data_pages * 4096, PTE_PRESENT | PTE_RW | PTE_USER);
     
     // Copy Data from file buffer
     // Offset in file = sizeof(CXEHeader) + hdr->text_len
@@ -87,12 +78,9 @@ void ElfLoader::load_and_run(const char* filename, int argc, char** argv) {
     
     // 5. Setup User Stack at 0x70000000 (grows down from 0x70008000)
     uint64_t stack_base = 0x70000000;
+    // Only the pages the program actually touches get a frame
     uint64_t stack_pages = 8;
-    for(uint64_t i=0; i<stack_pages; i++) {
-        void* phys = pmm_alloc(1);
-        vmm_map_page(stack_base + i*4096, (uint64_t)phys, PTE_PRESENT | PTE_RW | PTE_USER);
-        memset((void*)(stack_base + i*4096), 0, 4096);
-    }
+    vmm_reserve_range(stack_base, stack_pages * 4096, PTE_PRESENT | PTE_RW | PTE_USER);
     
     // Stack Top (16-byte aligned)
     uint64_t stack_top = stack_base + (stack_pages * 4096);
@@ -63,10 +63,7 @@ void HighLoader::load_and_run(const char* filename) {
     uint64_t stack_top = virt_base; 
     uint64_t stack_bottom = stack_top - (4 * 4096);
     
-    for (uint64_t addr = stack_bottom; addr < stack_top; addr += 4096) {
-        void* s_phys = pmm_alloc(1);
-        vmm_map_page(addr, (uint64_t)s_phys, PTE_PRESENT | PTE_RW | PTE_USER);
-    }
+    vmm_reserve_range(stack_bottom, stack_top - stack_bottom, PTE_PRESENT | PTE_RW | PTE_USER);
 
     printf("LOADER: Launching...\n");
     
@@ -41,11 +41,8 @@ void RawLoader::load_and_run(const char* filename, int argc, char** argv) {
     
     // 3. Map Executable Kernel Memory
     // 16 pages (64KB) at KERNEL_PROG_BASE, RWX (0x03 in Kernel implies RW, NX absent implies X)
-    for(int i=0; i<16; i++) {
-        void* phys = pmm_alloc(1);
-        vmm_map_page(KERNEL_PROG_BASE + (i * 4096), (uint64_t)phys, 0x03); 
-        memset((void*)(KERNEL_PROG_BASE + (i * 4096)), 0, 4096);
-    }
+    // Reserved zero-filled; frames arrive as the copy below writes them
+    vmm_reserve_range(KERNEL_PROG_BASE, 16 * 4096, 0x03);
     
     // 4. Copy Code (Skip header)
     memcpy((void*)KERNEL_PROG_BASE, buffer + 16, max_size - 16);
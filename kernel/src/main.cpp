@@ -17,14 +17,21 @@
 #include "interrupts/idt.h"
 #include "interrupts/gdt.h" 
 #include "interrupts/pic.h"
+#include "interrupts/lapic.h"
+#include "interrupts/ioapic.h"
+#include "acpi/acpi.h"
 #include "drv/ps2/ps2_kbd.h"
 #include "drv/ps2/ps2_mouse.h"
 #include "drv/usb/xhci.h" 
 #include "drv/storage/ahci.h"
 #include "fs/fat32.h"
+#include "fs/bcache.h"
 #include "smp/smp.h" 
 #include "sys/system_stats.h" 
 #include "sys/raw_panic.h" 
+#include "sys/percpu.h"
+#include "sys/idle.h"
+#include "sys/sched.h"
 #include "timer.h"
 
 #include "drv/input/elan_touch.h"
@@ -106,6 +113,8 @@ static void kernel_ui_update_wrapper() {
 
 extern "C" void kmain() {
     enable_sse();
+    // Before anything takes a lock: Spinlock reads the current thread through GS
+    percpu_init_bsp();
     if (LIMINE_BASE_REVISION_SUPPORTED(limine_base_revision) == false) hcf();
     for (std::size_t i = 0; &__init_array[i] != __init_array_end; i++) __init_array[i]();
     if (framebuffer_request.response == nullptr || framebuffer_request.response->framebuffer_count < 1) hcf();
@@ -125,8 +134,15 @@ extern "C" void kmain() {
 
     g_renderer = new Renderer(framebuffer, g_zap_font); 
     g_console = new Console(g_renderer);
+    pmm_self_test();
+    vmm_self_test();
 
     pic_init();
+    bool have_acpi = acpi_init();
+    timer_init(); // TSC against the HPET/PIT, before anything derives delays from it
+    lapic_init(); // Before the APs come up, they need it for TLB shootdowns
+    if (have_acpi) ioapic_init(); // ISA IRQs move off the 8259 if there is an IOAPIC
+
     ps2_init();       
     SystemStats::getInstance().service_ps2_active = true;
     
@@ -136,12 +152,17 @@ extern "C" void kmain() {
     asm volatile ("sti");
     g_using_interrupts = true; 
 
+    idle_init();
+    sched_init(); // kmain becomes a thread; APs join as they come up
     smp_init();
 
     if (AhciDriver::getInstance().init()) {
         SystemStats::getInstance().service_ahci_active = true;
         g_sata_port = AhciDriver::getInstance().findFirstSataPort();
-        if (g_sata_port != -1) Fat32::getInstance().init(g_sata_port);
+        if (g_sata_port != -1) {
+            BlockCache::getInstance().init();
+            Fat32::getInstance().init(g_sata_port);
+        }
     }
     
     WindowManager::getInstance().init(g_renderer->getWidth(), g_renderer->getHeight());
@@ -156,25 +177,22 @@ extern "C" void kmain() {
     // Initial Render
     WindowManager::getInstance().render(g_renderer);
 
-    // Frame Limiter Variables
-    uint64_t last_tick = rdtsc_serialized();
-    uint64_t cpu_freq = get_cpu_frequency();
-    if (cpu_freq == 0) cpu_freq = 2000000000; // Fallback
-    uint64_t ticks_per_frame = cpu_freq / 60; // 60 FPS
+    // Frame Limiter: sleep until the next frame is due instead of spinning
+    const uint64_t frame_ns = 1000000000ULL / 60; // 60 FPS
+    uint64_t next_frame = clock_ns();
 
     while (true) {
         // Non-blocking Input Check (PS/2 Buffer)
         check_input_hooks(); 
-        SystemStats::getInstance().cpu_ticks[0]++;
         
-        // Frame Limiter
-        uint64_t now = rdtsc_serialized();
-        if (now - last_tick >= ticks_per_frame) {
-            last_tick = now;
+        uint64_t now = clock_ns();
+        if (now >= next_frame) {
+            // Don't try to catch up on frames missed while busy
+            next_frame = (now - next_frame > frame_ns) ? now + frame_ns : next_frame + frame_ns;
             // Force UI update at 60Hz
             kernel_ui_update_wrapper();
         } else {
-            asm volatile("pause");
+            sleep_until_ns(next_frame);
         }
     }
-}   
\ No newline at end of file
+}   
@@ -0,0 +1,132 @@
+#include "dma.h"
+#include "pmm.h"
+#include "vmm.h"
+#include "../cppstd/stdio.h"
+#include "../cppstd/string.h"
+
+// Bump allocator over the uncached window. Freed uncached ranges are not
+// reused; uncached buffers are long-lived (pools, rings).
+static uint64_t dma_virt_next = DMA_VIRT_BASE;
+static Spinlock dma_virt_lock;
+
+bool dma_alloc(size_t size, size_t align, uint32_t flags, DmaBuffer* out) {
+    if (size == 0) return false;
+
+    size_t pages = (size + PAGE_SIZE - 1) / PAGE_SIZE;
+    // Buddy blocks are aligned to their own size: ask for enough pages
+    // that the block covers the alignment
+    size_t align_pages = (align + PAGE_SIZE - 1) / PAGE_SIZE;
+    size_t alloc_pages = pages < align_pages ? align_pages : pages;
+
+    void* phys = pmm_alloc(alloc_pages);
+    if (!phys) return false;
+
+    uint64_t virt = (uint64_t)phys + g_hhdm_offset;
+    if (flags & DMA_UNCACHED) {
+        ScopedLock lock(dma_virt_lock);
+        if (dma_virt_next + alloc_pages * PAGE_SIZE > DMA_VIRT_BASE + DMA_VIRT_SIZE) {
+            pmm_free(phys, alloc_pages);
+            return false;
+        }
+        virt = dma_virt_next;
+        dma_virt_next += alloc_pages * PAGE_SIZE;
+        vmm_map_range(virt, (uint64_t)phys, alloc_pages * PAGE_SIZE,
+            PTE_PRESENT | PTE_RW | PTE_PCD | PTE_PWT | PTE_NX);
+    }
+
+    memset((void*)virt, 0, alloc_pages * PAGE_SIZE);
+
+    out->virt = (void*)virt;
+    out->phys = (uint64_t)phys;
+    out->size = alloc_pages * PAGE_SIZE;
+    return true;
+}
+
+void dma_free(DmaBuffer* buf) {
+    if (!buf || !buf->virt) return;
+
+    uint64_t virt = (uint64_t)buf->virt;
+    if (virt >= DMA_VIRT_BASE && virt < DMA_VIRT_BASE + DMA_VIRT_SIZE) {
+        vmm_unmap_range(virt, buf->size);
+    }
+    pmm_free((void*)buf->phys, buf->size / PAGE_SIZE);
+
+    buf->virt = nullptr;
+    buf->phys = 0;
+    buf->size = 0;
+}
+
+uint64_t dma_virt_to_phys(const void* virt) {
+    uint64_t addr = (uint64_t)virt;
+    if (addr >= DMA_VIRT_BASE && addr < DMA_VIRT_BASE + DMA_VIRT_SIZE) {
+        return vmm_virt_to_phys(addr);
+    }
+    return addr - g_hhdm_offset;
+}
+
+// --- Pools ---
+
+DmaPool::DmaPool()
+    : name("dma"), region{nullptr, 0, 0}, chunk_size(0), count(0),
+      in_use(0), peak_use(0), free_list(nullptr) {}
+
+bool DmaPool::init(const char* pool_name, size_t size, size_t align, size_t chunks, uint32_t flags) {
+    if (isReady() || chunks == 0) return false;
+
+    if (align < 16) align = 16;
+    size = (size + align - 1) & ~(align - 1);
+
+    if (!dma_alloc(size * chunks, align, flags, &region)) {
+        printf("DMA: Pool '%s' (%d x %d bytes) failed: OOM\n", pool_name, (int)chunks, (int)size);
+        return false;
+    }
+
+    name = pool_name;
+    chunk_size = size;
+    count = chunks;
+    in_use = 0;
+    peak_use = 0;
+
+    // Thread the free list through the chunks, lowest address first
+    free_list = nullptr;
+    for (size_t i = chunks; i-- > 0;) {
+        FreeChunk* chunk = (FreeChunk*)((uint8_t*)region.virt + i * size);
+        chunk->next = free_list;
+        free_list = chunk;
+    }
+    return true;
+}
+
+void DmaPool::destroy() {
+    ScopedLock guard(lock);
+    dma_free(&region);
+    free_list = nullptr;
+    count = in_use = 0;
+}
+
+bool DmaPool::alloc(DmaBuffer* out) {
+    FreeChunk* chunk;
+    {
+        ScopedLock guard(lock);
+        chunk = free_list;
+        if (!chunk) return false;
+        free_list = chunk->next;
+        in_use++;
+        if (in_use > peak_use) peak_use = in_use;
+    }
+
+    out->virt = chunk;
+    out->phys = region.phys + ((uint8_t*)chunk - (uint8_t*)region.virt);
+    out->size = chunk_size;
+    return true;
+}
+
+void DmaPool::free(void* virt) {
+    if (!virt) return;
+    FreeChunk* chunk = (FreeChunk*)virt;
+
+    ScopedLock guard(lock);
+    chunk->next = free_list;
+    free_list = chunk;
+    in_use--;
+}
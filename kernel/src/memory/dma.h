@@ -0,0 +1,76 @@
+#ifndef DMA_H
+#define DMA_H
+
+#include <cstdint>
+#include <cstddef>
+#include "../sys/spinlock.h"
+
+// Physically contiguous memory for device DMA.
+// Buffers come as virt/phys pairs so drivers never do address math.
+// Cached buffers live in the HHDM; uncached ones (DMA_UNCACHED) get their
+// own PCD|PWT mapping in the DMA window (the HHDM alias stays write-back,
+// so never touch an uncached buffer through it).
+
+#define DMA_UNCACHED (1 << 0)
+
+#define DMA_VIRT_BASE 0xFFFFA00100000000ULL
+#define DMA_VIRT_SIZE 0x0000000100000000ULL // 4 GB of window
+
+struct DmaBuffer {
+    void* virt;
+    uint64_t phys;
+    size_t size;
+};
+
+// One-off allocation straight from the PMM (rings, tables, pool backing).
+// size is rounded up to whole pages; align may be up to the rounded size
+// (buddy blocks are naturally aligned). Memory is zeroed.
+bool dma_alloc(size_t size, size_t align, uint32_t flags, DmaBuffer* out);
+void dma_free(DmaBuffer* buf);
+
+// Physical address of any byte inside a buffer from this module
+uint64_t dma_virt_to_phys(const void* virt);
+
+// Fixed-size chunks pre-carved from one contiguous block.
+// alloc/free are a spinlock and a list pop/push: the PMM is only touched
+// when the pool is created, so hot I/O paths stay off pmm_lock.
+class DmaPool {
+public:
+    DmaPool();
+
+    // chunk_size is rounded up to align (at least 16 bytes)
+    bool init(const char* name, size_t chunk_size, size_t align, size_t count, uint32_t flags = 0);
+    void destroy();
+
+    // Returns false when the pool is exhausted (buffer left untouched)
+    bool alloc(DmaBuffer* out);
+    void free(void* virt);
+    void free(const DmaBuffer& buf) { free(buf.virt); }
+
+    // True if virt is a chunk of this pool
+    bool owns(const void* virt) const {
+        uint64_t addr = (uint64_t)virt, base = (uint64_t)region.virt;
+        return region.virt && addr >= base && addr < base + chunk_size * count;
+    }
+
+    bool isReady() const { return region.virt != nullptr; }
+    size_t chunkSize() const { return chunk_size; }
+    size_t inUse() const { return in_use; }
+    size_t peak() const { return peak_use; }
+    size_t capacity() const { return count; }
+    const char* getName() const { return name; }
+
+private:
+    struct FreeChunk { FreeChunk* next; };
+
+    const char* name;
+    DmaBuffer region;
+    size_t chunk_size;
+    size_t count;
+    size_t in_use;
+    size_t peak_use;
+    FreeChunk* free_list;
+    Spinlock lock;
+};
+
+#endif
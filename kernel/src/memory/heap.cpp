@@ -4,177 +4,700 @@
 #include "../cppstd/stdio.h"
 #include "../cppstd/string.h"
 #include "../sys/spinlock.h"
+#include "../timer.h"
 
 #define HEAP_MAGIC 0xC0FFEE
 #define HEAP_INITIAL_PAGES 16 
 
-struct HeapHeader {
-    size_t length; 
-    HeapHeader* next;
-    HeapHeader* prev;
-    bool is_free;
+// --- Layout ---
+// The heap is a run of page-granular spans growing up from HEAP_START_ADDR.
+// Every span starts with a SpanHeader and is one of:
+//   FREE  - pages waiting to be handed out again
+//   SLAB  - carved into equal objects of one size class (16..2048 bytes)
+//   LARGE - a single allocation bigger than the largest class
+// The page map (one SpanHeader* per heap page) finds the owner of any
+// pointer in O(1). FREE and LARGE spans only keep their first and last
+// entries current; SLAB spans fill every entry since objects sit on any page.
+
+enum SpanKind : uint16_t {
+    SPAN_FREE = 0,
+    SPAN_SLAB = 1,
+    SPAN_LARGE = 2
+};
+
+struct SpanHeader {
     uint32_t magic; 
+    SpanKind kind;
+    uint16_t size_class;
+    size_t pages;
+    SpanHeader* next;
+    SpanHeader* prev;
+    void* free_objects;   // SLAB: singly linked list of free objects
+    uint32_t in_use;      // SLAB: objects handed out
+    uint32_t capacity;    // SLAB: objects in this span
+    bool decommitted;     // FREE: only the header page is still mapped
+} __attribute__((aligned(16)));
+
+#define SPAN_HEADER_SIZE sizeof(SpanHeader)
+
+// --- Size Classes ---
+#define NUM_CLASSES 24
+#define MAX_SMALL_SIZE 2048
+#define SLAB_TARGET_OBJECTS 8
+
+static const uint16_t class_sizes[NUM_CLASSES] = {
+    16, 32, 48, 64, 80, 96, 112, 128,
+    160, 192, 224, 256, 320, 384, 448, 512,
+    640, 768, 896, 1024, 1280, 1536, 1792, 2048
 };
 
-static HeapHeader* first_block = nullptr;
+struct SizeClass {
+    Spinlock lock;
+    SpanHeader* partial;      // Slabs with at least one free object
+    uint32_t partial_count;
+    uint32_t slab_pages;
+};
+
+static SizeClass classes[NUM_CLASSES];
+static uint8_t size_to_class[MAX_SMALL_SIZE / 16 + 1];
+
+// --- Page Heap ---
+// Free spans are bucketed by exact page count; bucket 0 holds
+// everything of FREE_BUCKETS pages or more. Decommitted spans (frames
+// already returned to the PMM) sit on their own list and are only used
+// when no backed span fits.
+#define FREE_BUCKETS 128
+
+// Trimming hysteresis: once more than HIGH backed pages sit free, give
+// frames back to the PMM until only LOW remain.
+#define HEAP_TRIM_HIGH 1024
+#define HEAP_TRIM_LOW  256
+
+static SpanHeader* free_spans[FREE_BUCKETS];
+static SpanHeader* decommitted_spans = nullptr;
+static size_t free_backed_pages = 0;
+static SpanHeader** page_map = (SpanHeader**)HEAP_PAGEMAP_ADDR;
+static uint64_t page_map_end = HEAP_PAGEMAP_ADDR;
 static uint64_t heap_end_virt = HEAP_START_ADDR;
-static Spinlock heap_lock;
+static TicketLock page_lock("heap pages");
+
+static size_t heap_used_bytes = 0;
+static size_t heap_mapped_pages = 0;
+static uint64_t heap_reclaimed_bytes = 0;
 
 static size_t align_up(size_t n, size_t align) {
     return (n + align - 1) & ~(align - 1);
 }
 
-static void heap_expand(size_t size_needed) {
-    size_t pages_needed = (size_needed + PAGE_SIZE - 1) / PAGE_SIZE;
-    if (pages_needed == 0) pages_needed = 1;
+static uint64_t page_index(const void* addr) {
+    return ((uint64_t)addr - HEAP_START_ADDR) / PAGE_SIZE;
+}
+
+static uint64_t heap_pages() {
+    return (heap_end_virt - HEAP_START_ADDR) / PAGE_SIZE;
+}
+
+static void map_span_edges(SpanHeader* span) {
+    uint64_t first = page_index(span);
+    page_map[first] = span;
+    page_map[first + span->pages - 1] = span;
+}
+
+static void map_span_all(SpanHeader* span) {
+    uint64_t first = page_index(span);
+    for (size_t i = 0; i < span->pages; i++) page_map[first + i] = span;
+}
+
+static int bucket_for(size_t pages) {
+    return pages < FREE_BUCKETS ? (int)pages : 0;
+}
+
+static SpanHeader** free_list_for(SpanHeader* span) {
+    if (span->decommitted) return &decommitted_spans;
+    return &free_spans[bucket_for(span->pages)];
+}
+
+static void free_list_push(SpanHeader* span) {
+    SpanHeader** head = free_list_for(span);
+    span->prev = nullptr;
+    span->next = *head;
+    if (span->next) span->next->prev = span;
+    *head = span;
+    if (!span->decommitted) free_backed_pages += span->pages;
+}
+
+static void free_list_remove(SpanHeader* span) {
+    if (span->prev) span->prev->next = span->next;
+    else *free_list_for(span) = span->next;
+    if (span->next) span->next->prev = span->prev;
+    span->next = span->prev = nullptr;
+    if (!span->decommitted) free_backed_pages -= span->pages;
+}
+
+static void span_insert_free(SpanHeader* span) {
+    span->magic = HEAP_MAGIC;
+    span->kind = SPAN_FREE;
+    map_span_edges(span);
+    free_list_push(span);
+}
+
+// When two decommitted spans merge, the absorbed header page is the only
+// mapped page left in the middle. Give its frame back as well.
+static void drop_header_page(SpanHeader* header) {
+    vmm_unmap_and_free((uint64_t)header, PAGE_SIZE);
+    heap_mapped_pages--;
+    heap_reclaimed_bytes += PAGE_SIZE;
+}
+
+static bool can_merge(SpanHeader* span, SpanHeader* other) {
+    return other && other->magic == HEAP_MAGIC && other->kind == SPAN_FREE &&
+           other->decommitted == span->decommitted;
+}
+
+// Returns a span to the page heap, merging it with free neighbours
+// in the same backing state. Caller holds page_lock.
+static void span_release(SpanHeader* span) {
+    uint64_t first = page_index(span);
+
+    if (first > 0) {
+        SpanHeader* prev = page_map[first - 1];
+        if (can_merge(span, prev)) {
+            free_list_remove(prev);
+            prev->pages += span->pages;
+            span->magic = 0;
+            if (span->decommitted) drop_header_page(span);
+            span = prev;
+            first = page_index(span);
+        }
+    }
+
+    uint64_t next_page = first + span->pages;
+    if (next_page < heap_pages()) {
+        SpanHeader* next = page_map[next_page];
+        if (can_merge(span, next)) {
+            free_list_remove(next);
+            span->pages += next->pages;
+            next->magic = 0;
+            if (next->decommitted) drop_header_page(next);
+        }
+    }
+
+    span_insert_free(span);
+}
+
+// Makes sure the page map has entries for 'pages' heap pages.
+static bool page_map_reserve(uint64_t pages) {
+    uint64_t needed = HEAP_PAGEMAP_ADDR + align_up(pages * sizeof(SpanHeader*), PAGE_SIZE);
+    while (page_map_end < needed) {
+        void* phys = pmm_alloc(1); 
+        if (!phys) return false;
+        vmm_map_page(page_map_end, (uint64_t)phys, PTE_PRESENT | PTE_RW | PTE_NX);
+        memset((void*)page_map_end, 0, PAGE_SIZE);
+        page_map_end += PAGE_SIZE;
+    }
+    return true;
+}
 
-    for (size_t i = 0; i < pages_needed; i++) {
+// Backs [virt, virt + pages) with fresh frames. Whole 2MB windows get a
+// 2MB buddy block mapped as one huge page (large back buffers then cost a
+// single TLB entry); everything else is mapped page by page. Stops early
+// on OOM and returns how many pages were mapped.
+static size_t heap_map_fresh(uint64_t virt, size_t pages) {
+    const size_t huge_pages = PAGE_SIZE_2M / PAGE_SIZE;
+    size_t mapped = 0;
+    while (mapped < pages) {
+        if ((virt & (PAGE_SIZE_2M - 1)) == 0 && pages - mapped >= huge_pages) {
+            void* phys = pmm_alloc(huge_pages);
+            if (phys) {
+                vmm_map_range(virt, (uint64_t)phys, PAGE_SIZE_2M, PTE_PRESENT | PTE_RW | PTE_NX);
+                virt += PAGE_SIZE_2M;
+                mapped += huge_pages;
+                continue;
+            }
+        }
         void* phys = pmm_alloc(1); 
-        if (!phys) return; 
-        vmm_map_page(heap_end_virt, (uint64_t)phys, PTE_PRESENT | PTE_RW | PTE_NX);
-        heap_end_virt += PAGE_SIZE;
+        if (!phys) break;
+        vmm_map_page(virt, (uint64_t)phys, PTE_PRESENT | PTE_RW | PTE_NX);
+        virt += PAGE_SIZE;
+        mapped++;
     }
+    return mapped;
+}
 
-    HeapHeader* new_block = nullptr;
-    if (!first_block) {
-        new_block = (HeapHeader*)HEAP_START_ADDR;
-        new_block->prev = nullptr;
-        first_block = new_block;
-    } else {
-        HeapHeader* current = first_block;
-        while (current->next) current = current->next;
-        new_block = (HeapHeader*)((uint8_t*)current + sizeof(HeapHeader) + current->length);
-        current->next = new_block;
-        new_block->prev = current;
+// Maps fresh pages at the top of the heap and adds them as a free span.
+// Caller holds page_lock.
+static bool heap_expand(size_t pages_needed) {
+    if (pages_needed < HEAP_INITIAL_PAGES) pages_needed = HEAP_INITIAL_PAGES;
+    // Big growth ends on a 2MB boundary so every full window can be a huge page
+    if (pages_needed >= PAGE_SIZE_2M / PAGE_SIZE) {
+        uint64_t end = align_up(heap_end_virt + pages_needed * PAGE_SIZE, PAGE_SIZE_2M);
+        pages_needed = (end - heap_end_virt) / PAGE_SIZE;
     }
+    if (heap_end_virt + pages_needed * PAGE_SIZE > HEAP_START_ADDR + HEAP_MAX_SIZE) return false;
+    if (!page_map_reserve(heap_pages() + pages_needed)) return false;
+
+    uint64_t start = heap_end_virt;
+    size_t mapped = heap_map_fresh(start, pages_needed);
+    if (mapped == 0) return false;
+    heap_end_virt += mapped * PAGE_SIZE;
+    heap_mapped_pages += mapped;
 
-    new_block->length = (pages_needed * PAGE_SIZE) - sizeof(HeapHeader);
-    new_block->next = nullptr;
-    new_block->is_free = true;
-    new_block->magic = HEAP_MAGIC;
+    SpanHeader* span = (SpanHeader*)start;
+    span->pages = mapped;
+    span->decommitted = false;
+    span_release(span);
+    return mapped == pages_needed;
 }
 
-void heap_init() {
-    ScopedLock lock(heap_lock);
-    heap_expand(HEAP_INITIAL_PAGES * PAGE_SIZE);
-    printf("HEAP: Initialized at %p\n", (void*)HEAP_START_ADDR);
+static SpanHeader* find_free_span(size_t pages) {
+    for (size_t b = pages; b < FREE_BUCKETS; b++) {
+        if (free_spans[b]) return free_spans[b];
+    }
+    for (SpanHeader* s = free_spans[0]; s; s = s->next) {
+        if (s->pages >= pages) return s;
+    }
+    for (SpanHeader* s = decommitted_spans; s; s = s->next) {
+        if (s->pages >= pages) return s;
+    }
+    return nullptr;
 }
 
-static void split_block(HeapHeader* block, size_t size) {
-    size_t remaining = block->length - size - sizeof(HeapHeader);
-    if (remaining > 32) {
-        HeapHeader* new_split = (HeapHeader*)((uint8_t*)block + sizeof(HeapHeader) + size);
-        new_split->length = remaining;
-        new_split->is_free = true;
-        new_split->magic = HEAP_MAGIC;
-        new_split->next = block->next;
-        new_split->prev = block;
-        if (block->next) block->next->prev = new_split;
-        block->next = new_split;
-        block->length = size;
+// Maps fresh frames behind pages [from, to) of a span. Undoes itself on OOM.
+static bool span_commit(SpanHeader* span, size_t from, size_t to) {
+    uint64_t base = (uint64_t)span;
+    size_t mapped = heap_map_fresh(base + from * PAGE_SIZE, to - from);
+    if (mapped < to - from) {
+        vmm_unmap_and_free(base + from * PAGE_SIZE, mapped * PAGE_SIZE);
+        return false;
     }
+    heap_mapped_pages += to - from;
+    return true;
 }
 
-static void coalesce(HeapHeader* block) {
-    if (block->next && block->next->is_free) {
-        block->length += sizeof(HeapHeader) + block->next->length;
-        block->next = block->next->next;
-        if (block->next) block->next->prev = block;
+// Takes a free span off its list and cuts it down to 'pages', backing any
+// decommitted pages handed out. The remainder goes back as a free span.
+static bool span_take(SpanHeader* span, size_t pages) {
+    bool split = span->pages > pages;
+    if (span->decommitted) {
+        // Page 0 is always mapped. The remainder needs its header page too.
+        if (!span_commit(span, 1, split ? pages + 1 : span->pages)) return false;
     }
-    if (block->prev && block->prev->is_free) {
-        block->prev->length += sizeof(HeapHeader) + block->length;
-        block->prev->next = block->next;
-        if (block->next) block->next->prev = block->prev;
+
+    free_list_remove(span);
+    if (split) {
+        SpanHeader* rest = (SpanHeader*)((uint8_t*)span + pages * PAGE_SIZE);
+        rest->pages = span->pages - pages;
+        rest->decommitted = span->decommitted && rest->pages > 1;
+        span_insert_free(rest);
+        span->pages = pages;
     }
+    span->decommitted = false;
+    return true;
 }
 
-void* malloc(size_t size) {
-    ScopedLock lock(heap_lock); 
-    if (size == 0) return nullptr;
-    size = align_up(size, 16);
+// Carves 'pages' pages out of the page heap, growing it if needed.
+static SpanHeader* span_alloc(size_t pages, SpanKind kind) {
+    ScopedIrqLock lock(page_lock);
 
-    HeapHeader* current = first_block;
-    int safety_loop = 0;
+    SpanHeader* span = find_free_span(pages);
+    if (!span) {
+        heap_expand(pages);
+        span = find_free_span(pages);
+        if (!span) return nullptr;
+    }
+    if (!span_take(span, pages)) return nullptr;
 
-    while (current) {
-        // FIX: Detect circular loops or infinite walks caused by corruption
-        if (safety_loop++ > 100000) {
-            // Break loop to avoid freeze, return null
-            return nullptr; 
-        }
+    span->magic = HEAP_MAGIC;
+    span->kind = kind;
+    if (kind == SPAN_SLAB) map_span_all(span);
+    else map_span_edges(span);
+    return span;
+}
 
-        if (current->magic != HEAP_MAGIC) return nullptr;
+// --- Trimming ---
 
-        if (current->is_free && current->length >= size) {
-            current->is_free = false;
-            split_block(current, size);
-            return (void*)((uint8_t*)current + sizeof(HeapHeader));
-        }
-        
-        if (current->next == nullptr) {
-            heap_expand(size + sizeof(HeapHeader));
+// Unmaps a free span and returns its frames to the PMM. The header page
+// stays mapped for bookkeeping, unless the span is the top of the heap,
+// in which case the heap simply shrinks. Caller holds page_lock.
+static size_t span_decommit(SpanHeader* span) {
+    uint64_t base = (uint64_t)span;
+    size_t pages = span->pages;
+    bool at_tail = page_index(span) + pages == heap_pages();
+
+    free_list_remove(span);
+
+    size_t keep = at_tail ? 0 : 1;
+    vmm_unmap_and_free(base + keep * PAGE_SIZE, (pages - keep) * PAGE_SIZE);
+    size_t released = pages - keep;
+    heap_mapped_pages -= released;
+    heap_reclaimed_bytes += released * PAGE_SIZE;
+
+    if (at_tail) {
+        heap_end_virt = base;
+    } else {
+        span->decommitted = true;
+        span_release(span);
+    }
+    return released;
+}
+
+// Decommits free spans, largest first, until at most 'keep_pages'
+// backed free pages remain. Caller holds page_lock.
+static size_t heap_trim_locked(size_t keep_pages) {
+    size_t released = 0;
+    int b = 0; // Bucket 0 holds the biggest spans
+    while (free_backed_pages > keep_pages) {
+        SpanHeader* span = free_spans[b];
+        if (!span) {
+            // Single-page spans release nothing themselves, but turning them
+            // into decommitted spans lets their neighbours merge across them
+            b = (b == 0) ? FREE_BUCKETS - 1 : b - 1;
+            if (b < 1) break;
+            continue;
         }
-        
-        current = current->next;
+        released += span_decommit(span);
     }
-    return nullptr;
+    return released;
+}
+
+// Called after pages come back to the page heap. Caller holds page_lock.
+static void heap_maybe_trim() {
+    if (free_backed_pages > HEAP_TRIM_HIGH) heap_trim_locked(HEAP_TRIM_LOW);
+}
+
+// --- Slabs ---
+
+static void partial_push(SizeClass& sc, SpanHeader* span) {
+    span->prev = nullptr;
+    span->next = sc.partial;
+    if (span->next) span->next->prev = span;
+    sc.partial = span;
+    sc.partial_count++;
+}
+
+static void partial_remove(SizeClass& sc, SpanHeader* span) {
+    if (span->prev) span->prev->next = span->next;
+    else sc.partial = span->next;
+    if (span->next) span->next->prev = span->prev;
+    span->next = span->prev = nullptr;
+    sc.partial_count--;
+}
+
+static SpanHeader* slab_create(int cls) {
+    SizeClass& sc = classes[cls];
+    SpanHeader* span = span_alloc(sc.slab_pages, SPAN_SLAB);
+    if (!span) return nullptr;
+
+    size_t size = class_sizes[cls];
+    span->size_class = (uint16_t)cls;
+    span->in_use = 0;
+    span->capacity = (uint32_t)((span->pages * PAGE_SIZE - SPAN_HEADER_SIZE) / size);
+
+    // Thread the free list through the objects, lowest address first
+    uint8_t* base = (uint8_t*)span + SPAN_HEADER_SIZE;
+    span->free_objects = nullptr;
+    for (uint32_t i = span->capacity; i > 0; i--) {
+        void* obj = base + (i - 1) * size;
+        *(void**)obj = span->free_objects;
+        span->free_objects = obj;
+    }
+    return span;
+}
+
+static void* slab_alloc(int cls) {
+    SizeClass& sc = classes[cls];
+    ScopedIrqLock lock(sc.lock);
+
+    SpanHeader* span = sc.partial;
+    if (!span) {
+        span = slab_create(cls);
+        if (!span) return nullptr;
+        partial_push(sc, span);
+    }
+
+    void* obj = span->free_objects;
+    span->free_objects = *(void**)obj;
+    span->in_use++;
+    if (!span->free_objects) partial_remove(sc, span);
+
+    __atomic_fetch_add(&heap_used_bytes, class_sizes[cls], __ATOMIC_RELAXED);
+    return obj;
+}
+
+static void slab_free(SpanHeader* span, void* ptr) {
+    SizeClass& sc = classes[span->size_class];
+    ScopedIrqLock lock(sc.lock);
+
+    bool was_full = (span->free_objects == nullptr);
+    *(void**)ptr = span->free_objects;
+    span->free_objects = ptr;
+    span->in_use--;
+    if (was_full) partial_push(sc, span);
+
+    __atomic_fetch_sub(&heap_used_bytes, class_sizes[span->size_class], __ATOMIC_RELAXED);
+
+    // Keep one empty slab per class around so alloc/free pairs don't thrash
+    if (span->in_use == 0 && sc.partial_count > 1) {
+        partial_remove(sc, span);
+        ScopedIrqLock page_guard(page_lock);
+        span_release(span);
+        heap_maybe_trim();
+    }
+}
+
+// Finds the span owning a heap pointer, or nullptr if it isn't ours.
+static SpanHeader* span_of(void* ptr) {
+    uint64_t addr = (uint64_t)ptr;
+    if (addr < HEAP_START_ADDR || addr >= heap_end_virt) return nullptr;
+    SpanHeader* span = page_map[page_index(ptr)];
+    if (!span || span->magic != HEAP_MAGIC) return nullptr;
+    if (span->kind == SPAN_LARGE && addr != (uint64_t)span + SPAN_HEADER_SIZE) return nullptr;
+    return span;
+}
+
+static size_t usable_size(SpanHeader* span) {
+    if (span->kind == SPAN_SLAB) return class_sizes[span->size_class];
+    return span->pages * PAGE_SIZE - SPAN_HEADER_SIZE;
+}
+
+void heap_init() {
+    static_assert(sizeof(SpanHeader) % 16 == 0, "SpanHeader size must keep objects 16-byte aligned");
+
+    int cls = 0;
+    for (int i = 0; i <= MAX_SMALL_SIZE / 16; i++) {
+        while (class_sizes[cls] < i * 16) cls++;
+        size_to_class[i] = (uint8_t)cls;
+    }
+    for (int c = 0; c < NUM_CLASSES; c++) {
+        size_t bytes = SPAN_HEADER_SIZE + class_sizes[c] * SLAB_TARGET_OBJECTS;
+        classes[c].slab_pages = (uint32_t)(align_up(bytes, PAGE_SIZE) / PAGE_SIZE);
+    }
+
+    {
+        ScopedIrqLock lock(page_lock);
+        heap_expand(HEAP_INITIAL_PAGES);
+    }
+    printf("HEAP: Initialized at %p (%d size classes)\n", (void*)HEAP_START_ADDR, NUM_CLASSES);
+}
+
+void* malloc(size_t size) {
+    if (size == 0) return nullptr;
+
+    if (size <= MAX_SMALL_SIZE) {
+        return slab_alloc(size_to_class[(size + 15) / 16]);
+    }
+
+    size_t pages = align_up(size + SPAN_HEADER_SIZE, PAGE_SIZE) / PAGE_SIZE;
+    SpanHeader* span = span_alloc(pages, SPAN_LARGE);
+    if (!span) return nullptr;
+
+    __atomic_fetch_add(&heap_used_bytes, pages * PAGE_SIZE, __ATOMIC_RELAXED);
+    return (uint8_t*)span + SPAN_HEADER_SIZE;
 }
 
 void free(void* ptr) {
-    ScopedLock lock(heap_lock);
     if (!ptr) return;
-    HeapHeader* header = (HeapHeader*)((uint8_t*)ptr - sizeof(HeapHeader));
-    if (header->magic != HEAP_MAGIC) return;
-    header->is_free = true;
-    coalesce(header);
+    SpanHeader* span = span_of(ptr);
+    if (!span) return;
+
+    if (span->kind == SPAN_SLAB) {
+        slab_free(span, ptr);
+    } else if (span->kind == SPAN_LARGE) {
+        __atomic_fetch_sub(&heap_used_bytes, span->pages * PAGE_SIZE, __ATOMIC_RELAXED);
+        ScopedIrqLock lock(page_lock);
+        span_release(span);
+        heap_maybe_trim();
+    }
 }
 
 void* calloc(size_t num, size_t size) {
+    if (size && num > (size_t)-1 / size) return nullptr;
     size_t total = num * size;
     void* ptr = malloc(total);
     if (ptr) memset(ptr, 0, total);
     return ptr;
 }
 
+// Grows a LARGE span to 'pages' without moving it, by absorbing the free
+// span right behind it. A span at the top of the heap grows the heap instead.
+static bool span_grow(SpanHeader* span, size_t pages) {
+    ScopedIrqLock lock(page_lock);
+
+    uint64_t next_page = page_index(span) + span->pages;
+    size_t extra = pages - span->pages;
+
+    SpanHeader* next = nullptr;
+    if (next_page < heap_pages()) {
+        next = page_map[next_page];
+        if (!next || next->magic != HEAP_MAGIC || next->kind != SPAN_FREE) return false;
+    }
+
+    size_t available = next ? next->pages : 0;
+    if (available < extra) {
+        if (next_page + available != heap_pages()) return false;
+        // New tail pages merge into 'next' (or become it)
+        heap_expand(extra - available);
+        if (next_page >= heap_pages()) return false;
+        next = page_map[next_page];
+        if (next->kind != SPAN_FREE || next->pages < extra) return false;
+    }
+
+    if (!span_take(next, extra)) return false;
+    next->magic = 0;
+
+    span->pages = pages;
+    map_span_edges(span);
+    return true;
+}
+
+// Hands the pages past 'pages' back to the page heap.
+static void span_shrink(SpanHeader* span, size_t pages) {
+    ScopedIrqLock lock(page_lock);
+
+    SpanHeader* rest = (SpanHeader*)((uint8_t*)span + pages * PAGE_SIZE);
+    rest->pages = span->pages - pages;
+    rest->decommitted = false;
+    span->pages = pages;
+    map_span_edges(span);
+    span_release(rest);
+    heap_maybe_trim();
+}
+
+static uint64_t realloc_in_place = 0;
+static uint64_t realloc_moved = 0;
+
 void* realloc(void* ptr, size_t new_size) {
     if (!ptr) return malloc(new_size);
     if (new_size == 0) { free(ptr); return nullptr; }
 
-    heap_lock.lock();
-    HeapHeader* header = (HeapHeader*)((uint8_t*)ptr - sizeof(HeapHeader));
-    size_t current_len = header->length;
-    heap_lock.unlock();
+    SpanHeader* span = span_of(ptr);
+    if (!span) return nullptr;
+
+    size_t current_len = usable_size(span);
+
+    if (span->kind == SPAN_SLAB && new_size <= current_len) {
+        __atomic_fetch_add(&realloc_in_place, 1, __ATOMIC_RELAXED);
+        return ptr;
+    }
+
+    if (span->kind == SPAN_LARGE && new_size > MAX_SMALL_SIZE) {
+        size_t old_pages = span->pages;
+        size_t pages = align_up(new_size + SPAN_HEADER_SIZE, PAGE_SIZE) / PAGE_SIZE;
+        bool in_place = true;
 
-    if (current_len >= new_size) return ptr; 
+        if (pages < old_pages) span_shrink(span, pages);
+        else if (pages > old_pages) in_place = span_grow(span, pages);
 
+        if (in_place) {
+            if (pages > old_pages) __atomic_fetch_add(&heap_used_bytes, (pages - old_pages) * PAGE_SIZE, __ATOMIC_RELAXED);
+            else __atomic_fetch_sub(&heap_used_bytes, (old_pages - pages) * PAGE_SIZE, __ATOMIC_RELAXED);
+            __atomic_fetch_add(&realloc_in_place, 1, __ATOMIC_RELAXED);
+            return ptr;
+        }
+    }
+
+    // Different kind of block (or no room to grow): move it
     void* new_ptr = malloc(new_size);
     if (new_ptr) {
-        memcpy(new_ptr, ptr, current_len);
+        memcpy(new_ptr, ptr, current_len < new_size ? current_len : new_size);
         free(ptr);
+        __atomic_fetch_add(&realloc_moved, 1, __ATOMIC_RELAXED);
     }
     return new_ptr;
 }
 
 size_t heap_get_used() {
-    ScopedLock lock(heap_lock);
-    HeapHeader* curr = first_block;
-    size_t used = 0;
-    while (curr) {
-        if (!curr->is_free) used += curr->length;
-        used += sizeof(HeapHeader);
-        curr = curr->next;
-    }
-    return used;
+    return __atomic_load_n(&heap_used_bytes, __ATOMIC_RELAXED);
 }
 
 size_t heap_get_total() {
-    ScopedLock lock(heap_lock);
-    if (heap_end_virt <= HEAP_START_ADDR) return 0;
-    return heap_end_virt - HEAP_START_ADDR;
+    ScopedIrqLock lock(page_lock);
+    return heap_mapped_pages * PAGE_SIZE;
+}
+
+size_t heap_trim() {
+    ScopedIrqLock lock(page_lock);
+    return heap_trim_locked(0) * PAGE_SIZE;
+}
+
+uint64_t heap_get_reclaimed() {
+    ScopedIrqLock lock(page_lock);
+    return heap_reclaimed_bytes;
 }
 
 void heap_print_stats() { /* Debug only */ }
 
+// --- Realloc Microbenchmark ---
+// Compares realloc against the old "always malloc + copy + free" path
+// for the growth patterns our editors, compilers and browser produce.
+
+#define HEAP_BENCH_ROUNDS 8
+
+static void* copy_realloc(void* ptr, size_t old_size, size_t new_size) {
+    void* new_ptr = malloc(new_size);
+    if (new_ptr) {
+        memcpy(new_ptr, ptr, old_size < new_size ? old_size : new_size);
+        free(ptr);
+    }
+    return new_ptr;
+}
+
+// pattern 0: append 4 KB at a time up to 1 MB
+// pattern 1: double from 16 bytes up to 1 MB
+// pattern 2: two buffers appending 4 KB in turn up to 512 KB each
+static uint64_t bench_pattern(int pattern, bool use_realloc) {
+    uint64_t start = rdtsc_serialized();
+
+    for (int round = 0; round < HEAP_BENCH_ROUNDS; round++) {
+        if (pattern == 2) {
+            uint8_t* a = (uint8_t*)malloc(4096);
+            uint8_t* b = (uint8_t*)malloc(4096);
+            for (size_t size = 8192; size <= 512 * 1024 && a && b; size += 4096) {
+                a = (uint8_t*)(use_realloc ? realloc(a, size) : copy_realloc(a, size - 4096, size));
+                b = (uint8_t*)(use_realloc ? realloc(b, size) : copy_realloc(b, size - 4096, size));
+                if (a) a[size - 1] = (uint8_t)size;
+                if (b) b[size - 1] = (uint8_t)size;
+            }
+            free(a);
+            free(b);
+            continue;
+        }
+
+        size_t size = (pattern == 0) ? 4096 : 16;
+        uint8_t* buf = (uint8_t*)malloc(size);
+        while (buf && size < 1024 * 1024) {
+            size_t next = (pattern == 0) ? size + 4096 : size * 2;
+            buf = (uint8_t*)(use_realloc ? realloc(buf, next) : copy_realloc(buf, size, next));
+            size = next;
+            if (buf) buf[size - 1] = (uint8_t)size;
+        }
+        free(buf);
+    }
+    return rdtsc_serialized() - start;
+}
+
+void heap_benchmark() {
+    static const char* names[] = { "append 4K to 1M", "double to 1M", "2x append to 512K" };
+    uint64_t freq = get_cpu_frequency();
+    uint64_t us_div = freq / 1000000;
+    if (us_div == 0) us_div = 1;
+
+    printf("Heap realloc benchmark (%d rounds per pattern)\n", HEAP_BENCH_ROUNDS);
+    for (int p = 0; p < 3; p++) {
+        uint64_t in_place_before = realloc_in_place;
+        uint64_t moved_before = realloc_moved;
+
+        uint64_t copy_cycles = bench_pattern(p, false);
+        uint64_t realloc_cycles = bench_pattern(p, true);
+
+        printf("  %s: copy %u us, realloc %u us (%u in place, %u moved)\n", names[p],
+            (unsigned long long)(copy_cycles / us_div),
+            (unsigned long long)(realloc_cycles / us_div),
+            (unsigned long long)(realloc_in_place - in_place_before),
+            (unsigned long long)(realloc_moved - moved_before));
+    }
+}
+
 void* operator new(size_t size) { return malloc(size); }
 void* operator new[](size_t size) { return malloc(size); }
 void operator delete(void* p) { free(p); }
@@ -9,6 +9,11 @@
 // 0xffff_c000_0000_0000 is a nice clean spot in the higher half.
 #define HEAP_START_ADDR 0xFFFFC00000000000
 
+// The heap may grow up to 64 GB. Its page map (one pointer per heap page,
+// mapped on demand) sits directly above that range.
+#define HEAP_MAX_SIZE     0x1000000000ULL
+#define HEAP_PAGEMAP_ADDR (HEAP_START_ADDR + HEAP_MAX_SIZE)
+
 void heap_init();
 
 // Standard Library Allocator Interface
@@ -18,10 +23,22 @@ void* calloc(size_t num, size_t size);
 void* realloc(void* ptr, size_t new_size);
 
 // --- Getters for Live Stats ---
+// Bytes handed out (size-class rounded). O(1), no lock.
 size_t heap_get_used();
+// Bytes currently backed by physical frames.
 size_t heap_get_total();
 
+// Returns every fully free heap page to the PMM. Gives the bytes released.
+// (The allocator also trims on its own once enough free pages pile up.)
+size_t heap_trim();
+
+// Total bytes handed back to the PMM since boot.
+uint64_t heap_get_reclaimed();
+
 // Debugging
 void heap_print_stats();
 
+// Times realloc-heavy growth patterns against malloc + copy + free.
+void heap_benchmark();
+
 #endif
\ No newline at end of file
@@ -3,6 +3,8 @@
 #include <limine.h>
 #include "../cppstd/stdio.h"
 #include "../cppstd/string.h" 
+#include "../timer.h"
+#include "../sys/percpu.h"
 
 // Limine Memory Map Request
 __attribute__((used, section(".limine_requests")))
@@ -26,11 +28,31 @@ static uint64_t highest_addr = 0;
 static uint64_t total_ram = 0;
 static uint64_t used_ram = 0;
 
+// --- Buddy Allocator State ---
+// Free blocks live in the free pages themselves (reached via the HHDM).
+// page_order[] records the order of every page that heads a free block,
+// or PMM_ORDER_NONE. That is all we need to find and merge buddies.
+// Pages sitting in a per-CPU magazine are PMM_ORDER_CACHED, which never
+// matches an order, so the buddy code leaves them alone.
+#define PMM_ORDER_NONE   0xFF
+#define PMM_ORDER_CACHED 0xFE
+
+struct FreeBlock {
+    FreeBlock* next;
+    FreeBlock* prev;
+};
+
+static FreeBlock* free_lists[PMM_MAX_ORDER + 1];
+static uint64_t free_counts[PMM_MAX_ORDER + 1];
+static uint8_t* page_order = nullptr;
+static uint64_t buddy_pages = 0; // Pages below the highest usable address
+
 // Global HHDM Offset
 uint64_t g_hhdm_offset = 0; 
 
-// SMP Lock
-static Spinlock pmm_lock;
+// SMP Lock. Interrupt handlers reach it through the heap, so it is
+// always taken with interrupts off.
+static McsLock pmm_lock("pmm");
 
 static void bitmap_set(uint64_t bit) {
     bitmap[bit / 8] |= (1 << (bit % 8));
@@ -44,6 +66,153 @@ static bool bitmap_test(uint64_t bit) {
     return (bitmap[bit / 8] & (1 << (bit % 8))) > 0;
 }
 
+// Range helpers. Whole bytes in the middle are written at once.
+static void bitmap_set_range(uint64_t start, uint64_t count) {
+    uint64_t end = start + count;
+    while (start < end && (start % 8)) bitmap_set(start++);
+    while (start + 8 <= end) { bitmap[start / 8] = 0xFF; start += 8; }
+    while (start < end) bitmap_set(start++);
+}
+
+static void bitmap_unset_range(uint64_t start, uint64_t count) {
+    uint64_t end = start + count;
+    while (start < end && (start % 8)) bitmap_unset(start++);
+    while (start + 8 <= end) { bitmap[start / 8] = 0x00; start += 8; }
+    while (start < end) bitmap_unset(start++);
+}
+
+static FreeBlock* block_at(uint64_t page) {
+    return (FreeBlock*)(page * PAGE_SIZE + g_hhdm_offset);
+}
+
+static uint64_t block_page(FreeBlock* block) {
+    return ((uint64_t)block - g_hhdm_offset) / PAGE_SIZE;
+}
+
+static void list_push(uint64_t page, int order) {
+    FreeBlock* block = block_at(page);
+    block->prev = nullptr;
+    block->next = free_lists[order];
+    if (block->next) block->next->prev = block;
+    free_lists[order] = block;
+    page_order[page] = (uint8_t)order;
+    free_counts[order]++;
+}
+
+static void list_remove(uint64_t page, int order) {
+    FreeBlock* block = block_at(page);
+    if (block->prev) block->prev->next = block->next;
+    else free_lists[order] = block->next;
+    if (block->next) block->next->prev = block->prev;
+    page_order[page] = PMM_ORDER_NONE;
+    free_counts[order]--;
+}
+
+// Smallest order whose block holds 'count' pages.
+static int order_for(uint64_t count) {
+    int order = 0;
+    while ((1ULL << order) < count) order++;
+    return order;
+}
+
+// Insert a naturally aligned block and merge it with its buddy
+// for as long as the buddy is a free block of the same order.
+static void buddy_free_block(uint64_t page, int order) {
+    while (order < PMM_MAX_ORDER) {
+        uint64_t buddy = page ^ (1ULL << order);
+        if (buddy + (1ULL << order) > buddy_pages) break;
+        if (page_order[buddy] != order) break;
+
+        list_remove(buddy, order);
+        page &= ~(1ULL << order);
+        order++;
+    }
+    list_push(page, order);
+}
+
+// Hands an arbitrary page run to the free lists as the largest
+// aligned blocks that fit. Does not touch the bitmap.
+static void buddy_insert_range(uint64_t start, uint64_t count) {
+    while (count > 0) {
+        int order = 0;
+        while (order < PMM_MAX_ORDER &&
+               (start & ((2ULL << order) - 1)) == 0 &&
+               (2ULL << order) <= count) {
+            order++;
+        }
+        buddy_free_block(start, order);
+        start += 1ULL << order;
+        count -= 1ULL << order;
+    }
+}
+
+// Pops a block of exactly 'order', splitting a larger one if needed.
+// Returns the first page index, or UINT64_MAX when out of memory.
+static uint64_t buddy_alloc_block(int order) {
+    int found = order;
+    while (found <= PMM_MAX_ORDER && !free_lists[found]) found++;
+    if (found > PMM_MAX_ORDER) return UINT64_MAX;
+
+    uint64_t page = block_page(free_lists[found]);
+    list_remove(page, found);
+
+    while (found > order) {
+        found--;
+        list_push(page + (1ULL << found), found);
+    }
+    return page;
+}
+
+// Pulls the pages [start, start + count) out of the free lists.
+// Every page in the range must be free. Parts of the covering blocks
+// that fall outside the range are handed back.
+static void buddy_claim_range(uint64_t start, uint64_t count) {
+    uint64_t end = start + count;
+    uint64_t page = start;
+
+    while (page < end) {
+        int order = 0;
+        uint64_t head = page;
+        for (; order <= PMM_MAX_ORDER; order++) {
+            head = page & ~((1ULL << order) - 1);
+            if (page_order[head] == order) break;
+        }
+        if (order > PMM_MAX_ORDER) { page++; continue; } // Not in a list
+
+        list_remove(head, order);
+        uint64_t block_end = head + (1ULL << order);
+        if (head < start) buddy_insert_range(head, start - head);
+        if (block_end > end) {
+            buddy_insert_range(end, block_end - end);
+            block_end = end;
+        }
+        page = block_end;
+    }
+    bitmap_set_range(start, count);
+}
+
+// Legacy first-fit scan over the bitmap. Only used for runs larger
+// than the biggest buddy order (and by pmm_benchmark for comparison).
+static uint64_t linear_alloc(uint64_t count) {
+    uint64_t consecutive = 0;
+    uint64_t start_idx = 0;
+
+    for (uint64_t i = 0; i < buddy_pages; i++) {
+        if (!bitmap_test(i)) {
+            if (consecutive == 0) start_idx = i;
+            consecutive++;
+
+            if (consecutive == count) {
+                buddy_claim_range(start_idx, count);
+                return start_idx;
+            }
+        } else {
+            consecutive = 0;
+        }
+    }
+    return UINT64_MAX;
+}
+
 void pmm_init() {
     struct limine_memmap_response* memmap = memmap_request.response;
     struct limine_hhdm_response* hhdm = hhdm_request.response;
@@ -56,15 +225,22 @@ void pmm_init() {
     g_hhdm_offset = hhdm->offset;
 
     // 1. Calculate Total RAM and Highest Address
+    uint64_t highest_usable = 0;
     for (uint64_t i = 0; i < memmap->entry_count; i++) {
         struct limine_memmap_entry* entry = memmap->entries[i];
-        
+
         if (entry->type == LIMINE_MEMMAP_USABLE || 
             entry->type == LIMINE_MEMMAP_BOOTLOADER_RECLAIMABLE ||
             entry->type == LIMINE_MEMMAP_EXECUTABLE_AND_MODULES) {
             total_ram += entry->length;
         }
 
+        if (entry->type == LIMINE_MEMMAP_USABLE || 
+            entry->type == LIMINE_MEMMAP_BOOTLOADER_RECLAIMABLE) {
+            uint64_t usable_top = entry->base + entry->length;
+            if (usable_top > highest_usable) highest_usable = usable_top;
+        }
+
         uint64_t top = entry->base + entry->length;
         if (top > highest_addr) highest_addr = top;
     }
@@ -74,14 +250,21 @@ void pmm_init() {
     bitmap_size = total_pages / 8;
     if (total_pages % 8) bitmap_size++;
 
-    // 3. Find a place to put the bitmap
+    // The buddy order table only has to cover RAM we can hand out,
+    // not the MMIO holes at the top of the address space.
+    buddy_pages = highest_usable / PAGE_SIZE;
+    uint64_t meta_size = bitmap_size + buddy_pages;
+
+    // 3. Find a place to put the bitmap and the order table
     for (uint64_t i = 0; i < memmap->entry_count; i++) {
         struct limine_memmap_entry* entry = memmap->entries[i];
         if (entry->type == LIMINE_MEMMAP_USABLE) {
-            if (entry->length >= bitmap_size) {
+            if (entry->length >= meta_size) {
                 // IMPORTANT: Convert Physical Address to Virtual Address!
                 bitmap = (uint8_t*)(entry->base + g_hhdm_offset);
                 memset(bitmap, 0xFF, bitmap_size); 
+                page_order = bitmap + bitmap_size;
+                memset(page_order, PMM_ORDER_NONE, buddy_pages);
                 break;
             }
         }
@@ -98,7 +281,7 @@ void pmm_init() {
 
         if (entry->type == LIMINE_MEMMAP_USABLE || 
             entry->type == LIMINE_MEMMAP_BOOTLOADER_RECLAIMABLE) {
-            
+
             for (uint64_t j = 0; j < entry->length; j += PAGE_SIZE) {
                 uint64_t phys_addr = entry->base + j;
                 bitmap_unset(phys_addr / PAGE_SIZE);
@@ -106,11 +289,11 @@ void pmm_init() {
         }
     }
 
-    // 5. Mark the Bitmap ITSELF as used!
+    // 5. Mark the Bitmap and Order Table ITSELF as used!
     uint64_t bitmap_phys = (uint64_t)bitmap - g_hhdm_offset;
     uint64_t bitmap_start_page = bitmap_phys / PAGE_SIZE;
-    uint64_t bitmap_pages = bitmap_size / PAGE_SIZE + 1;
-    
+    uint64_t bitmap_pages = meta_size / PAGE_SIZE + 1;
+
     for (uint64_t i = 0; i < bitmap_pages; i++) {
         bitmap_set(bitmap_start_page + i);
     }
@@ -120,14 +303,22 @@ void pmm_init() {
         bitmap_set(i);
     }
 
-    // 7. Calculate Stats
+    // 7. Feed every free run into the buddy lists and calculate stats
     uint64_t free_pages = 0;
-    for (uint64_t i = 0; i < total_pages; i++) {
+    uint64_t run_start = 0;
+    uint64_t run_len = 0;
+    for (uint64_t i = 0; i < buddy_pages; i++) {
         if (!bitmap_test(i)) {
+            if (run_len == 0) run_start = i;
+            run_len++;
             free_pages++;
+        } else if (run_len) {
+            buddy_insert_range(run_start, run_len);
+            run_len = 0;
         }
     }
-    
+    if (run_len) buddy_insert_range(run_start, run_len);
+
     uint64_t free_ram_bytes = free_pages * PAGE_SIZE;
     used_ram = total_ram - free_ram_bytes;
 
@@ -139,48 +330,266 @@ void pmm_init() {
         (int)(free_ram_bytes / 1024 / 1024));
 }
 
-void* pmm_alloc(size_t count) {
-    ScopedLock lock(pmm_lock); // SMP Safety
+// Takes 'count' pages from the buddy lists. Caller holds pmm_lock.
+// Returns the first page index, or UINT64_MAX when out of memory.
+static uint64_t global_alloc(uint64_t count) {
+    int order = order_for(count);
+    if (order > PMM_MAX_ORDER) return linear_alloc(count);
 
-    if (count == 0) return nullptr;
+    uint64_t page = buddy_alloc_block(order);
+    if (page == UINT64_MAX) return UINT64_MAX;
 
-    uint64_t total_pages = highest_addr / PAGE_SIZE;
-    uint64_t consecutive = 0;
-    uint64_t start_idx = 0;
+    // Non power-of-two requests give the tail back right away
+    bitmap_set_range(page, count);
+    uint64_t block = 1ULL << order;
+    if (block > count) buddy_insert_range(page + count, block - count);
+    return page;
+}
 
-    for (uint64_t i = 0; i < total_pages; i++) {
-        if (!bitmap_test(i)) {
-            if (consecutive == 0) start_idx = i;
-            consecutive++;
-            
-            if (consecutive == count) {
-                for (uint64_t j = 0; j < count; j++) {
-                    bitmap_set(start_idx + j);
-                }
-                used_ram += count * PAGE_SIZE;
-                // Return PHYSICAL address
-                return (void*)(start_idx * PAGE_SIZE);
-            }
-        } else {
-            consecutive = 0;
+// Returns pages to the buddy lists. Caller holds pmm_lock.
+// Pages that are already free (double free), in the lists or in a
+// magazine, are skipped so the lists stay consistent. Returns how many pages were actually released.
+static uint64_t global_free(uint64_t start_page, uint64_t count) {
+    uint64_t released = 0;
+    uint64_t run_start = start_page;
+    uint64_t run_len = 0;
+    for (uint64_t page = start_page; page < start_page + count; page++) {
+        if (bitmap_test(page) && page_order[page] != PMM_ORDER_CACHED) {
+            if (run_len == 0) run_start = page;
+            run_len++;
+        } else if (run_len) {
+            bitmap_unset_range(run_start, run_len);
+            buddy_insert_range(run_start, run_len);
+            released += run_len;
+            run_len = 0;
         }
     }
+    if (run_len) {
+        bitmap_unset_range(run_start, run_len);
+        buddy_insert_range(run_start, run_len);
+        released += run_len;
+    }
+    return released;
+}
+
+// --- Per-CPU Page Caches ---
+// Each core keeps a small magazine of free order-0 pages so single page
+// requests (heap growth, bounce buffers, page tables) skip pmm_lock.
+// Cached pages stay marked in the bitmap; only used_ram treats them as free.
+// Magazines are refilled/drained PCP_BATCH pages at a time.
+// The magazine itself lives in the core's PerCpu block.
+#define PCP_CAPACITY PERCPU_PAGE_CACHE
+#define PCP_BATCH    16
+
+// The magazine is only touched by its own core, so masking interrupts
+// is enough to keep an IRQ handler from racing us.
+static uint64_t irq_save() {
+    uint64_t flags;
+    asm volatile("pushfq; pop %0; cli" : "=r"(flags) :: "memory");
+    return flags;
+}
+
+static void irq_restore(uint64_t flags) {
+    if (flags & 0x200) asm volatile("sti" ::: "memory");
+}
+
+static void pcp_refill(PerCpu* cache) {
+    ScopedIrqLock lock(pmm_lock);
+    while (cache->page_count < PCP_BATCH) {
+        uint64_t page = buddy_alloc_block(0);
+        if (page == UINT64_MAX) break;
+        bitmap_set(page);
+        page_order[page] = PMM_ORDER_CACHED;
+        cache->page_cache[cache->page_count++] = page;
+    }
+}
+
+static void pcp_drain(PerCpu* cache, int keep) {
+    ScopedIrqLock lock(pmm_lock);
+    while (cache->page_count > keep) {
+        uint64_t page = cache->page_cache[--cache->page_count];
+        page_order[page] = PMM_ORDER_NONE;
+        global_free(page, 1);
+    }
+}
+
+static void* pcp_alloc() {
+    // Look the core up with interrupts off so the thread can't migrate
+    uint64_t flags = irq_save();
+    PerCpu* cache = this_cpu();
+    if (cache->page_count == 0) {
+        percpu_inc(pcp_misses);
+        pcp_refill(cache);
+        if (cache->page_count == 0) { irq_restore(flags); return nullptr; }
+    } else {
+        percpu_inc(pcp_hits);
+    }
+    uint64_t page = cache->page_cache[--cache->page_count];
+    __atomic_store_n(&page_order[page], PMM_ORDER_NONE, __ATOMIC_RELAXED);
+    irq_restore(flags);
+
+    __atomic_fetch_add(&used_ram, PAGE_SIZE, __ATOMIC_RELAXED);
+    return (void*)(page * PAGE_SIZE);
+}
+
+static void pcp_free(uint64_t page) {
+    // Double frees are ignored: a page back in the buddy lists has its
+    // bitmap bit clear, and one in any core's magazine is already marked
+    // cached. The CAS settles two cores freeing the same page at once.
+    if (!bitmap_test(page)) return;
+    uint8_t expected = PMM_ORDER_NONE;
+    if (!__atomic_compare_exchange_n(&page_order[page], &expected, (uint8_t)PMM_ORDER_CACHED, false,
+                                     __ATOMIC_RELAXED, __ATOMIC_RELAXED)) return;
+
+    uint64_t flags = irq_save();
+    PerCpu* cache = this_cpu();
+    if (cache->page_count == PCP_CAPACITY) {
+        percpu_inc(pcp_misses);
+        pcp_drain(cache, PCP_CAPACITY - PCP_BATCH);
+    } else {
+        percpu_inc(pcp_hits);
+    }
+    cache->page_cache[cache->page_count++] = page;
+    irq_restore(flags);
+
+    __atomic_fetch_sub(&used_ram, PAGE_SIZE, __ATOMIC_RELAXED);
+}
+
+void* pmm_alloc(size_t count) {
+    if (count == 0 || !page_order) return nullptr;
+    if (count == 1) return pcp_alloc();
+
+    ScopedIrqLock lock(pmm_lock); // SMP Safety
+    uint64_t page = global_alloc(count);
+    if (page == UINT64_MAX) return nullptr;
 
-    return nullptr;
+    __atomic_fetch_add(&used_ram, count * PAGE_SIZE, __ATOMIC_RELAXED);
+    // Return PHYSICAL address
+    return (void*)(page * PAGE_SIZE);
 }
 
 void pmm_free(void* ptr, size_t count) {
-    ScopedLock lock(pmm_lock); // SMP Safety
+    if (!ptr || !page_order) return;
 
-    if (!ptr) return;
-    
     uint64_t start_page = (uint64_t)ptr / PAGE_SIZE;
-    for (size_t i = 0; i < count; i++) {
-        bitmap_unset(start_page + i);
+    if (start_page >= buddy_pages) return;
+    if (start_page + count > buddy_pages) count = buddy_pages - start_page;
+
+    if (count == 1) {
+        pcp_free(start_page);
+        return;
     }
-    used_ram -= count * PAGE_SIZE;
+
+    ScopedIrqLock lock(pmm_lock); // SMP Safety
+    uint64_t released = global_free(start_page, count);
+    __atomic_fetch_sub(&used_ram, released * PAGE_SIZE, __ATOMIC_RELAXED);
+}
+
+void pmm_drain_local_cache() {
+    uint64_t flags = irq_save();
+    pcp_drain(this_cpu(), 0);
+    irq_restore(flags);
 }
 
 uint64_t pmm_get_total_memory() { return total_ram; }
-uint64_t pmm_get_used_memory() { return used_ram; }
-uint64_t pmm_get_free_memory() { return total_ram - used_ram; }
\ No newline at end of file
+uint64_t pmm_get_used_memory() { return __atomic_load_n(&used_ram, __ATOMIC_RELAXED); }
+uint64_t pmm_get_free_memory() { return total_ram - pmm_get_used_memory(); }
+uint64_t pmm_get_highest_address() { return highest_addr; }
+
+uint64_t pmm_get_free_blocks(int order) {
+    if (order < 0 || order > PMM_MAX_ORDER) return 0;
+    ScopedIrqLock lock(pmm_lock);
+    return free_counts[order];
+}
+
+bool pmm_self_test() {
+    uint64_t counts_before[PMM_MAX_ORDER + 1];
+    pmm_drain_local_cache();
+    {
+        ScopedIrqLock lock(pmm_lock);
+        for (int i = 0; i <= PMM_MAX_ORDER; i++) counts_before[i] = free_counts[i];
+    }
+    uint64_t free_before = pmm_get_free_memory();
+    bool ok = true;
+
+    // 1. Single pages: distinct, aligned and writable
+    void* pages[64] = {};
+    for (int i = 0; i < 64; i++) {
+        pages[i] = pmm_alloc(1);
+        if (!pages[i] || ((uint64_t)pages[i] % PAGE_SIZE) != 0) { ok = false; break; }
+        *(volatile uint64_t*)((uint64_t)pages[i] + g_hhdm_offset) = (uint64_t)i;
+        for (int j = 0; j < i; j++) {
+            if (pages[j] == pages[i]) ok = false;
+        }
+    }
+    for (int i = 0; ok && i < 64; i++) {
+        if (*(volatile uint64_t*)((uint64_t)pages[i] + g_hhdm_offset) != (uint64_t)i) ok = false;
+    }
+
+    // 2. Contiguous runs: power-of-two sizes come back naturally aligned
+    const size_t run_sizes[] = { 2, 3, 8, 17, 1024 };
+    void* runs[5] = { nullptr, nullptr, nullptr, nullptr, nullptr };
+    for (int i = 0; i < 5; i++) {
+        runs[i] = pmm_alloc(run_sizes[i]);
+        if (!runs[i]) { ok = false; continue; }
+        uint64_t page = (uint64_t)runs[i] / PAGE_SIZE;
+        if ((run_sizes[i] & (run_sizes[i] - 1)) == 0 && (page & (run_sizes[i] - 1)) != 0) ok = false;
+    }
+
+    for (int i = 0; i < 64; i++) if (pages[i]) pmm_free(pages[i], 1);
+    for (int i = 0; i < 5; i++) if (runs[i]) pmm_free(runs[i], run_sizes[i]);
+
+    // 3. Everything freed must coalesce back into the original blocks
+    pmm_drain_local_cache();
+    if (pmm_get_free_memory() != free_before) ok = false;
+    {
+        ScopedIrqLock lock(pmm_lock);
+        for (int i = 0; i <= PMM_MAX_ORDER; i++) {
+            if (free_counts[i] != counts_before[i]) ok = false;
+        }
+    }
+
+    printf("PMM: Buddy self-test %s.\n", ok ? "PASSED" : "FAILED");
+    return ok;
+}
+
+#define PMM_BENCH_ALLOCS 2048
+static void* bench_slots[PMM_BENCH_ALLOCS];
+
+static uint64_t bench_run(bool use_linear, size_t count, int allocs) {
+    uint64_t start = rdtsc_serialized();
+    for (int i = 0; i < allocs; i++) {
+        if (use_linear) {
+            ScopedIrqLock lock(pmm_lock);
+            uint64_t page = linear_alloc(count);
+            if (page == UINT64_MAX) { bench_slots[i] = nullptr; continue; }
+            __atomic_fetch_add(&used_ram, count * PAGE_SIZE, __ATOMIC_RELAXED);
+            bench_slots[i] = (void*)(page * PAGE_SIZE);
+        } else {
+            bench_slots[i] = pmm_alloc(count);
+        }
+    }
+    uint64_t cycles = rdtsc_serialized() - start;
+    for (int i = 0; i < allocs; i++) {
+        if (bench_slots[i]) pmm_free(bench_slots[i], count);
+    }
+    return cycles ? cycles : 1;
+}
+
+void pmm_benchmark() {
+    uint64_t freq = get_cpu_frequency();
+    const size_t sizes[] = { 1, 16 };
+
+    printf("PMM Benchmark (%d allocations per run)\n", PMM_BENCH_ALLOCS);
+    for (int s = 0; s < 2; s++) {
+        uint64_t linear = bench_run(true, sizes[s], PMM_BENCH_ALLOCS);
+        uint64_t buddy = bench_run(false, sizes[s], PMM_BENCH_ALLOCS);
+
+        uint64_t linear_rate = (PMM_BENCH_ALLOCS * freq) / linear;
+        uint64_t buddy_rate = (PMM_BENCH_ALLOCS * freq) / buddy;
+
+        printf("  %d page(s): bitmap scan %u allocs/sec, buddy %u allocs/sec (x%u)\n",
+            (int)sizes[s], (unsigned long long)linear_rate, (unsigned long long)buddy_rate,
+            (unsigned long long)(linear / buddy));
+    }
+}
\ No newline at end of file
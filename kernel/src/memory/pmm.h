@@ -6,6 +6,10 @@
 
 #define PAGE_SIZE 4096
 
+// Largest buddy block is 2^PMM_MAX_ORDER pages (4 MB).
+// Bigger contiguous requests fall back to a bitmap scan.
+#define PMM_MAX_ORDER 10
+
 // Global HHDM Offset (Physical Address + Offset = Virtual Address)
 // Exposed so the VMM can read/write page tables.
 extern uint64_t g_hhdm_offset;
@@ -19,8 +23,24 @@ void* pmm_alloc(size_t count);
 // Frees pages starting at Physical Address 'ptr'.
 void pmm_free(void* ptr, size_t count);
 
+// Single pages are served from a per-CPU cache. This hands the calling
+// core's cached pages back to the global buddy lists.
+void pmm_drain_local_cache();
+
 uint64_t pmm_get_total_memory();
 uint64_t pmm_get_used_memory();
 uint64_t pmm_get_free_memory();
 
+// End of the highest range in the memory map: the HHDM covers [0, this)
+uint64_t pmm_get_highest_address();
+
+// Number of free blocks sitting in the buddy list for 'order'.
+uint64_t pmm_get_free_blocks(int order);
+
+// Boot-time sanity check of the buddy allocator (alloc/free/coalesce).
+bool pmm_self_test();
+
+// Compares allocations/sec of the old bitmap scan against the buddy lists.
+void pmm_benchmark();
+
 #endif
\ No newline at end of file
@@ -1,16 +1,35 @@
 #include "swp.h"
 #include "pmm.h"
 #include "vmm.h"
+#include "tlb.h"
 #include "../cppstd/stdio.h"
 #include "../cppstd/string.h"
 #include "../cppstd/stdlib.h" // for atoi if needed, though we implement custom parse
+#include "../drv/storage/ahci.h"
+#include "../fs/fat32.h"
+#include "../timer.h"
+#include "../smp/smp_call.h"
+
+extern int g_sata_port;
+
+#define SWAP_PAGE_ON_DISK 0x01 // The disk slot holds the page's contents
+
+#define SECTORS_PER_PAGE (4096 / 512)
+
+// Resident set: an eighth of free RAM, at most 32 MB, at least 64 pages
+#define SWAP_RESIDENT_MAX 8192
+#define SWAP_RESIDENT_MIN 64
 
 SwapManager& SwapManager::getInstance() {
     static SwapManager instance;
     return instance;
 }
 
-SwapManager::SwapManager() : is_active(false), current_size(0), page_count(0) {}
+SwapManager::SwapManager()
+    : is_active(false), current_size(0), page_count(0), port(-1), disk_lba(0),
+      resident(nullptr), resident_limit(0), resident_count(0), clock_hand(0),
+      page_flags(nullptr), page_ins(0), page_outs(0), clean_drops(0), zero_fills(0),
+      in_cycles(0), out_cycles(0), max_in_cycles(0), max_out_cycles(0) {}
 
 uint64_t SwapManager::parse_size(const char* str) {
     uint64_t num = 0;
@@ -54,50 +73,61 @@ bool SwapManager::allocate_swap(const char* size_str) {
         return false;
     }
 
-    uint64_t pages_needed = bytes / 4096;
-    uint64_t free_ram = pmm_get_free_memory();
+    if (g_sata_port == -1) {
+        printf("SWAP: No SATA disk to swap to.\n");
+        return false;
+    }
 
-    printf("SWAP: Requesting %d MB (%d pages)...\n", (int)(bytes/1024/1024), (int)pages_needed);
+    // The swap area takes the last sectors of the disk, past the FAT32 volume
+    uint64_t disk_sectors = AhciDriver::getInstance().getSectorCount(g_sata_port);
+    uint64_t sectors_needed = bytes / 512;
+    uint64_t volume_end = Fat32::getInstance().getVolumeSectors();
 
-    // Safety check (leave at least 16MB for the system)
-    if (bytes + (16*1024*1024) > free_ram) {
-        printf("SWAP: Not enough physical RAM. (Free: %d MB)\n", (int)(free_ram/1024/1024));
+    if (disk_sectors == 0) {
+        printf("SWAP: Could not read disk size.\n");
+        return false;
+    }
+    if (sectors_needed > disk_sectors || disk_sectors - sectors_needed < volume_end) {
+        printf("SWAP: Not enough disk space outside the FAT32 volume (Free: %d MB)\n",
+            (int)((disk_sectors > volume_end ? disk_sectors - volume_end : 0) / 2048));
         return false;
     }
 
-    // Allocate and Map
-    uint64_t virt_addr = SWAP_VIRT_BASE;
-    uint64_t allocated = 0;
+    uint64_t pages_needed = bytes / 4096;
+    uint64_t limit = pmm_get_free_memory() / 4096 / 8;
+    if (limit > SWAP_RESIDENT_MAX) limit = SWAP_RESIDENT_MAX;
+    if (limit < SWAP_RESIDENT_MIN) limit = SWAP_RESIDENT_MIN;
+    if (limit > pages_needed) limit = pages_needed;
 
-    for (uint64_t i = 0; i < pages_needed; i++) {
-        void* phys = pmm_alloc(1);
-        if (!phys) {
-            printf("SWAP: OOM during allocation loop at page %d!\n", (int)i);
-            // Ideally we should rollback here, but for now we just stop.
-            return false;
-        }
+    printf("SWAP: Requesting %d MB (%d pages)...\n", (int)(bytes/1024/1024), (int)pages_needed);
 
-        // Map SWAP_VIRT_BASE + offset -> Physical Frame
-        // Flags: Present | ReadWrite | NoExecute
-        vmm_map_page(virt_addr, (uint64_t)phys, PTE_PRESENT | PTE_RW | PTE_NX);
-        
-        virt_addr += 4096;
-        allocated++;
-        
-        // Progress bar for large allocations
-        if (pages_needed > 10000 && (i % 5000 == 0)) {
-            printf(".");
-        }
+    resident = new uint64_t[limit];
+    page_flags = new uint8_t[pages_needed];
+    if (!resident || !page_flags) {
+        printf("SWAP: OOM allocating swap tables.\n");
+        delete[] resident;
+        delete[] page_flags;
+        resident = nullptr;
+        page_flags = nullptr;
+        return false;
     }
+    memset(page_flags, 0, pages_needed);
 
-    if (pages_needed > 10000) printf("\n");
+    ScopedLock guard(lock);
+    port = g_sata_port;
+    disk_lba = disk_sectors - sectors_needed;
+    resident_limit = limit;
+    resident_count = 0;
+    clock_hand = 0;
+    page_ins = page_outs = clean_drops = zero_fills = 0;
+    in_cycles = out_cycles = max_in_cycles = max_out_cycles = 0;
 
     current_size = bytes;
-    page_count = allocated;
+    page_count = pages_needed;
     is_active = true;
 
-    printf("SWAP: Successfully allocated %d MB at Virtual %p\n", 
-        (int)(bytes/1024/1024), (void*)SWAP_VIRT_BASE);
+    printf("SWAP: %d MB at Virtual %p, disk LBA %d, up to %d pages resident\n", 
+        (int)(bytes/1024/1024), (void*)SWAP_VIRT_BASE, (int)disk_lba, (int)resident_limit);
         
     return true;
 }
@@ -106,24 +136,134 @@ void SwapManager::free_swap() {
     if (!is_active) return;
 
     printf("SWAP: Freeing memory...\n");
-    uint64_t virt_addr = SWAP_VIRT_BASE;
+    {
+        ScopedLock guard(lock);
+        is_active = false;
+
+        // Only resident pages have frames behind them
+        vmm_unmap_and_free(SWAP_VIRT_BASE, current_size);
+
+        delete[] resident;
+        delete[] page_flags;
+        resident = nullptr;
+        page_flags = nullptr;
+        resident_count = 0;
+        current_size = 0;
+        page_count = 0;
+    }
+    printf("SWAP: Freed.\n");
+}
+
+uint64_t SwapManager::evict(uint64_t* slot_out) {
+    // Second chance: a page referenced since the last pass loses its
+    // accessed bit and is skipped. Two full turns always find a victim.
+    for (uint64_t scanned = 0; scanned < resident_count * 2 + 1; scanned++) {
+        uint64_t slot = clock_hand;
+        clock_hand = (clock_hand + 1) % resident_count;
 
-    for (uint64_t i = 0; i < page_count; i++) {
-        // Get physical address to free it in PMM
-        uint64_t phys = vmm_virt_to_phys(virt_addr);
-        if (phys) {
-            pmm_free((void*)phys, 1);
+        uint64_t index = resident[slot];
+        uint64_t virt = SWAP_VIRT_BASE + index * 4096;
+        uint64_t* pte = vmm_get_pte(virt, false);
+        if (!pte || !(*pte & PTE_PRESENT)) continue;
+
+        if (*pte & PTE_ACCESSED) {
+            *pte &= ~PTE_ACCESSED;
+            continue;
         }
-        
-        // Unmap from Page Table
-        vmm_unmap_page(virt_addr);
-        virt_addr += 4096;
+
+        // Unmap first so no core can write while the page is on its way out
+        uint64_t entry = *pte;
+        uint64_t frame = entry & 0x000FFFFFFFFFF000;
+        *pte = 0;
+        tlb_flush_range(virt, 4096);
+
+        if (entry & PTE_DIRTY) {
+            uint64_t start = rdtsc_serialized();
+            void* data = (void*)(frame + g_hhdm_offset);
+            if (!AhciDriver::getInstance().write(port, disk_lba + index * SECTORS_PER_PAGE, SECTORS_PER_PAGE, data)) {
+                printf("SWAP: Write-back failed for page %d\n", (int)index);
+                *pte = entry;
+                continue;
+            }
+            uint64_t cycles = rdtsc_serialized() - start;
+            out_cycles += cycles;
+            if (cycles > max_out_cycles) max_out_cycles = cycles;
+            page_outs++;
+            page_flags[index] |= SWAP_PAGE_ON_DISK;
+        } else {
+            // Unchanged since it came in: the disk copy (or zero page) is current
+            clean_drops++;
+        }
+
+        *slot_out = slot;
+        return frame;
     }
+    return 0;
+}
 
-    is_active = false;
-    current_size = 0;
-    page_count = 0;
-    printf("SWAP: Freed.\n");
+bool SwapManager::handle_page_fault(uint64_t addr, uint64_t error_code) {
+    if (!is_active) return false;
+    if (addr < SWAP_VIRT_BASE || addr >= SWAP_VIRT_BASE + current_size) return false;
+    if (error_code & 1) return false; // Protection fault on a present page
+
+    // Interrupts are off in here: keep answering TLB shootdowns while
+    // another core holds the lock (it may be evicting)
+    while (!lock.try_lock()) {
+        smp_call_poll();
+        asm volatile("pause");
+    }
+
+    bool resolved = false;
+    uint64_t index = (addr - SWAP_VIRT_BASE) / 4096;
+    uint64_t virt = SWAP_VIRT_BASE + index * 4096;
+    uint64_t* pte = vmm_get_pte(virt, true);
+
+    if (!is_active) {
+        // Raced with free_swap
+    } else if (*pte & PTE_PRESENT) {
+        resolved = true; // Another core brought it in meanwhile
+    } else {
+        uint64_t slot = resident_count;
+        uint64_t frame = 0;
+        if (resident_count < resident_limit) {
+            frame = (uint64_t)pmm_alloc(1);
+            if (frame) resident_count++;
+        }
+        if (!frame && resident_count > 0) frame = evict(&slot);
+
+        if (frame) {
+            void* data = (void*)(frame + g_hhdm_offset);
+            bool ok = true;
+            if (page_flags[index] & SWAP_PAGE_ON_DISK) {
+                uint64_t start = rdtsc_serialized();
+                ok = AhciDriver::getInstance().read(port, disk_lba + index * SECTORS_PER_PAGE, SECTORS_PER_PAGE, data);
+                uint64_t cycles = rdtsc_serialized() - start;
+                in_cycles += cycles;
+                if (cycles > max_in_cycles) max_in_cycles = cycles;
+                page_ins++;
+            } else {
+                memset(data, 0, 4096);
+                zero_fills++;
+            }
+
+            if (ok) {
+                resident[slot] = index;
+                // Not present before, so no TLB holds it: a local invlpg is enough
+                *pte = frame | PTE_PRESENT | PTE_RW | PTE_NX;
+                asm volatile("invlpg (%0)" :: "r"(virt) : "memory");
+                resolved = true;
+            } else {
+                printf("SWAP: Read failed for page %d\n", (int)index);
+                // Give up the slot: the last resident page moves into it
+                pmm_free((void*)frame, 1);
+                resident[slot] = resident[--resident_count];
+                if (clock_hand >= resident_count) clock_hand = 0;
+            }
+        }
+    }
+
+    lock.unlock();
+    return resolved;
 }
 
 void SwapManager::test_swap() {
@@ -132,19 +272,48 @@ void SwapManager::test_swap() {
         return;
     }
 
-    volatile uint64_t* start = (uint64_t*)SWAP_VIRT_BASE;
-    volatile uint64_t* end = (uint64_t*)(SWAP_VIRT_BASE + current_size - 8);
+    // Enough pages to push some of them out to disk
+    uint64_t pages = resident_limit + 1024;
+    if (pages > page_count) pages = page_count;
 
-    printf("SWAP: Testing R/W...\n");
+    printf("SWAP: Testing R/W over %d pages (%d resident max)...\n", (int)pages, (int)resident_limit);
     
     // Write patterns
-    *start = 0xDEADBEEFCAFEBABE;
-    *end   = 0x1234567890ABCDEF;
+    for (uint64_t i = 0; i < pages; i++) {
+        volatile uint64_t* page = (uint64_t*)(SWAP_VIRT_BASE + i * 4096);
+        page[0] = 0xDEADBEEF00000000 | i;
+        page[511] = 0x1234567800000000 | i;
+    }
 
     // Read back
-    if (*start == 0xDEADBEEFCAFEBABE && *end == 0x1234567890ABCDEF) {
+    uint64_t bad = 0;
+    for (uint64_t i = 0; i < pages; i++) {
+        volatile uint64_t* page = (uint64_t*)(SWAP_VIRT_BASE + i * 4096);
+        if (page[0] != (0xDEADBEEF00000000 | i) || page[511] != (0x1234567800000000 | i)) bad++;
+    }
+
+    if (bad == 0) {
         printf("SWAP: Verification PASSED.\n");
     } else {
-        printf("SWAP: Verification FAILED! (Mem: %lx, %lx)\n", *start, *end);
+        printf("SWAP: Verification FAILED! (%d bad pages)\n", (int)bad);
     }
-}
\ No newline at end of file
+    print_stats();
+}
+
+void SwapManager::print_stats() {
+    if (!is_active) {
+        printf("SWAP: Not allocated.\n");
+        return;
+    }
+
+    uint64_t us_div = get_cpu_frequency() / 1000000;
+    if (us_div == 0) us_div = 1;
+
+    printf("SWAP: %d MB on port %d @ LBA %d, %d/%d pages resident\n",
+        (int)(current_size/1024/1024), port, (int)disk_lba, (int)resident_count, (int)resident_limit);
+    printf("  Page-ins:  %d (avg %d us, max %d us)\n", (int)page_ins,
+        (int)(page_ins ? in_cycles / page_ins / us_div : 0), (int)(max_in_cycles / us_div));
+    printf("  Page-outs: %d (avg %d us, max %d us)\n", (int)page_outs,
+        (int)(page_outs ? out_cycles / page_outs / us_div : 0), (int)(max_out_cycles / us_div));
+    printf("  Clean drops: %d, zero-fill faults: %d\n", (int)clean_drops, (int)zero_fills);
+}
@@ -3,25 +3,40 @@
 
 #include <cstdint>
 #include <cstddef>
+#include "../sys/spinlock.h"
 
 // We place the swap region at a very high virtual address
 // Heap starts at 0xFFFF_C000..., so let's put Swap at 0xFFFF_E000...
 #define SWAP_VIRT_BASE 0xFFFFE00000000000
 
+// Demand-paged memory backed by a reserved area at the end of the SATA
+// disk (past the FAT32 volume). The window at SWAP_VIRT_BASE is as large
+// as the disk area; only up to resident_limit pages of it hold RAM at a
+// time. Pages fault in on first touch (zero-filled) or from disk, and
+// cold pages are evicted with a clock (second chance) sweep over the
+// PTE accessed bits. Dirty pages are written back, clean ones dropped.
 class SwapManager {
 public:
     static SwapManager& getInstance();
 
-    // Allocates a region of memory.
+    // Reserves the on-disk area and opens the window.
     // size_str: e.g., "512M", "1G", "4096K"
     bool allocate_swap(const char* size_str);
 
-    // Frees the swap region (returns pages to PMM)
+    // Closes the window (returns resident pages to PMM)
     void free_swap();
 
-    // Verification method to prove memory is mapped and writable
+    // Writes and verifies a pattern over more pages than can stay
+    // resident, so part of it has to go through the disk
     void test_swap();
 
+    // Called for vector 14. Returns true if the fault was inside the
+    // window and has been resolved (the access can be retried).
+    bool handle_page_fault(uint64_t addr, uint64_t error_code);
+
+    // Page-in/out counts and latencies (swapstat)
+    void print_stats();
+
     uint64_t getSize() const { return current_size; }
     bool isActive() const { return is_active; }
 
@@ -32,8 +47,29 @@ private:
     uint64_t current_size;
     uint64_t page_count;
 
+    // Backing store
+    int port;
+    uint64_t disk_lba;        // First sector of the swap area
+
+    // Resident set, swept by the clock hand
+    uint64_t* resident;       // Page index per slot
+    uint64_t resident_limit;
+    uint64_t resident_count;
+    uint64_t clock_hand;
+    uint8_t* page_flags;      // SWAP_PAGE_* per window page
+
+    Spinlock lock;
+
+    // Statistics (cycles are TSC ticks)
+    uint64_t page_ins, page_outs, clean_drops, zero_fills;
+    uint64_t in_cycles, out_cycles, max_in_cycles, max_out_cycles;
+
     // Helper to parse "512M" -> bytes
     uint64_t parse_size(const char* str);
+
+    // Picks a victim with the clock, writes it out if dirty and unmaps it.
+    // Returns its frame (now free for reuse) and the slot it occupied.
+    uint64_t evict(uint64_t* slot_out);
 };
 
-#endif
\ No newline at end of file
+#endif
@@ -0,0 +1,56 @@
+#include "tlb.h"
+#include "pmm.h"
+#include "../sys/spinlock.h"
+#include "../smp/smp_call.h"
+
+// Range handed to the other cores; lives on the initiator's stack, which
+// waits for every target to finish with it
+struct FlushRange {
+    uint64_t start;
+    uint64_t size;
+};
+
+static void reload_cr3() {
+    uint64_t cr3;
+    asm volatile("mov %%cr3, %0" : "=r"(cr3));
+    asm volatile("mov %0, %%cr3" :: "r"(cr3) : "memory");
+}
+
+void tlb_flush_local(uint64_t virt, uint64_t size) {
+    uint64_t start = virt & ~(uint64_t)(PAGE_SIZE - 1);
+    uint64_t end = (virt + size + PAGE_SIZE - 1) & ~(uint64_t)(PAGE_SIZE - 1);
+
+    if ((end - start) / PAGE_SIZE > TLB_FULL_FLUSH_THRESHOLD) {
+        reload_cr3();
+        return;
+    }
+    for (uint64_t addr = start; addr < end; addr += PAGE_SIZE) {
+        asm volatile("invlpg (%0)" :: "r"(addr) : "memory");
+    }
+}
+
+static void flush_remote(void* arg) {
+    FlushRange* range = (FlushRange*)arg;
+    tlb_flush_local(range->start, range->size);
+}
+
+void tlb_flush_range(uint64_t virt, uint64_t size) {
+    // Pinned, so the local flush and "every other core" agree on who we are
+    sched_preempt_disable();
+    tlb_flush_local(virt, size);
+
+    // No-op on single core systems / before the APs come up
+    FlushRange range = { virt, size };
+    smp_call_function_all(flush_remote, &range, true);
+    sched_preempt_enable();
+}
+
+void tlb_flush_all() {
+    // A range past the threshold makes every core reload CR3
+    tlb_flush_range(0, (TLB_FULL_FLUSH_THRESHOLD + 1) * PAGE_SIZE);
+}
+
+void tlb_cpu_online() {
+    // Anything cached before we started taking calls is gone after this
+    reload_cr3();
+}
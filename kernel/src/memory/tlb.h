@@ -0,0 +1,25 @@
+#ifndef TLB_H
+#define TLB_H
+
+#include <cstdint>
+
+// Above this many pages a flush reloads CR3 instead of issuing invlpg
+// per page (also used by the remote side of a shootdown).
+#define TLB_FULL_FLUSH_THRESHOLD 32
+
+// Invalidate [virt, virt + size) on the calling core only
+void tlb_flush_local(uint64_t virt, uint64_t size);
+
+// Invalidate [virt, virt + size) on every online core. Remote cores are
+// reached through smp_call_function_all() once they take calls; before
+// that (or on a single core system) this is a local flush.
+void tlb_flush_range(uint64_t virt, uint64_t size);
+
+// Drop every non-global TLB entry on every online core
+void tlb_flush_all();
+
+// Called by an AP right after smp_call_cpu_online(). Drops whatever
+// the core cached before it started taking part in shootdowns.
+void tlb_cpu_online();
+
+#endif
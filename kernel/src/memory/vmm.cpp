@@ -1,7 +1,32 @@
 #include "vmm.h"
 #include "pmm.h"
+#include "tlb.h"
 #include "../cppstd/stdio.h"
 #include "../cppstd/string.h" 
+#include "../sys/spinlock.h"
+#include "../smp/smp_call.h"
+
+#define PTE_ADDR_MASK   0x000FFFFFFFFFF000ULL
+#define PTE_ADDR_MASK_2M 0x000FFFFFFFE00000ULL
+#define PTE_ADDR_MASK_1G 0x000FFFFFC0000000ULL
+
+// The PAT bit sits at bit 12 in huge leaves and at bit 7 in 4KB PTEs
+#define PTE_PAT_HUGE  (1ULL << 12)
+#define PTE_PAT_4K    (1ULL << 7)
+
+// Attribute bits of a leaf entry (everything but the frame address)
+#define PTE_ATTR_MASK (~PTE_ADDR_MASK)
+
+// Table levels, counted from the leaf up
+#define LEVEL_PT   1
+#define LEVEL_PD   2
+#define LEVEL_PDPT 3
+#define LEVEL_PML4 4
+
+static bool has_1g_pages = false;
+
+// Frame every lazily reserved page reads from until its first write
+static uint64_t zero_page_phys = 0;
 
 // Helper to access CPU CR3 register
 static uint64_t read_cr3() {
@@ -15,67 +40,118 @@ static void invlpg(uint64_t addr) {
     asm volatile("invlpg (%0)" :: "r"(addr) : "memory");
 }
 
+static uint64_t* get_pml4() {
+    uint64_t pml4_phys = read_cr3() & PTE_ADDR_MASK;
+    return (uint64_t*)(pml4_phys + g_hhdm_offset);
+}
+
+static uint64_t* table_from_entry(uint64_t entry) {
+    return (uint64_t*)((entry & PTE_ADDR_MASK) + g_hhdm_offset);
+}
+
 void vmm_init() {
     // We stick to the Limine-provided page table for now.
-    printf("VMM: Initialized (Using existing PML4)\n");
+    // CPUID 0x80000001 EDX bit 26: 1GB pages (PDPE1GB)
+    uint32_t eax, ebx, ecx, edx;
+    asm volatile("cpuid" : "=a"(eax), "=b"(ebx), "=c"(ecx), "=d"(edx) : "a"(0x80000001), "c"(0));
+    has_1g_pages = (edx >> 26) & 1;
+
+    // CR0.WP: kernel writes to read-only (copy-on-write) pages must fault
+    // like user writes do. Limine already sets it; make sure.
+    uint64_t cr0;
+    asm volatile("mov %%cr0, %0" : "=r"(cr0));
+    asm volatile("mov %0, %%cr0" :: "r"(cr0 | (1ULL << 16)));
+
+    zero_page_phys = (uint64_t)pmm_alloc(1);
+    if (zero_page_phys) memset((void*)(zero_page_phys + g_hhdm_offset), 0, PAGE_SIZE);
+
+    printf("VMM: Initialized (Using existing PML4, 2MB pages%s)\n",
+        has_1g_pages ? ", 1GB pages" : "");
+}
+
+// Allocates a zeroed page table. There is no way to recover from running
+// out of memory in the middle of a walk, so this halts.
+static uint64_t* alloc_table(uint64_t* phys_out) {
+    void* new_table_phys = pmm_alloc(1); // 1 page
+    if (!new_table_phys) {
+        printf("VMM: PANIC! OOM while allocating page table.\n");
+        while(1) asm("hlt");
+    }
+
+    // Zero it out (crucial!)
+    void* new_table_virt = (void*)((uint64_t)new_table_phys + g_hhdm_offset);
+    memset(new_table_virt, 0, PAGE_SIZE);
+    *phys_out = (uint64_t)new_table_phys;
+    return (uint64_t*)new_table_virt;
+}
+
+// Replaces the huge leaf in 'slot' with a table of 512 smaller entries
+// mapping the same frames with the same attributes. A 1GB page becomes
+// 2MB pages, a 2MB page becomes 4KB pages. 'virt' is any address inside
+// the huge page, used to flush its TLB entry.
+static uint64_t* split_huge(uint64_t* slot, int level, uint64_t virt) {
+    uint64_t entry = *slot;
+    uint64_t table_phys;
+    uint64_t* table = alloc_table(&table_phys);
+
+    if (level == LEVEL_PDPT) {
+        // Children stay huge; PAT keeps its position
+        uint64_t base = entry & PTE_ADDR_MASK_1G;
+        uint64_t attrs = (entry & PTE_ATTR_MASK) | (entry & PTE_PAT_HUGE);
+        for (uint64_t i = 0; i < 512; i++) {
+            table[i] = (base + i * PAGE_SIZE_2M) | attrs;
+        }
+    } else {
+        uint64_t base = entry & PTE_ADDR_MASK_2M;
+        uint64_t attrs = entry & PTE_ATTR_MASK & ~PTE_HUGE;
+        if (entry & PTE_PAT_HUGE) attrs |= PTE_PAT_4K;
+        for (uint64_t i = 0; i < 512; i++) {
+            table[i] = (base + i * PAGE_SIZE) | attrs;
+        }
+    }
+
+    // User | RW | Present, the leaves carry the real permissions
+    *slot = table_phys | PTE_USER | PTE_RW | PTE_PRESENT;
+
+    // One invlpg drops the whole huge translation
+    invlpg(virt);
+    return table;
 }
 
 // Returns the pointer to the next level table (Virtual Address).
-// If alloc is true, it creates the table if missing.
-static uint64_t* get_next_level(uint64_t* current_level, uint64_t index, bool alloc) {
+// 'level' is the level of current_level (LEVEL_PDPT for a PDPT, etc).
+// If alloc is true, it creates the table if missing and splits a huge
+// page found in the way. Without alloc, huge pages end the walk (nullptr).
+static uint64_t* get_next_level(uint64_t* current_level, uint64_t index, bool alloc,
+                                int level, uint64_t virt) {
     uint64_t entry = current_level[index];
 
     // Check if the entry is present
     if (entry & PTE_PRESENT) {
-        // CRITICAL FIX: Check for Huge Page bit (Bit 7).
-        // If we encounter a Huge Page while trying to traverse down, 
-        // we essentially hit a "leaf" where we expected a "branch".
-        // For this simple OS, we will DESTROY the huge page mapping 
-        // to allow allocating a granular 4KB page table here.
-        // This creates a "hole" in the identity map, which is acceptable 
-        // for remapping user space over unused lower RAM.
-        if (entry & PTE_HUGE) {
-            // Only clear if we intend to allocate (modify)
-            if (alloc) {
-                // printf("VMM: Breaking Huge Page at index %d\n", (int)index);
-                current_level[index] = 0;
-                // Fall through to allocation logic below
-            } else {
-                // If not allocating, we can't traverse deeper into a huge page
-                // without complex splitting logic. Return null.
-                return nullptr;
-            }
-        } else {
+        if (!(entry & PTE_HUGE)) {
             // Normal Page Table pointer. Mask flags to get physical address.
-            uint64_t phys = entry & 0x000FFFFFFFFFF000;
-            return (uint64_t*)(phys + g_hhdm_offset);
+            return table_from_entry(entry);
         }
+        if (!alloc) return nullptr;
+        return split_huge(&current_level[index], level, virt);
     }
 
     if (!alloc) return nullptr;
 
     // Allocate a new table
-    void* new_table_phys = pmm_alloc(1); // 1 page
-    if (!new_table_phys) {
-        printf("VMM: PANIC! OOM while allocating page table.\n");
-        while(1) asm("hlt");
-    }
-
-    // Zero it out (crucial!)
-    void* new_table_virt = (void*)((uint64_t)new_table_phys + g_hhdm_offset);
-    memset(new_table_virt, 0, PAGE_SIZE);
+    uint64_t table_phys;
+    uint64_t* table = alloc_table(&table_phys);
 
     // Write the entry into the current level
     // User | RW | Present
-    current_level[index] = (uint64_t)new_table_phys | PTE_USER | PTE_RW | PTE_PRESENT;
+    current_level[index] = table_phys | PTE_USER | PTE_RW | PTE_PRESENT;
 
-    return (uint64_t*)new_table_virt;
+    return table;
 }
 
 void vmm_map_page(uint64_t virt, uint64_t phys, uint64_t flags) {
     // 1. Get PML4 (Top Level)
-    uint64_t pml4_phys = read_cr3() & 0x000FFFFFFFFFF000;
-    uint64_t* pml4 = (uint64_t*)(pml4_phys + g_hhdm_offset);
+    uint64_t* pml4 = get_pml4();
 
     // 2. Calculate Indices
     uint64_t pml4_idx = (virt >> 39) & 0x1FF;
@@ -83,75 +159,425 @@ void vmm_map_page(uint64_t virt, uint64_t phys, uint64_t flags) {
     uint64_t pd_idx   = (virt >> 21) & 0x1FF;
     uint64_t pt_idx   = (virt >> 12) & 0x1FF;
 
-    // 3. Walk the tree
-    uint64_t* pdpt = get_next_level(pml4, pml4_idx, true);
+    // 3. Walk the tree (splitting any huge page that covers virt)
+    uint64_t* pdpt = get_next_level(pml4, pml4_idx, true, LEVEL_PML4, virt);
     if (!pdpt) return; // Should panic
     
-    uint64_t* pd   = get_next_level(pdpt, pdpt_idx, true);
+    uint64_t* pd   = get_next_level(pdpt, pdpt_idx, true, LEVEL_PDPT, virt);
     if (!pd) return;
     
-    uint64_t* pt   = get_next_level(pd, pd_idx, true);
+    uint64_t* pt   = get_next_level(pd, pd_idx, true, LEVEL_PD, virt);
     if (!pt) return;
 
     // 4. Set the Page Table Entry
+    uint64_t old = pt[pt_idx];
     pt[pt_idx] = phys | flags;
 
-    // 5. Invalidate TLB
-    invlpg(virt);
+    // 5. Invalidate TLB. Other cores can only hold the old translation
+    // if there was one.
+    if (old & PTE_PRESENT) tlb_flush_range(virt, PAGE_SIZE);
+    else invlpg(virt);
+}
+
+// Installs a huge leaf at 'level' if the slot is empty or already a huge
+// leaf. A slot holding a page table is left alone (it may still map other
+// pages), and the caller falls back to smaller pages.
+static bool map_huge(uint64_t virt, uint64_t phys, uint64_t flags, int level) {
+    uint64_t* pml4 = get_pml4();
+    uint64_t* pdpt = get_next_level(pml4, (virt >> 39) & 0x1FF, true, LEVEL_PML4, virt);
+
+    uint64_t* slot;
+    if (level == LEVEL_PDPT) {
+        slot = &pdpt[(virt >> 30) & 0x1FF];
+    } else {
+        uint64_t* pd = get_next_level(pdpt, (virt >> 30) & 0x1FF, true, LEVEL_PDPT, virt);
+        slot = &pd[(virt >> 21) & 0x1FF];
+    }
+
+    uint64_t old = *slot;
+    if ((old & PTE_PRESENT) && !(old & PTE_HUGE)) return false;
+
+    *slot = phys | flags | PTE_HUGE;
+    if (old & PTE_PRESENT) tlb_flush_range(virt, level == LEVEL_PDPT ? PAGE_SIZE_1G : PAGE_SIZE_2M);
+    else invlpg(virt);
+    return true;
+}
+
+void vmm_map_range(uint64_t virt, uint64_t phys, uint64_t size, uint64_t flags) {
+    uint64_t end = virt + ((size + PAGE_SIZE - 1) & ~(uint64_t)(PAGE_SIZE - 1));
+
+    while (virt < end) {
+        uint64_t left = end - virt;
+        uint64_t align = virt | phys;
+
+        if (has_1g_pages && left >= PAGE_SIZE_1G && (align & (PAGE_SIZE_1G - 1)) == 0 &&
+            map_huge(virt, phys, flags, LEVEL_PDPT)) {
+            virt += PAGE_SIZE_1G;
+            phys += PAGE_SIZE_1G;
+        } else if (left >= PAGE_SIZE_2M && (align & (PAGE_SIZE_2M - 1)) == 0 &&
+                   map_huge(virt, phys, flags, LEVEL_PD)) {
+            virt += PAGE_SIZE_2M;
+            phys += PAGE_SIZE_2M;
+        } else {
+            vmm_map_page(virt, phys, flags);
+            virt += PAGE_SIZE;
+            phys += PAGE_SIZE;
+        }
+    }
+}
+
+// Finds the leaf entry mapping virt without modifying the tables.
+// Returns nullptr if unmapped; page_size receives 4KB, 2MB or 1GB.
+static uint64_t* lookup_leaf(uint64_t virt, uint64_t* page_size) {
+    uint64_t* pml4 = get_pml4();
+
+    uint64_t e4 = pml4[(virt >> 39) & 0x1FF];
+    if (!(e4 & PTE_PRESENT)) return nullptr;
+
+    uint64_t* pdpt = table_from_entry(e4);
+    uint64_t* e3 = &pdpt[(virt >> 30) & 0x1FF];
+    if (!(*e3 & PTE_PRESENT)) return nullptr;
+    if (*e3 & PTE_HUGE) {
+        *page_size = PAGE_SIZE_1G;
+        return e3;
+    }
+
+    uint64_t* pd = table_from_entry(*e3);
+    uint64_t* e2 = &pd[(virt >> 21) & 0x1FF];
+    if (!(*e2 & PTE_PRESENT)) return nullptr;
+    if (*e2 & PTE_HUGE) {
+        *page_size = PAGE_SIZE_2M;
+        return e2;
+    }
+
+    uint64_t* pt = table_from_entry(*e2);
+    uint64_t* e1 = &pt[(virt >> 12) & 0x1FF];
+    if (!(*e1 & PTE_PRESENT)) return nullptr;
+    *page_size = PAGE_SIZE;
+    return e1;
+}
+
+// --- Copy-on-write ---
+// A COW page is mapped read-only with PTE_COW set. Frames mapped by more
+// than one page carry a reference count in a small open addressed table;
+// a COW frame missing from it has a single owner. The zero page is never
+// counted and never freed.
+#define COW_TABLE_SIZE 4096 // Power of two
+
+struct CowRef {
+    uint64_t frame; // 0 = empty slot
+    uint64_t count;
+};
+
+static CowRef cow_refs[COW_TABLE_SIZE];
+static uint64_t cow_used = 0;
+static Spinlock cow_lock;
+
+static uint64_t cow_slot(uint64_t frame) {
+    return ((frame >> 12) * 0x9E3779B97F4A7C15ULL) >> (64 - 12);
+}
+
+static CowRef* cow_find(uint64_t frame) {
+    for (uint64_t i = cow_slot(frame), n = 0; n < COW_TABLE_SIZE; i = (i + 1) & (COW_TABLE_SIZE - 1), n++) {
+        if (cow_refs[i].frame == frame) return &cow_refs[i];
+        if (cow_refs[i].frame == 0) return nullptr;
+    }
+    return nullptr;
+}
+
+// Adds a sharer. Returns false if the table is full (caller copies instead).
+static bool cow_get(uint64_t frame) {
+    CowRef* ref = cow_find(frame);
+    if (ref) {
+        ref->count++;
+        return true;
+    }
+    // Keep some slack so probe chains stay short
+    if (cow_used >= COW_TABLE_SIZE * 3 / 4) return false;
+
+    uint64_t i = cow_slot(frame);
+    while (cow_refs[i].frame) i = (i + 1) & (COW_TABLE_SIZE - 1);
+    cow_refs[i].frame = frame;
+    cow_refs[i].count = 2; // The original mapping and the new one
+    cow_used++;
+    return true;
+}
+
+// Removes an entry, shifting later members of its probe chain back
+static void cow_remove(CowRef* ref) {
+    uint64_t hole = ref - cow_refs;
+    uint64_t i = hole;
+    cow_refs[hole].frame = 0;
+    cow_used--;
+
+    while (true) {
+        i = (i + 1) & (COW_TABLE_SIZE - 1);
+        if (cow_refs[i].frame == 0) return;
+        uint64_t home = cow_slot(cow_refs[i].frame);
+        // Move i into the hole unless its home lies in (hole, i]
+        bool stays = (hole <= i) ? (home > hole && home <= i) : (home > hole || home <= i);
+        if (stays) continue;
+        cow_refs[hole] = cow_refs[i];
+        cow_refs[i].frame = 0;
+        hole = i;
+    }
+}
+
+// Drops one sharer of 'frame'. Returns true if someone else still maps it
+// (the frame must not be freed or written), false if the caller was the
+// last one and now owns it outright.
+static bool cow_put(uint64_t frame) {
+    if (frame == zero_page_phys) return true;
+    CowRef* ref = cow_find(frame);
+    if (!ref) return false;
+    if (--ref->count <= 1) cow_remove(ref);
+    return true;
+}
+
+// Locked cow_put for the unmap path
+static bool cow_is_shared_release(uint64_t frame) {
+    if (frame == zero_page_phys) return true;
+    ScopedLock lock(cow_lock);
+    return cow_put(frame);
+}
+
+// Clears the mapping at virt without touching the TLB. A huge page that
+// lies entirely inside [virt, end) goes whole; otherwise it is split and
+// only the 4KB page at virt goes. Returns how many bytes were stepped over
+// and, through frame/frame_pages, what was mapped there (0 if nothing).
+static uint64_t clear_mapping(uint64_t virt, uint64_t end, uint64_t* frame, uint64_t* frame_pages) {
+    *frame = 0;
+    *frame_pages = 0;
+
+    uint64_t page_size = PAGE_SIZE;
+    uint64_t* leaf = lookup_leaf(virt, &page_size);
+    if (!leaf) return PAGE_SIZE;
+
+    if (page_size > PAGE_SIZE) {
+        if ((virt & (page_size - 1)) == 0 && end - virt >= page_size) {
+            *frame = *leaf & (page_size == PAGE_SIZE_1G ? PTE_ADDR_MASK_1G : PTE_ADDR_MASK_2M);
+            *frame_pages = page_size / PAGE_SIZE;
+            *leaf = 0;
+            return page_size;
+        }
+
+        // Split down to 4KB; the walk below cannot fail on present tables
+        uint64_t* pml4 = get_pml4();
+        uint64_t* pdpt = get_next_level(pml4, (virt >> 39) & 0x1FF, false, LEVEL_PML4, virt);
+        uint64_t* pd = get_next_level(pdpt, (virt >> 30) & 0x1FF, true, LEVEL_PDPT, virt);
+        uint64_t* pt = get_next_level(pd, (virt >> 21) & 0x1FF, true, LEVEL_PD, virt);
+        leaf = &pt[(virt >> 12) & 0x1FF];
+    }
+
+    *frame = *leaf & PTE_ADDR_MASK;
+    *frame_pages = 1;
+    *leaf = 0;
+    return PAGE_SIZE;
 }
 
 void vmm_unmap_page(uint64_t virt) {
-    uint64_t pml4_phys = read_cr3() & 0x000FFFFFFFFFF000;
-    uint64_t* pml4 = (uint64_t*)(pml4_phys + g_hhdm_offset);
+    uint64_t frame, frame_pages;
+    clear_mapping(virt, virt + PAGE_SIZE, &frame, &frame_pages);
+    if (frame_pages) tlb_flush_range(virt, PAGE_SIZE);
+}
 
-    uint64_t pml4_idx = (virt >> 39) & 0x1FF;
-    uint64_t pdpt_idx = (virt >> 30) & 0x1FF;
-    uint64_t pd_idx   = (virt >> 21) & 0x1FF;
-    uint64_t pt_idx   = (virt >> 12) & 0x1FF;
+void vmm_unmap_range(uint64_t virt, uint64_t size) {
+    uint64_t start = virt;
+    uint64_t end = virt + ((size + PAGE_SIZE - 1) & ~(uint64_t)(PAGE_SIZE - 1));
+    bool any = false;
 
-    uint64_t* pdpt = get_next_level(pml4, pml4_idx, false);
-    if (!pdpt) return;
-    uint64_t* pd = get_next_level(pdpt, pdpt_idx, false);
-    if (!pd) return;
-    uint64_t* pt = get_next_level(pd, pd_idx, false);
-    if (!pt) return;
+    while (virt < end) {
+        uint64_t frame, frame_pages;
+        virt += clear_mapping(virt, end, &frame, &frame_pages);
+        if (frame_pages) any = true;
+    }
 
-    // Clear presence bit
-    pt[pt_idx] = 0;
-    invlpg(virt);
+    // One flush (and at most one shootdown) for the whole range
+    if (any) tlb_flush_range(start, end - start);
+}
+
+// Frames are only handed back once no TLB can reach them any more,
+// so they are collected in batches between flushes.
+#define VMM_FREE_BATCH 64
+
+void vmm_unmap_and_free(uint64_t virt, uint64_t size) {
+    uint64_t end = virt + ((size + PAGE_SIZE - 1) & ~(uint64_t)(PAGE_SIZE - 1));
+    uint64_t frames[VMM_FREE_BATCH];
+    uint64_t counts[VMM_FREE_BATCH];
+
+    while (virt < end) {
+        uint64_t batch_start = virt;
+        int n = 0;
+
+        while (virt < end && n < VMM_FREE_BATCH) {
+            virt += clear_mapping(virt, end, &frames[n], &counts[n]);
+            if (counts[n]) n++;
+        }
+        if (n == 0) continue;
+
+        tlb_flush_range(batch_start, virt - batch_start);
+        for (int i = 0; i < n; i++) {
+            // Shared frames stay with their other mappings
+            if (counts[i] == 1 && cow_is_shared_release(frames[i])) continue;
+            pmm_free((void*)frames[i], counts[i]);
+        }
+    }
 }
 
 uint64_t vmm_virt_to_phys(uint64_t virt) {
-    uint64_t pml4_phys = read_cr3() & 0x000FFFFFFFFFF000;
-    uint64_t* pml4 = (uint64_t*)(pml4_phys + g_hhdm_offset);
+    uint64_t page_size = 0;
+    uint64_t* leaf = lookup_leaf(virt, &page_size);
+    if (!leaf) return 0;
 
-    uint64_t pml4_idx = (virt >> 39) & 0x1FF;
-    uint64_t pdpt_idx = (virt >> 30) & 0x1FF;
-    uint64_t pd_idx   = (virt >> 21) & 0x1FF;
-    uint64_t pt_idx   = (virt >> 12) & 0x1FF;
+    if (page_size == PAGE_SIZE_1G) return (*leaf & PTE_ADDR_MASK_1G) + (virt & (PAGE_SIZE_1G - 1));
+    if (page_size == PAGE_SIZE_2M) return (*leaf & PTE_ADDR_MASK_2M) + (virt & (PAGE_SIZE_2M - 1));
+    return (*leaf & PTE_ADDR_MASK) + (virt & 0xFFF);
+}
 
-    uint64_t* pdpt = get_next_level(pml4, pml4_idx, false);
-    if (!pdpt) return 0;
-    
-    // Check if PDPT entry is Huge (1GB page)
-    if (pml4[pml4_idx] & PTE_HUGE) {
-         uint64_t base = pml4[pml4_idx] & 0x000FFFFFC0000000; // 1GB align
-         return base + (virt & 0x3FFFFFFF);
+uint64_t* vmm_get_pte(uint64_t virt, bool alloc) {
+    uint64_t* pml4 = get_pml4();
+
+    uint64_t* pdpt = get_next_level(pml4, (virt >> 39) & 0x1FF, alloc, LEVEL_PML4, virt);
+    if (!pdpt) return nullptr;
+    uint64_t* pd = get_next_level(pdpt, (virt >> 30) & 0x1FF, alloc, LEVEL_PDPT, virt);
+    if (!pd) return nullptr;
+    uint64_t* pt = get_next_level(pd, (virt >> 21) & 0x1FF, alloc, LEVEL_PD, virt);
+    if (!pt) return nullptr;
+
+    return &pt[(virt >> 12) & 0x1FF];
+}
+
+uint64_t vmm_get_page_size(uint64_t virt) {
+    uint64_t page_size = 0;
+    if (!lookup_leaf(virt, &page_size)) return 0;
+    return page_size;
+}
+
+void vmm_reserve_range(uint64_t virt, uint64_t size, uint64_t flags) {
+    uint64_t start = virt;
+    uint64_t end = virt + ((size + PAGE_SIZE - 1) & ~(uint64_t)(PAGE_SIZE - 1));
+    bool replaced = false;
+
+    // Read-only view of the zero page; writable reservations get PTE_COW
+    // so the first write swaps in a private frame
+    uint64_t entry = zero_page_phys | (flags & ~PTE_RW) | PTE_PRESENT;
+    if (flags & PTE_RW) entry |= PTE_COW;
+
+    for (; virt < end; virt += PAGE_SIZE) {
+        uint64_t* pte = vmm_get_pte(virt, true);
+        if (*pte & PTE_PRESENT) replaced = true;
+        *pte = entry;
     }
 
-    uint64_t* pd = get_next_level(pdpt, pdpt_idx, false);
-    if (!pd) return 0;
-    
-    // Check if PD entry is Huge (2MB page)
-    if (pdpt[pdpt_idx] & PTE_HUGE) {
-        uint64_t base = pdpt[pdpt_idx] & 0x000FFFFFFFE00000; // 2MB align mask
-        return base + (virt & 0x1FFFFF);
+    if (replaced) tlb_flush_range(start, end - start);
+}
+
+void vmm_share_range(uint64_t dst, uint64_t src, uint64_t size) {
+    uint64_t src_start = src;
+    uint64_t end = src + ((size + PAGE_SIZE - 1) & ~(uint64_t)(PAGE_SIZE - 1));
+    ScopedLock lock(cow_lock);
+
+    for (; src < end; src += PAGE_SIZE, dst += PAGE_SIZE) {
+        uint64_t* src_pte = vmm_get_pte(src, true);
+        if (!(*src_pte & PTE_PRESENT)) continue;
+
+        uint64_t frame = *src_pte & PTE_ADDR_MASK;
+        uint64_t attrs = *src_pte & PTE_ATTR_MASK & ~(PTE_ACCESSED | PTE_DIRTY);
+        uint64_t* dst_pte = vmm_get_pte(dst, true);
+
+        if (frame != zero_page_phys && !cow_get(frame)) {
+            // Table full: fall back to a private copy
+            void* copy = pmm_alloc(1);
+            if (!copy) continue;
+            memcpy((void*)((uint64_t)copy + g_hhdm_offset), (void*)(frame + g_hhdm_offset), PAGE_SIZE);
+            *dst_pte = (uint64_t)copy | attrs;
+            continue;
+        }
+
+        // Writable pages turn into COW on both sides
+        if (attrs & (PTE_RW | PTE_COW)) {
+            attrs = (attrs & ~PTE_RW) | PTE_COW;
+            *src_pte = frame | attrs;
+        }
+        *dst_pte = frame | attrs;
+    }
+
+    // The source lost its write permission on every core
+    tlb_flush_range(src_start, end - src_start);
+}
+
+bool vmm_handle_fault(uint64_t addr, uint64_t error_code) {
+    // Only writes to present pages can be COW breaks
+    if ((error_code & 0x3) != 0x3) return false;
+    uint64_t virt = addr & ~(uint64_t)(PAGE_SIZE - 1);
+
+    // Interrupts are off; keep answering shootdowns while we wait
+    while (!cow_lock.try_lock()) {
+        smp_call_poll();
+        asm volatile("pause");
     }
 
-    uint64_t* pt = get_next_level(pd, pd_idx, false);
-    if (!pt) return 0;
+    bool resolved = false;
+    uint64_t* pte = vmm_get_pte(virt, false);
+    if (pte && (*pte & PTE_PRESENT)) {
+        uint64_t entry = *pte;
+        if (entry & PTE_RW) {
+            resolved = true; // Broken by another core meanwhile
+        } else if (entry & PTE_COW) {
+            uint64_t frame = entry & PTE_ADDR_MASK;
+            uint64_t attrs = (entry & PTE_ATTR_MASK & ~(PTE_COW | PTE_ACCESSED | PTE_DIRTY)) | PTE_RW;
 
-    if (!(pt[pt_idx] & PTE_PRESENT)) return 0;
+            if (!cow_put(frame)) {
+                // Last sharer: take the frame over as is
+                *pte = frame | attrs;
+                resolved = true;
+            } else {
+                void* copy = pmm_alloc(1);
+                if (copy) {
+                    void* dst = (void*)((uint64_t)copy + g_hhdm_offset);
+                    if (frame == zero_page_phys) memset(dst, 0, PAGE_SIZE);
+                    else memcpy(dst, (void*)(frame + g_hhdm_offset), PAGE_SIZE);
+                    *pte = (uint64_t)copy | attrs;
+                    resolved = true;
+                } else if (frame != zero_page_phys) {
+                    cow_get(frame); // Undo, the page stays shared
+                }
+            }
 
-    return (pt[pt_idx] & 0x000FFFFFFFFFF000) + (virt & 0xFFF);
-}
\ No newline at end of file
+            // Other cores may still hold the read-only translation
+            if (resolved) tlb_flush_range(virt, PAGE_SIZE);
+        }
+    }
+
+    cow_lock.unlock();
+    return resolved;
+}
+
+bool vmm_self_test() {
+    // Scratch window in the loader's kernel program area (unused at boot)
+    const uint64_t base = 0xFFFFF00000000000ULL + 0x10000000;
+    bool ok = true;
+
+    // Lazy zero-fill: reads come from the zero page, a write gets a frame
+    vmm_reserve_range(base, 4 * PAGE_SIZE, PTE_PRESENT | PTE_RW | PTE_NX);
+    volatile uint64_t* a = (volatile uint64_t*)base;
+    if (a[0] != 0 || vmm_virt_to_phys(base) != zero_page_phys) ok = false;
+    a[0] = 0x1122334455667788ULL;
+    if (a[0] != 0x1122334455667788ULL || vmm_virt_to_phys(base) == zero_page_phys) ok = false;
+    if (vmm_virt_to_phys(base + PAGE_SIZE) != zero_page_phys) ok = false;
+
+    // COW: both views see the data, a write on one side leaves the other alone
+    uint64_t dst = base + 4 * PAGE_SIZE;
+    vmm_share_range(dst, base, PAGE_SIZE);
+    volatile uint64_t* b = (volatile uint64_t*)dst;
+    if (b[0] != 0x1122334455667788ULL || vmm_virt_to_phys(dst) != vmm_virt_to_phys(base)) ok = false;
+    b[0] = 42;
+    if (a[0] != 0x1122334455667788ULL || b[0] != 42) ok = false;
+    a[0] = 7; // Last sharer: takes the frame over without a copy
+    if (a[0] != 7 || b[0] != 42) ok = false;
+
+    vmm_unmap_and_free(base, 5 * PAGE_SIZE);
+
+    printf("VMM: Zero-fill/COW self test %s\n", ok ? "passed" : "FAILED");
+    return ok;
+}
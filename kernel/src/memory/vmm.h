@@ -12,8 +12,12 @@
 #define PTE_ACCESSED  (1ULL << 5)
 #define PTE_DIRTY     (1ULL << 6)
 #define PTE_HUGE      (1ULL << 7) // Huge Page (2MB/1GB)
+#define PTE_COW       (1ULL << 9) // Software: copy on write (mapped read-only)
 #define PTE_NX        (1ULL << 63)// No Execute
 
+#define PAGE_SIZE_2M  0x200000ULL
+#define PAGE_SIZE_1G  0x40000000ULL
+
 // Initialize VMM (stores current PML4)
 void vmm_init();
 
@@ -23,10 +27,49 @@ void vmm_init();
 // flags: PTE flags
 void vmm_map_page(uint64_t virt, uint64_t phys, uint64_t flags);
 
-// Unmap a page
+// Map a physically contiguous range. Uses 1GB and 2MB pages wherever
+// virt/phys alignment and the remaining size allow, 4KB pages elsewhere.
+// size is rounded up to a whole page.
+void vmm_map_range(uint64_t virt, uint64_t phys, uint64_t size, uint64_t flags);
+
+// Unmap a page (and flush it on all cores). A huge page covering it is
+// split first.
 void vmm_unmap_page(uint64_t virt);
 
+// Unmap a range. Huge pages fully inside it are dropped whole.
+// The TLB is flushed once for the whole range, on every core.
+void vmm_unmap_range(uint64_t virt, uint64_t size);
+
+// Unmap a range and return the frames behind it to the PMM, after the
+// TLBs on all cores have been flushed.
+void vmm_unmap_and_free(uint64_t virt, uint64_t size);
+
 // Helper: Get physical address of a virtual one
 uint64_t vmm_virt_to_phys(uint64_t virt);
 
+// Pointer to the 4KB page table entry for virt, for callers that manage
+// entries themselves (swap, fault handlers). With alloc, missing tables
+// are created and huge pages split; without it, nullptr if there is no
+// page table for virt. The caller flushes the TLB after changing it.
+uint64_t* vmm_get_pte(uint64_t virt, bool alloc);
+
+// Size of the page mapping virt (4KB, 2MB or 1GB), 0 if unmapped
+uint64_t vmm_get_page_size(uint64_t virt);
+
+// Reserve a range without backing it: every page maps the shared zero page
+// read-only. With PTE_RW in flags the first write to a page faults and
+// gives it a private zeroed frame, so only touched pages cost memory.
+void vmm_reserve_range(uint64_t virt, uint64_t size, uint64_t flags);
+
+// Map the frames behind [src, src + size) at dst as well. Writable pages
+// become copy-on-write on both sides; the first writer gets a private copy.
+void vmm_share_range(uint64_t dst, uint64_t src, uint64_t size);
+
+// Page fault hook (vector 14): resolves writes to COW/zero pages.
+// Returns true if the faulting access can be retried.
+bool vmm_handle_fault(uint64_t addr, uint64_t error_code);
+
+// Boot-time check of zero-fill and COW fault handling
+bool vmm_self_test();
+
 #endif
\ No newline at end of file
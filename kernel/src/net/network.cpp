@@ -8,14 +8,63 @@
 #include "../gui/window.h" // Added for UI updates
 #include "../globals.h"     // Added for g_renderer
 #include "../input.h"       // Added for check_input_hooks
+#include "../sys/sched.h"
+#include "../sys/timer_wheel.h"
 
-NetworkStack::NetworkStack() : arp_resolved(false), ping_active(false), dns_active(false), active_tcp_socket(nullptr) {
+#define NET_POLL_MS   1
+#define NET_FRAME_NS  (1000000000ULL / 60)
+
+NetworkStack::NetworkStack() : query_lock("net query"), arp_busy(false), arp_resolved(false), ping_active(false),
+                               dns_active(false), active_tcp_socket(nullptr), rx_lock("net rx") {
     my_ip = htonl((10 << 24) | (0 << 16) | (2 << 8) | 15);
     gateway_ip = htonl((10 << 24) | (0 << 16) | (2 << 8) | 2);
     dns_ip = htonl((10 << 24) | (0 << 16) | (2 << 8) | 3);
     max_udp_speed = 0;
 }
 
+static bool flag_set(void* flag) {
+    return *(volatile bool*)flag;
+}
+
+bool NetworkStack::claim_query(void* busy) {
+    ScopedIrqLock guard(getInstance().query_lock);
+    if (*(bool*)busy) return false;
+    *(bool*)busy = true;
+    return true;
+}
+
+static void wait_expired(void* arg) {
+    *(volatile bool*)arg = true;
+}
+
+// The timeout is a timer wheel entry; the loop itself sleeps between
+// checks (replies arrive from the e1000 interrupt) and on kmain redraws
+// the UI at frame rate so the desktop doesn't freeze while we wait.
+bool NetworkStack::wait_until(bool (*ready)(void* ctx), void* ctx, uint64_t timeout_ms) {
+    volatile bool expired = false;
+    Timer timeout;
+    timer_init(&timeout);
+    timer_add(&timeout, clock_ns() + timeout_ms * 1000000ULL, wait_expired, (void*)&expired);
+
+    // Threads (browser loader, ...) must leave the window manager alone
+    bool pump_ui = thread_is_kmain();
+    uint64_t next_frame = 0;
+
+    bool ok;
+    while (!(ok = ready(ctx)) && !expired) {
+        if (pump_ui && clock_ns() >= next_frame) {
+            check_input_hooks();
+            WindowManager::getInstance().update();
+            if (g_renderer) WindowManager::getInstance().render(g_renderer);
+            next_frame = clock_ns() + NET_FRAME_NS;
+        }
+        sleep_ms(NET_POLL_MS);
+    }
+
+    timer_cancel(&timeout);
+    return ok;
+}
+
 NetworkStack& NetworkStack::getInstance() {
     static NetworkStack instance;
     return instance;
@@ -29,10 +78,13 @@ void NetworkStack::init() {
 }
 
 void NetworkStack::register_tcp_socket(TcpSocket* sock) {
+    ScopedIrqLock guard(rx_lock);
     active_tcp_socket = sock;
 }
 
+// Once this returns no packet is being delivered to sock, or will be
 void NetworkStack::unregister_tcp_socket(TcpSocket* sock) {
+    ScopedIrqLock guard(rx_lock);
     if (active_tcp_socket == sock) active_tcp_socket = nullptr;
 }
 
@@ -108,26 +160,19 @@ void NetworkStack::send_arp_request(uint32_t target_ip) {
 }
 
 bool NetworkStack::resolve_arp(uint32_t ip, uint8_t* mac_out) {
-    arp_resolved = false;
-    arp_target_ip = ip;
+    if (!wait_until(claim_query, &arp_busy, 2000)) return false;
+    {
+        ScopedIrqLock guard(query_lock);
+        arp_resolved = false;
+        arp_target_ip = ip;
+    }
     send_arp_request(ip);
 
-    uint64_t start = rdtsc_serialized();
-    uint64_t freq = get_cpu_frequency();
-    
-    while (true) {
-        if (arp_resolved) {
-            memcpy(mac_out, arp_result_mac, 6);
-            return true;
-        }
-        if (rdtsc_serialized() - start > freq * 2) break;
-        
-        // Keep UI alive while waiting
-        check_input_hooks();
-        WindowManager::getInstance().update();
-        if (g_renderer) WindowManager::getInstance().render(g_renderer);
-    }
-    return false;
+    bool ok = wait_until(flag_set, &arp_resolved, 2000);
+    ScopedIrqLock guard(query_lock);
+    if (ok) memcpy(mac_out, arp_result_mac, 6);
+    arp_busy = false;
+    return ok;
 }
 
 bool NetworkStack::send_udp(uint32_t dest_ip, uint16_t dest_port, uint16_t src_port, const void* data, uint16_t len) {
@@ -178,11 +223,13 @@ void NetworkStack::handle_packet(const uint8_t* data, uint16_t len) {
     if (len < sizeof(EthernetHeader)) return;
     EthernetHeader* eth = (EthernetHeader*)data;
     uint16_t type = ntohs(eth->type);
+    ScopedIrqLock rx_guard(rx_lock);
 
     if (type == ETH_TYPE_ARP) {
         ARPHeader* arp = (ARPHeader*)(data + sizeof(EthernetHeader));
         if (ntohs(arp->opcode) == ARP_OP_REPLY) {
-            if (arp->src_ip == arp_target_ip) {
+            ScopedIrqLock guard(query_lock);
+            if (arp_busy && arp->src_ip == arp_target_ip) {
                 memcpy(arp_result_mac, arp->src_mac, 6);
                 arp_resolved = true;
             }
@@ -199,6 +246,7 @@ void NetworkStack::handle_packet(const uint8_t* data, uint16_t len) {
             if (ip->proto == IP_PROTO_ICMP) {
                 ICMPHeader* icmp = (ICMPHeader*)(data + sizeof(EthernetHeader) + ip_hdr_len);
                 if (icmp->type == ICMP_TYPE_ECHO_REPLY) {
+                    ScopedIrqLock guard(query_lock);
                     if (ping_active && ntohs(icmp->id) == ping_id && ntohs(icmp->seq) == ping_seq) {
                         ping_reply_recvd = true;
                     }
@@ -229,6 +277,7 @@ void NetworkStack::handle_packet(const uint8_t* data, uint16_t len) {
 void NetworkStack::handle_udp(IPv4Header* ip, UDPHeader* udp, uint8_t* data, int len) {
     (void)ip;
     (void)len; 
+    ScopedIrqLock guard(query_lock);
     if (ntohs(udp->src_port) == 53 && dns_active) {
         DNSHeader* dns = (DNSHeader*)data;
         if (ntohs(dns->id) == dns_tx_id) {
@@ -255,8 +304,7 @@ uint32_t NetworkStack::dns_lookup(const char* hostname) {
     uint8_t buf[512];
     memset(buf, 0, 512);
     DNSHeader* dns = (DNSHeader*)buf;
-    dns_tx_id = 0xABCD;
-    dns->id = htons(dns_tx_id);
+    dns->id = htons(0xABCD);
     dns->flags = htons(0x0100); 
     dns->q_count = htons(1);
     
@@ -283,32 +331,28 @@ uint32_t NetworkStack::dns_lookup(const char* hostname) {
     
     int len = qname - buf;
     
-    dns_active = true;
-    dns_resolved = false;
+    if (!wait_until(claim_query, &dns_active, 3000)) return 0;
+    {
+        ScopedIrqLock guard(query_lock);
+        dns_tx_id = 0xABCD;
+        dns_resolved = false;
+    }
     
     printf("NET: Querying DNS %d.%d.%d.%d for %s...\n", 
         dns_ip & 0xFF, (dns_ip >> 8) & 0xFF, (dns_ip >> 16) & 0xFF, (dns_ip >> 24) & 0xFF, hostname);
     
-    if (!send_udp(dns_ip, 53, 50000, buf, len)) return 0;
-    
-    uint64_t start = rdtsc_serialized();
-    uint64_t freq = get_cpu_frequency();
-    while (true) {
-        if (dns_resolved) {
-            dns_active = false;
-            return dns_result_ip;
-        }
-        if (rdtsc_serialized() - start > freq * 3) {
-            printf("NET: DNS Timeout.\n");
-            dns_active = false;
-            return 0;
-        }
-        
-        // Keep UI alive while waiting
-        check_input_hooks();
-        WindowManager::getInstance().update();
-        if (g_renderer) WindowManager::getInstance().render(g_renderer);
+    bool ok = send_udp(dns_ip, 53, 50000, buf, len) && wait_until(flag_set, &dns_resolved, 3000);
+    uint32_t result;
+    {
+        ScopedIrqLock guard(query_lock);
+        result = dns_result_ip;
+        dns_active = false;
+    }
+    if (!ok) {
+        printf("NET: DNS Timeout.\n");
+        return 0;
     }
+    return result;
 }
 
 int NetworkStack::ping(const char* ip_str) {
@@ -347,34 +391,27 @@ int NetworkStack::ping(const char* ip_str) {
     ip->dest_ip = target_ip;
     ip->checksum = checksum(ip, sizeof(IPv4Header));
     
-    ping_id = 0x1234;
-    ping_seq = 1;
     icmp->type = ICMP_TYPE_ECHO_REQUEST;
-    icmp->id = htons(ping_id);
-    icmp->seq = htons(ping_seq);
+    icmp->id = htons(0x1234);
+    icmp->seq = htons(1);
     icmp->checksum = checksum(icmp, sizeof(ICMPHeader));
 
-    ping_active = true;
-    ping_reply_recvd = false;
-    uint64_t start_time = rdtsc_serialized();
-    uint64_t cpu_freq = get_cpu_frequency();
+    if (!wait_until(claim_query, &ping_active, 1000)) return -1;
+    {
+        ScopedIrqLock guard(query_lock);
+        ping_id = 0x1234;
+        ping_seq = 1;
+        ping_reply_recvd = false;
+    }
+    uint64_t start_time = clock_ns();
     
     E1000Driver::getInstance().send_packet(packet, sizeof(EthernetHeader) + sizeof(IPv4Header) + sizeof(ICMPHeader));
     
-    while (true) {
-        if (ping_reply_recvd) {
-            uint64_t end_time = rdtsc_serialized();
-            ping_active = false;
-            return (int)((end_time - start_time) / (cpu_freq / 1000));
-        }
-        if (rdtsc_serialized() - start_time > cpu_freq) {
-            ping_active = false;
-            return -1;
-        }
-        
-        // Keep UI alive
-        check_input_hooks();
-        WindowManager::getInstance().update();
-        if (g_renderer) WindowManager::getInstance().render(g_renderer);
+    bool ok = wait_until(flag_set, &ping_reply_recvd, 1000);
+    {
+        ScopedIrqLock guard(query_lock);
+        ping_active = false;
     }
+    if (!ok) return -1;
+    return (int)((clock_ns() - start_time) / 1000000);
 }
\ No newline at end of file
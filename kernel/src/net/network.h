@@ -3,6 +3,7 @@
 
 #include <cstdint>
 #include "defs.h"
+#include "../sys/spinlock.h"
 
 // Forward declare TcpSocket to avoid circular include issues
 class TcpSocket;
@@ -25,6 +26,10 @@ public:
     // ARP Helper made public for TCP
     bool resolve_arp(uint32_t ip, uint8_t* mac_out);
     
+    // Blocks until ready(ctx) returns true or timeout_ms passes.
+    // Returns false on timeout.
+    bool wait_until(bool (*ready)(void* ctx), void* ctx, uint64_t timeout_ms);
+    
     // Getters for TCP
     uint32_t get_my_ip() { return my_ip; }
     uint32_t get_gateway_ip() { return gateway_ip; }
@@ -42,7 +47,13 @@ private:
     uint8_t  my_mac[6];
     uint64_t max_udp_speed;
 
+    // One ARP, DNS and ping query each can be in flight. A caller claims
+    // the kind it needs (arp_busy, dns_active, ping_active) and the rest
+    // goes with it; the RX path only fills in replies to a claimed query.
+    Spinlock query_lock;      // The query state below, also taken from the IRQ
+
     // ARP
+    bool     arp_busy;
     uint32_t arp_target_ip;
     uint8_t  arp_result_mac[6];
     bool     arp_resolved;
@@ -62,6 +73,14 @@ private:
     // Active TCP Socket (Simplification: Only one at a time for now)
     TcpSocket* active_tcp_socket;
 
+    // Serializes RX processing and guards active_tcp_socket, so a socket
+    // can't be unregistered while a packet is being handed to it.
+    // Order: rx_lock, then query_lock or the socket's lock.
+    Spinlock rx_lock;
+
+    // wait_until() condition: claims a query kind if it's free
+    static bool claim_query(void* busy);
+
     // Helpers
     uint32_t parse_ip(const char* str);
     void send_arp_request(uint32_t target_ip);
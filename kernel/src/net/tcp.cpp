@@ -5,15 +5,21 @@
 #include "../cppstd/stdio.h"
 #include "../cppstd/string.h"
 #include "../timer.h"
-#include "../gui/window.h"     
-#include "../globals.h"        
-#include "../input.h"          
 
-TcpSocket::TcpSocket() : state(CLOSED), rx_head(0), rx_tail(0) {
-    rx_buffer = (uint8_t*)malloc(RX_BUF_SIZE);
+TcpSocket::TcpSocket() : state(CLOSED), lock("tcp") {
+    rx_buffer = new SpscRing<uint8_t, RX_BUF_SIZE>();
     local_port = 49152 + (rdtsc_serialized() % 16384);
 }
 
+bool TcpSocket::handshake_done(void* ctx) {
+    return ((TcpSocket*)ctx)->state != SYN_SENT;
+}
+
+bool TcpSocket::rx_ready(void* ctx) {
+    TcpSocket* sock = (TcpSocket*)ctx;
+    return !sock->rx_buffer->empty() || sock->state == CLOSED;
+}
+
 // Helper to sum 16-bit words (Standard Internet Checksum logic)
 static uint32_t sum_words(const void* data, int len) {
     uint32_t sum = 0;
@@ -76,17 +82,8 @@ void TcpSocket::send_segment(uint8_t flags, const uint8_t* payload, uint32_t len
     uint32_t my_ip = NetworkStack::getInstance().get_my_ip();
     uint8_t* my_mac = E1000Driver::getInstance().get_mac();
     
-    uint32_t gateway = NetworkStack::getInstance().get_gateway_ip();
-    uint32_t next_hop = remote_ip;
-    if ((remote_ip & 0x00FFFFFF) != (my_ip & 0x00FFFFFF)) next_hop = gateway;
-    
-    uint8_t dest_mac[6];
-    if (!NetworkStack::getInstance().resolve_arp(next_hop, dest_mac)) {
-        free(packet);
-        return;
-    }
-    
-    memcpy(eth->dest, dest_mac, 6);
+    // No ARP round trip here: this runs from the RX interrupt too
+    memcpy(eth->dest, remote_mac, 6);
     memcpy(eth->src, my_mac, 6);
     eth->type = htons(ETH_TYPE_IP);
     
@@ -124,34 +121,36 @@ void TcpSocket::send_segment(uint8_t flags, const uint8_t* payload, uint32_t len
 }
 
 bool TcpSocket::connect(uint32_t dest_ip, uint16_t dest_port) {
+    NetworkStack& net = NetworkStack::getInstance();
     remote_ip = dest_ip;
     remote_port = dest_port;
+
+    uint32_t next_hop = remote_ip;
+    if ((remote_ip & 0x00FFFFFF) != (net.get_my_ip() & 0x00FFFFFF)) next_hop = net.get_gateway_ip();
+    if (!net.resolve_arp(next_hop, remote_mac)) {
+        printf("TCP: Host unreachable.\n");
+        return false;
+    }
     
     seq_num = rdtsc_serialized(); 
     ack_num = 0;
     state = SYN_SENT;
     
-    NetworkStack::getInstance().register_tcp_socket(this);
+    net.register_tcp_socket(this);
     
     printf("TCP: Sending SYN to %d.%d.%d.%d:%d (Local Port %d)...\n", 
         dest_ip&0xFF, (dest_ip>>8)&0xFF, (dest_ip>>16)&0xFF, (dest_ip>>24)&0xFF, dest_port, local_port);
         
-    send_segment(TCP_SYN, nullptr, 0);
-    
-    uint64_t start = rdtsc_serialized();
-    uint64_t freq = get_cpu_frequency();
+    {
+        ScopedIrqLock guard(lock);
+        send_segment(TCP_SYN, nullptr, 0);
+    }
     
-    // Wait for connection with visual updates
-    while(state == SYN_SENT) {
-        if (rdtsc_serialized() - start > freq * 5) { 
-            printf("TCP: Connect Timeout.\n");
-            NetworkStack::getInstance().unregister_tcp_socket(this);
-            return false;
-        }
-        
-        check_input_hooks();
-        WindowManager::getInstance().update();
-        if (g_renderer) WindowManager::getInstance().render(g_renderer);
+    // Wait for the SYN-ACK (or RST)
+    if (!NetworkStack::getInstance().wait_until(handshake_done, this, 5000)) {
+        printf("TCP: Connect Timeout.\n");
+        NetworkStack::getInstance().unregister_tcp_socket(this);
+        return false;
     }
     
     if (state == ESTABLISHED) {
@@ -159,10 +158,13 @@ bool TcpSocket::connect(uint32_t dest_ip, uint16_t dest_port) {
         return true;
     }
     
+    // Refused: callers don't close() a socket that never connected
+    net.unregister_tcp_socket(this);
     return false;
 }
 
 bool TcpSocket::send(const uint8_t* data, uint32_t len) {
+    ScopedIrqLock guard(lock);
     if (state != ESTABLISHED) return false;
     
     send_segment(TCP_PSH | TCP_ACK, data, len);
@@ -171,38 +173,28 @@ bool TcpSocket::send(const uint8_t* data, uint32_t len) {
 }
 
 void TcpSocket::close() {
-    if (state == ESTABLISHED) {
-        send_segment(TCP_FIN | TCP_ACK, nullptr, 0);
-        state = CLOSED;
+    {
+        ScopedIrqLock guard(lock);
+        if (state == ESTABLISHED) {
+            send_segment(TCP_FIN | TCP_ACK, nullptr, 0);
+            state = CLOSED;
+        }
     }
+    // Not under lock: unregistering takes the RX lock, which comes first
     NetworkStack::getInstance().unregister_tcp_socket(this);
-    free(rx_buffer);
+    delete rx_buffer;
+    rx_buffer = nullptr;
 }
 
 int TcpSocket::recv(uint8_t* buffer, uint32_t max_len) {
-    uint64_t start = rdtsc_serialized();
-    uint64_t freq = get_cpu_frequency();
-    
-    while (rx_head == rx_tail) {
-        if (state == CLOSED) return -1;
-        
-        // 5 seconds read timeout
-        if (rdtsc_serialized() - start > freq * 5) return 0; 
-        
-        check_input_hooks();
-        WindowManager::getInstance().update();
-        if (g_renderer) WindowManager::getInstance().render(g_renderer);
-    }
-    
-    int read = 0;
-    while (rx_head != rx_tail && read < (int)max_len) {
-        buffer[read++] = rx_buffer[rx_tail];
-        rx_tail = (rx_tail + 1) % RX_BUF_SIZE;
-    }
-    return read;
+    // 5 seconds read timeout
+    if (!NetworkStack::getInstance().wait_until(rx_ready, this, 5000)) return 0;
+    if (rx_buffer->empty()) return -1; // Closed
+    return (int)rx_buffer->pop_bulk(buffer, max_len);
 }
 
 void TcpSocket::handle_packet(TCPHeader* header, uint8_t* data, uint16_t len) {
+    ScopedIrqLock guard(lock);
     uint8_t flags = header->flags;
     uint32_t seq = ntohl(header->seq_num);
     uint32_t ack = ntohl(header->ack_num);
@@ -229,13 +221,8 @@ void TcpSocket::handle_packet(TCPHeader* header, uint8_t* data, uint16_t len) {
         
         // Handle Payload
         if (len > 0) {
-            for (int i = 0; i < len; i++) {
-                int next = (rx_head + 1) % RX_BUF_SIZE;
-                if (next != rx_tail) { 
-                    rx_buffer[rx_head] = data[i];
-                    rx_head = next;
-                }
-            }
+            // Whatever doesn't fit is dropped (but still acked)
+            rx_buffer->push_bulk(data, len);
             
             ack_num += len;
             send_segment(TCP_ACK, nullptr, 0);
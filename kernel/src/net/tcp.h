@@ -3,6 +3,8 @@
 
 #include <cstdint>
 #include "defs.h"
+#include "../sys/ring.h"
+#include "../sys/spinlock.h"
 
 // TCP Flags
 #define TCP_FIN 0x01
@@ -58,17 +60,25 @@ private:
     uint32_t remote_ip;
     uint16_t remote_port;
     uint16_t local_port;
+    uint8_t  remote_mac[6];   // Next hop, resolved once in connect()
     
     uint32_t seq_num;
     uint32_t ack_num;
     
     volatile TcpState state;
+
+    // seq_num, ack_num and state: the RX interrupt and the owning thread
+    // both send segments
+    Spinlock lock;
     
-    // Receive Buffer (Simple circular or linear buffer)
-    static const int RX_BUF_SIZE = 8192;
-    uint8_t* rx_buffer;
-    volatile int rx_head;
-    volatile int rx_tail;
+    // Receive buffer. Filled from the NIC's interrupt (any core),
+    // drained by recv().
+    static const uint32_t RX_BUF_SIZE = 8192;
+    SpscRing<uint8_t, RX_BUF_SIZE>* rx_buffer;
+
+    // NetworkStack::wait_until() conditions
+    static bool handshake_done(void* ctx);
+    static bool rx_ready(void* ctx);
 
     void send_segment(uint8_t flags, const uint8_t* payload, uint32_t len);
     uint16_t calculate_checksum(TCPHeader* header, const uint8_t* payload, uint32_t len, uint32_t src_ip, uint32_t dst_ip);
@@ -108,8 +108,52 @@ inline void pci_enable_bus_mastering(PCIDevice* dev) {
     val &= ~(1 << 10);    // Clear Interrupt Disable (Enable INTx)
 
     pci_write_dword(dev->bus, dev->slot, dev->function, 0x04, val);
-    printf("PCI: Enabled Bus Master & INTx for %02x:%02x (IRQ Line: %d)\n", 
+    printf("PCI: Enabled Bus Master & INTx for %02x:%02x (IRQ Line: %d)\n",
            dev->bus, dev->slot, dev->irq_line);
 }
 
+#define PCI_CAP_MSI 0x05
+
+// Config space offset of a capability, 0 if the device doesn't have it
+inline uint8_t pci_find_capability(PCIDevice* dev, uint8_t cap_id) {
+    uint16_t status = pci_read_word(dev->bus, dev->slot, dev->function, 0x06);
+    if (!(status & (1 << 4))) return 0; // No capability list
+
+    uint8_t ptr = pci_read_byte(dev->bus, dev->slot, dev->function, 0x34) & 0xFC;
+    for (int guard = 0; ptr && guard < 48; guard++) {
+        if (pci_read_byte(dev->bus, dev->slot, dev->function, ptr) == cap_id) return ptr;
+        ptr = pci_read_byte(dev->bus, dev->slot, dev->function, ptr + 1) & 0xFC;
+    }
+    return 0;
+}
+
+// Points the device's single MSI message at one LAPIC (physical
+// destination, fixed delivery) and switches INTx off. Rewriting a live
+// MSI is fine: the device latches address/data per message.
+inline bool pci_enable_msi(PCIDevice* dev, uint32_t apic_id, uint8_t vector) {
+    uint8_t cap = pci_find_capability(dev, PCI_CAP_MSI);
+    if (!cap || apic_id > 0xFF) return false;
+
+    uint32_t header = pci_read_dword(dev->bus, dev->slot, dev->function, cap);
+    uint16_t control = header >> 16;
+    bool is_64bit = control & (1 << 7);
+
+    pci_write_dword(dev->bus, dev->slot, dev->function, cap + 4, 0xFEE00000 | (apic_id << 12));
+    if (is_64bit) {
+        pci_write_dword(dev->bus, dev->slot, dev->function, cap + 8, 0);
+        pci_write_dword(dev->bus, dev->slot, dev->function, cap + 12, vector);
+    } else {
+        pci_write_dword(dev->bus, dev->slot, dev->function, cap + 8, vector);
+    }
+
+    // One message (MME = 0), enabled
+    control &= ~(7 << 4);
+    control |= 1;
+    pci_write_dword(dev->bus, dev->slot, dev->function, cap, (header & 0xFFFF) | ((uint32_t)control << 16));
+
+    uint32_t cmd = pci_read_dword(dev->bus, dev->slot, dev->function, 0x04);
+    pci_write_dword(dev->bus, dev->slot, dev->function, 0x04, cmd | (1 << 10));
+    return true;
+}
+
 #endif
\ No newline at end of file
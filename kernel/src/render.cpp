@@ -3,6 +3,10 @@
 #include "cppstd/sse.h"
 #include "cppstd/stdio.h"
 #include "cppstd/string.h" // for memcpy
+#include "sys/parallel.h"
+
+// Rows per parallel_for chunk when clearing
+#define CLEAR_GRAIN_ROWS 128
 
 static int iabs(int v) { return v < 0 ? -v : v; }
 
@@ -88,9 +92,24 @@ void Renderer::drawFilledCircle(int cx, int cy, int radius, std::uint32_t color)
     }
 }
 
+struct ClearJob {
+    Renderer* r;
+    std::uint32_t color;
+};
+
 void Renderer::clear(std::uint32_t color) {
-    for (std::uint32_t y = 0; y < height; y++) {
-        std::uint8_t* row = (std::uint8_t*)fb->address + (y * pitch);
+    ClearJob job = { this, color };
+    parallel_for(0, height, CLEAR_GRAIN_ROWS, clear_rows, &job);
+}
+
+void Renderer::clear_rows(std::int64_t begin, std::int64_t end, void* arg) {
+    ClearJob* job = (ClearJob*)arg;
+    Renderer* r = job->r;
+    std::uint32_t color = job->color;
+    std::uint32_t width = r->width;
+
+    for (std::int64_t y = begin; y < end; y++) {
+        std::uint8_t* row = (std::uint8_t*)r->fb->address + (y * r->pitch);
         int pixels = width;
         // Optimization: Use SSE for clearing
         int p_off = 0;
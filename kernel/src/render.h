@@ -46,6 +46,9 @@ private:
     // Font Data
     PSF1_Header* font_header;
     const uint8_t* glyph_buffer;
+
+    // parallel_for body for clear()
+    static void clear_rows(std::int64_t begin, std::int64_t end, void* arg);
 };
 
 #endif
\ No newline at end of file
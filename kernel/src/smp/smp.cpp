@@ -3,8 +3,20 @@
 #include "../cppstd/stdio.h"
 #include "../interrupts/gdt.h"
 #include "../interrupts/idt.h"
+#include "../interrupts/lapic.h"
 #include "../memory/vmm.h"
+#include "../memory/tlb.h"
+#include "smp_call.h"
+#include "../sys/idle.h"
 #include "../sys/system_stats.h" 
+#include "../sys/percpu.h"
+#include "../sys/sched.h"
+#include "../sys/parallel.h"
+#include "../timer.h"
+
+#define SMP_AP_WAIT_MS 100
+
+static volatile int aps_online = 0;
 
 // Tell Limine we want MP info (Protocol V2+ naming)
 __attribute__((used, section(".limine_requests")))
@@ -16,7 +28,11 @@ static volatile struct limine_mp_request mp_request = {
 };
 
 // This function runs on EVERY Application Processor (AP)
-void smp_ap_entry(struct limine_mp_info* info) {
+void smp_ap_entry(struct limine_mp_info*) {
+    // 0. Per-CPU block (GS base). Everything below may take a lock,
+    //    and the lock code finds the current thread through it.
+    percpu_init_ap();
+
     // 1. Initialize per-core GDT/TSS (Fixes Triple Fault)
     gdt_init_ap();
     
@@ -27,23 +43,35 @@ void smp_ap_entry(struct limine_mp_info* info) {
     uint64_t cr0, cr4;
     asm volatile ("mov %%cr0, %0" : "=r"(cr0));
     cr0 &= ~(1 << 2); cr0 |= (1 << 1);  
+    cr0 |= (1 << 16); // WP, copy-on-write relies on it
     asm volatile ("mov %0, %%cr0" :: "r"(cr0));
     asm volatile ("mov %%cr4, %0" : "=r"(cr4));
     cr4 |= (3 << 9);  
     asm volatile ("mov %0, %%cr4" :: "r"(cr4));
 
+    // 4. Enable this core's Local APIC and start taking IPIs
+    //    (TLB shootdowns, device interrupts steered here). 8259 IRQs only reach the BSP.
+    lapic_init_ap();
+    asm volatile("sti");
+    smp_call_cpu_online();
+    tlb_cpu_online();
+    sched_init_ap();
+    __atomic_fetch_add(&aps_online, 1, __ATOMIC_RELEASE);
+
     // Optional: Print status (Locking handles concurrency)
-    // printf("SMP: Core %d online!\n", (int)info->processor_id);
+    // printf("SMP: Core %d online!\n", this_cpu_id());
 
-    // 4. Halt loop (Activity Counter)
+    // 5. Idle loop. This is the core's idle thread: the scheduler
+    //    switches away from it whenever work is queued here.
     while (true) {
-        if (info->processor_id < 32) {
-            // Explicit read-modify-write to satisfy volatile
-            uint64_t current = SystemStats::getInstance().cpu_ticks[info->processor_id];
-            SystemStats::getInstance().cpu_ticks[info->processor_id] = current + 1;
-        }
+        // Taken before looking for work, so parallel_for's wake between
+        // the two isn't slept through
+        uint64_t seq = idle_wake_seq();
+
+        // Help with parallel_for jobs before going back to sleep
+        while (task_run_one()) {}
         
-        asm volatile("hlt");
+        idle_wait(seq);
     }
 }
 
@@ -58,6 +86,9 @@ void smp_init() {
     uint64_t cpu_count = response->cpu_count;
     uint64_t bsp_lapic_id = response->bsp_lapic_id;
 
+    // The BSP takes calls from the APs from here on
+    smp_call_cpu_online();
+
     SystemStats::getInstance().cpu_count = (int)cpu_count;
     if (cpu_count > 1) SystemStats::getInstance().service_smp_active = true;
 
@@ -72,4 +103,15 @@ void smp_init() {
 
         cpu->goto_address = smp_ap_entry;
     }
+
+    // Drivers that come up next steer their interrupts to APs, so wait
+    // for the APs to have their LAPICs enabled
+    uint64_t deadline = clock_ns() + SMP_AP_WAIT_MS * 1000000ULL;
+    while (__atomic_load_n(&aps_online, __ATOMIC_ACQUIRE) < (int)cpu_count - 1) {
+        if (clock_ns() > deadline) {
+            printf("SMP: Only %d of %d APs came up\n", (int)aps_online, (int)cpu_count - 1);
+            break;
+        }
+        asm volatile("pause");
+    }
 }
\ No newline at end of file
@@ -0,0 +1,228 @@
+#include "smp_call.h"
+#include "../interrupts/lapic.h"
+#include "../sys/percpu.h"
+#include "../sys/spinlock.h"
+#include "../cppstd/stdio.h"
+#include "../timer.h"
+
+// Requests without a waiter come from here, since the target can't call
+// free() from inside a lock's spin loop
+#define SMP_CALL_ASYNC_SLOTS 128
+
+struct SmpCall {
+    SmpCall* next;
+    SmpCallFn fn;
+    void* arg;
+    volatile int* remaining;   // Waiter's counter, nullptr for async calls
+    volatile bool busy;        // Async slot in use
+};
+
+// Multi-producer, single-consumer: senders push onto head with a CAS,
+// the owning core takes the whole list in one exchange.
+struct CallQueue {
+    SmpCall* volatile head;
+    volatile bool online;
+    volatile uint64_t handled;
+} __attribute__((aligned(64)));
+
+static CallQueue queues[SMP_CALL_MAX_CPUS];
+static SmpCall async_slots[SMP_CALL_ASYNC_SLOTS];
+
+static volatile bool stop_requested = false;
+static volatile int cpus_stopped = 0;
+
+static void post(int cpu, SmpCall* call) {
+    CallQueue* q = &queues[cpu];
+    SmpCall* head = __atomic_load_n(&q->head, __ATOMIC_RELAXED);
+    do {
+        call->next = head;
+    } while (!__atomic_compare_exchange_n(&q->head, &head, call, true,
+                                          __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+
+    // A non-empty queue already has an IPI on the way, or is being polled
+    // and will see our entry on the next exchange
+    if (head) return;
+    uint32_t apic_id;
+    if (lapic_core_apic_id(cpu, &apic_id)) lapic_send_ipi(apic_id, IPI_CALL_VECTOR);
+}
+
+static SmpCall* claim_slot() {
+    while (true) {
+        for (int i = 0; i < SMP_CALL_ASYNC_SLOTS; i++) {
+            if (async_slots[i].busy) continue;
+            if (!__atomic_test_and_set(&async_slots[i].busy, __ATOMIC_ACQUIRE)) return &async_slots[i];
+        }
+        // All in flight: keep draining our own mailbox so whoever we are
+        // waiting on isn't waiting on us
+        smp_call_poll();
+        asm volatile("pause");
+    }
+}
+
+static void wait_for(volatile int* remaining) {
+    while (__atomic_load_n(remaining, __ATOMIC_ACQUIRE) > 0) {
+        smp_call_poll();
+        asm volatile("pause");
+    }
+}
+
+static void run_queue(CallQueue* q) {
+    SmpCall* list = __atomic_exchange_n(&q->head, nullptr, __ATOMIC_ACQUIRE);
+
+    // Pushed newest first; reverse so calls run in the order they were sent
+    SmpCall* fifo = nullptr;
+    while (list) {
+        SmpCall* next = list->next;
+        list->next = fifo;
+        fifo = list;
+        list = next;
+    }
+
+    while (fifo) {
+        SmpCall* call = fifo;
+        fifo = call->next;
+        call->fn(call->arg);
+        q->handled = q->handled + 1;
+
+        // The request may be gone as soon as we let go of it
+        if (call->remaining) __atomic_fetch_sub(call->remaining, 1, __ATOMIC_RELEASE);
+        else __atomic_clear(&call->busy, __ATOMIC_RELEASE);
+    }
+}
+
+void smp_call_poll() {
+    // Cheap unmasked peek first: this sits in every spin loop
+    int cpu = this_cpu_id();
+    if (cpu >= SMP_CALL_MAX_CPUS || !queues[cpu].head) return;
+
+    IrqSaveGuard irq;
+    cpu = this_cpu_id();
+    if (queues[cpu].head) run_queue(&queues[cpu]);
+}
+
+void smp_call_handler() {
+    int cpu = this_cpu_id();
+    if (cpu < SMP_CALL_MAX_CPUS) run_queue(&queues[cpu]);
+}
+
+void smp_call_cpu_online() {
+    int cpu = this_cpu_id();
+    if (cpu < SMP_CALL_MAX_CPUS) __atomic_store_n(&queues[cpu].online, true, __ATOMIC_RELEASE);
+}
+
+bool smp_call_function(int cpu, SmpCallFn fn, void* arg, bool wait) {
+    if (cpu < 0 || cpu >= SMP_CALL_MAX_CPUS) return false;
+
+    // Pinned, so "ourselves" stays the same core until we're done
+    sched_preempt_disable();
+
+    if (cpu == this_cpu_id()) {
+        IrqSaveGuard irq;
+        fn(arg);
+        sched_preempt_enable();
+        return true;
+    }
+    if (!queues[cpu].online) {
+        sched_preempt_enable();
+        return false;
+    }
+
+    if (wait) {
+        volatile int remaining = 1;
+        SmpCall call;
+        call.fn = fn;
+        call.arg = arg;
+        call.remaining = &remaining;
+        post(cpu, &call);
+        wait_for(&remaining);
+    } else {
+        SmpCall* call = claim_slot();
+        call->fn = fn;
+        call->arg = arg;
+        call->remaining = nullptr;
+        post(cpu, call);
+    }
+
+    sched_preempt_enable();
+    return true;
+}
+
+void smp_call_function_all(SmpCallFn fn, void* arg, bool wait) {
+    sched_preempt_disable();
+    int self = this_cpu_id();
+
+    if (wait) {
+        // One request per target (each sits in its own queue), one counter
+        SmpCall calls[SMP_CALL_MAX_CPUS];
+        volatile int remaining = 0;
+        for (int i = 0; i < SMP_CALL_MAX_CPUS; i++) {
+            if (i == self || !queues[i].online) continue;
+            calls[i].fn = fn;
+            calls[i].arg = arg;
+            calls[i].remaining = &remaining;
+            __atomic_fetch_add(&remaining, 1, __ATOMIC_RELAXED);
+            post(i, &calls[i]);
+        }
+        wait_for(&remaining);
+    } else {
+        for (int i = 0; i < SMP_CALL_MAX_CPUS; i++) {
+            if (i == self || !queues[i].online) continue;
+            SmpCall* call = claim_slot();
+            call->fn = fn;
+            call->arg = arg;
+            call->remaining = nullptr;
+            post(i, call);
+        }
+    }
+
+    sched_preempt_enable();
+}
+
+void smp_stop_others() {
+    // Someone else is already taking the system down; their NMI parks us
+    if (__atomic_test_and_set(&stop_requested, __ATOMIC_ACQ_REL)) {
+        while (true) asm volatile("cli; hlt");
+    }
+
+    int self = this_cpu_id();
+    int others = 0;
+    for (int i = 0; i < SMP_CALL_MAX_CPUS; i++) {
+        if (i != self && queues[i].online) others++;
+    }
+    if (others == 0) return;
+
+    // NMI rather than IPI_CALL_VECTOR: a core spinning with interrupts
+    // off (maybe on a lock we hold) still takes it
+    lapic_broadcast_nmi();
+
+    // Bounded: the clock may not be calibrated if we crashed early
+    for (uint64_t spins = 0; spins < 100000000ULL; spins++) {
+        if (__atomic_load_n(&cpus_stopped, __ATOMIC_ACQUIRE) >= others) break;
+        asm volatile("pause");
+    }
+}
+
+void smp_stop_nmi() {
+    if (!__atomic_load_n(&stop_requested, __ATOMIC_ACQUIRE)) return;
+    __atomic_fetch_add(&cpus_stopped, 1, __ATOMIC_RELEASE);
+    // NMIs stay blocked until an IRET, so nothing gets us out of here
+    while (true) asm volatile("cli; hlt");
+}
+
+static void ping(void*) {}
+
+void smp_call_print_stats() {
+    int self = this_cpu_id();
+    for (int i = 0; i < SMP_CALL_MAX_CPUS; i++) {
+        CallQueue* q = &queues[i];
+        if (!q->online) continue;
+        if (i == self) {
+            printf("CPU %d: %d calls handled (this core)\n", i, (int)q->handled);
+            continue;
+        }
+        uint64_t start = clock_ns();
+        smp_call_function(i, ping, nullptr, true);
+        uint64_t rtt = clock_ns() - start;
+        printf("CPU %d: %d calls handled, round trip %d ns\n", i, (int)q->handled, (int)rtt);
+    }
+}
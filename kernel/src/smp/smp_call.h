@@ -0,0 +1,46 @@
+#ifndef SMP_CALL_H
+#define SMP_CALL_H
+
+#include <cstdint>
+
+// Cross-core function calls. Every core has a lock-free mailbox; senders
+// push a request and kick the target with IPI_CALL_VECTOR, and the target
+// runs it from the IPI handler, or earlier from any spin loop that polls
+// (lock_relax() does). TLB shootdowns go through here.
+
+#define SMP_CALL_MAX_CPUS 32
+
+// Runs on the target core with interrupts off, possibly from inside a
+// lock's spin loop. Must not sleep or take locks.
+typedef void (*SmpCallFn)(void* arg);
+
+// Runs fn(arg) on one core. With wait, returns once it has finished
+// there; without, arg must outlive the call. The caller's own core runs
+// it directly. False if the core isn't taking calls.
+bool smp_call_function(int cpu, SmpCallFn fn, void* arg, bool wait);
+
+// Same for every other core that is taking calls (not the caller)
+void smp_call_function_all(SmpCallFn fn, void* arg, bool wait);
+
+// Runs whatever is queued for the calling core. Interrupts must be off.
+void smp_call_poll();
+
+// IPI_CALL_VECTOR handler
+void smp_call_handler();
+
+// Called by each core once its Local APIC accepts IPIs. From then on it
+// gets calls (and takes part in shootdowns).
+void smp_call_cpu_online();
+
+// Panic path: parks every other core with an NMI so nothing keeps
+// drawing or touching devices behind the panic screen. A second core
+// panicking at the same time parks itself instead of returning.
+void smp_stop_others();
+
+// NMI handler hook. Never returns if a stop is in progress.
+void smp_stop_nmi();
+
+// Per-core call counts and an IPI round trip to each core
+void smp_call_print_stats();
+
+#endif
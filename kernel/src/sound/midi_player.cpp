@@ -25,11 +25,10 @@ void play_midi(const uint8_t* i1, uint32_t i2, void* i3, void* i4) {
     
     if (g_renderer) g_renderer->clear(0x000000);
 
-    uint64_t cpu_freq = get_cpu_frequency();
-    if (cpu_freq == 0) cpu_freq = 2000000000;
-    
-    uint64_t cycles_per_sample = cpu_freq / 44100;
-    uint64_t next_sample = rdtsc_serialized();
+    // 22.7 us per sample is far below the scheduler tick, so pace with
+    // the (calibrated) TSC directly
+    uint64_t cycles_per_sample = get_cpu_frequency() / 44100;
+    uint64_t next_sample = rdtsc();
 
     for(int i=0; i<8; i++) g_voices[i].active = false;
     pcspeaker_on();
@@ -86,7 +85,7 @@ void play_midi(const uint8_t* i1, uint32_t i2, void* i3, void* i4) {
         if(!running) break;
 
         // Wait
-        while(rdtsc_serialized() < next_sample) asm("pause");
+        while(rdtsc() < next_sample) asm("pause");
         
         // Synthesize
         int32_t mix = 0;
@@ -7,11 +7,13 @@
 #include "../memory/heap.h"
 #include "../memory/vmm.h"       
 #include "../drv/gpu/intel_gpu.h" 
+#include "../sys/parallel.h"
 
 #define MAX_BALLS 5000
 #define CONTAINER_RADIUS 350.0f 
 #define GAP_SIZE_RAD 0.8f 
 #define BALL_RADIUS 4.0f 
+#define PHYSICS_GRAIN 256
 
 static float* b_x = nullptr;
 static float* b_y = nullptr;
@@ -44,6 +46,54 @@ static void spawn_ball(float start_x, float start_y) {
     ball_count++;
 }
 
+struct PhysicsJob {
+    float cx, cy;
+    float container_angle;
+    volatile int spawn_queue;
+};
+
+static void physics_range(int64_t begin, int64_t end, void* arg) {
+    PhysicsJob* job = (PhysicsJob*)arg;
+    float cx = job->cx;
+    float cy = job->cy;
+    float container_angle = job->container_angle;
+    float r_inner_sq = (CONTAINER_RADIUS - BALL_RADIUS) * (CONTAINER_RADIUS - BALL_RADIUS);
+    float r_inner = CONTAINER_RADIUS - BALL_RADIUS;
+    int spawn_queue = 0;
+
+    for (int i = (int)begin; i < (int)end; i++) {
+        if (!b_active[i]) continue;
+        b_x[i] += b_vx[i];
+        b_y[i] += b_vy[i];
+        b_vy[i] += 0.15f; 
+        float dx = b_x[i] - cx;
+        float dy = b_y[i] - cy;
+        float dist_sq = dx*dx + dy*dy;
+        if (dist_sq >= r_inner_sq) {
+            float dist = sqrt(dist_sq);
+            float angle = atan2(dy, dx);
+            float diff = angle - container_angle;
+            while (diff > PI) diff -= 2*PI;
+            while (diff < -PI) diff += 2*PI;
+            if (fabs(diff) < GAP_SIZE_RAD / 2.0f) {
+                b_active[i] = false;
+                spawn_queue += 2;
+            } else {
+                float nx = dx / dist;
+                float ny = dy / dist;
+                float dot = b_vx[i] * nx + b_vy[i] * ny;
+                b_vx[i] = b_vx[i] - 2.0f * dot * nx;
+                b_vy[i] = b_vy[i] - 2.0f * dot * ny;
+                b_vx[i] *= 1.02f; b_vy[i] *= 1.02f;
+                float overlap = dist - r_inner;
+                b_x[i] -= nx * overlap; b_y[i] -= ny * overlap;
+            }
+        }
+    }
+
+    if (spawn_queue) __atomic_fetch_add(&job->spawn_queue, spawn_queue, __ATOMIC_RELAXED);
+}
+
 void run_stress_test(Renderer* r, uint64_t override_speed) {
     (void)override_speed; // Unused
     bool running = true;
@@ -75,7 +125,7 @@ void run_stress_test(Renderer* r, uint64_t override_speed) {
     
     float container_angle = 0.0f;
     uint64_t accumulator = 0;
-    uint64_t last_time = rdtsc_serialized();
+    uint64_t last_time = rdtsc();
     
     while (running) {
         // --- INPUT ---
@@ -83,7 +133,7 @@ void run_stress_test(Renderer* r, uint64_t override_speed) {
         if (c == 27) running = false;
         // -------------
 
-        uint64_t now = rdtsc_serialized();
+        uint64_t now = rdtsc();
         uint64_t delta = now - last_time;
         last_time = now;
         if (delta > cpu_freq / 5) delta = cpu_freq / 5;
@@ -93,39 +143,11 @@ void run_stress_test(Renderer* r, uint64_t override_speed) {
         while (accumulator >= ticks_per_physics) {
             container_angle += 0.02f; 
             if (container_angle > PI) container_angle -= 2*PI;
-            int spawn_queue = 0;
-            float r_inner_sq = (CONTAINER_RADIUS - BALL_RADIUS) * (CONTAINER_RADIUS - BALL_RADIUS);
-            float r_inner = CONTAINER_RADIUS - BALL_RADIUS;
-
-            for (int i = 0; i < ball_count; i++) {
-                if (!b_active[i]) continue;
-                b_x[i] += b_vx[i];
-                b_y[i] += b_vy[i];
-                b_vy[i] += 0.15f; 
-                float dx = b_x[i] - cx;
-                float dy = b_y[i] - cy;
-                float dist_sq = dx*dx + dy*dy;
-                if (dist_sq >= r_inner_sq) {
-                    float dist = sqrt(dist_sq);
-                    float angle = atan2(dy, dx);
-                    float diff = angle - container_angle;
-                    while (diff > PI) diff -= 2*PI;
-                    while (diff < -PI) diff += 2*PI;
-                    if (fabs(diff) < GAP_SIZE_RAD / 2.0f) {
-                        b_active[i] = false;
-                        spawn_queue += 2;
-                    } else {
-                        float nx = dx / dist;
-                        float ny = dy / dist;
-                        float dot = b_vx[i] * nx + b_vy[i] * ny;
-                        b_vx[i] = b_vx[i] - 2.0f * dot * nx;
-                        b_vy[i] = b_vy[i] - 2.0f * dot * ny;
-                        b_vx[i] *= 1.02f; b_vy[i] *= 1.02f;
-                        float overlap = dist - r_inner;
-                        b_x[i] -= nx * overlap; b_y[i] -= ny * overlap;
-                    }
-                }
-            }
+            // Balls don't interact, so the step fans out over the cores
+            PhysicsJob job = { (float)cx, (float)cy, container_angle, 0 };
+            parallel_for(0, ball_count, PHYSICS_GRAIN, physics_range, &job);
+
+            int spawn_queue = job.spawn_queue;
             if (spawn_queue > 200) spawn_queue = 200; 
             for (int k = 0; k < spawn_queue; k++) spawn_ball((float)cx, (float)cy);
             accumulator -= ticks_per_physics;
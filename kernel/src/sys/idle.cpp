@@ -0,0 +1,137 @@
+#include "idle.h"
+#include "percpu.h"
+#include "../interrupts/lapic.h"
+#include "../cppstd/stdio.h"
+#include "../timer.h"
+
+// Deepest C-state we ask MWAIT for. Anything past C1 is only used when
+// the LAPIC timer keeps running in it (ARAT), since the scheduler tick
+// and the timer wheel depend on it.
+#define IDLE_MAX_CSTATE 2
+
+static bool use_mwait = false;
+static uint32_t mwait_hint = 0;  // EAX for MWAIT: (C-state - 1) << 4 | sub-state
+
+static void cpuid(uint32_t leaf, uint32_t* a, uint32_t* b, uint32_t* c, uint32_t* d) {
+    asm volatile("cpuid" : "=a"(*a), "=b"(*b), "=c"(*c), "=d"(*d) : "a"(leaf), "c"(0));
+}
+
+void idle_init() {
+    uint32_t eax, ebx, ecx, edx;
+    cpuid(0, &eax, &ebx, &ecx, &edx);
+    uint32_t max_leaf = eax;
+
+    cpuid(1, &eax, &ebx, &ecx, &edx);
+    if (!(ecx & (1 << 3)) || max_leaf < 5) {
+        printf("IDLE: No MONITOR/MWAIT, idle cores halt\n");
+        return;
+    }
+
+    // Leaf 5: EDX has 4 bits per C-state with the number of sub-states
+    // MWAIT supports for it (C0 in bits 3:0, C1 in 7:4, ...)
+    cpuid(5, &eax, &ebx, &ecx, &edx);
+    uint32_t substates = (ecx & 1) ? edx : 0x10; // No enumeration: C1 only
+
+    bool arat = false;
+    if (max_leaf >= 6) {
+        uint32_t a6, b6, c6, d6;
+        cpuid(6, &a6, &b6, &c6, &d6);
+        arat = a6 & (1 << 2);
+    }
+
+    int cstate = arat ? IDLE_MAX_CSTATE : 1;
+    for (; cstate > 1; cstate--) {
+        if ((substates >> (cstate * 4)) & 0xF) break;
+    }
+    if (!((substates >> (cstate * 4)) & 0xF)) {
+        printf("IDLE: MWAIT without C1 sub-states, idle cores halt\n");
+        return;
+    }
+
+    mwait_hint = (uint32_t)(cstate - 1) << 4;
+    use_mwait = true;
+    printf("IDLE: MWAIT, C%d (hint %x)%s\n", cstate, mwait_hint, arat ? "" : ", no ARAT");
+}
+
+uint64_t idle_wake_seq() {
+    return __atomic_load_n(&this_cpu()->idle_wake, __ATOMIC_SEQ_CST);
+}
+
+void idle_wait(uint64_t seq) {
+    asm volatile("cli" ::: "memory");
+    PerCpu* cpu = this_cpu();
+
+    // Pairs with idle_wake(): either it sees us asleep, or we see its bump
+    __atomic_store_n(&cpu->idle_sleeping, true, __ATOMIC_SEQ_CST);
+    bool woken = __atomic_load_n(&cpu->idle_wake, __ATOMIC_SEQ_CST) != seq;
+
+    if (!woken && use_mwait) {
+        // idle_sleeping shares the monitored line, so its store has to come
+        // first or it would end the MWAIT straight away. Checked again once
+        // armed: a wake written after that ends the MWAIT instead.
+        asm volatile("monitor" :: "a"(&cpu->idle_wake), "c"(0), "d"(0));
+        woken = __atomic_load_n(&cpu->idle_wake, __ATOMIC_SEQ_CST) != seq;
+    }
+    if (woken) {
+        cpu->idle_sleeping = false;
+        asm volatile("sti" ::: "memory");
+        return;
+    }
+
+    uint64_t start = rdtsc();
+    cpu->idle_since = start;
+
+    // STI only takes effect after the next instruction, so an interrupt
+    // can't slip in between and leave us asleep with it already handled
+    if (use_mwait) asm volatile("sti; mwait" :: "a"(mwait_hint), "c"(0) : "memory");
+    else asm volatile("sti; hlt" ::: "memory");
+
+    // Whatever woke us has been handled by now
+    asm volatile("cli" ::: "memory");
+    cpu->idle_tsc = cpu->idle_tsc + (rdtsc() - start);
+    cpu->idle_since = 0;
+    cpu->idle_sleeping = false;
+    asm volatile("sti" ::: "memory");
+}
+
+void idle_wake(int cpu) {
+    PerCpu* target = percpu_of(cpu);
+    if (!target) return;
+
+    __atomic_fetch_add(&target->idle_wake, 1, __ATOMIC_SEQ_CST);
+    if (use_mwait || !__atomic_load_n(&target->idle_sleeping, __ATOMIC_SEQ_CST)) return;
+
+    uint32_t apic_id;
+    if (lapic_core_apic_id(cpu, &apic_id)) lapic_send_ipi(apic_id, IPI_RESCHEDULE_VECTOR);
+}
+
+void idle_wake_all() {
+    int self = this_cpu_id();
+    for (int i = 0; i < percpu_count(); i++) {
+        if (i != self) idle_wake(i);
+    }
+}
+
+int idle_busy_percent(int cpu, IdleSample* prev) {
+    PerCpu* p = percpu_of(cpu);
+    if (!p) return 0;
+
+    // Count the idle period in progress too, or a core that has been
+    // asleep since the last sample would look busy. The part counted here
+    // comes off the next delta, once the period lands in idle_tsc. A
+    // period ending mid-read can skew one sample; it's only a display.
+    uint64_t total = p->idle_tsc;
+    uint64_t since = p->idle_since;
+    uint64_t now = rdtsc();
+    uint64_t idle = total + ((since && since < now) ? now - since : 0);
+
+    uint64_t elapsed = now - prev->tsc;
+    uint64_t idle_delta = idle > prev->idle_tsc ? idle - prev->idle_tsc : 0;
+    bool first = prev->tsc == 0;
+    prev->tsc = now;
+    prev->idle_tsc = idle;
+    if (first || elapsed == 0) return 0;
+
+    if (idle_delta > elapsed) idle_delta = elapsed;
+    return (int)(100 - (idle_delta * 100) / elapsed);
+}
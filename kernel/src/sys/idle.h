@@ -0,0 +1,43 @@
+#ifndef IDLE_H
+#define IDLE_H
+
+#include <cstdint>
+
+// Idle loop support. A core with nothing to do waits in MONITOR/MWAIT on
+// its own wake line when the CPU has it (HLT otherwise), and every idle
+// period is accounted per core for the utilisation display.
+//
+// Idle loops take a wake sequence before they look for work and hand it
+// to idle_wait(), so a wake that lands in between isn't slept through:
+//
+//     uint64_t seq = idle_wake_seq();
+//     if (!found_work()) idle_wait(seq);
+
+// BSP, once: picks MWAIT and its C-state hint, or HLT
+void idle_init();
+
+// The calling core's wake sequence
+uint64_t idle_wake_seq();
+
+// Sleeps until an interrupt arrives or idle_wake() is called for this
+// core after seq was taken. Call with interrupts on, from a context that
+// stays on its core (idle loops, kmain); interrupts are on again (and
+// the one that woke us handled) when it returns.
+void idle_wait(uint64_t seq);
+
+// Wakes a core out of idle_wait() to look for work. A plain store when
+// it sits in MWAIT, an IPI only if it halted.
+void idle_wake(int cpu);
+
+// Same for every other core
+void idle_wake_all();
+
+// Busy percentage of a core between two calls. prev holds the last
+// sample and is updated; zero-initialise it before the first call.
+struct IdleSample {
+    uint64_t tsc;
+    uint64_t idle_tsc;
+};
+int idle_busy_percent(int cpu, IdleSample* prev);
+
+#endif
@@ -0,0 +1,205 @@
+#include "parallel.h"
+#include "sched.h"
+#include "system_stats.h"
+#include "percpu.h"
+#include "idle.h"
+#include "../memory/heap.h"
+#include "../cppstd/stdio.h"
+#include "../timer.h"
+
+#define PARALLEL_MAX_CPUS 32
+#define DEQUE_MASK (PARALLEL_DEQUE_SIZE - 1)
+
+// Chase-Lev deque with a fixed ring. top only ever grows (thieves CAS it),
+// bottom is written by the owning core alone. Owner operations run with
+// preemption disabled, which makes "the thread on this core" the owner.
+struct WorkDeque {
+    volatile int64_t top;
+    uint8_t pad[56];
+    volatile int64_t bottom;
+    Task* volatile slots[PARALLEL_DEQUE_SIZE];
+} __attribute__((aligned(64)));
+
+static WorkDeque deques[PARALLEL_MAX_CPUS];
+
+static bool deque_push(WorkDeque* d, Task* task) {
+    int64_t b = __atomic_load_n(&d->bottom, __ATOMIC_RELAXED);
+    int64_t t = __atomic_load_n(&d->top, __ATOMIC_ACQUIRE);
+    if (b - t >= PARALLEL_DEQUE_SIZE) return false;
+
+    d->slots[b & DEQUE_MASK] = task;
+    __atomic_store_n(&d->bottom, b + 1, __ATOMIC_RELEASE);
+    return true;
+}
+
+static Task* deque_pop(WorkDeque* d) {
+    int64_t b = __atomic_load_n(&d->bottom, __ATOMIC_RELAXED) - 1;
+    __atomic_store_n(&d->bottom, b, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    int64_t t = __atomic_load_n(&d->top, __ATOMIC_RELAXED);
+
+    if (t > b) {
+        // Empty
+        __atomic_store_n(&d->bottom, b + 1, __ATOMIC_RELAXED);
+        return nullptr;
+    }
+
+    Task* task = d->slots[b & DEQUE_MASK];
+    if (t == b) {
+        // Last task: race the thieves for it
+        if (!__atomic_compare_exchange_n(&d->top, &t, t + 1, false, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED)) {
+            task = nullptr;
+        }
+        __atomic_store_n(&d->bottom, b + 1, __ATOMIC_RELAXED);
+    }
+    return task;
+}
+
+static Task* deque_steal(WorkDeque* d) {
+    int64_t t = __atomic_load_n(&d->top, __ATOMIC_ACQUIRE);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    int64_t b = __atomic_load_n(&d->bottom, __ATOMIC_ACQUIRE);
+    if (t >= b) return nullptr;
+
+    Task* task = d->slots[t & DEQUE_MASK];
+    if (!__atomic_compare_exchange_n(&d->top, &t, t + 1, false, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED)) {
+        return nullptr; // Lost to the owner or another thief
+    }
+    return task;
+}
+
+static void run_task(Task* task) {
+    task->fn(task->arg);
+    __atomic_fetch_sub(&task->group->pending, 1, __ATOMIC_RELEASE);
+}
+
+void task_submit(TaskGroup* group, Task* task) {
+    task->group = group;
+    __atomic_fetch_add(&group->pending, 1, __ATOMIC_RELAXED);
+
+    sched_preempt_disable();
+    bool queued = deque_push(&deques[this_cpu_id()], task);
+    if (!queued) run_task(task);
+    sched_preempt_enable();
+}
+
+bool task_run_one() {
+    sched_preempt_disable();
+    int self = this_cpu_id();
+
+    Task* task = deque_pop(&deques[self]);
+    // Start stealing at the next core so thieves spread out
+    for (int i = 1; !task && i < PARALLEL_MAX_CPUS; i++) {
+        task = deque_steal(&deques[(self + i) % PARALLEL_MAX_CPUS]);
+    }
+    if (task) run_task(task);
+
+    sched_preempt_enable();
+    return task != nullptr;
+}
+
+void task_wait(TaskGroup* group) {
+    while (__atomic_load_n(&group->pending, __ATOMIC_ACQUIRE) > 0) {
+        if (!task_run_one()) asm volatile("pause");
+    }
+}
+
+struct RangeChunk {
+    RangeFn fn;
+    void* arg;
+    int64_t begin;
+    int64_t end;
+};
+
+static void run_range_chunk(void* arg) {
+    RangeChunk* chunk = (RangeChunk*)arg;
+    chunk->fn(chunk->begin, chunk->end, chunk->arg);
+}
+
+void parallel_for(int64_t begin, int64_t end, int64_t grain, RangeFn fn, void* arg) {
+    int64_t count = end - begin;
+    if (count <= 0) return;
+    if (grain < 1) grain = 1;
+
+    int cpus = SystemStats::getInstance().cpu_count;
+    if (cpus <= 1 || count <= grain) {
+        fn(begin, end, arg);
+        return;
+    }
+
+    // A few chunks per core so thieves can balance uneven work
+    int64_t chunks = (count + grain - 1) / grain;
+    if (chunks > cpus * 4) chunks = cpus * 4;
+    if (chunks > PARALLEL_MAX_TASKS) chunks = PARALLEL_MAX_TASKS;
+    int64_t per_chunk = (count + chunks - 1) / chunks;
+
+    RangeChunk ranges[PARALLEL_MAX_TASKS];
+    Task tasks[PARALLEL_MAX_TASKS];
+    TaskGroup group = { 0 };
+
+    int n = 0;
+    for (int64_t start = begin; start < end; start += per_chunk) {
+        ranges[n] = { fn, arg, start, (end - start < per_chunk) ? end : start + per_chunk };
+        tasks[n] = { run_range_chunk, &ranges[n], nullptr };
+        task_submit(&group, &tasks[n]);
+        n++;
+    }
+
+    // Get idle APs out of MWAIT/HLT to steal
+    idle_wake_all();
+    task_wait(&group);
+}
+
+// --- Benchmark ---
+
+#define BENCH_ITEMS  (1024 * 1024)
+#define BENCH_ROUNDS 64
+
+static void bench_kernel(int64_t begin, int64_t end, void* arg) {
+    uint32_t* out = (uint32_t*)arg;
+    for (int64_t i = begin; i < end; i++) {
+        uint32_t x = (uint32_t)i * 2654435761u + 1;
+        for (int r = 0; r < BENCH_ROUNDS; r++) {
+            x ^= x << 13; x ^= x >> 17; x ^= x << 5;
+        }
+        out[i] = x;
+    }
+}
+
+void parallel_benchmark() {
+    uint32_t* serial = (uint32_t*)malloc(BENCH_ITEMS * sizeof(uint32_t));
+    uint32_t* par = (uint32_t*)malloc(BENCH_ITEMS * sizeof(uint32_t));
+    if (!serial || !par) {
+        printf("PARBENCH: Out of memory\n");
+        if (serial) free(serial);
+        if (par) free(par);
+        return;
+    }
+
+    uint64_t freq = get_cpu_frequency() / 1000000;
+    if (freq == 0) freq = 1;
+
+    uint64_t t0 = rdtsc_serialized();
+    bench_kernel(0, BENCH_ITEMS, serial);
+    uint64_t t1 = rdtsc_serialized();
+    parallel_for(0, BENCH_ITEMS, 4096, bench_kernel, par);
+    uint64_t t2 = rdtsc_serialized();
+
+    bool match = true;
+    for (int i = 0; i < BENCH_ITEMS; i++) {
+        if (serial[i] != par[i]) { match = false; break; }
+    }
+
+    uint64_t serial_us = (t1 - t0) / freq;
+    uint64_t par_us = (t2 - t1) / freq;
+    uint64_t speedup = par_us ? (serial_us * 100) / par_us : 0;
+
+    printf("PARBENCH: %d items on %d cores\n", BENCH_ITEMS, SystemStats::getInstance().cpu_count);
+    printf("  Serial:   %d us\n", (int)serial_us);
+    printf("  Parallel: %d us (%d.%d%dx)%s\n", (int)par_us,
+        (int)(speedup / 100), (int)((speedup / 10) % 10), (int)(speedup % 10),
+        match ? "" : "  RESULT MISMATCH");
+
+    free(serial);
+    free(par);
+}
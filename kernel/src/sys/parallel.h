@@ -0,0 +1,45 @@
+#ifndef PARALLEL_H
+#define PARALLEL_H
+
+#include <cstdint>
+
+// Work-stealing task pool. Every core owns a Chase-Lev deque: the core
+// that submits pushes and pops at the bottom, idle APs steal from the top.
+// Tasks run with preemption disabled and must not sleep.
+
+#define PARALLEL_DEQUE_SIZE 256 // Power of two
+#define PARALLEL_MAX_TASKS  64  // Chunks a single parallel_for splits into
+
+typedef void (*TaskFn)(void* arg);
+
+// Runs fn over [begin, end) in chunks of at least `grain` items
+typedef void (*RangeFn)(int64_t begin, int64_t end, void* arg);
+
+struct TaskGroup {
+    volatile int64_t pending;
+};
+
+struct Task {
+    TaskFn fn;
+    void* arg;
+    TaskGroup* group;
+};
+
+// Queues a task on the calling core's deque (or runs it inline if the
+// deque is full). The Task must stay valid until task_wait() returns.
+void task_submit(TaskGroup* group, Task* task);
+
+// Runs/steals tasks until every task in the group has finished
+void task_wait(TaskGroup* group);
+
+// Runs one queued or stolen task. Returns false if there was nothing to do.
+// Called from the AP idle loop.
+bool task_run_one();
+
+// Splits the range, fans it out to idle cores and joins
+void parallel_for(int64_t begin, int64_t end, int64_t grain, RangeFn fn, void* arg);
+
+// Times a CPU bound job serially and with parallel_for
+void parallel_benchmark();
+
+#endif
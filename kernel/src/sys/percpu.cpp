@@ -0,0 +1,45 @@
+#include "percpu.h"
+
+#define IA32_GS_BASE        0xC0000101
+#define IA32_KERNEL_GS_BASE 0xC0000102
+
+static PerCpu blocks[PERCPU_MAX_CPUS];
+static volatile int cpus_up = 0;
+
+static void wrmsr(uint32_t msr, uint64_t value) {
+    asm volatile("wrmsr" :: "c"(msr), "a"((uint32_t)value), "d"((uint32_t)(value >> 32)));
+}
+
+static void load(int cpu) {
+    PerCpu* p = &blocks[cpu];
+    p->self = p;
+    p->cpu_id = cpu;
+
+    wrmsr(IA32_GS_BASE, (uint64_t)p);
+    // Swapped in while the core runs ring 3
+    wrmsr(IA32_KERNEL_GS_BASE, 0);
+}
+
+void percpu_init_bsp() {
+    load(0);
+    __atomic_store_n(&cpus_up, 1, __ATOMIC_RELEASE);
+}
+
+void percpu_init_ap() {
+    int cpu = __atomic_fetch_add(&cpus_up, 1, __ATOMIC_ACQ_REL);
+    // No block for this core: park it before it touches anything shared
+    if (cpu >= PERCPU_MAX_CPUS) {
+        while (true) asm volatile("cli; hlt");
+    }
+    load(cpu);
+}
+
+int percpu_count() {
+    int n = __atomic_load_n(&cpus_up, __ATOMIC_ACQUIRE);
+    return n < PERCPU_MAX_CPUS ? n : PERCPU_MAX_CPUS;
+}
+
+PerCpu* percpu_of(int cpu) {
+    if (cpu < 0 || cpu >= percpu_count()) return nullptr;
+    return &blocks[cpu];
+}
@@ -0,0 +1,73 @@
+#ifndef PERCPU_H
+#define PERCPU_H
+
+#include <cstdint>
+
+// Per-core data, reached through the GS base. In ring 0 GS points at the
+// core's own block; the interrupt stubs swapgs on the way in from and out
+// to ring 3, so user code never sees it.
+
+#define PERCPU_MAX_CPUS   32
+#define PERCPU_PAGE_CACHE 64   // Order-0 pages in the PMM magazine
+
+struct Thread;
+
+struct PerCpu {
+    PerCpu* self;              // %gs:0, so this_cpu() is one load
+    int cpu_id;                // 0 = BSP, APs in the order they came up
+    Thread* current_thread;    // Set by the scheduler on every switch
+
+    // PMM magazine (pmm.cpp). Own core only, with interrupts off.
+    uint64_t page_cache[PERCPU_PAGE_CACHE];
+    int page_count;
+
+    // Idle state (idle.cpp). idle_wake is the MONITOR target and other
+    // cores write it to wake us, so it sits on a line of its own.
+    alignas(64) volatile uint64_t idle_wake;
+    volatile bool idle_sleeping;
+
+    // Counters. Written by the owning core only, but SystemWidget reads
+    // them from the BSP, so they get a line of their own.
+    alignas(64) volatile uint64_t idle_tsc;   // TSC cycles spent idle, summed
+    volatile uint64_t idle_since;             // Start of the current idle period, 0 while busy
+    volatile uint64_t pcp_hits;
+    volatile uint64_t pcp_misses;
+} __attribute__((aligned(64)));
+
+// BSP: first thing in kmain, before anything takes a lock
+void percpu_init_bsp();
+
+// AP: first thing in smp_ap_entry. Hands out the next core index.
+void percpu_init_ap();
+
+// Another core's block (stats readers). nullptr if it never came up.
+PerCpu* percpu_of(int cpu);
+
+// Number of cores that have a block
+int percpu_count();
+
+static inline PerCpu* this_cpu() {
+    PerCpu* p;
+    asm volatile("mov %%gs:0, %0" : "=r"(p));
+    return p;
+}
+
+// Single GS-relative loads: they can't be split by a migration, so
+// unlike this_cpu()->field they need no interrupt masking.
+static inline int this_cpu_id() {
+    int id;
+    asm volatile("movl %%gs:%c1, %0" : "=r"(id) : "i"(__builtin_offsetof(PerCpu, cpu_id)));
+    return id;
+}
+
+static inline Thread* this_cpu_thread() {
+    Thread* t;
+    asm volatile("mov %%gs:%c1, %0" : "=r"(t) : "i"(__builtin_offsetof(PerCpu, current_thread)));
+    return t;
+}
+
+// Bumps one of the counters above on the calling core
+#define percpu_inc(field) \
+    asm volatile("incq %%gs:%c0" :: "i"(__builtin_offsetof(PerCpu, field)) : "memory")
+
+#endif
@@ -0,0 +1,162 @@
+#ifndef RING_H
+#define RING_H
+
+#include <cstdint>
+
+// Bounded lock-free rings for handing data between cores (or between an
+// interrupt handler and a thread). N must be a power of two. Indices run
+// free and are masked on access, so all N slots are usable.
+//
+// The producer's and consumer's indices sit on separate cache lines, so
+// the two sides only touch each other's line when they have to. Padding
+// rather than alignas keeps the types usable with plain operator new.
+
+#define RING_CACHE_LINE 64
+
+// One producer and one consumer at a time (each may be any core).
+template <typename T, uint32_t N>
+class SpscRing {
+    static_assert(N >= 2 && (N & (N - 1)) == 0, "ring size must be a power of two");
+
+public:
+    constexpr SpscRing() {}
+
+    // Producer side. False when full.
+    bool push(const T& item) {
+        uint32_t head = _head;
+        if (head - _cached_tail == N) {
+            _cached_tail = __atomic_load_n(&_tail, __ATOMIC_ACQUIRE);
+            if (head - _cached_tail == N) return false;
+        }
+        _slots[head & (N - 1)] = item;
+        __atomic_store_n(&_head, head + 1, __ATOMIC_RELEASE);
+        return true;
+    }
+
+    // Producer side. Copies as many as fit, returns how many.
+    uint32_t push_bulk(const T* items, uint32_t count) {
+        uint32_t head = _head;
+        uint32_t space = N - (head - _cached_tail);
+        if (space < count) {
+            _cached_tail = __atomic_load_n(&_tail, __ATOMIC_ACQUIRE);
+            space = N - (head - _cached_tail);
+        }
+        if (count > space) count = space;
+        for (uint32_t i = 0; i < count; i++) _slots[(head + i) & (N - 1)] = items[i];
+        __atomic_store_n(&_head, head + count, __ATOMIC_RELEASE);
+        return count;
+    }
+
+    // Consumer side. False when empty.
+    bool pop(T* out) {
+        uint32_t tail = _tail;
+        if (tail == _cached_head) {
+            _cached_head = __atomic_load_n(&_head, __ATOMIC_ACQUIRE);
+            if (tail == _cached_head) return false;
+        }
+        *out = _slots[tail & (N - 1)];
+        __atomic_store_n(&_tail, tail + 1, __ATOMIC_RELEASE);
+        return true;
+    }
+
+    // Consumer side. Copies up to max items, returns how many.
+    uint32_t pop_bulk(T* out, uint32_t max) {
+        uint32_t tail = _tail;
+        _cached_head = __atomic_load_n(&_head, __ATOMIC_ACQUIRE);
+        uint32_t count = _cached_head - tail;
+        if (count > max) count = max;
+        for (uint32_t i = 0; i < count; i++) out[i] = _slots[(tail + i) & (N - 1)];
+        __atomic_store_n(&_tail, tail + count, __ATOMIC_RELEASE);
+        return count;
+    }
+
+    // Snapshot; exact only when called by one of the two sides
+    bool empty() const {
+        return __atomic_load_n(&_head, __ATOMIC_ACQUIRE) == __atomic_load_n(&_tail, __ATOMIC_ACQUIRE);
+    }
+
+private:
+    // Producer line: its own index plus its last look at the consumer's
+    uint32_t _head = 0;
+    uint32_t _cached_tail = 0;
+    uint8_t _pad0[RING_CACHE_LINE - 2 * sizeof(uint32_t)] = {};
+
+    // Consumer line
+    uint32_t _tail = 0;
+    uint32_t _cached_head = 0;
+    uint8_t _pad1[RING_CACHE_LINE - 2 * sizeof(uint32_t)] = {};
+
+    T _slots[N] = {};
+};
+
+// Any number of producers, one consumer. Every slot carries a sequence
+// number: producers claim a position with a CAS on the head, fill the
+// slot, then publish it through the sequence, so the consumer never
+// sees a claimed slot before its contents.
+template <typename T, uint32_t N>
+class MpscRing {
+    static_assert(N >= 2 && (N & (N - 1)) == 0, "ring size must be a power of two");
+
+public:
+    constexpr MpscRing() {
+        for (uint32_t i = 0; i < N; i++) _slots[i].seq = i;
+    }
+
+    // Any core, any context. False when full.
+    bool push(const T& item) {
+        uint32_t pos = __atomic_load_n(&_head, __ATOMIC_RELAXED);
+        Slot* slot;
+        while (true) {
+            slot = &_slots[pos & (N - 1)];
+            int32_t diff = (int32_t)(__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) - pos);
+            if (diff == 0) {
+                // Free and ours if nobody claims it first (pos reloads on failure)
+                if (__atomic_compare_exchange_n(&_head, &pos, pos + 1, true,
+                                                __ATOMIC_RELAXED, __ATOMIC_RELAXED)) break;
+            } else if (diff < 0) {
+                // Still holds an item from the previous lap
+                return false;
+            } else {
+                // Another producer got there first
+                pos = __atomic_load_n(&_head, __ATOMIC_RELAXED);
+            }
+        }
+        slot->value = item;
+        __atomic_store_n(&slot->seq, pos + 1, __ATOMIC_RELEASE);
+        return true;
+    }
+
+    // Consumer side. False when empty, or when the next producer in line
+    // has claimed its slot but not filled it yet.
+    bool pop(T* out) {
+        uint32_t pos = _tail;
+        Slot* slot = &_slots[pos & (N - 1)];
+        if (__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) != pos + 1) return false;
+        *out = slot->value;
+        // Hand the slot to the producer one lap ahead
+        __atomic_store_n(&slot->seq, pos + N, __ATOMIC_RELEASE);
+        _tail = pos + 1;
+        return true;
+    }
+
+    // Consumer side
+    bool empty() const {
+        return __atomic_load_n(&_slots[_tail & (N - 1)].seq, __ATOMIC_ACQUIRE) != _tail + 1;
+    }
+
+private:
+    struct Slot {
+        uint32_t seq;
+        T value;
+    };
+
+    uint32_t _head = 0;
+    uint8_t _pad0[RING_CACHE_LINE - sizeof(uint32_t)] = {};
+
+    uint32_t _tail = 0;
+    uint8_t _pad1[RING_CACHE_LINE - sizeof(uint32_t)] = {};
+
+    Slot _slots[N] = {};
+};
+
+#endif
@@ -0,0 +1,476 @@
+#include "sched.h"
+#include "spinlock.h"
+#include "system_stats.h"
+#include "percpu.h"
+#include "idle.h"
+#include "../interrupts/lapic.h"
+#include "../memory/heap.h"
+#include "../smp/smp_call.h"
+#include "../cppstd/stdio.h"
+#include "../cppstd/string.h"
+#include "../timer.h"
+
+// Saves callee-saved registers on the current stack, parks RSP in
+// *old_rsp and resumes the thread whose stack pointer is new_rsp.
+extern "C" void sched_switch(uint64_t* old_rsp, uint64_t new_rsp);
+
+// One queue per core. READY and SLEEPING threads wait in the list; the
+// running thread and the idle thread are never on it. The lock is only
+// taken with interrupts off and is held across the stack switch: the
+// thread that comes out the other side releases it (finish_switch).
+struct RunQueue {
+    volatile bool lock;
+    bool online;
+    uint32_t apic_id;
+    Thread* current;
+    Thread* idle;
+    Thread* prev;          // Thread we just switched away from
+    Thread* head;
+    Thread* tail;
+    int nr_threads;        // Threads owned by this core, idle excluded
+    int slice;             // Ticks the current thread has run
+    uint64_t next_wake;    // Earliest sleeper deadline (0 = none)
+    uint64_t ticks;
+    uint64_t idle_ticks;
+    uint64_t switches;
+} __attribute__((aligned(64)));
+
+static RunQueue run_queues[SCHED_MAX_CPUS];
+static bool sched_running = false;
+static Thread* kmain_thread = nullptr;
+static uint64_t next_thread_id = 0;
+
+// Clean FPU/SSE state new threads start from
+static uint8_t fpu_template_area[512 + 16];
+static uint8_t* fpu_template;
+
+static RwLock threads_lock("threads");
+static Thread* all_threads = nullptr;
+
+static uint64_t irq_save() {
+    uint64_t flags;
+    asm volatile("pushfq; pop %0; cli" : "=r"(flags) :: "memory");
+    return flags;
+}
+
+static void irq_restore(uint64_t flags) {
+    if (flags & 0x200) asm volatile("sti" ::: "memory");
+}
+
+static bool irqs_enabled() {
+    uint64_t flags;
+    asm volatile("pushfq; pop %0" : "=r"(flags));
+    return flags & 0x200;
+}
+
+static void fpu_save(uint8_t* area) { asm volatile("fxsave (%0)" :: "r"(area) : "memory"); }
+static void fpu_restore(uint8_t* area) { asm volatile("fxrstor (%0)" :: "r"(area) : "memory"); }
+
+static uint8_t* fpu_align(uint8_t* area) {
+    return (uint8_t*)(((uint64_t)area + 15) & ~15ULL);
+}
+
+// Run queue locks are raw: a Spinlock would count against the preempt
+// state of whichever thread happens to hold it across the switch.
+// Spinning keeps servicing cross-core calls (TLB shootdowns) since
+// interrupts are off.
+static void rq_lock(RunQueue* rq) {
+    while (__atomic_test_and_set(&rq->lock, __ATOMIC_ACQUIRE)) {
+        smp_call_poll();
+        asm volatile("pause");
+    }
+}
+
+static bool rq_try_lock(RunQueue* rq) {
+    return !__atomic_test_and_set(&rq->lock, __ATOMIC_ACQUIRE);
+}
+
+static void rq_unlock(RunQueue* rq) {
+    __atomic_clear(&rq->lock, __ATOMIC_RELEASE);
+}
+
+static RunQueue* this_rq() {
+    return &run_queues[this_cpu_id()];
+}
+
+static void rq_push(RunQueue* rq, Thread* t) {
+    t->next = nullptr;
+    if (rq->tail) rq->tail->next = t;
+    else rq->head = t;
+    rq->tail = t;
+}
+
+static void rq_unlink(RunQueue* rq, Thread* prev, Thread* t) {
+    if (prev) prev->next = t->next;
+    else rq->head = t->next;
+    if (rq->tail == t) rq->tail = prev;
+    t->next = nullptr;
+}
+
+// Takes the first runnable thread off the queue, waking sleepers whose
+// deadline passed. Recomputes next_wake for the ones left behind.
+static Thread* rq_pick(RunQueue* rq, uint64_t now) {
+    Thread* found = nullptr;
+    Thread* prev = nullptr;
+    uint64_t next_wake = 0;
+
+    for (Thread* t = rq->head; t; ) {
+        Thread* next = t->next;
+        if (t->state == THREAD_SLEEPING && now >= t->wake_tsc) t->state = THREAD_READY;
+
+        if (!found && t->state == THREAD_READY) {
+            rq_unlink(rq, prev, t);
+            found = t;
+        } else {
+            if (t->state == THREAD_SLEEPING && (next_wake == 0 || t->wake_tsc < next_wake)) {
+                next_wake = t->wake_tsc;
+            }
+            prev = t;
+        }
+        t = next;
+    }
+
+    rq->next_wake = next_wake;
+    return found;
+}
+
+// Pulls a READY, unpinned thread off another core's queue. Only ever
+// try-locks the victim so two idle cores can't deadlock on each other.
+static Thread* steal_work(int self) {
+    for (int i = 0; i < SCHED_MAX_CPUS; i++) {
+        RunQueue* victim = &run_queues[i];
+        if (i == self || !victim->online || !victim->head) continue;
+        if (!rq_try_lock(victim)) continue;
+
+        Thread* prev = nullptr;
+        for (Thread* t = victim->head; t; prev = t, t = t->next) {
+            if (t->state == THREAD_READY && t->affinity == SCHED_CPU_ANY) {
+                rq_unlink(victim, prev, t);
+                victim->nr_threads--;
+                rq_unlock(victim);
+
+                t->cpu = self;
+                run_queues[self].nr_threads++;
+                return t;
+            }
+        }
+        rq_unlock(victim);
+    }
+    return nullptr;
+}
+
+// Runs on the new thread right after the switch (interrupts still off)
+static void finish_switch() {
+    RunQueue* rq = this_rq();
+    Thread* prev = rq->prev;
+    rq->prev = nullptr;
+    rq_unlock(rq);
+    if (prev) __atomic_store_n(&prev->on_cpu, false, __ATOMIC_RELEASE);
+}
+
+// Picks the next thread for this core and switches to it.
+// Interrupts must be off; the caller restores them afterwards.
+static void schedule() {
+    int cpu = this_cpu_id();
+    RunQueue* rq = &run_queues[cpu];
+    Thread* prev = rq->current;
+
+    rq_lock(rq);
+    prev->need_resched = false;
+
+    if (prev != rq->idle) {
+        if (prev->state == THREAD_RUNNING) prev->state = THREAD_READY;
+        if (prev->state == THREAD_DEAD) rq->nr_threads--;
+        else rq_push(rq, prev);
+    }
+
+    Thread* next = rq_pick(rq, rdtsc());
+    if (!next) next = steal_work(cpu);
+    if (!next) next = rq->idle;
+
+    rq->slice = 0;
+    if (next == prev) {
+        if (prev != rq->idle) prev->state = THREAD_RUNNING;
+        rq_unlock(rq);
+        return;
+    }
+
+    if (next != rq->idle) next->state = THREAD_RUNNING;
+    next->on_cpu = true;
+    rq->current = next;
+    this_cpu()->current_thread = next;
+    rq->prev = prev;
+    rq->switches++;
+
+    fpu_save(prev->fpu_state);
+    sched_switch(&prev->rsp, next->rsp);
+
+    // Back on prev, possibly on another core if it was stolen
+    finish_switch();
+    fpu_restore(prev->fpu_state);
+}
+
+// First code a new thread runs (reached by sched_switch's RET)
+static void thread_bootstrap() {
+    finish_switch();
+    Thread* self = this_rq()->current;
+    fpu_restore(self->fpu_state);
+    asm volatile("sti");
+
+    self->entry(self->arg);
+    thread_exit();
+}
+
+static void idle_loop(void*) {
+    while (true) idle_wait(idle_wake_seq());
+}
+
+static Thread* thread_alloc(const char* name, ThreadEntry entry, void* arg, bool with_stack) {
+    Thread* t = (Thread*)malloc(sizeof(Thread));
+    if (!t) return nullptr;
+    memset(t, 0, sizeof(Thread));
+
+    for (int i = 0; i < THREAD_NAME_LEN - 1 && name[i]; i++) t->name[i] = name[i];
+    t->id = __atomic_fetch_add(&next_thread_id, 1, __ATOMIC_RELAXED);
+    t->affinity = SCHED_CPU_ANY;
+    t->entry = entry;
+    t->arg = arg;
+    t->fpu_state = fpu_align(t->fpu_area);
+    memcpy(t->fpu_state, fpu_template, 512);
+
+    if (with_stack) {
+        t->stack = (uint8_t*)malloc(THREAD_STACK_SIZE);
+        if (!t->stack) { free(t); return nullptr; }
+
+        // Frame popped by sched_switch: six callee-saved registers, then
+        // RET into thread_bootstrap with the stack aligned like a call.
+        uint64_t* sp = (uint64_t*)(((uint64_t)t->stack + THREAD_STACK_SIZE) & ~15ULL);
+        *--sp = 0;
+        *--sp = (uint64_t)thread_bootstrap;
+        for (int i = 0; i < 6; i++) *--sp = 0;
+        t->rsp = (uint64_t)sp;
+    }
+
+    ScopedLock lock(threads_lock);
+    t->all_next = all_threads;
+    all_threads = t;
+    return t;
+}
+
+// Registers the calling core with boot_thread as its running context
+static void cpu_online(Thread* boot_thread, Thread* idle) {
+    RunQueue* rq = this_rq();
+    int cpu = (int)(rq - run_queues);
+    boot_thread->cpu = idle->cpu = cpu;
+    boot_thread->affinity = idle->affinity = cpu;
+    boot_thread->state = THREAD_RUNNING;
+    idle->state = THREAD_RUNNING;
+    boot_thread->on_cpu = true;
+
+    rq->apic_id = lapic_get_id();
+    rq->idle = idle;
+    rq->current = boot_thread;
+    this_cpu()->current_thread = boot_thread;
+    __atomic_store_n(&rq->online, true, __ATOMIC_RELEASE);
+
+    lapic_timer_start(SCHED_TICK_HZ);
+}
+
+void sched_init() {
+    fpu_template = fpu_align(fpu_template_area);
+    fpu_save(fpu_template);
+
+    lapic_timer_calibrate();
+
+    kmain_thread = thread_alloc("kmain", nullptr, nullptr, false);
+    Thread* idle = thread_alloc("idle-0", idle_loop, nullptr, true);
+    if (!kmain_thread || !idle) {
+        printf("SCHED: Out of memory, staying single threaded.\n");
+        return;
+    }
+
+    uint64_t flags = irq_save();
+    cpu_online(kmain_thread, idle);
+    run_queues[0].nr_threads = 1;
+    sched_running = true;
+    irq_restore(flags);
+
+    printf("SCHED: Preemptive scheduler online (%d Hz tick, %d ms slice)\n",
+        SCHED_TICK_HZ, (int)(SCHED_TIMESLICE_TICKS * 1000 / SCHED_TICK_HZ));
+}
+
+void sched_init_ap() {
+    if (!sched_running) return;
+
+    int cpu = this_cpu_id();
+    char name[THREAD_NAME_LEN];
+    sprintf(name, "idle-%d", cpu);
+
+    // The AP keeps running its boot stack as the idle thread
+    Thread* idle = thread_alloc(name, nullptr, nullptr, false);
+    if (!idle) return;
+
+    uint64_t flags = irq_save();
+    cpu_online(idle, idle);
+    irq_restore(flags);
+}
+
+Thread* thread_create(const char* name, ThreadEntry entry, void* arg, int cpu) {
+    if (!sched_running || !entry) return nullptr;
+    if (cpu != SCHED_CPU_ANY && (cpu < 0 || cpu >= SCHED_MAX_CPUS || !run_queues[cpu].online)) return nullptr;
+
+    Thread* t = thread_alloc(name, entry, arg, true);
+    if (!t) return nullptr;
+    t->affinity = cpu;
+
+    // Least loaded core. Ties go to the highest index so the BSP, which
+    // already runs kmain, is the last choice.
+    if (cpu == SCHED_CPU_ANY) {
+        int best = 0;
+        for (int i = 1; i < SCHED_MAX_CPUS; i++) {
+            if (run_queues[i].online && run_queues[i].nr_threads <= run_queues[best].nr_threads) best = i;
+        }
+        cpu = best;
+    }
+
+    RunQueue* rq = &run_queues[cpu];
+    uint64_t flags = irq_save();
+    rq_lock(rq);
+    t->cpu = cpu;
+    t->state = THREAD_READY;
+    rq->nr_threads++;
+    rq_push(rq, t);
+    rq_unlock(rq);
+    irq_restore(flags);
+
+    // Kick the target out of hlt instead of waiting for its next tick
+    if (rq != this_rq()) lapic_send_ipi(rq->apic_id, IPI_RESCHEDULE_VECTOR);
+    return t;
+}
+
+void thread_join(Thread* t) {
+    if (!t) return;
+    while (t->state != THREAD_DEAD || __atomic_load_n(&t->on_cpu, __ATOMIC_ACQUIRE)) {
+        thread_sleep_ms(1);
+    }
+
+    {
+        ScopedLock lock(threads_lock);
+        Thread** link = &all_threads;
+        while (*link && *link != t) link = &(*link)->all_next;
+        if (*link) *link = t->all_next;
+    }
+
+    free(t->stack);
+    free(t);
+}
+
+void thread_exit() {
+    asm volatile("cli");
+    this_rq()->current->state = THREAD_DEAD;
+    schedule();
+    while (true) asm volatile("hlt"); // Not reached
+}
+
+void thread_yield() {
+    if (!sched_running) return;
+    uint64_t flags = irq_save();
+    schedule();
+    irq_restore(flags);
+}
+
+bool sched_may_sleep() {
+    if (!sched_running || !irqs_enabled()) return false;
+
+    uint64_t flags = irq_save();
+    RunQueue* rq = this_rq();
+    Thread* t = rq->current;
+    bool ok = t && t != rq->idle && t->preempt_count == 0;
+    irq_restore(flags);
+    return ok;
+}
+
+void thread_sleep_ms(uint64_t ms) {
+    // Holding a spinlock, in an interrupt or before the scheduler runs:
+    // wait in place instead
+    if (!sched_may_sleep()) {
+        sleep_ticks(ns_to_tsc(ms * 1000000));
+        return;
+    }
+
+    uint64_t flags = irq_save();
+    Thread* self = this_rq()->current;
+    self->wake_tsc = rdtsc() + ns_to_tsc(ms * 1000000);
+    self->state = THREAD_SLEEPING;
+    schedule();
+    irq_restore(flags);
+}
+
+Thread* thread_current() {
+    return this_cpu_thread();
+}
+
+bool thread_is_kmain() {
+    if (!sched_running) return true;
+    return thread_current() == kmain_thread;
+}
+
+void sched_tick(bool preemptible) {
+    RunQueue* rq = this_rq();
+    Thread* cur = rq->current;
+    if (!cur) return;
+
+    rq->ticks++;
+    cur->run_ticks++;
+    if (cur == rq->idle) rq->idle_ticks++;
+
+    // Idle also looks for work to steal once per slice
+    bool resched;
+    if (cur == rq->idle) resched = rq->head != nullptr || rq->ticks % SCHED_TIMESLICE_TICKS == 0;
+    else resched = ++rq->slice >= SCHED_TIMESLICE_TICKS ||
+                   (rq->next_wake && rdtsc() >= rq->next_wake);
+    if (!resched) return;
+
+    if (!preemptible || cur->preempt_count > 0) {
+        cur->need_resched = true;
+        return;
+    }
+    schedule();
+}
+
+void sched_reschedule_ipi(bool preemptible) {
+    RunQueue* rq = this_rq();
+    if (!rq->current || rq->current != rq->idle || !preemptible) return;
+    schedule();
+}
+
+// this_cpu_thread() is one load, and whichever core we end up on its
+// answer is still us, so neither side needs to mask interrupts
+void sched_preempt_disable() {
+    Thread* t = this_cpu_thread();
+    if (t) t->preempt_count++;
+}
+
+void sched_preempt_enable() {
+    Thread* t = this_cpu_thread();
+    if (!t || t->preempt_count == 0) return;
+    if (--t->preempt_count == 0 && t->need_resched && irqs_enabled()) thread_yield();
+}
+
+void sched_print_stats() {
+    static const char* state_names[] = { "ready", "run", "sleep", "dead" };
+
+    for (int i = 0; i < SCHED_MAX_CPUS; i++) {
+        RunQueue* rq = &run_queues[i];
+        if (!rq->online) continue;
+        uint64_t busy = rq->ticks ? ((rq->ticks - rq->idle_ticks) * 100) / rq->ticks : 0;
+        printf("CPU %d: %d threads, %d switches, %d%% busy\n",
+            i, rq->nr_threads, (int)rq->switches, (int)busy);
+    }
+
+    ScopedReadLock lock(threads_lock);
+    for (Thread* t = all_threads; t; t = t->all_next) {
+        printf("  [%d] %s  cpu %d  %s  %d ticks\n", (int)t->id, t->name, t->cpu,
+            state_names[t->state], (int)t->run_ticks);
+    }
+}
@@ -0,0 +1,87 @@
+#ifndef SCHED_H
+#define SCHED_H
+
+#include <cstdint>
+#include <cstddef>
+
+#define SCHED_MAX_CPUS        32
+#define SCHED_CPU_ANY         -1
+#define SCHED_TICK_HZ         1000
+#define SCHED_TIMESLICE_TICKS 10
+#define THREAD_STACK_SIZE     (64 * 1024)
+#define THREAD_NAME_LEN       32
+
+enum ThreadState {
+    THREAD_READY,
+    THREAD_RUNNING,
+    THREAD_SLEEPING,
+    THREAD_DEAD
+};
+
+typedef void (*ThreadEntry)(void* arg);
+
+struct Thread {
+    uint64_t rsp;              // Saved stack pointer (sched_switch)
+    uint64_t id;
+    char name[THREAD_NAME_LEN];
+
+    volatile ThreadState state;
+    volatile bool on_cpu;      // Still running on its stack (join waits for this)
+    volatile bool need_resched;
+    int preempt_count;         // > 0 while holding a spinlock
+    int cpu;                   // Run queue the thread lives on
+    int affinity;              // SCHED_CPU_ANY or a fixed core
+
+    uint64_t wake_tsc;         // THREAD_SLEEPING: TSC deadline
+    uint64_t run_ticks;        // Timer ticks spent running
+
+    ThreadEntry entry;
+    void* arg;
+    uint8_t* stack;            // nullptr for boot contexts (kmain, AP idle)
+
+    Thread* next;              // Run queue link
+    Thread* all_next;          // Global thread list link
+
+    uint8_t* fpu_state;        // 16 byte aligned FXSAVE area inside fpu_area
+    uint8_t fpu_area[512 + 16];
+};
+
+// BSP: turns the running kmain context into a thread and starts the tick.
+// Call after lapic_init() and before smp_init().
+void sched_init();
+
+// AP: registers the calling core. Its boot context becomes the idle thread.
+void sched_init_ap();
+
+// Creates a kernel thread. cpu = SCHED_CPU_ANY places it on the least
+// loaded core (APs first, the BSP keeps the UI). Returns nullptr on OOM.
+Thread* thread_create(const char* name, ThreadEntry entry, void* arg, int cpu = SCHED_CPU_ANY);
+
+// Waits for the thread to finish and frees it. Every thread must be joined.
+void thread_join(Thread* t);
+
+[[noreturn]] void thread_exit();
+void thread_yield();
+void thread_sleep_ms(uint64_t ms);
+Thread* thread_current();
+
+// True on the kmain thread (or before the scheduler runs), the only
+// context that may drive the window manager
+bool thread_is_kmain();
+
+// True if the caller is a kernel thread that may block: the scheduler
+// runs, interrupts are on and no spinlock is held
+bool sched_may_sleep();
+
+// Timer / reschedule IPI entry points (interrupts off, EOI already sent).
+// preemptible is false when the interrupted code was running in ring 3.
+void sched_tick(bool preemptible);
+void sched_reschedule_ipi(bool preemptible);
+
+// Spinlock hooks, see sys/spinlock.h
+void sched_preempt_disable();
+void sched_preempt_enable();
+
+void sched_print_stats();
+
+#endif
@@ -0,0 +1,73 @@
+#include "spinlock.h"
+#include "../cppstd/stdio.h"
+
+// Registry of named locks. A raw flag rather than a Spinlock, since it
+// is taken from inside Spinlock::lock().
+static volatile bool registry_lock = false;
+static LockStats* registry = nullptr;
+
+static void register_stats(LockStats* stats) {
+    // Interrupts off: a handler on this core may register a lock too
+    IrqSaveGuard irq;
+    while (__atomic_test_and_set(&registry_lock, __ATOMIC_ACQUIRE)) asm volatile("pause");
+    if (!stats->registered) {
+        stats->next = registry;
+        registry = stats;
+        stats->registered = true;
+    }
+    __atomic_clear(&registry_lock, __ATOMIC_RELEASE);
+}
+
+void LockStats::acquired(uint64_t wait_start) {
+    if (!registered) register_stats(this);
+
+    uint64_t now = rdtsc();
+    acquisitions++;
+    if (wait_start) {
+        contended++;
+        spin_cycles += now - wait_start;
+    }
+    held_since = now;
+}
+
+void LockStats::acquired_shared(uint64_t wait_start) {
+    if (!registered) register_stats(this);
+
+    __atomic_fetch_add(&acquisitions, 1, __ATOMIC_RELAXED);
+    if (wait_start) {
+        __atomic_fetch_add(&contended, 1, __ATOMIC_RELAXED);
+        __atomic_fetch_add(&spin_cycles, rdtsc() - wait_start, __ATOMIC_RELAXED);
+    }
+}
+
+void LockStats::released() {
+    uint64_t held = rdtsc() - held_since;
+    if (held > max_hold_cycles) max_hold_cycles = held;
+}
+
+void lock_stats_print() {
+    uint64_t freq = get_cpu_frequency();
+    printf("LOCK: Name  Acquired  Contended  Avg wait  Max hold\n");
+
+    for (LockStats* s = registry; s; s = s->next) {
+        uint64_t acquisitions = s->acquisitions;
+        uint64_t contended = s->contended;
+        uint64_t pct = acquisitions ? (contended * 100) / acquisitions : 0;
+        uint64_t avg_wait = contended ? s->spin_cycles / contended : 0;
+        uint64_t max_hold_us = (s->max_hold_cycles * 1000000) / freq;
+
+        printf("  %s  %d  %d (%d%%)  %d cycles  %d us\n", s->name, (int)acquisitions,
+            (int)contended, (int)pct, (int)avg_wait, (int)max_hold_us);
+    }
+}
+
+// Racy against holders updating their counters, which at worst leaves a
+// stray count behind
+void lock_stats_reset() {
+    for (LockStats* s = registry; s; s = s->next) {
+        s->acquisitions = 0;
+        s->contended = 0;
+        s->spin_cycles = 0;
+        s->max_hold_cycles = 0;
+    }
+}
@@ -2,32 +2,302 @@
 #define SPINLOCK_H
 
 #include <cstdint>
+#include "../timer.h"
+#include "../smp/smp_call.h"
 
+// Implemented by the scheduler (sys/sched.cpp). A thread holding a
+// spinlock is never preempted, so nobody on the same core can end up
+// spinning (possibly with interrupts off) on a holder that isn't running.
+void sched_preempt_disable();
+void sched_preempt_enable();
+
+// Contention counters. Only locks given a name keep them, the rest skip
+// the bookkeeping entirely. Written by the lock holder, except for the
+// shared side of an RwLock, which uses atomics.
+struct LockStats {
+    const char* name;
+    uint64_t acquisitions;
+    uint64_t contended;        // Acquisitions that had to wait
+    uint64_t spin_cycles;      // TSC cycles spent waiting, summed
+    uint64_t max_hold_cycles;  // Exclusive holds only
+    uint64_t held_since;
+    LockStats* next;
+    volatile bool registered;
+
+    constexpr LockStats(const char* n = nullptr)
+        : name(n), acquisitions(0), contended(0), spin_cycles(0),
+          max_hold_cycles(0), held_since(0), next(nullptr), registered(false) {}
+
+    // wait_start is the TSC when spinning began, 0 if we got in first try
+    void acquired(uint64_t wait_start);
+    void acquired_shared(uint64_t wait_start);
+    void released();
+};
+
+// Named locks show up here after their first acquisition
+void lock_stats_print();
+void lock_stats_reset();
+
+// Body of every spin loop. Keeps servicing cross-core calls (TLB
+// shootdowns), since the lock may be wanted with interrupts off
+// (ScopedIrqLock) by a core whose holder is waiting on our answer.
+static inline void lock_relax() {
+    smp_call_poll();
+    asm volatile("pause");
+}
+
+// Test-and-test-and-set. Cheapest when uncontended; unfair under load.
 class Spinlock {
 public:
+    constexpr Spinlock() {}
+    constexpr explicit Spinlock(const char* name) : _stats(name) {}
+
     void lock() {
-        // Atomic test-and-set. 
-        // While the value was already true (locked), keep spinning.
-        // __atomic_test_and_set returns the previous value.
+        sched_preempt_disable();
+        uint64_t wait_start = 0;
+        // __atomic_test_and_set returns the previous value. Waiters spin
+        // on a plain read so the line stays shared until it is released.
         while (__atomic_test_and_set(&_locked, __ATOMIC_ACQUIRE)) {
-            asm volatile("pause");
+            if (_stats.name && !wait_start) wait_start = rdtsc();
+            while (_locked) lock_relax();
+        }
+        if (_stats.name) _stats.acquired(wait_start);
+    }
+
+    // Single attempt. Returns true if the lock was taken.
+    bool try_lock() {
+        sched_preempt_disable();
+        if (!__atomic_test_and_set(&_locked, __ATOMIC_ACQUIRE)) {
+            if (_stats.name) _stats.acquired(0);
+            return true;
         }
+        sched_preempt_enable();
+        return false;
     }
 
     void unlock() {
-        // Release the lock
+        if (_stats.name) _stats.released();
         __atomic_clear(&_locked, __ATOMIC_RELEASE);
+        sched_preempt_enable();
     }
 
 private:
     volatile bool _locked = false;
+    LockStats _stats;
+};
+
+// FIFO: every waiter draws a ticket and waits for its number. Fair, and
+// as cheap as Spinlock uncontended, but all waiters still poll one line.
+class TicketLock {
+public:
+    constexpr TicketLock() {}
+    constexpr explicit TicketLock(const char* name) : _stats(name) {}
+
+    void lock() {
+        sched_preempt_disable();
+        uint32_t ticket = __atomic_fetch_add(&_next, 1, __ATOMIC_RELAXED);
+        uint64_t wait_start = 0;
+        if (__atomic_load_n(&_serving, __ATOMIC_ACQUIRE) != ticket) {
+            if (_stats.name) wait_start = rdtsc();
+            while (__atomic_load_n(&_serving, __ATOMIC_ACQUIRE) != ticket) lock_relax();
+        }
+        if (_stats.name) _stats.acquired(wait_start);
+    }
+
+    bool try_lock() {
+        sched_preempt_disable();
+        uint32_t serving = __atomic_load_n(&_serving, __ATOMIC_ACQUIRE);
+        uint32_t expected = serving;
+        if (__atomic_compare_exchange_n(&_next, &expected, serving + 1, false,
+                                        __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+            if (_stats.name) _stats.acquired(0);
+            return true;
+        }
+        sched_preempt_enable();
+        return false;
+    }
+
+    void unlock() {
+        if (_stats.name) _stats.released();
+        __atomic_store_n(&_serving, _serving + 1, __ATOMIC_RELEASE);
+        sched_preempt_enable();
+    }
+
+private:
+    volatile uint32_t _next = 0;
+    volatile uint32_t _serving = 0;
+    LockStats _stats;
+};
+
+// MCS queue lock: FIFO, and each waiter spins on its own node, so a
+// handoff touches one remote line instead of every waiter's. The node
+// must live until unlock(); ScopedLock keeps it on the stack.
+class McsLock {
+public:
+    struct Node {
+        Node* volatile next;
+        volatile bool locked;
+    };
+
+    constexpr McsLock() {}
+    constexpr explicit McsLock(const char* name) : _stats(name) {}
+
+    void lock(Node* node) {
+        sched_preempt_disable();
+        node->next = nullptr;
+        node->locked = true;
+
+        uint64_t wait_start = 0;
+        Node* prev = __atomic_exchange_n(&_tail, node, __ATOMIC_ACQ_REL);
+        if (prev) {
+            if (_stats.name) wait_start = rdtsc();
+            __atomic_store_n(&prev->next, node, __ATOMIC_RELEASE);
+            while (__atomic_load_n(&node->locked, __ATOMIC_ACQUIRE)) lock_relax();
+        }
+        if (_stats.name) _stats.acquired(wait_start);
+    }
+
+    bool try_lock(Node* node) {
+        sched_preempt_disable();
+        node->next = nullptr;
+        node->locked = true;
+
+        Node* expected = nullptr;
+        if (__atomic_compare_exchange_n(&_tail, &expected, node, false,
+                                        __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+            if (_stats.name) _stats.acquired(0);
+            return true;
+        }
+        sched_preempt_enable();
+        return false;
+    }
+
+    void unlock(Node* node) {
+        if (_stats.name) _stats.released();
+
+        Node* next = __atomic_load_n(&node->next, __ATOMIC_ACQUIRE);
+        if (!next) {
+            Node* expected = node;
+            if (__atomic_compare_exchange_n(&_tail, &expected, nullptr, false,
+                                            __ATOMIC_RELEASE, __ATOMIC_RELAXED)) {
+                sched_preempt_enable();
+                return;
+            }
+            // A successor swapped the tail but hasn't linked itself yet
+            while (!(next = __atomic_load_n(&node->next, __ATOMIC_ACQUIRE))) asm volatile("pause");
+        }
+        __atomic_store_n(&next->locked, false, __ATOMIC_RELEASE);
+        sched_preempt_enable();
+    }
+
+private:
+    Node* volatile _tail = nullptr;
+    LockStats _stats;
+};
+
+// Many readers or one writer. Writers take priority: once one is waiting
+// new readers hold off, so a steady stream of readers can't starve it.
+// Not recursive on the read side for the same reason.
+class RwLock {
+public:
+    constexpr RwLock() {}
+    constexpr explicit RwLock(const char* name) : _stats(name) {}
+
+    void read_lock() {
+        sched_preempt_disable();
+        uint64_t wait_start = 0;
+        while (true) {
+            uint32_t s = __atomic_load_n(&_state, __ATOMIC_RELAXED);
+            if (s & (WRITER | WRITER_WAITING)) {
+                if (_stats.name && !wait_start) wait_start = rdtsc();
+                lock_relax();
+                continue;
+            }
+            if (__atomic_compare_exchange_n(&_state, &s, s + READER, true,
+                                            __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) break;
+        }
+        if (_stats.name) _stats.acquired_shared(wait_start);
+    }
+
+    void read_unlock() {
+        __atomic_fetch_sub(&_state, READER, __ATOMIC_RELEASE);
+        sched_preempt_enable();
+    }
+
+    void write_lock() {
+        sched_preempt_disable();
+        uint64_t wait_start = 0;
+        while (true) {
+            uint32_t s = __atomic_load_n(&_state, __ATOMIC_RELAXED);
+            if ((s & ~WRITER_WAITING) == 0) {
+                // Taking it clears the waiting flag; other waiting
+                // writers set it again on their next pass
+                if (__atomic_compare_exchange_n(&_state, &s, WRITER, true,
+                                                __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) break;
+                continue;
+            }
+            if (!(s & WRITER_WAITING)) __atomic_fetch_or(&_state, WRITER_WAITING, __ATOMIC_RELAXED);
+            if (_stats.name && !wait_start) wait_start = rdtsc();
+            lock_relax();
+        }
+        if (_stats.name) _stats.acquired(wait_start);
+    }
+
+    void write_unlock() {
+        if (_stats.name) _stats.released();
+        __atomic_fetch_and(&_state, ~WRITER, __ATOMIC_RELEASE);
+        sched_preempt_enable();
+    }
+
+    // Exclusive side, so ScopedLock works as a write guard
+    void lock() { write_lock(); }
+    void unlock() { write_unlock(); }
+
+private:
+    static const uint32_t WRITER = 1;
+    static const uint32_t WRITER_WAITING = 2;
+    static const uint32_t READER = 4;   // Reader count lives above the flags
+
+    volatile uint32_t _state = 0;
+    LockStats _stats;
 };
 
 // A helper for RAII-style locking (locks on creation, unlocks on destruction)
+template <typename Lock>
 struct ScopedLock {
-    Spinlock& sl;
-    ScopedLock(Spinlock& s) : sl(s) { sl.lock(); }
+    Lock& sl;
+    ScopedLock(Lock& s) : sl(s) { sl.lock(); }
     ~ScopedLock() { sl.unlock(); }
 };
 
-#endif
\ No newline at end of file
+template <>
+struct ScopedLock<McsLock> {
+    McsLock& sl;
+    McsLock::Node node;
+    ScopedLock(McsLock& s) : sl(s) { sl.lock(&node); }
+    ~ScopedLock() { sl.unlock(&node); }
+};
+
+struct ScopedReadLock {
+    RwLock& rw;
+    ScopedReadLock(RwLock& l) : rw(l) { rw.read_lock(); }
+    ~ScopedReadLock() { rw.read_unlock(); }
+};
+
+// Masks interrupts on this core for its lifetime
+struct IrqSaveGuard {
+    uint64_t flags;
+    IrqSaveGuard() { asm volatile("pushfq; pop %0; cli" : "=r"(flags) :: "memory"); }
+    ~IrqSaveGuard() { if (flags & 0x200) asm volatile("sti" ::: "memory"); }
+};
+
+// For locks that interrupt handlers take too. With interrupts masked
+// while we hold it, no handler on this core can spin on it forever.
+// The base masks before the lock is taken and restores after release.
+template <typename Lock>
+struct ScopedIrqLock : private IrqSaveGuard {
+    ScopedLock<Lock> guard;
+    ScopedIrqLock(Lock& l) : IrqSaveGuard(), guard(l) {}
+};
+
+#endif
@@ -7,6 +7,7 @@
 #include "../io.h"
 #include "../memory/heap.h"
 #include "../fs/fat32.h"
+#include "../fs/bcache.h"
 #include "../drv/storage/ahci.h"
 
 // Defined in interrupts.asm
@@ -65,14 +66,14 @@ extern "C" void cpp_syscall_handler(uint64_t syscall_id, uint64_t arg1, uint64_t
         case SYS_DISK_READ:
             // arg1=lba, arg2=count, arg3=buffer
             if (g_sata_port != -1) {
-                AhciDriver::getInstance().read(g_sata_port, arg1, arg2, (void*)arg3);
+                BlockCache::getInstance().read(g_sata_port, arg1, arg2, (void*)arg3);
             }
             break;
 
         case SYS_DISK_WRITE:
             // arg1=lba, arg2=count, arg3=buffer
             if (g_sata_port != -1) {
-                AhciDriver::getInstance().write(g_sata_port, arg1, arg2, (void*)arg3);
+                BlockCache::getInstance().write(g_sata_port, arg1, arg2, (void*)arg3);
             }
             break;
 
@@ -11,9 +11,7 @@ struct SystemStats {
     bool service_xhci_active;
     bool service_ps2_active;
     
-    // CPU Counters (Updated by cores)
-    // We support up to 32 cores for display
-    volatile uint64_t cpu_ticks[32]; 
+    // Per-core counters live in the PerCpu blocks (sys/percpu.h)
     int cpu_count;
     
     static SystemStats& getInstance() {
@@ -27,9 +25,7 @@ private:
                     service_ahci_active(false),
                     service_xhci_active(false),
                     service_ps2_active(false),
-                    cpu_count(1) {
-        for(int i=0; i<32; i++) cpu_ticks[i] = 0;
-    }
+                    cpu_count(1) {}
 };
 
 #endif
\ No newline at end of file
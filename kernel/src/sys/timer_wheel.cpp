@@ -0,0 +1,233 @@
+#include "timer_wheel.h"
+#include "sched.h"
+#include "percpu.h"
+#include "../smp/smp_call.h"
+#include "../timer.h"
+#include "../cppstd/stdio.h"
+
+// Root level: one slot per tick for the next 256 ms. Each level above
+// covers 64 slots of the level below it.
+#define TW_ROOT_BITS   8
+#define TW_LEVEL_BITS  6
+#define TW_LEVELS      3
+#define TW_ROOT_SIZE   (1 << TW_ROOT_BITS)
+#define TW_LEVEL_SIZE  (1 << TW_LEVEL_BITS)
+#define TW_ROOT_MASK   (TW_ROOT_SIZE - 1)
+#define TW_LEVEL_MASK  (TW_LEVEL_SIZE - 1)
+#define TW_MAX_DELTA   ((1ULL << (TW_ROOT_BITS + TW_LEVELS * TW_LEVEL_BITS)) - 1)
+#define TW_TICK_NS     (1000000000ULL / SCHED_TICK_HZ)
+
+// Only ever locked with interrupts off: by the owning core from its tick,
+// by timer_add() on the owning core and by timer_cancel() from anywhere.
+struct TimerWheel {
+    volatile bool lock;
+    uint64_t clock;              // Next tick to process
+    Timer* volatile running;     // Callback in progress (lock dropped)
+    uint64_t pending;
+    uint64_t fired;
+    Timer* root[TW_ROOT_SIZE];
+    Timer* levels[TW_LEVELS][TW_LEVEL_SIZE];
+} __attribute__((aligned(64)));
+
+static TimerWheel wheels[SCHED_MAX_CPUS];
+
+static uint64_t irq_save() {
+    uint64_t flags;
+    asm volatile("pushfq; pop %0; cli" : "=r"(flags) :: "memory");
+    return flags;
+}
+
+static void irq_restore(uint64_t flags) {
+    if (flags & 0x200) asm volatile("sti" ::: "memory");
+}
+
+static void wheel_lock(TimerWheel* w) {
+    while (__atomic_test_and_set(&w->lock, __ATOMIC_ACQUIRE)) {
+        smp_call_poll();
+        asm volatile("pause");
+    }
+}
+
+static void wheel_unlock(TimerWheel* w) {
+    __atomic_clear(&w->lock, __ATOMIC_RELEASE);
+}
+
+static uint64_t current_tick() {
+    return clock_ns() / TW_TICK_NS;
+}
+
+static void list_add(Timer** head, Timer* t) {
+    t->next = *head;
+    if (t->next) t->next->pprev = &t->next;
+    *head = t;
+    t->pprev = head;
+}
+
+static void list_del(Timer* t) {
+    *t->pprev = t->next;
+    if (t->next) t->next->pprev = t->pprev;
+    t->next = nullptr;
+    t->pprev = nullptr;
+}
+
+// Files t under the slot its expiry falls into, relative to w->clock.
+// Overdue timers go into the slot processed next.
+static void enqueue(TimerWheel* w, Timer* t) {
+    uint64_t expires = t->expires;
+    uint64_t delta = expires - w->clock;
+
+    if ((int64_t)delta < 0) {
+        list_add(&w->root[w->clock & TW_ROOT_MASK], t);
+        return;
+    }
+    if (delta < TW_ROOT_SIZE) {
+        list_add(&w->root[expires & TW_ROOT_MASK], t);
+        return;
+    }
+
+    // Beyond the top level's range: park it at the far end, it gets
+    // filed again when that slot cascades
+    if (delta > TW_MAX_DELTA) {
+        delta = TW_MAX_DELTA;
+        expires = w->clock + TW_MAX_DELTA;
+    }
+
+    int level = 0;
+    int shift = TW_ROOT_BITS + TW_LEVEL_BITS;
+    while (level < TW_LEVELS - 1 && delta >= (1ULL << shift)) {
+        level++;
+        shift += TW_LEVEL_BITS;
+    }
+    list_add(&w->levels[level][(expires >> (shift - TW_LEVEL_BITS)) & TW_LEVEL_MASK], t);
+}
+
+// Re-files one upper level slot, which spreads it over the levels below
+static void cascade(TimerWheel* w, int level, int index) {
+    Timer* t = w->levels[level][index];
+    w->levels[level][index] = nullptr;
+
+    while (t) {
+        Timer* next = t->next;
+        enqueue(w, t);
+        t = next;
+    }
+}
+
+void timer_add(Timer* t, uint64_t deadline_ns, TimerFn fn, void* arg) {
+    timer_cancel(t);
+
+    uint64_t flags = irq_save();
+    int cpu = this_cpu_id();
+    TimerWheel* w = &wheels[cpu];
+    wheel_lock(w);
+
+    // An empty wheel stops advancing; catch it up before filing against it
+    uint64_t now = current_tick();
+    if (w->pending == 0 && w->clock < now) w->clock = now;
+
+    t->expires = (deadline_ns + TW_TICK_NS - 1) / TW_TICK_NS;
+    t->fn = fn;
+    t->arg = arg;
+    t->cpu = cpu;
+    enqueue(w, t);
+    w->pending++;
+
+    wheel_unlock(w);
+    irq_restore(flags);
+}
+
+bool timer_cancel(Timer* t) {
+    uint64_t flags = irq_save();
+    int self = this_cpu_id();
+    bool removed = false;
+
+    while (true) {
+        int cpu = t->cpu;
+        TimerWheel* w = &wheels[cpu];
+        wheel_lock(w);
+
+        // Re-added on another core while we were getting the lock
+        if (t->cpu != cpu) {
+            wheel_unlock(w);
+            continue;
+        }
+
+        if (t->pprev) {
+            list_del(t);
+            w->pending--;
+            removed = true;
+        }
+
+        // With interrupts off, a callback running on our own core can
+        // only be the caller itself
+        bool in_flight = w->running == t && cpu != self;
+        wheel_unlock(w);
+        if (!in_flight) break;
+
+        while (w->running == t) {
+            smp_call_poll();
+            asm volatile("pause");
+        }
+        // The callback may have re-added it: go round again
+    }
+
+    irq_restore(flags);
+    return removed;
+}
+
+void timer_wheel_tick() {
+    TimerWheel* w = &wheels[this_cpu_id()];
+    uint64_t now = current_tick();
+
+    wheel_lock(w);
+    if (w->pending == 0) {
+        w->clock = now + 1;
+        wheel_unlock(w);
+        return;
+    }
+
+    while (w->clock <= now) {
+        int index = w->clock & TW_ROOT_MASK;
+
+        // The root wrapped: pull the next slot of each level down,
+        // stopping at the first level that didn't wrap too
+        if (index == 0) {
+            for (int level = 0; level < TW_LEVELS; level++) {
+                int slot = (w->clock >> (TW_ROOT_BITS + level * TW_LEVEL_BITS)) & TW_LEVEL_MASK;
+                cascade(w, level, slot);
+                if (slot != 0) break;
+            }
+        }
+
+        // Detach the slot so callbacks re-adding themselves land in a
+        // later one, and cancels from other cores still find a list
+        Timer* expired = w->root[index];
+        w->root[index] = nullptr;
+        if (expired) expired->pprev = &expired;
+        w->clock++;
+
+        while (expired) {
+            Timer* t = expired;
+            list_del(t);
+            w->pending--;
+            w->fired++;
+            w->running = t;
+
+            wheel_unlock(w);
+            t->fn(t->arg);
+            wheel_lock(w);
+
+            __atomic_store_n(&w->running, nullptr, __ATOMIC_RELEASE);
+        }
+    }
+
+    wheel_unlock(w);
+}
+
+void timer_wheel_print_stats() {
+    for (int i = 0; i < SCHED_MAX_CPUS; i++) {
+        TimerWheel* w = &wheels[i];
+        if (w->clock == 0 && w->fired == 0) continue;
+        printf("CPU %d: %d timers pending, %d fired\n", i, (int)w->pending, (int)w->fired);
+    }
+}
@@ -0,0 +1,54 @@
+#ifndef TIMER_WHEEL_H
+#define TIMER_WHEEL_H
+
+#include <cstdint>
+
+// Kernel timeouts and deferred callbacks. Every core has a hierarchical
+// timing wheel (one millisecond per slot at the bottom level, four levels,
+// ~18 hours of range) advanced from its scheduler tick. Adding and
+// cancelling are O(1); a far-off timer is moved down a level at most
+// three times before it fires.
+
+// Runs in interrupt context on the core the timer was added on, with
+// interrupts off. Must not sleep; may add or cancel other timers, or
+// re-add its own.
+typedef void (*TimerFn)(void* arg);
+
+// Owned by the caller and must stay valid until it fired or
+// timer_cancel() returned. Zero-initialise (or timer_init()) before the
+// first timer_add().
+struct Timer {
+    uint64_t expires;        // Wheel tick (ms) the timer is due at
+    TimerFn fn;
+    void* arg;
+    Timer* next;
+    Timer** pprev;           // Link pointing at us, nullptr when not queued
+    volatile int cpu;        // Wheel the timer is queued on
+};
+
+static inline void timer_init(Timer* t) {
+    t->next = nullptr;
+    t->pprev = nullptr;
+    t->cpu = 0;
+}
+
+// Arms t to call fn(arg) once clock_ns() reaches deadline_ns (rounded up
+// to the next millisecond tick). Deadlines in the past fire on the next
+// tick. Re-adding a pending timer moves it.
+void timer_add(Timer* t, uint64_t deadline_ns, TimerFn fn, void* arg);
+
+// Disarms t. Returns true if it was still pending, false if it already
+// fired. Waits for a callback running on another core to return, so the
+// Timer can be freed afterwards. From t's own callback it just returns.
+bool timer_cancel(Timer* t);
+
+static inline bool timer_pending(const Timer* t) { return t->pprev != nullptr; }
+
+// Advances the calling core's wheel and runs whatever expired.
+// Called from the LAPIC timer interrupt.
+void timer_wheel_tick();
+
+// Pending and fired counts per core, for the terminal
+void timer_wheel_print_stats();
+
+#endif
@@ -1,9 +1,49 @@
 #include "timer.h"
 #include "input.h"
+#include "io.h"
+#include "acpi/acpi.h"
+#include "interrupts/lapic.h"
+#include "memory/vmm.h"
+#include "sys/sched.h"
+#include "sys/idle.h"
+#include "cppstd/stdio.h"
+
+#define CALIBRATE_MS      50
+#define PIT_HZ            1193182
+#define PIT_CH2_DATA      0x42
+#define PIT_COMMAND       0x43
+#define PIT_CH2_GATE      0x61
+#define PIT_CH2_OUT       (1 << 5)
+
+// After the IOAPIC windows (ioapic.cpp)
+#define HPET_VIRT_BASE    0xFFFFA00040010000ULL
+#define HPET_REG_CAP      0x00
+#define HPET_REG_CONFIG   0x10
+#define HPET_REG_COUNTER  0xF0
+#define HPET_CAP_64BIT    (1 << 13)
+#define HPET_ENABLE       1
+
+struct AcpiHpet {
+    AcpiSdtHeader header;
+    uint32_t event_timer_block_id;
+    uint8_t address_space;   // Generic Address Structure
+    uint8_t register_width;
+    uint8_t register_offset;
+    uint8_t reserved;
+    uint64_t address;
+    uint8_t hpet_number;
+    uint16_t minimum_tick;
+    uint8_t page_protection;
+} __attribute__((packed));
+
+static uint64_t tsc_hz = 0;
+static uint64_t tsc_boot = 0;
+static uint64_t ns_mult = 0;   // ns = tsc * ns_mult >> 32
+static uint64_t tsc_mult = 0;  // tsc = ns * tsc_mult >> 24
 
 static inline void cpuid(uint32_t leaf, uint32_t *eax, uint32_t *ebx, uint32_t *ecx, uint32_t *edx) {
-    asm volatile ("cpuid" 
-        : "=a"(*eax), "=b"(*ebx), "=c"(*ecx), "=d"(*edx) 
+    asm volatile ("cpuid"
+        : "=a"(*eax), "=b"(*ebx), "=c"(*ecx), "=d"(*edx)
         : "a"(leaf)
         : "memory"
     );
@@ -11,33 +51,23 @@ static inline void cpuid(uint32_t leaf, uint32_t *eax, uint32_t *ebx, uint32_t *
 
 uint64_t rdtsc_serialized() {
     uint32_t lo, hi;
-    // Clear EAX to ensure leaf 0 is called for serialization
-    // Fixed clobber list (no % prefix for registers in clobber)
-    asm volatile (
-        "xor %%eax, %%eax\n\t"
-        "cpuid\n\t"
-        "rdtsc\n\t"
-        : "=a"(lo), "=d"(hi)
-        :
-        : "rbx", "rcx" 
-    );
+    // LFENCE waits for everything before it to complete locally, without
+    // the VM exit a CPUID costs
+    asm volatile("lfence; rdtsc" : "=a"(lo), "=d"(hi) :: "memory");
     return ((uint64_t)hi << 32) | lo;
 }
 
-void sleep_ticks(uint64_t ticks) {
-    uint64_t start_ticks = rdtsc_serialized();
-    while (rdtsc_serialized() - start_ticks < ticks) {
-        check_input_hooks();
-        asm volatile ("pause");
-    }
+static void set_tsc_hz(uint64_t hz) {
+    tsc_hz = hz;
+    ns_mult = (1000000000ULL << 32) / hz;
+    tsc_mult = (hz << 24) / 1000000000ULL;
 }
 
-uint64_t get_cpu_frequency() {
-    static uint64_t cached_freq = 0;
-    if (cached_freq != 0) return cached_freq;
-
+// Frequency the CPU reports about itself. Only a starting point: leaf
+// 0x16 is the nominal core clock, and hypervisors often leave both empty.
+static uint64_t cpuid_frequency() {
     uint32_t eax, ebx, ecx, edx;
-    
+
     // 1. Check max CPUID leaf
     cpuid(0, &eax, &ebx, &ecx, &edx);
     uint32_t max_leaf = eax;
@@ -45,30 +75,156 @@ uint64_t get_cpu_frequency() {
     // 2. Try Leaf 0x16 (Processor Frequency Information)
     if (max_leaf >= 0x16) {
         cpuid(0x16, &eax, &ebx, &ecx, &edx);
-        if (eax != 0) {
-            cached_freq = (uint64_t)eax * 1000000;
-            return cached_freq;
-        }
+        if (eax != 0) return (uint64_t)eax * 1000000;
     }
 
     // 3. Try Leaf 0x15 (Crystal Clock)
     if (max_leaf >= 0x15) {
         cpuid(0x15, &eax, &ebx, &ecx, &edx);
-        if (ecx != 0 && eax != 0 && ebx != 0) {
-            cached_freq = ((uint64_t)ecx * ebx) / eax;
-            return cached_freq;
-        }
+        if (ecx != 0 && eax != 0 && ebx != 0) return ((uint64_t)ecx * ebx) / eax;
     }
 
     // 4. Fallback (2 GHz)
-    cached_freq = 2000000000;
-    return cached_freq;
+    return 2000000000;
+}
+
+uint64_t get_cpu_frequency() {
+    if (tsc_hz == 0) {
+        tsc_boot = rdtsc();
+        set_tsc_hz(cpuid_frequency());
+    }
+    return tsc_hz;
+}
+
+uint64_t clock_ns() {
+    if (tsc_hz == 0) get_cpu_frequency();
+    return (uint64_t)(((unsigned __int128)(rdtsc() - tsc_boot) * ns_mult) >> 32);
+}
+
+uint64_t ns_to_tsc(uint64_t ns) {
+    if (tsc_hz == 0) get_cpu_frequency();
+    return (uint64_t)(((unsigned __int128)ns * tsc_mult) >> 24);
+}
+
+// TSC ticks per second measured against the HPET main counter, 0 if
+// there is no usable HPET
+static uint64_t calibrate_hpet() {
+    AcpiHpet* table = (AcpiHpet*)acpi_find_table("HPET");
+    if (!table || table->address_space != 0 || table->address == 0) return 0;
+
+    vmm_map_page(HPET_VIRT_BASE, table->address & ~0xFFFULL, PTE_PRESENT | PTE_RW | PTE_PCD | PTE_NX);
+    volatile uint8_t* hpet = (volatile uint8_t*)(HPET_VIRT_BASE + (table->address & 0xFFF));
+
+    uint64_t cap = *(volatile uint64_t*)(hpet + HPET_REG_CAP);
+    uint64_t period_fs = cap >> 32;
+    // The spec caps the period at 100 ns
+    if (period_fs == 0 || period_fs > 100000000) return 0;
+    bool wide = cap & HPET_CAP_64BIT;
+
+    volatile uint64_t* config = (volatile uint64_t*)(hpet + HPET_REG_CONFIG);
+    *config = *config | HPET_ENABLE;
+
+    volatile uint64_t* counter = (volatile uint64_t*)(hpet + HPET_REG_COUNTER);
+    uint64_t window = (CALIBRATE_MS * 1000000000000ULL) / period_fs;
+
+    uint64_t h0 = *counter;
+    uint64_t t0 = rdtsc_serialized();
+    uint64_t elapsed = 0;
+    while (elapsed < window) {
+        uint64_t now = *counter;
+        elapsed = wide ? now - h0 : (uint32_t)((uint32_t)now - (uint32_t)h0);
+        asm volatile("pause");
+    }
+    uint64_t t1 = rdtsc_serialized();
+
+    uint64_t elapsed_ns = (elapsed * period_fs) / 1000000;
+    if (elapsed_ns == 0) return 0;
+    return ((t1 - t0) * 1000000000ULL) / elapsed_ns;
+}
+
+// PIT channel 2 in mode 0: counting starts with the high byte of the
+// count, OUT (read back through port 0x61) goes high when it hits zero.
+// Needs nothing but port I/O.
+static uint64_t calibrate_pit() {
+    uint16_t count = (uint16_t)((PIT_HZ * CALIBRATE_MS) / 1000);
+
+    // Gate high, speaker off
+    uint8_t gate = inb(PIT_CH2_GATE);
+    outb(PIT_CH2_GATE, (gate & ~0x02) | 0x01);
+
+    outb(PIT_COMMAND, 0xB0); // Channel 2, lo/hi byte, mode 0, binary
+    outb(PIT_CH2_DATA, count & 0xFF);
+    outb(PIT_CH2_DATA, count >> 8);
+
+    uint64_t t0 = rdtsc_serialized();
+    while (!(inb(PIT_CH2_GATE) & PIT_CH2_OUT)) asm volatile("pause");
+    uint64_t t1 = rdtsc_serialized();
+
+    outb(PIT_CH2_GATE, gate);
+    return ((t1 - t0) * PIT_HZ) / count;
+}
+
+void timer_init() {
+    uint64_t flags;
+    asm volatile("pushfq; pop %0; cli" : "=r"(flags) :: "memory");
+
+    get_cpu_frequency(); // Fixes tsc_boot
+    const char* source = "HPET";
+    uint64_t hz = calibrate_hpet();
+    if (hz == 0) {
+        source = "PIT";
+        hz = calibrate_pit();
+    }
+
+    if (flags & 0x200) asm volatile("sti" ::: "memory");
+
+    // Sanity check: anything outside 100 MHz - 20 GHz is a broken timer
+    if (hz < 100000000ULL || hz > 20000000000ULL) {
+        printf("TIMER: Calibration failed, keeping CPUID estimate (%d MHz)\n", (int)(tsc_hz / 1000000));
+        return;
+    }
+
+    set_tsc_hz(hz);
+    printf("TIMER: TSC runs at %d.%d MHz (%s)\n",
+        (int)(hz / 1000000), (int)((hz / 100000) % 10), source);
+}
+
+// Halting is only safe if something will wake us: the periodic LAPIC
+// tick, with interrupts on. A tick is at most one period away, so only
+// halt while at least that much time is left and spin the tail.
+static bool can_halt(uint64_t remaining) {
+    uint64_t flags;
+    asm volatile("pushfq; pop %0" : "=r"(flags));
+    uint32_t hz = lapic_timer_hz();
+    return (flags & 0x200) && hz && remaining >= tsc_hz / hz;
+}
+
+void sleep_ticks(uint64_t ticks) {
+    uint64_t start_ticks = rdtsc();
+    uint64_t elapsed;
+    while ((elapsed = rdtsc() - start_ticks) < ticks) {
+        check_input_hooks();
+        if (can_halt(ticks - elapsed)) idle_wait(idle_wake_seq());
+        else asm volatile("pause");
+    }
 }
 
 void sleep_ms(uint64_t ms) {
-    uint64_t freq = get_cpu_frequency();
-    if (freq == 0) freq = 2000000000; // Absolute safety fallback
-    
-    uint64_t ticks = (freq / 1000) * ms;
-    sleep_ticks(ticks);
-}
\ No newline at end of file
+    if (sched_may_sleep()) {
+        thread_sleep_ms(ms);
+        return;
+    }
+    sleep_ticks(ns_to_tsc(ms * 1000000));
+}
+
+void sleep_until_ns(uint64_t deadline) {
+    uint64_t now = clock_ns();
+    if (now >= deadline) return;
+
+    // Whole milliseconds through the scheduler, the remainder in place
+    uint64_t ms = (deadline - now) / 1000000;
+    if (ms > 0 && sched_may_sleep()) thread_sleep_ms(ms);
+
+    now = clock_ns();
+    if (now < deadline) sleep_ticks(ns_to_tsc(deadline - now));
+}
@@ -3,16 +3,43 @@
 
 #include <cstdint>
 
-// Waits for a specific number of CPU clock cycles (ticks).
-void sleep_ticks(uint64_t ticks);
+// Measures the TSC against the HPET (if ACPI lists one) or PIT channel 2.
+// BSP only, once, after acpi_init(). Until then the TSC rate is the
+// CPUID estimate.
+void timer_init();
 
-// New: Waits for a specific number of milliseconds (CPU independent)
-void sleep_ms(uint64_t ms);
+// Plain RDTSC. Not serializing, so it is cheap enough for tight loops
+// (no CPUID, which is a VM exit under virtualization).
+static inline uint64_t rdtsc() {
+    uint32_t lo, hi;
+    asm volatile("rdtsc" : "=a"(lo), "=d"(hi));
+    return ((uint64_t)hi << 32) | lo;
+}
 
-// Serialized RDTSC (waits for instructions to retire before reading)
+// Ordered RDTSC: earlier instructions finish before the read.
+// For timing a piece of code, not for timekeeping.
 uint64_t rdtsc_serialized();
 
-// Detects CPU Frequency using CPUID Leaf 0x16 (or 0x15).
+// TSC frequency in Hz (calibrated once timer_init() has run)
 uint64_t get_cpu_frequency();
 
-#endif
\ No newline at end of file
+// Monotonic nanoseconds since boot, from the invariant TSC
+uint64_t clock_ns();
+
+static inline uint64_t clock_ms() { return clock_ns() / 1000000; }
+
+// Duration conversion for TSC deadlines
+uint64_t ns_to_tsc(uint64_t ns);
+
+// Waits for a number of TSC ticks. Halts between timer ticks when
+// interrupts are on, spins otherwise.
+void sleep_ticks(uint64_t ticks);
+
+// Sleeps for ms milliseconds. Kernel threads that may block give up the
+// CPU (thread_sleep_ms); everything else halts or spins as sleep_ticks.
+void sleep_ms(uint64_t ms);
+
+// Sleeps until clock_ns() reaches deadline (frame limiters)
+void sleep_until_ns(uint64_t deadline);
+
+#endif
@@ -0,0 +1,135 @@
+// Host-side stress test for sys/ring.h. Built and run with `make test`.
+//
+// The rings only use GCC __atomic builtins, so the kernel header compiles
+// as is; std::thread stands in for the cores.
+
+#include <cstdio>
+#include <cstdlib>
+#include <thread>
+#include <vector>
+#include "../kernel/src/sys/ring.h"
+
+static int failures = 0;
+
+#define CHECK(cond, ...) do { \
+    if (!(cond)) { \
+        printf("FAIL %s:%d: ", __FILE__, __LINE__); \
+        printf(__VA_ARGS__); \
+        printf("\n"); \
+        failures++; \
+    } \
+} while (0)
+
+// After a failure the other side may be stuck on a full ring, so don't
+// wait for it
+static void bail_if_failed(const char* test) {
+    if (!failures) return;
+    printf("%s: %d failure(s)\n", test, failures);
+    fflush(stdout);
+    _Exit(EXIT_FAILURE);
+}
+
+// One producer, one consumer: every item arrives, once, in order. Mixes
+// single and bulk calls on both sides so the cached indices get a workout.
+static void spsc_stream() {
+    const uint32_t total = 1000000;
+    static SpscRing<uint32_t, 256> ring;
+
+    std::thread producer([] {
+        uint32_t next = 0;
+        uint32_t batch[17];
+        while (next < total) {
+            if (next % 3 == 0) {
+                uint32_t n = 0;
+                while (n < 17 && next + n < total) { batch[n] = next + n; n++; }
+                uint32_t pushed = ring.push_bulk(batch, n);
+                if (!pushed) std::this_thread::yield();
+                next += pushed;
+            } else if (ring.push(next)) {
+                next++;
+            } else {
+                std::this_thread::yield();
+            }
+        }
+    });
+
+    uint32_t expect = 0;
+    uint32_t batch[32];
+    while (expect < total && failures == 0) {
+        if (expect % 2 == 0) {
+            uint32_t n = ring.pop_bulk(batch, 32);
+            if (!n) std::this_thread::yield();
+            for (uint32_t i = 0; i < n; i++) {
+                CHECK(batch[i] == expect, "spsc: got %u, expected %u", batch[i], expect);
+                expect++;
+            }
+        } else {
+            uint32_t v;
+            if (ring.pop(&v)) {
+                CHECK(v == expect, "spsc: got %u, expected %u", v, expect);
+                expect++;
+            } else {
+                std::this_thread::yield();
+            }
+        }
+    }
+    bail_if_failed("spsc_stream");
+    producer.join();
+    CHECK(ring.empty(), "spsc: ring not empty at the end");
+    printf("spsc_stream: %u items\n", expect);
+}
+
+// Several producers, one consumer: nothing lost or duplicated, and each
+// producer's items come out in the order it pushed them.
+static void mpsc_per_producer_order() {
+    const uint32_t producers = 6;
+    const uint32_t per_producer = 200000;
+    static MpscRing<uint64_t, 1024> ring;
+
+    std::vector<std::thread> threads;
+    for (uint32_t p = 0; p < producers; p++) {
+        threads.emplace_back([p] {
+            for (uint32_t i = 0; i < per_producer; i++) {
+                uint64_t item = ((uint64_t)p << 32) | i;
+                while (!ring.push(item)) std::this_thread::yield();
+            }
+        });
+    }
+
+    std::vector<uint32_t> next(producers, 0);
+    uint64_t received = 0;
+    while (received < (uint64_t)producers * per_producer && failures == 0) {
+        uint64_t item;
+        if (!ring.pop(&item)) {
+            std::this_thread::yield();
+            continue;
+        }
+        uint32_t p = (uint32_t)(item >> 32);
+        uint32_t i = (uint32_t)item;
+        CHECK(p < producers, "mpsc: bad producer %u", p);
+        if (p >= producers) break;
+        CHECK(i == next[p], "mpsc: producer %u sent %u, expected %u", p, i, next[p]);
+        next[p] = i + 1;
+        received++;
+    }
+    bail_if_failed("mpsc_per_producer_order");
+    for (auto& t : threads) t.join();
+
+    for (uint32_t p = 0; p < producers; p++) {
+        CHECK(next[p] == per_producer, "mpsc: producer %u delivered %u of %u", p, next[p], per_producer);
+    }
+    CHECK(ring.empty(), "mpsc: ring not empty at the end");
+    printf("mpsc_per_producer_order: %llu items from %u producers\n", (unsigned long long)received, producers);
+}
+
+int main() {
+    spsc_stream();
+    mpsc_per_producer_order();
+
+    if (failures) {
+        printf("ring_stress: %d failure(s)\n", failures);
+        return EXIT_FAILURE;
+    }
+    printf("ring_stress: OK\n");
+    return EXIT_SUCCESS;
+}